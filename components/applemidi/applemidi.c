@@ -31,13 +31,24 @@
  */
 
 #include "applemidi.h"
+#include "applemidi_trace.h"
+#include "applemidi_pool.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
 #include <arpa/inet.h>
 
+#ifdef ESP_PLATFORM
+# include "esp_timer.h"
+#else
+# include <time.h>
+#endif
+
+#if APPLEMIDI_DEFAULT_MTU > APPLEMIDI_OUTBUFFER_SIZE || APPLEMIDI_DEFAULT_MTU < APPLEMIDI_MIN_MTU
+# error "APPLEMIDI_DEFAULT_MTU must be within APPLEMIDI_MIN_MTU..APPLEMIDI_OUTBUFFER_SIZE"
+#endif
+
 
 // from https://en.wikipedia.org/wiki/RTP-MIDI#Apple's_session_protocol
 #define APPLEMIDI_COMMAND_INVITATION            0x494e  // IN
@@ -49,27 +60,58 @@
 #define APPLEMIDI_COMMAND_BITRATE_RECEIVE_LIMIT 0x524c  // RL
 
 
-static applemidi_peer_t applemidi_peer[APPLEMIDI_MAX_PEERS];
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+static const char *applemidi_histogram_name[APPLEMIDI_NUM_HISTOGRAMS] = {
+  "CK Round Trip Time [uS]",
+  "Inter-Arrival Jitter [uS]",
+  "Events per Outgoing Packet",
+  "Bytes per Outgoing Packet",
+  "Output Buffer Residency [uS]",
+};
 
-static uint8_t applemidi_debug_level = APPLEMIDI_DEFAULT_DEBUG_LEVEL;
-
-// callbacks
-static void (*applemidi_callback_midi_message_received)(uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos);
-static int32_t (*applemidi_callback_send_udp_datagram)(uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len);
+static void applemidi_peer_histograms_clear(applemidi_peer_t *peer);
+#endif
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Initialization
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_init(void *_callback_midi_message_received, void *_callback_send_udp_datagram)
+int32_t applemidi_init(applemidi_t *applemidi, void *_callback_midi_message_received, void *callback_midi_message_received_ctx, void *_callback_send_udp_datagram, void *callback_send_udp_datagram_ctx)
+{
+#if APPLEMIDI_MAX_PEERS > 0
+  return applemidi_init_with_peers(applemidi, applemidi->peer_storage, APPLEMIDI_MAX_PEERS, _callback_midi_message_received, callback_midi_message_received_ctx, _callback_send_udp_datagram, callback_send_udp_datagram_ctx);
+#else
+  return -1; // no embedded peer storage, use applemidi_init_with_peers()
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Initialization with peer slots which are provided by the caller
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_init_with_peers(applemidi_t *applemidi, applemidi_peer_t *peers, uint8_t num_peers, void *_callback_midi_message_received, void *callback_midi_message_received_ctx, void *_callback_send_udp_datagram, void *callback_send_udp_datagram_ctx)
 {
   int i;
 
-  applemidi_callback_midi_message_received = _callback_midi_message_received;
-  applemidi_callback_send_udp_datagram = _callback_send_udp_datagram;
+  if( peers == NULL || num_peers < 2 )
+    return -1; // at least myself and one remote peer
+
+  applemidi->peer = peers;
+  applemidi->num_peers = num_peers;
+
+  applemidi->debug_level = APPLEMIDI_DEFAULT_DEBUG_LEVEL;
+  applemidi->rtp_clock_rate = APPLEMIDI_RTP_CLOCK_RATE;
+
+  applemidi->callback_midi_message_received = _callback_midi_message_received;
+  applemidi->callback_midi_message_received_ctx = callback_midi_message_received_ctx;
+  applemidi->callback_midi_events_received = NULL;
+  applemidi->callback_midi_events_received_ctx = NULL;
+  applemidi->callback_send_udp_datagram = _callback_send_udp_datagram;
+  applemidi->callback_send_udp_datagram_ctx = callback_send_udp_datagram_ctx;
+  applemidi->callback_send_udp_datagrams = NULL;
+  applemidi->callback_send_udp_datagram_iov = NULL;
 
-  applemidi_peer_t *peer = &applemidi_peer[0];
-  for(i=0; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
+  applemidi_peer_t *peer = &applemidi->peer[0];
+  for(i=0; i<applemidi->num_peers; ++i, ++peer) {
     if( i == 0 ) {
       peer->ssrc = rand();
       if( peer->ssrc == 0 ) // just to ensure that we never get SSRC=0
@@ -83,17 +125,48 @@ int32_t applemidi_init(void *_callback_midi_message_received, void *_callback_se
     peer->data_port = APPLEMIDI_DEFAULT_PORT + 1;
     peer->applemidi_port = i; // internal port number, don't touch!
     memset(peer->ip_addr, 0, sizeof(peer->ip_addr));
+    peer->addr_family = applemidi_ip_addr_get_family(peer->ip_addr);
     peer->token = 0;
     peer->seq_nr = 0;
     peer->continued_sysex_pos = 0;
     peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE;
     peer->connection_sync_ctr = 0;
     peer->connection_sync_done_timestamp = 0;
+    peer->connection_retry_timestamp = 0;
+    peer->connection_attempts = 0;
+    peer->connection_is_master = 0;
+    peer->connection_auto_reconnect = 0;
     peer->outbuffer_len = 0;
     peer->outbuffer_timestamp_last_flush = 0;
+    peer->mtu = APPLEMIDI_DEFAULT_MTU;
+    peer->data_addr_cache.valid = 0;
     peer->packets_sent = 0;
     peer->packets_received = 0;
     peer->packets_loss = 0;
+    peer->timestamp_session_start = 0;
+    peer->timestamp_last_activity = 0;
+    peer->probe_sent = 0;
+    peer->sessions_evicted = 0;
+    peer->last_session_hold_time_ms = 0;
+#if APPLEMIDI_ENABLE_ROUTING
+    {
+      int channel;
+      for(channel=0; channel<APPLEMIDI_ROUTE_CHANNELS; ++channel) {
+        peer->route[channel] = APPLEMIDI_ROUTE_LOCAL;
+      }
+    }
+    peer->outbuffer_running_status = 0;
+    peer->route_sysex_owner = 0;
+    peer->route_sysex_timestamp = 0;
+    peer->route_forwarded = 0;
+    peer->route_dropped = 0;
+#endif
+    peer->filter_in = NULL;
+    peer->filter_out = NULL;
+    peer->filter_dropped = 0;
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+    applemidi_peer_histograms_clear(peer);
+#endif
   }
 
 
@@ -104,9 +177,22 @@ int32_t applemidi_init(void *_callback_midi_message_received, void *_callback_se
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Debug Level can be changed during runtime
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_set_debug_level(uint8_t verbosity)
+int32_t applemidi_set_debug_level(applemidi_t *applemidi, uint8_t verbosity)
+{
+  applemidi->debug_level = verbosity;
+
+  return 0; // no error
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// RTP Clock Rate can be changed during runtime
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_rtp_clock_rate(applemidi_t *applemidi, uint32_t rtp_clock_rate)
 {
-  applemidi_debug_level = verbosity;
+  if( rtp_clock_rate == 0 || rtp_clock_rate > 1000000 )
+    return -1; // invalid rate
+
+  applemidi->rtp_clock_rate = rtp_clock_rate;
 
   return 0; // no error
 }
@@ -115,34 +201,169 @@ int32_t applemidi_set_debug_level(uint8_t verbosity)
  * @brief Returns the verbosity level
  *
  */
-int32_t applemidi_get_debug_level(void)
+int32_t applemidi_get_debug_level(applemidi_t *applemidi)
+{
+  return applemidi->debug_level;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sets the name of the local endpoint
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_name(applemidi_t *applemidi, const char *name)
 {
-  return applemidi_debug_level;
+  if( name == NULL )
+    return -1; // invalid name
+
+  applemidi_peer_t *peer = &applemidi->peer[0];
+  strncpy(peer->name, name, APPLEMIDI_MAX_NAME_LEN-1);
+  peer->name[APPLEMIDI_MAX_NAME_LEN-1] = 0;
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Installs the optional callback for decoded MIDI events
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_callback_midi_events_received(applemidi_t *applemidi, void *_callback_midi_events_received, void *callback_midi_events_received_ctx)
+{
+  applemidi->callback_midi_events_received = _callback_midi_events_received;
+  applemidi->callback_midi_events_received_ctx = callback_midi_events_received_ctx;
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Installs the optional callback for batched transmission
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_callback_send_udp_datagrams(applemidi_t *applemidi, void *_callback_send_udp_datagrams)
+{
+  applemidi->callback_send_udp_datagrams = _callback_send_udp_datagrams;
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Installs the optional callback for scatter-gather transmission
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_callback_send_udp_datagram_iov(applemidi_t *applemidi, void *_callback_send_udp_datagram_iov)
+{
+  applemidi->callback_send_udp_datagram_iov = _callback_send_udp_datagram_iov;
+
+  return 0; // no error
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Returns information about a peer
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-applemidi_peer_t *applemidi_peer_get_info(uint8_t applemidi_port)
+applemidi_peer_t *applemidi_peer_get_info(applemidi_t *applemidi, uint8_t applemidi_port)
 {
-  if( applemidi_port >= APPLEMIDI_MAX_PEERS )
+  if( applemidi_port >= applemidi->num_peers )
     return NULL; // invalid port
 
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
   return peer;
 }
 
 
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Histograms
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_histogram_clear(applemidi_histogram_t *h)
+{
+  memset(h, 0, sizeof(applemidi_histogram_t));
+  h->min = ~0;
+}
+
+static void applemidi_histogram_add(applemidi_histogram_t *h, uint32_t value)
+{
+  uint8_t bucket = value ? (32 - __builtin_clz(value)) : 0;
+  if( bucket >= APPLEMIDI_HISTOGRAM_BUCKETS )
+    bucket = APPLEMIDI_HISTOGRAM_BUCKETS - 1;
+
+  if( h->bucket[bucket] != ~0 )
+    h->bucket[bucket] += 1;
+  if( h->count != ~0 )
+    h->count += 1;
+  if( value < h->min )
+    h->min = value;
+  if( value > h->max )
+    h->max = value;
+  h->sum += value;
+}
+
+// adds the value to the histogram of the peer, and to my own histogram (aggregate)
+static void applemidi_peer_histogram_add(applemidi_t *applemidi, applemidi_peer_t *peer, applemidi_histogram_e histogram, uint32_t value)
+{
+  if( peer != NULL && peer != &applemidi->peer[0] ) {
+    applemidi_histogram_add(&peer->histogram[histogram], value);
+  }
+  applemidi_histogram_add(&applemidi->peer[0].histogram[histogram], value);
+}
+
+static void applemidi_peer_histograms_clear(applemidi_peer_t *peer)
+{
+  int i;
+  for(i=0; i<APPLEMIDI_NUM_HISTOGRAMS; ++i) {
+    applemidi_histogram_clear(&peer->histogram[i]);
+  }
+  peer->outbuffer_timestamp_first_push = 0;
+  peer->outbuffer_events = 0;
+  peer->rx_transit_valid = 0;
+  peer->rx_transit = 0;
+  peer->rx_jitter_us = 0;
+}
+
+int32_t applemidi_peer_get_histograms(applemidi_t *applemidi, uint8_t applemidi_port, applemidi_histogram_t *snapshot, uint8_t reset)
+{
+  if( applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+  int i;
+  for(i=0; i<APPLEMIDI_NUM_HISTOGRAMS; ++i) {
+    memcpy(&snapshot[i], &peer->histogram[i], sizeof(applemidi_histogram_t));
+    if( reset ) {
+      applemidi_histogram_clear(&peer->histogram[i]);
+    }
+  }
+
+  return 0; // no error
+}
+
+const char *applemidi_histogram_get_name(applemidi_histogram_e histogram)
+{
+  return (histogram < APPLEMIDI_NUM_HISTOGRAMS) ? applemidi_histogram_name[histogram] : "Unknown";
+}
+
+void applemidi_histogram_get_bucket_range(uint8_t bucket, uint32_t *min, uint32_t *max)
+{
+  if( bucket == 0 ) {
+    *min = 0;
+    *max = 0;
+  } else {
+    *min = 1 << (bucket - 1);
+    *max = (bucket >= (APPLEMIDI_HISTOGRAM_BUCKETS-1) || bucket >= 32) ? ~0 : ((1 << bucket) - 1);
+  }
+}
+#endif
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Returns free applemidi_port which can be used to initiate a new session
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-extern int32_t applemidi_search_free_port(void)
+extern int32_t applemidi_search_free_port(applemidi_t *applemidi)
 {
   int i;
-  applemidi_peer_t *peer = &applemidi_peer[1]; // starting at 1 (because I'm 0)
-  for(i=1; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
-    if( peer->ssrc == 0 ) {
+  applemidi_peer_t *peer = &applemidi->peer[1]; // starting at 1 (because I'm 0)
+  for(i=1; i<applemidi->num_peers; ++i, ++peer) {
+    // Note: as long as we are inviting a peer as master, the SSRC is still 0 but the slot is allocated
+    if( peer->ssrc == 0 && peer->connection_state == APPLEMIDI_CONNECTION_STATE_SLAVE ) {
       return i;
     }
   }
@@ -154,31 +375,53 @@ extern int32_t applemidi_search_free_port(void)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Dummy Callbacks
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void applemidi_receive_packet_callback_for_debugging(uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+void applemidi_receive_packet_callback_for_debugging(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+}
+
+void applemidi_midi_events_received_callback_for_debugging(void *ctx, applemidi_event_t *events, size_t num_events)
 {
+  applemidi_event_t *event = events;
+  int i;
+  for(i=0; i<num_events; ++i, ++event) {
+    if( event->sysex != NULL ) {
+      printf(APPLEMIDI_LOG_TAG "port #%d [%u] SysEx %02x: %d bytes at pos %u\n", event->applemidi_port, event->timestamp, event->midi_status, event->sysex_len, event->sysex_pos);
+    } else {
+      printf(APPLEMIDI_LOG_TAG "port #%d [%u] %02x %02x %02x\n", event->applemidi_port, event->timestamp, event->midi_status, event->data1, event->data2);
+    }
+  }
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Always send packets via this function to ensure proper statistics
+// Packet statistics, called before a datagram is handed over to the interface
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static int32_t applemidi_send_udp_datagram(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len)
+static void applemidi_count_sent_packet(applemidi_t *applemidi, applemidi_peer_t *peer)
 {
-  if( applemidi_callback_send_udp_datagram ) {
-    // peer stats
-    if( peer != NULL && peer->packets_sent != ~0 ) {
-      peer->packets_sent += 1;
-    }
+  // peer stats
+  if( peer != NULL && peer->packets_sent != ~0 ) {
+    peer->packets_sent += 1;
+  }
 
-    // my own stats
-    if( applemidi_peer[0].packets_sent != ~0 ) {
-      applemidi_peer[0].packets_sent += 1;
-    }
+  // my own stats
+  if( applemidi->peer[0].packets_sent != ~0 ) {
+    applemidi->peer[0].packets_sent += 1;
+  }
+}
 
-    int32_t status = applemidi_callback_send_udp_datagram(ip_addr, port, tx_data, tx_len);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Always send packets via this function to ensure proper statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_send_udp_datagram(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint8_t *tx_data, size_t tx_len)
+{
+  if( applemidi->callback_send_udp_datagram ) {
+    applemidi_count_sent_packet(applemidi, peer);
+
+    int32_t status = applemidi->callback_send_udp_datagram(applemidi->callback_send_udp_datagram_ctx, ip_addr, port, tx_data, tx_len, is_dataport);
 
     if( status < 0 ) {
-      if( applemidi_debug_level >= 1 ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_TX_ERROR, peer ? peer->applemidi_port : 0xff, port, tx_len);
+      if( applemidi->debug_level >= 1 ) {
         printf(APPLEMIDI_LOG_TAG "applemidi_send_udp_datagram ERROR: failed to send data\n"); // TODO: more info required?
       }
     }
@@ -189,11 +432,63 @@ static int32_t applemidi_send_udp_datagram(applemidi_peer_t *peer, uint8_t *ip_a
   return -1; // no packet sent
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scatter-gather variant of applemidi_send_udp_datagram, tx_len is the sum of all fragments
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_send_udp_datagram_iov(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, applemidi_iovec_t *iov, size_t iovcnt, size_t tx_len, applemidi_addr_cache_t *addr_cache)
+{
+  applemidi_count_sent_packet(applemidi, peer);
+
+  int32_t status = applemidi->callback_send_udp_datagram_iov(applemidi->callback_send_udp_datagram_ctx, ip_addr, port, iov, iovcnt, is_dataport, addr_cache);
+
+  if( status < 0 ) {
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_TX_ERROR, peer ? peer->applemidi_port : 0xff, port, tx_len);
+    if( applemidi->debug_level >= 1 ) {
+      printf(APPLEMIDI_LOG_TAG "applemidi_send_udp_datagram_iov ERROR: failed to send data\n");
+    }
+  }
+
+  return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Batched variant of applemidi_send_udp_datagram, peer[i] belongs to datagram[i]
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_send_udp_datagrams(applemidi_t *applemidi, applemidi_peer_t **peer, applemidi_udp_datagram_t *datagram, size_t num_datagrams)
+{
+  size_t i;
+
+  for(i=0; i<num_datagrams; ++i) {
+    if( peer[i]->packets_sent != UINT32_MAX ) {
+      peer[i]->packets_sent += 1;
+    }
+  }
+
+  if( num_datagrams <= (size_t)(UINT32_MAX - applemidi->peer[0].packets_sent) ) {
+    applemidi->peer[0].packets_sent += num_datagrams;
+  } else {
+    applemidi->peer[0].packets_sent = UINT32_MAX; // saturate like the per-peer counters
+  }
+
+  int32_t sent = applemidi->callback_send_udp_datagrams(applemidi->callback_send_udp_datagram_ctx, datagram, num_datagrams);
+
+  if( sent < 0 || (size_t)sent < num_datagrams ) {
+    for(i=(sent < 0) ? 0 : (size_t)sent; i<num_datagrams; ++i) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_TX_ERROR, peer[i]->applemidi_port, datagram[i].port, datagram[i].tx_len);
+    }
+    if( applemidi->debug_level >= 1 ) {
+      printf(APPLEMIDI_LOG_TAG "applemidi_send_udp_datagrams ERROR: sent only %d of %d datagrams\n", (sent < 0) ? 0 : sent, (int)num_datagrams);
+    }
+  }
+
+  return sent;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Some util functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static int32_t applemidi_send_invitation(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc, char *name)
+static int32_t applemidi_send_invitation(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t token, uint32_t ssrc, char *name)
 {
   uint32_t tx_buffer[4 + (APPLEMIDI_MAX_NAME_LEN+1)/4] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_INVITATION),
@@ -203,21 +498,24 @@ static int32_t applemidi_send_invitation(applemidi_peer_t *peer, uint8_t *ip_add
   };
   strncpy((void *)&tx_buffer[4], name, APPLEMIDI_MAX_NAME_LEN);
   size_t tx_len = 4*4 + strlen(name) + 1;
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, tx_len);
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, tx_len);
 }
 
-static int32_t applemidi_send_invitation_accepted(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc)
+static int32_t applemidi_send_invitation_accepted(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t token, uint32_t ssrc, char *name)
 {
-  uint32_t tx_buffer[4] = {
+  // the name is optional, but it allows the remote side to distinguish multiple endpoints of the same device
+  uint32_t tx_buffer[4 + (APPLEMIDI_MAX_NAME_LEN+1)/4] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_INVITATION_ACCEPTED),
     htonl(0x00000002),
     htonl(token),
     htonl(ssrc)
   };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 4*4);
+  strncpy((void *)&tx_buffer[4], name, APPLEMIDI_MAX_NAME_LEN);
+  size_t tx_len = 4*4 + strlen(name) + 1;
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, tx_len);
 }
 
-static int32_t applemidi_send_invitation_rejected(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc)
+static int32_t applemidi_send_invitation_rejected(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t token, uint32_t ssrc)
 {
   uint32_t tx_buffer[4] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_INVITATION_REJECTED),
@@ -225,10 +523,10 @@ static int32_t applemidi_send_invitation_rejected(applemidi_peer_t *peer, uint8_
     htonl(token),
     htonl(ssrc)
   };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 4*4);
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, 4*4);
 }
 
-static int32_t applemidi_send_endsession(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc)
+static int32_t applemidi_send_endsession(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t token, uint32_t ssrc)
 {
   uint32_t tx_buffer[4] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_ENDSESSION),
@@ -236,20 +534,20 @@ static int32_t applemidi_send_endsession(applemidi_peer_t *peer, uint8_t *ip_add
     htonl(token),
     htonl(ssrc)
   };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 4*4);
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, 4*4);
 }
 
-static int32_t applemidi_send_bitrate_receive_limit(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t ssrc, uint32_t receive_limit)
+static int32_t applemidi_send_bitrate_receive_limit(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t ssrc, uint32_t receive_limit)
 {
   uint32_t tx_buffer[3] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_BITRATE_RECEIVE_LIMIT),
     htonl(ssrc),
     htonl(receive_limit)
   };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 3*4);
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, 3*4);
 }
 
-static int32_t applemidi_send_synchronization(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t ssrc, uint8_t count, uint64_t timestamp1, uint64_t timestamp2, uint64_t timestamp3)
+static int32_t applemidi_send_synchronization(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t ssrc, uint8_t count, uint64_t timestamp1, uint64_t timestamp2, uint64_t timestamp3)
 {
   uint32_t tx_buffer[9] = {
     htonl(0xffff0000 | APPLEMIDI_COMMAND_SYNCHRONIZATION),
@@ -262,240 +560,1037 @@ static int32_t applemidi_send_synchronization(applemidi_peer_t *peer, uint8_t *i
     htonl(timestamp3 >> 32),
     htonl(timestamp3)
   };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 9*4);
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, 9*4);
+}
+
+static int32_t applemidi_send_receiver_feedback(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint8_t is_dataport, uint32_t ssrc, uint16_t seq_nr)
+{
+  uint32_t tx_buffer[3] = {
+    htonl(0xffff0000 | APPLEMIDI_COMMAND_RECEIVER_FEEDBACK),
+    htonl(ssrc),
+    htons(seq_nr),
+  };
+  return applemidi_send_udp_datagram(applemidi, peer, ip_addr, port, is_dataport, (uint8_t *)tx_buffer, 3*4);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Time Base
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// default clock source: monotonic, so that it doesn't jump on SNTP updates like the wall clock
+static uint64_t applemidi_default_clock_us(void)
+{
+#ifdef ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t (*applemidi_clock_us)(void) = applemidi_default_clock_us;
+
+void applemidi_set_clock_source(uint64_t (*get_time_us)(void))
+{
+  applemidi_clock_us = (get_time_us != NULL) ? get_time_us : applemidi_default_clock_us;
+}
+
+uint64_t applemidi_get_timestamp_us(void)
+{
+  return applemidi_clock_us();
+}
+
+// returns the 100 uS based timestamp which is used for CK synchronization and internal deadlines
+static uint64_t get_timestamp_100us()
+{
+  return applemidi_clock_us() / 100; // 100 uS per increment
+}
+
+// converts the arrival time passed by the interface layer, 0: now
+static inline uint64_t get_rx_timestamp_us(uint64_t rx_timestamp_us)
+{
+  return (rx_timestamp_us != 0) ? rx_timestamp_us : applemidi_clock_us();
+}
+
+// converts a time into an RTP timestamp with the configured clock rate
+static uint32_t get_rtp_timestamp(applemidi_t *applemidi, uint64_t timestamp_us)
+{
+  uint32_t rate = applemidi->rtp_clock_rate;
+
+  if( rate == 10000 ) {
+    return (uint32_t)(timestamp_us / 100); // AppleMIDI default
+  }
+
+  // split into seconds and fraction, so that the multiplication can't overflow
+  return (uint32_t)((timestamp_us / 1000000) * rate + ((timestamp_us % 1000000) * rate) / 1000000);
+}
+
+// wrap-safe arithmetic for the 32bit timestamps (100 uS units) which are stored in the peer slots,
+// they wrap after ~5 days, intervals up to half of this range are handled correctly
+static inline uint32_t applemidi_time_elapsed(uint32_t now, uint32_t since)
+{
+  return now - since;
+}
+
+static inline uint8_t applemidi_time_reached(uint32_t now, uint32_t deadline)
+{
+  return (int32_t)(now - deadline) >= 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Liveness Detection
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static applemidi_peer_t *applemidi_release_peer_slot(applemidi_t *applemidi, uint8_t *ip_addr, uint32_t ssrc);
+static void applemidi_route_session_end(applemidi_t *applemidi, applemidi_peer_t *peer);
+
+// should be called whenever a data or CK packet has been received from the peer
+static void applemidi_peer_activity(applemidi_peer_t *peer)
+{
+  peer->timestamp_last_activity = get_timestamp_100us();
+  peer->probe_sent = 0;
+}
+
+int32_t applemidi_peer_get_idle_time_ms(applemidi_t *applemidi, uint8_t applemidi_port)
+{
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+  if( peer->ssrc == 0 )
+    return -2; // not connected
+
+  return applemidi_time_elapsed(get_timestamp_100us(), peer->timestamp_last_activity) / 10;
+}
+
+#if APPLEMIDI_PEER_TIMEOUT_MS > 0
+static void applemidi_peer_check_liveness(applemidi_t *applemidi, applemidi_peer_t *peer, uint64_t now)
+{
+  if( peer->ssrc == 0 ||
+      (peer->connection_state != APPLEMIDI_CONNECTION_STATE_SLAVE &&
+       peer->connection_state != APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED) )
+    return; // no established session
+
+  uint32_t idle = applemidi_time_elapsed(now, peer->timestamp_last_activity); // 100 uS units
+
+  if( idle >= (10*APPLEMIDI_PEER_TIMEOUT_MS) ) {
+    if( applemidi->debug_level >= 1 ) {
+      char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+      printf(APPLEMIDI_LOG_TAG "liveness: peer at applemidi_port=%d: IP=%s:%d, SSRC=0x%08x, Name='%s' timed out - releasing slot\n",
+        peer->applemidi_port,
+        applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port,
+        peer->ssrc,
+        peer->name);
+    }
+
+    // just in case the peer is still alive but can't reach us: notify it
+    applemidi_send_endsession(applemidi, peer, peer->ip_addr, peer->control_port, 0, peer->token, applemidi->peer[0].ssrc);
+
+    if( applemidi_release_peer_slot(applemidi, peer->ip_addr, peer->ssrc) != NULL ) {
+      // peer stats
+      if( peer->sessions_evicted != ~0 ) {
+        peer->sessions_evicted += 1;
+      }
+
+      // my own stats
+      if( applemidi->peer[0].sessions_evicted != ~0 ) {
+        applemidi->peer[0].sessions_evicted += 1;
+      }
+    }
+  } else if( idle >= (10*APPLEMIDI_PEER_PROBE_MS) && !peer->probe_sent ) {
+    if( applemidi->debug_level >= 2 ) {
+      printf(APPLEMIDI_LOG_TAG "liveness: probing silent peer at applemidi_port=%d\n", peer->applemidi_port);
+    }
+
+    peer->probe_sent = 1;
+    applemidi_send_synchronization(applemidi, peer, peer->ip_addr, peer->data_port, 1, applemidi->peer[0].ssrc, 0, now, 0, 0);
+  }
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Master Invitation Handling
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// returns the capped exponential backoff delay in 100 uS units
+static uint32_t applemidi_master_retry_delay(uint8_t attempts)
+{
+  uint32_t delay_ms = APPLEMIDI_MASTER_INVITE_RETRY_MS;
+  while( attempts-- > 0 && delay_ms < APPLEMIDI_MASTER_INVITE_RETRY_MAX_MS ) {
+    delay_ms *= 2;
+  }
+
+  if( delay_ms > APPLEMIDI_MASTER_INVITE_RETRY_MAX_MS )
+    delay_ms = APPLEMIDI_MASTER_INVITE_RETRY_MAX_MS;
+
+  return 10*delay_ms;
+}
+
+// sends a (new) invitation over the control port
+static void applemidi_master_invite(applemidi_t *applemidi, applemidi_peer_t *peer, uint32_t now)
+{
+  peer->token = rand();
+  if( peer->token == 0 ) // just to ensure that we never get a token with 0
+    peer->token = 42;
+
+  peer->connection_state = APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL;
+  peer->connection_attempts = 1;
+  peer->connection_retry_timestamp = now + applemidi_master_retry_delay(0);
+  applemidi_send_invitation(applemidi, peer, peer->ip_addr, peer->control_port, 0, peer->token, applemidi->peer[0].ssrc, applemidi->peer[0].name);
+}
+
+// called when an invitation failed or a session dropped: either frees the slot, or waits for a reconnect
+static void applemidi_master_connection_lost(applemidi_t *applemidi, applemidi_peer_t *peer, uint32_t now)
+{
+  peer->ssrc = 0;
+  applemidi_route_session_end(applemidi, peer);
+
+  if( peer->connection_is_master && peer->connection_auto_reconnect ) {
+    uint32_t delay = applemidi_master_retry_delay(peer->connection_attempts);
+    peer->connection_state = APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT;
+    peer->connection_retry_timestamp = now + delay;
+
+    if( applemidi->debug_level >= 1 ) {
+      char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+      printf(APPLEMIDI_LOG_TAG "master: reconnecting to peer at applemidi_port=%d: IP=%s:%d in %d mS\n",
+        peer->applemidi_port,
+        applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port,
+        delay / 10);
+    }
+  } else {
+    peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE;
+  }
+}
+
+// checks the deadlines of pending invitations
+static void applemidi_master_check_invitation(applemidi_t *applemidi, applemidi_peer_t *peer, uint32_t now)
+{
+  if( !applemidi_time_reached(now, peer->connection_retry_timestamp) )
+    return; // deadline not reached yet
+
+  switch( peer->connection_state ) {
+  case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL:
+  case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA: {
+    uint8_t is_dataport = peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA;
+
+    if( peer->connection_attempts >= APPLEMIDI_MASTER_INVITE_MAX_ATTEMPTS ) {
+      if( applemidi->debug_level >= 1 ) {
+        char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+        printf(APPLEMIDI_LOG_TAG "master: no response from peer at applemidi_port=%d: IP=%s:%d after %d invitations\n",
+          peer->applemidi_port,
+          applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), is_dataport ? peer->data_port : peer->control_port,
+          peer->connection_attempts);
+      }
+      applemidi_master_connection_lost(applemidi, peer, now);
+    } else {
+      if( applemidi->debug_level >= 2 ) {
+        printf(APPLEMIDI_LOG_TAG "master: retransmitting invitation #%d to peer at applemidi_port=%d\n",
+          peer->connection_attempts + 1,
+          peer->applemidi_port);
+      }
+
+      peer->connection_retry_timestamp = now + applemidi_master_retry_delay(peer->connection_attempts);
+      peer->connection_attempts += 1;
+      applemidi_send_invitation(applemidi, peer, peer->ip_addr, is_dataport ? peer->data_port : peer->control_port, is_dataport, peer->token, applemidi->peer[0].ssrc, applemidi->peer[0].name);
+    }
+  } break;
+
+  case APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT: {
+    applemidi_master_invite(applemidi, peer, now);
+  } break;
+
+  default:
+    break;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Resumes all sessions after the network link was temporarily lost
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_resync(applemidi_t *applemidi)
+{
+  uint64_t now = get_timestamp_100us();
+
+  int i;
+  applemidi_peer_t *peer = &applemidi->peer[1]; // starting at 1 (because I'm 0)
+  for(i=1; i<applemidi->num_peers; ++i, ++peer) {
+    switch( peer->connection_state ) {
+    case APPLEMIDI_CONNECTION_STATE_SLAVE:
+    case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED: {
+      if( peer->ssrc != 0 ) {
+        if( applemidi->debug_level >= 1 ) {
+          char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+          printf(APPLEMIDI_LOG_TAG "resync: resuming session with peer at applemidi_port=%d: IP=%s:%d, SSRC=0x%08x, Name='%s'\n",
+            peer->applemidi_port,
+            applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port,
+            peer->ssrc,
+            peer->name);
+        }
+
+        // the outage shouldn't be counted by the liveness detection
+        applemidi_peer_activity(peer);
+
+        // restart with the faster initial synchronization rate
+        if( peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED ) {
+          peer->connection_sync_done_timestamp = now;
+          peer->connection_sync_ctr = 0;
+        }
+
+        // synchronize immediately, so that the peer notices that we are back
+        applemidi_send_synchronization(applemidi, peer, peer->ip_addr, peer->data_port, 1, applemidi->peer[0].ssrc, 0, now, 0, 0);
+      }
+    } break;
+
+    case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL:
+    case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA:
+    case APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT: {
+      // pending invitations: retransmit with the next tick, and restart the backoff
+      peer->connection_retry_timestamp = now;
+      if( peer->connection_attempts > 1 )
+        peer->connection_attempts = 1;
+    } break;
+
+    default:
+      break;
+    }
+  }
+
+  return 0; // no error
 }
 
-static int32_t applemidi_send_receiver_feedback(applemidi_peer_t *peer, uint8_t *ip_addr, uint16_t port, uint32_t ssrc, uint16_t seq_nr)
-{
-  uint32_t tx_buffer[3] = {
-    htonl(0xffff0000 | APPLEMIDI_COMMAND_RECEIVER_FEEDBACK),
-    htonl(ssrc),
-    htons(seq_nr),
-  };
-  return applemidi_send_udp_datagram(peer, ip_addr, port, (uint8_t *)tx_buffer, 3*4);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Output Buffer and Synchronization Handling
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void applemidi_outbuffer_flush_due(applemidi_t *applemidi, uint32_t now);
+
+// should be called each mS
+void applemidi_tick(applemidi_t *applemidi)
+{
+  uint64_t now = get_timestamp_100us(); // 64bit for the CK timestamps, deadlines are compared with 32bit
+
+  int i;
+  applemidi_peer_t *peer;
+
+  // output buffers
+  applemidi_outbuffer_flush_due(applemidi, now);
+
+  peer = &applemidi->peer[0];
+  for(i=0; i<applemidi->num_peers; ++i, ++peer) {
+    // clock synchronization (if master)
+    if( peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED ) {
+      uint32_t sync_delay = (peer->connection_sync_ctr < 10) ? (10*APPLEMIDI_MASTER_START_SYNC_MS) : (10*APPLEMIDI_MASTER_REGULAR_SYNC_MS);
+
+      if( applemidi_time_elapsed(now, peer->connection_sync_done_timestamp) > sync_delay ) {
+
+        peer->connection_sync_done_timestamp = now;
+        if( peer->connection_sync_ctr < 10 )
+          peer->connection_sync_ctr += 1;
+
+        // initiate new synchronization
+        applemidi_send_synchronization(applemidi, peer, peer->ip_addr, peer->data_port, 1, applemidi->peer[0].ssrc, 0, now, 0, 0);
+      }
+    } else if( peer->connection_state != APPLEMIDI_CONNECTION_STATE_SLAVE ) {
+      // pending invitation (if master)
+      applemidi_master_check_invitation(applemidi, peer, now);
+    }
+
+#if APPLEMIDI_PEER_TIMEOUT_MS > 0
+    if( i > 0 ) {
+      applemidi_peer_check_liveness(applemidi, peer, now);
+    }
+#endif
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics of an output buffer which is going to be sent
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_outbuffer_flush_stats(applemidi_t *applemidi, applemidi_peer_t *peer)
+{
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_EVENTS_PER_PACKET, peer->outbuffer_events);
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_BYTES_PER_PACKET, peer->outbuffer_len);
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_OUTBUFFER_RESIDENCY, 100 * applemidi_time_elapsed(get_timestamp_100us(), peer->outbuffer_timestamp_first_push));
+#endif
+  APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_TX_RTP, peer->applemidi_port, htonl(peer->outbuffer[0]) & 0xffff, peer->outbuffer_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Flushes the output buffers of all peers which are due, with callback_send_udp_datagrams in a single batch
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_outbuffer_flush_due(applemidi_t *applemidi, uint32_t now)
+{
+  // the number of peers is only known at runtime, bigger tables are sent in multiple batches
+  applemidi_udp_datagram_t batch_datagram[APPLEMIDI_FLUSH_BATCH_SIZE];
+  applemidi_peer_t *batch_peer[APPLEMIDI_FLUSH_BATCH_SIZE];
+  size_t batch_len = 0;
+
+  int i;
+  applemidi_peer_t *peer = &applemidi->peer[0];
+  for(i=0; i<applemidi->num_peers; ++i, ++peer) {
+    if( applemidi_time_elapsed(now, peer->outbuffer_timestamp_last_flush) > (10*APPLEMIDI_OUTBUFFER_FLUSH_MS) ) {
+      peer->outbuffer_timestamp_last_flush = now;
+
+      if( applemidi->callback_send_udp_datagrams == NULL ) {
+        applemidi_outbuffer_flush(applemidi, i);
+      } else if( peer->outbuffer_len > 0 ) {
+        applemidi_outbuffer_flush_stats(applemidi, peer);
+
+        applemidi_udp_datagram_t *datagram = &batch_datagram[batch_len];
+        datagram->ip_addr = peer->ip_addr;
+        datagram->port = peer->data_port;
+        datagram->is_dataport = 1;
+        datagram->tx_data = (uint8_t *)peer->outbuffer;
+        datagram->tx_len = peer->outbuffer_len;
+        datagram->addr_cache = &peer->data_addr_cache;
+        batch_peer[batch_len] = peer;
+        ++batch_len;
+      }
+    }
+
+    if( batch_len > 0 && (batch_len >= APPLEMIDI_FLUSH_BATCH_SIZE || i == (applemidi->num_peers - 1)) ) {
+      int j;
+      applemidi_send_udp_datagrams(applemidi, batch_peer, batch_datagram, batch_len);
+
+      for(j=0; j<batch_len; ++j) {
+        batch_peer[j]->outbuffer_len = 0;
+      }
+      batch_len = 0;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Flush Output Buffer (normally done by blemidi_tick_ms each 1 mS)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_outbuffer_flush(applemidi_t *applemidi, uint8_t applemidi_port)
+{
+  if( applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  if( peer->outbuffer_len > 0 ) {
+    applemidi_outbuffer_flush_stats(applemidi, peer);
+    applemidi_send_udp_datagram(applemidi, peer, peer->ip_addr, peer->data_port, 1, (uint8_t *)peer->outbuffer, peer->outbuffer_len);
+    peer->outbuffer_len = 0;
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reserves len bytes for a new MIDI message in the output buffer, the caller has to copy the message
+// to the returned location. The message must fit into an empty packet (header + len <= peer->mtu)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint8_t *applemidi_outbuffer_reserve(applemidi_t *applemidi, applemidi_peer_t *peer, size_t len)
+{
+  uint8_t *buf = (uint8_t *)peer->outbuffer;
+
+  // flush buffer if the new message (+delta time) doesn't fit into the path MTU anymore
+  if( peer->outbuffer_len > 0 && (peer->outbuffer_len + 1 + len) > peer->mtu )
+    applemidi_outbuffer_flush(applemidi, peer->applemidi_port);
+
+  if( peer->outbuffer_len > 0 ) {
+    buf[peer->outbuffer_len++] = 0x00; // TODO no support for delta timestamps yet - always assume that we send at the same time
+
+    // update length field
+    uint16_t header_len = (((uint16_t)buf[3*4 + 0] & 0x0f) << 8) | buf[3*4 + 1];
+    header_len += len + 1;
+    buf[3*4 + 0] = (buf[3*4 + 0] & 0xf0) | ((header_len >> 8) & 0x0f);
+    buf[3*4 + 1] = header_len;
+    // TODO: we could shorten the header length if it's <16, but is it worth the time consuming copy operation?
+  } else {
+    // write initial header
+    uint64_t now_us = applemidi_clock_us();
+    peer->outbuffer[0] = htonl(0x80610000 | applemidi->peer[0].seq_nr++);
+    peer->outbuffer[1] = htonl(get_rtp_timestamp(applemidi, now_us));
+    peer->outbuffer[2] = htonl(applemidi->peer[0].ssrc);
+    peer->outbuffer[3] = (0x80 | (len >> 8)) | ((len & 0xff) << 8); // always use long header so that we can insert the actual length later
+    peer->outbuffer_len = 3*4 + 2;
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+    peer->outbuffer_timestamp_first_push = now_us / 100;
+    peer->outbuffer_events = 0;
+#endif
+  }
+
+  uint8_t *message = &buf[peer->outbuffer_len];
+  peer->outbuffer_len += len;
+#if APPLEMIDI_ENABLE_ROUTING
+  peer->outbuffer_running_status = 0; // the message could be anything, forwarded messages set it again
+#endif
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+  peer->outbuffer_events += 1;
+#endif
+
+  return message;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends a RTP MIDI packet which bypasses the output buffer, the MIDI command section is scattered
+// over iov[1..iovcnt-1], iov[0] is reserved for the RTP header. The output buffer has to be flushed before.
+// With callback_send_udp_datagram_iov the fragments are sent straight from their location,
+// otherwise they are copied into a contiguous packet.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_send_rtp_midi_packet(applemidi_t *applemidi, applemidi_peer_t *peer, applemidi_iovec_t *iov, size_t iovcnt)
+{
+  const size_t max_header_size = 3*4+2;
+  uint32_t header[4];
+  size_t len = 0;
+  int i;
+
+  for(i=1; i<iovcnt; ++i) {
+    len += iov[i].len;
+  }
+
+  size_t packet_len = max_header_size + len;
+  uint8_t *packet = NULL;
+  if( applemidi->callback_send_udp_datagram_iov == NULL ) {
+    packet = (packet_len <= sizeof(peer->outbuffer)) ? (uint8_t *)peer->outbuffer : applemidi_alloc(packet_len);
+    if( packet == NULL ) {
+      return -1; // couldn't create temporary packet
+    }
+  }
+
+  header[0] = htonl(0x80610000 | applemidi->peer[0].seq_nr++);
+  header[1] = htonl(get_rtp_timestamp(applemidi, applemidi_clock_us()));
+  header[2] = htonl(applemidi->peer[0].ssrc);
+  header[3] = (0x80 | (len >> 8)) | ((len & 0xff) << 8);
+  iov[0].base = (uint8_t *)header;
+  iov[0].len = max_header_size;
+
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_EVENTS_PER_PACKET, 1);
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_BYTES_PER_PACKET, packet_len);
+  applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_OUTBUFFER_RESIDENCY, 0);
+#endif
+  APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_TX_RTP, peer->applemidi_port, htonl(header[0]) & 0xffff, packet_len);
+
+  if( packet == NULL ) {
+    return applemidi_send_udp_datagram_iov(applemidi, peer, peer->ip_addr, peer->data_port, 1, iov, iovcnt, packet_len, &peer->data_addr_cache);
+  }
+
+  uint8_t *ptr = packet;
+  for(i=0; i<iovcnt; ++i) {
+    memcpy(ptr, iov[i].base, iov[i].len);
+    ptr += iov[i].len;
+  }
+
+  int32_t status = applemidi_send_udp_datagram(applemidi, peer, peer->ip_addr, peer->data_port, 1, packet, packet_len);
+
+  if( packet != (uint8_t *)peer->outbuffer ) {
+    applemidi_free(packet);
+  }
+
+  return status;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// MIDI Filter: returns the new status byte of a message w/o SysEx (0: dropped),
+// the data bytes are transformed in place
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static inline uint8_t applemidi_filter_apply(const applemidi_filter_t *filter, uint8_t midi_status, uint8_t *data, size_t len)
+{
+  uint8_t status = filter->status_map[midi_status & 0x7f];
+
+  if( status == 0 || !filter->transform || status >= 0xb0 || len < 2 )
+    return status; // dropped, or no Note Off/On/Poly Pressure transformation
+
+  if( filter->transform & APPLEMIDI_FILTER_TRANSFORM_NOTE ) {
+    uint8_t note = filter->note_map[data[0] & 0x7f];
+    if( note == 0xff )
+      return 0; // out of range
+    data[0] = note;
+  }
+
+  if( (filter->transform & APPLEMIDI_FILTER_TRANSFORM_VELOCITY) && (status & 0xf0) == 0x90 ) {
+    data[1] = filter->velocity_map[data[1] & 0x7f];
+  }
+
+  return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compiles a MIDI Filter
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_filter_compile(applemidi_filter_t *filter, const applemidi_filter_config_t *config)
+{
+  uint8_t velocity_min = config->velocity_min ? config->velocity_min : 1;
+  uint8_t velocity_max = config->velocity_max ? config->velocity_max : 127;
+  int i;
+
+  if( velocity_max > 127 || velocity_min > velocity_max )
+    return -1; // invalid velocity range
+
+  for(i=0; i<16; ++i) {
+    if( config->channel_map[i] > 16 )
+      return -1; // invalid channel
+  }
+
+  // status byte x channel
+  for(i=0; i<128; ++i) {
+    uint8_t status = 0x80 + i;
+    uint8_t channel = status & 0x0f;
+
+    if( config->drop[i >> 4] & (1 << channel) ) {
+      filter->status_map[i] = 0;
+    } else if( status < 0xf0 && config->channel_map[channel] ) {
+      filter->status_map[i] = (status & 0xf0) | (config->channel_map[channel] - 1);
+    } else {
+      filter->status_map[i] = status;
+    }
+  }
+  filter->status_map[0xf7 - 0x80] = filter->status_map[0xf0 - 0x80] ? 0xf7 : 0; // SysEx End belongs to the SysEx stream
+
+  filter->transform = 0;
+  if( config->transpose )
+    filter->transform |= APPLEMIDI_FILTER_TRANSFORM_NOTE;
+  if( config->velocity_curve != NULL || velocity_min > 1 || velocity_max < 127 )
+    filter->transform |= APPLEMIDI_FILTER_TRANSFORM_VELOCITY;
+
+  for(i=0; i<128; ++i) {
+    int note = i + config->transpose;
+    filter->note_map[i] = (note >= 0 && note <= 127) ? note : 0xff;
+
+    uint8_t velocity = (config->velocity_curve != NULL) ? (config->velocity_curve[i] & 0x7f) : i;
+    if( velocity < velocity_min )
+      velocity = velocity_min;
+    if( velocity > velocity_max )
+      velocity = velocity_max;
+    filter->velocity_map[i] = velocity;
+  }
+  filter->velocity_map[0] = 0; // Note On with velocity 0 is a Note Off
+
+  return 0; // no error
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Installs the MIDI Filters of a peer
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_filter(applemidi_t *applemidi, uint8_t applemidi_port, const applemidi_filter_t *filter_in, const applemidi_filter_t *filter_out)
+{
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+  peer->filter_in = filter_in;
+  peer->filter_out = filter_out;
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Push a new MIDI message to the output buffer
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_outbuffer_push(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t *stream, size_t len)
+{
+  const size_t max_header_size = 3*4+2;
+
+  if( applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  // if the message doesn't fit into a single packet, it will be sent out immediately
+  if( (max_header_size + len) > peer->mtu ) {
+    // this is very unlikely, since applemidi_send_message() splits SysEx streams into chunks which fit into the MTU
+    // but just in case of future extensions, the message is sent in a separate packet
+    applemidi_outbuffer_flush(applemidi, applemidi_port);
+
+    applemidi_iovec_t iov[2];
+    iov[1].base = stream;
+    iov[1].len = len;
+    if( applemidi_send_rtp_midi_packet(applemidi, peer, iov, 2) < 0 ) {
+      return -1; // packet not sent
+    }
+  } else {
+    memcpy(applemidi_outbuffer_reserve(applemidi, peer, len), stream, len);
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends a Apple MIDI message
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_send_message(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t *stream, size_t len)
+{
+  const size_t max_header_size = 3*4+2;
+
+  if( applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  uint8_t filtered[3];
+  if( peer->filter_out != NULL && len > 0 ) {
+    if( stream[0] == 0xf0 || stream[0] == 0xf7 ) {
+      if( peer->filter_out->status_map[stream[0] & 0x7f] == 0 ) {
+        ++peer->filter_dropped;
+        return 0; // SysEx dropped
+      }
+    } else if( stream[0] & 0x80 && len <= sizeof(filtered) ) {
+      memcpy(filtered, stream, len);
+      filtered[0] = applemidi_filter_apply(peer->filter_out, stream[0], &filtered[1], len-1);
+      if( filtered[0] == 0 ) {
+        ++peer->filter_dropped;
+        return 0; // message dropped
+      }
+      stream = filtered;
+    }
+  }
+
+  // if more bytes need to be sent than fit into the path MTU, split over multiple packets
+
+  if( (max_header_size + len) <= peer->mtu ) {
+    // just add to output buffer
+    applemidi_outbuffer_push(applemidi, applemidi_port, stream, len);
+  } else {
+    // TODO: currently only supports SysEx
+    // sending packets, each chunk is written directly into the output buffer,
+    // or sent straight from the stream if it fills a complete packet and the interface supports scatter-gather
+    size_t max_size = peer->mtu - max_header_size - 2; // -2 since we have to add F0/F7 at begin/end
+    uint8_t sysex_continue = 0xf7;
+    uint8_t sysex_tail = 0xf0;
+    int pos;
+    for(pos=0; pos<len; pos += max_size) {
+      uint8_t last_chunk = (pos > 0) && (pos+max_size+1) >= len;
+
+      if( applemidi->callback_send_udp_datagram_iov != NULL && !last_chunk ) {
+        applemidi_iovec_t iov[APPLEMIDI_MAX_IOV];
+        size_t iovcnt = 1; // iov[0] is reserved for the RTP header
+        if( pos > 0 ) {
+          iov[iovcnt].base = &sysex_continue;
+          iov[iovcnt].len = 1;
+          ++iovcnt;
+        }
+        iov[iovcnt].base = &stream[pos];
+        iov[iovcnt].len = max_size;
+        ++iovcnt;
+        iov[iovcnt].base = &sysex_tail;
+        iov[iovcnt].len = 1;
+        ++iovcnt;
+
+        applemidi_outbuffer_flush(applemidi, applemidi_port);
+        applemidi_send_rtp_midi_packet(applemidi, peer, iov, iovcnt);
+      } else if( pos == 0 ) {
+        uint8_t *chunk = applemidi_outbuffer_reserve(applemidi, peer, max_size+1);
+        memcpy(&chunk[0], stream, max_size);
+        chunk[max_size] = 0xf0; // tail status octet
+      } else {
+        size_t chunk_len = max_size + 2;
+        if( last_chunk ) {
+          chunk_len = len-pos+1;
+        }
+        uint8_t *chunk = applemidi_outbuffer_reserve(applemidi, peer, chunk_len);
+        chunk[0] = 0xf7; // continue stream
+        if( last_chunk ) {
+          memcpy(&chunk[1], &stream[pos], len-pos);
+          break; // the remaining bytes could be one more than max_size
+        } else {
+          memcpy(&chunk[1], &stream[pos], max_size);
+          chunk[max_size+1] = 0xf0; // tail status octet
+        }
+      }
+    }
+  }
+
+  return 0; // no error
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Returns the 100 uS based Timestamp
+// Sets the path MTU of a peer
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static uint64_t get_timestamp_100us()
+int32_t applemidi_set_mtu(applemidi_t *applemidi, uint8_t applemidi_port, uint16_t mtu)
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (tv.tv_sec * 10000 + (tv.tv_usec / 100)); // 100 uS per increment
+  if( applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  if( mtu < APPLEMIDI_MIN_MTU )
+    mtu = APPLEMIDI_MIN_MTU;
+  if( mtu > APPLEMIDI_OUTBUFFER_SIZE )
+    mtu = APPLEMIDI_OUTBUFFER_SIZE;
+
+  // pending messages might not fit anymore
+  if( peer->outbuffer_len > mtu )
+    applemidi_outbuffer_flush(applemidi, applemidi_port);
+
+  peer->mtu = mtu;
+
+  return 0; // no error
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Output Buffer and Synchronization Handling
+// Sets/Returns the destinations of the messages received from a peer
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-
-// should be called each mS
-void applemidi_tick(void)
+int32_t applemidi_set_route(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t channel, uint32_t dst_mask)
 {
-  uint32_t now = get_timestamp_100us(); // 32bit is enough...
+#if APPLEMIDI_ENABLE_ROUTING
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers )
+    return -1; // invalid port
 
-  int i;
-  applemidi_peer_t *peer = &applemidi_peer[0];
-  for(i=0; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
-    // output buffers
-    if( (peer->outbuffer_timestamp_last_flush > now) ||
-      (now > (peer->outbuffer_timestamp_last_flush + (10*APPLEMIDI_OUTBUFFER_FLUSH_MS))) ) {
-      applemidi_outbuffer_flush(i);
-      peer->outbuffer_timestamp_last_flush = now;
+  if( channel >= APPLEMIDI_ROUTE_CHANNELS && channel != APPLEMIDI_ROUTE_ALL )
+    return -1; // invalid channel
+
+  if( applemidi->num_peers < 32 )
+    dst_mask &= (1UL << applemidi->num_peers) - 1; // ports which don't exist are ignored
+
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+  if( channel == APPLEMIDI_ROUTE_ALL ) {
+    for(channel=0; channel<APPLEMIDI_ROUTE_CHANNELS; ++channel) {
+      peer->route[channel] = dst_mask;
     }
+  } else {
+    peer->route[channel] = dst_mask;
+  }
 
-    // clock synchronization (if master)
-    if( peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED ) {
-      uint32_t sync_delay = (peer->connection_sync_ctr < 10) ? (10*APPLEMIDI_MASTER_START_SYNC_MS) : (10*APPLEMIDI_MASTER_REGULAR_SYNC_MS);
+  return 0; // no error
+#else
+  return -1; // routing not enabled
+#endif
+}
+
+uint32_t applemidi_get_route(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t channel)
+{
+#if APPLEMIDI_ENABLE_ROUTING
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers || channel >= APPLEMIDI_ROUTE_CHANNELS )
+    return 0; // invalid port or channel
 
-      if( (peer->connection_sync_done_timestamp > now) ||
-          (now > (peer->connection_sync_done_timestamp + sync_delay)) ) {
+  return applemidi->peer[applemidi_port].route[channel];
+#else
+  return (applemidi_port > 0 && applemidi_port < applemidi->num_peers && channel < APPLEMIDI_ROUTE_CHANNELS) ? APPLEMIDI_ROUTE_LOCAL : 0;
+#endif
+}
 
-        peer->connection_sync_done_timestamp = now;
-        if( peer->connection_sync_ctr < 10 )
-          peer->connection_sync_ctr += 1;
 
-        // initiate new synchronization
-        applemidi_send_synchronization(peer, peer->ip_addr, peer->data_port, applemidi_peer[0].ssrc, 0, now, 0, 0);
-      }
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Number of expected data bytes of a MIDI message, indexed by the status byte
+// The values are defined in applemidi.h, since the C++ layer uses them as well
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const uint8_t applemidi_midi_expected_bytes[256] = APPLEMIDI_MIDI_EXPECTED_BYTES_INIT;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Hands over a decoded MIDI message to the application: either directly to callback_midi_message_received,
+// or it's collected in the event batch for callback_midi_events_received
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static inline void applemidi_deliver_midi_message(applemidi_t *applemidi, applemidi_event_t *events, size_t *num_events, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *stream, size_t len)
+{
+  if( applemidi->callback_midi_events_received != NULL ) {
+    applemidi_event_t *event = &events[*num_events];
+    event->timestamp = timestamp;
+    event->applemidi_port = applemidi_port;
+    event->midi_status = midi_status;
+    if( midi_status == 0xf0 || midi_status == 0xf7 ) {
+      event->sysex_pos = applemidi->peer[applemidi_port].continued_sysex_pos;
+      event->sysex = stream;
+      event->sysex_len = len;
+      event->data1 = 0;
+      event->data2 = 0;
+    } else {
+      event->sysex_pos = 0;
+      event->sysex = NULL;
+      event->sysex_len = 0;
+      event->data1 = (len >= 1) ? stream[0] : 0;
+      event->data2 = (len >= 2) ? stream[1] : 0;
     }
+
+    if( ++*num_events >= APPLEMIDI_MAX_EVENTS ) {
+      applemidi->callback_midi_events_received(applemidi->callback_midi_events_received_ctx, events, *num_events);
+      *num_events = 0;
+    }
+  } else if( applemidi->callback_midi_message_received != NULL ) {
+    applemidi->callback_midi_message_received(applemidi->callback_midi_message_received_ctx, applemidi_port, timestamp, midi_status, stream, len, applemidi->peer[applemidi_port].continued_sysex_pos);
   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Flush Output Buffer (normally done by blemidi_tick_ms each 1 mS)
+// Passes the remaining events of the batch to callback_midi_events_received
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_outbuffer_flush(uint8_t applemidi_port)
+static inline void applemidi_deliver_midi_events(applemidi_t *applemidi, applemidi_event_t *events, size_t num_events)
 {
-  if( applemidi_port >= APPLEMIDI_MAX_PEERS )
-    return -1; // invalid port
-
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
-
-  if( peer->outbuffer_len > 0 ) {
-    applemidi_send_udp_datagram(peer, peer->ip_addr, peer->data_port, (uint8_t *)peer->outbuffer, peer->outbuffer_len);
-    peer->outbuffer_len = 0;
+  if( num_events && applemidi->callback_midi_events_received != NULL ) {
+    applemidi->callback_midi_events_received(applemidi->callback_midi_events_received_ctx, events, num_events);
   }
-
-  return 0; // no error
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Push a new MIDI message to the output buffer
+// Routing Matrix
+// Received messages are copied from the receive buffer straight into the output buffers of the destinations.
+// Running status is tracked per destination packet, so that merged streams of different sources stay valid.
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static int32_t applemidi_outbuffer_push(uint8_t applemidi_port, uint8_t *stream, size_t len)
+#if APPLEMIDI_ENABLE_ROUTING
+
+#define APPLEMIDI_ROUTE_GET(peer, midi_status) ((peer)->route[((midi_status) < 0xf0) ? ((midi_status) & 0x0f) : APPLEMIDI_ROUTE_SYSTEM])
+
+// checks if a message of the source can be forwarded without interrupting the SysEx stream of another source
+static inline uint8_t applemidi_route_allowed(applemidi_t *applemidi, applemidi_peer_t *peer, uint8_t src_port, uint8_t midi_status)
 {
-  const size_t max_header_size = 3*4+2;
+  if( peer->route_sysex_owner == 0 || midi_status >= 0xf8 )
+    return 1; // no stream in progress, Realtime messages can be interleaved anyhow
 
-  if( applemidi_port >= APPLEMIDI_MAX_PEERS )
-    return -1; // invalid port
+  if( peer->route_sysex_owner == src_port ) {
+    if( midi_status != 0xf0 )
+      peer->route_sysex_owner = 0; // the source has abandoned its stream
+    return 1;
+  }
 
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+  if( applemidi_time_elapsed(get_timestamp_100us(), peer->route_sysex_timestamp) >= 10*APPLEMIDI_ROUTE_SYSEX_TIMEOUT_MS ) {
+    // the owner stalls (e.g. the final segment got lost): the destination drops the unfinished stream with the next status byte
+    peer->route_sysex_owner = 0;
+    return 1;
+  }
 
-  // if len >= buffer size, it makes sense to send out immediately
-  if( len >= (APPLEMIDI_OUTBUFFER_SIZE-max_header_size) ) {
-    // this is very unlikely, since applemidi_send_message() maintains the size
-    // but just in case of future extensions, we prepare dynamic memory allocation for "big packets"
-    applemidi_outbuffer_flush(applemidi_port);
-    {
-      size_t packet_len = max_header_size + len;
-      uint32_t *packet = malloc(packet_len);
-      if( packet == NULL ) {
-        return -1; // couldn't create temporary packet
-      } else {
-        packet[0] = htonl(0x80610000 | applemidi_peer[0].seq_nr++);
-        packet[1] = htonl(get_timestamp_100us());
-        packet[2] = htonl(applemidi_peer[0].ssrc);
-        packet[3] = (0x80 | (len >> 8)) | ((len & 0xff) << 8);
-        memcpy((uint8_t *)packet + max_header_size, stream, len);
-        applemidi_send_udp_datagram(peer, peer->ip_addr, peer->data_port, (uint8_t *)packet, packet_len);
-        free(packet);
+  return 0; // would interrupt the stream
+}
+
+// forwards a message w/o SysEx to the destinations
+static void applemidi_route_message(applemidi_t *applemidi, uint8_t src_port, uint32_t dst_mask, uint8_t midi_status, uint8_t *stream, size_t len)
+{
+  uint8_t dst_port;
+  applemidi_peer_t *peer = &applemidi->peer[1];
+
+  dst_mask >>= 1; // bit 0: application
+  for(dst_port=1; dst_mask && dst_port<applemidi->num_peers; ++dst_port, ++peer, dst_mask >>= 1) {
+    if( !(dst_mask & 1) || peer->ssrc == 0 )
+      continue; // not selected, or no session
+
+    uint8_t status = midi_status;
+    uint8_t *data = stream;
+    uint8_t filtered[2];
+    if( peer->filter_out != NULL ) {
+      memcpy(filtered, stream, len);
+      status = applemidi_filter_apply(peer->filter_out, midi_status, filtered, len);
+      if( status == 0 ) {
+        ++peer->filter_dropped;
+        continue;
       }
+      data = filtered;
     }
-  } else {
-    // flush buffer before adding new message
-    if( (peer->outbuffer_len + len) >= (APPLEMIDI_OUTBUFFER_SIZE-max_header_size) )
-      applemidi_outbuffer_flush(applemidi_port);
-
-    // adding new message
-    uint8_t *buf = (uint8_t *)peer->outbuffer;
-    if( peer->outbuffer_len > 0 ) {
-      buf[peer->outbuffer_len++] = 0x00; // TODO no support for delta timestamps yet - always assume that we send at the same time
-
-      // update length field
-      uint16_t header_len = (((uint16_t)buf[3*4 + 0] & 0x0f) << 8) | buf[3*4 + 1];
-      header_len += len + 1;
-      buf[3*4 + 0] = (buf[3*4 + 0] & 0xf0) | ((header_len >> 8) & 0x0f);
-      buf[3*4 + 1] = header_len;
-      // TODO: we could shorten the header length if it's <16, but is it worth the time consuming copy operation?
-    } else {
-      // write initial header
-      peer->outbuffer[0] = htonl(0x80610000 | applemidi_peer[0].seq_nr++);
-      peer->outbuffer[1] = htonl(get_timestamp_100us());
-      peer->outbuffer[2] = htonl(applemidi_peer[0].ssrc);
-      peer->outbuffer[3] = (0x80 | (len >> 8)) | ((len & 0xff) << 8); // always use long header so that we can insert the actual length later
-      peer->outbuffer_len = 3*4 + 2;
+
+    if( !applemidi_route_allowed(applemidi, peer, src_port, status) ) {
+      ++peer->route_dropped;
+      continue;
     }
 
-    memcpy(&buf[peer->outbuffer_len], stream, len);
-    peer->outbuffer_len += len;
-  }
+    // flush before checking the running status, it's only valid within the same packet
+    size_t message_len = 1 + len;
+    if( peer->outbuffer_len > 0 && (peer->outbuffer_len + 1 + message_len) > peer->mtu )
+      applemidi_outbuffer_flush(applemidi, dst_port);
 
-  return 0; // no error
-}
+    uint8_t running_status = peer->outbuffer_len > 0 && status == peer->outbuffer_running_status;
+    uint8_t *message = applemidi_outbuffer_reserve(applemidi, peer, message_len - running_status);
+    if( !running_status )
+      *(message++) = status;
+    memcpy(message, data, len);
 
+    peer->outbuffer_running_status = (status < 0xf0) ? status : 0; // System messages cancel the running status
+    ++peer->route_forwarded;
+  }
+}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
-// Sends a Apple MIDI message
-////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_send_message(uint8_t applemidi_port, uint8_t *stream, size_t len)
+// forwards a SysEx segment to the destinations, it's split again if it doesn't fit into the MTU of a destination
+static void applemidi_route_sysex(applemidi_t *applemidi, uint8_t src_port, uint32_t dst_mask, uint8_t sysex_lead, uint8_t *stream, size_t len, uint8_t sysex_tail)
 {
   const size_t max_header_size = 3*4+2;
+  uint8_t dst_port;
+  applemidi_peer_t *peer = &applemidi->peer[1];
 
-  if( applemidi_port >= APPLEMIDI_MAX_PEERS )
-    return -1; // invalid port
+  dst_mask >>= 1; // bit 0: application
+  for(dst_port=1; dst_mask && dst_port<applemidi->num_peers; ++dst_port, ++peer, dst_mask >>= 1) {
+    if( !(dst_mask & 1) || peer->ssrc == 0 )
+      continue; // not selected, or no session
 
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+    if( peer->filter_out != NULL && peer->filter_out->status_map[0xf0 - 0x80] == 0 ) {
+      ++peer->filter_dropped;
+      continue;
+    }
 
-  // we've to consider blemidi_mtu
-  // if more bytes need to be sent, split over multiple packets
-  // this will cost some extra stack space :-/ therefore handled separatly?
+    if( !applemidi_route_allowed(applemidi, peer, src_port, 0xf0) ) {
+      ++peer->route_dropped;
+      continue;
+    }
 
-  if( len < (APPLEMIDI_OUTBUFFER_SIZE-max_header_size) ) {
-    // just add to output buffer
-    applemidi_outbuffer_push(applemidi_port, stream, len);
-  } else {
-    // TODO: currently only supports SysEx
-    // sending packets
-    size_t max_size = APPLEMIDI_OUTBUFFER_SIZE - max_header_size - 2; // -2 since we have to add F0/F7 at begin/end
-    uint8_t packet[APPLEMIDI_OUTBUFFER_SIZE]; // now it becomes stack hungry...
-    int pos;
-    for(pos=0; pos<len; pos += max_size) {
-      if( pos == 0 ) {
-        memcpy(&packet[0], stream, max_size);
-        packet[max_size] = 0xf0; // tail status octet
-        applemidi_outbuffer_push(applemidi_port, packet, max_size+1);
-      } else {
-        packet[0] = 0xf7; // continue stream
-        memcpy(&packet[1], &stream[pos], max_size);
-        size_t packet_len = max_size + 2;
-        if( (pos+max_size+1) >= len ) {
-          packet_len = len-pos+1;
-        } else {
-          packet[max_size+1] = 0xf0; // tail status octet
-        }
-        applemidi_outbuffer_push(applemidi_port, packet, packet_len);
-      }
+    size_t max_size = peer->mtu - max_header_size - 2; // -2 since we have to add F0/F7 at begin/end
+    uint8_t lead = sysex_lead;
+    uint8_t *chunk = stream;
+    size_t remaining = len;
+    do {
+      size_t chunk_len = (remaining > max_size) ? max_size : remaining;
+      uint8_t *message = applemidi_outbuffer_reserve(applemidi, peer, chunk_len + 2);
+      message[0] = lead;
+      memcpy(&message[1], chunk, chunk_len);
+      chunk += chunk_len;
+      remaining -= chunk_len;
+      message[chunk_len + 1] = remaining ? 0xf0 : sysex_tail;
+      lead = 0xf7; // continue stream
+    } while( remaining > 0 );
+
+    if( sysex_tail == 0xf0 ) {
+      peer->route_sysex_owner = src_port; // the stream continues with the next packet of the source
+      peer->route_sysex_timestamp = get_timestamp_100us();
+    } else {
+      peer->route_sysex_owner = 0;
     }
+    ++peer->route_forwarded;
   }
+}
 
-  return 0; // no error
+// releases the destinations which are owned by a terminated session
+static void applemidi_route_session_end(applemidi_t *applemidi, applemidi_peer_t *peer)
+{
+  int i;
+  for(i=1; i<applemidi->num_peers; ++i) {
+    if( applemidi->peer[i].route_sysex_owner == peer->applemidi_port )
+      applemidi->peer[i].route_sysex_owner = 0;
+  }
+  peer->route_sysex_owner = 0;
 }
 
+#else
+
+#define APPLEMIDI_ROUTE_GET(peer, midi_status) ((void)(peer), APPLEMIDI_ROUTE_LOCAL)
+
+static inline void applemidi_route_message(applemidi_t *applemidi, uint8_t src_port, uint32_t dst_mask, uint8_t midi_status, uint8_t *stream, size_t len) {}
+static inline void applemidi_route_sysex(applemidi_t *applemidi, uint8_t src_port, uint32_t dst_mask, uint8_t sysex_lead, uint8_t *stream, size_t len, uint8_t sysex_tail) {}
+static void applemidi_route_session_end(applemidi_t *applemidi, applemidi_peer_t *peer) {}
+
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Decodes a RTP MIDI Message
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static int32_t applemidi_decode_rtp_midi(uint8_t applemidi_port, uint32_t timestamp, uint32_t ssrc, uint8_t *stream, size_t len)
-{
-  //! Number if expected bytes for a common MIDI event - 1
-  const uint8_t midi_expected_bytes_common[8] = {
-    2, // Note On
-    2, // Note Off
-    2, // Poly Preasure
-    2, // Controller
-    1, // Program Change
-    1, // Channel Preasure
-    2, // Pitch Bender
-    0, // System Message - must be zero, so that mios32_midi_expected_bytes_system[] will be used
-  };
-
-  //! Number if expected bytes for a system MIDI event - 1
-  const uint8_t midi_expected_bytes_system[16] = {
-    1, // SysEx Begin (endless until SysEx End F7)
-    1, // MTC Data frame
-    2, // Song Position
-    1, // Song Select
-    0, // Reserved
-    0, // Reserved
-    0, // Request Tuning Calibration
-    0, // SysEx End
-
-    // Note: just only for documentation, Realtime Messages don't change the running status
-    0, // MIDI Clock
-    0, // MIDI Tick
-    0, // MIDI Start
-    0, // MIDI Continue
-    0, // MIDI Stop
-    0, // Reserved
-    0, // Active Sense
-    0, // Reset
-  };
-
+static int32_t applemidi_decode_rtp_midi(applemidi_t *applemidi, uint8_t applemidi_port, uint32_t timestamp, uint32_t ssrc, uint8_t *stream, size_t len)
+{
   // inspired from https://github.com/lathoub/Arduino-AppleMIDI-Library/blob/master/src/utility/packet-rtp-midi.h
+  //
+  // The stream is taken from the network, so that each read is checked against the end of the command section;
+  // malformed lists are rejected with -1, messages which have been decoded before the error are kept.
+
+  if( len < 1 ) {
+    if( applemidi->debug_level >= 1 ) {
+      printf("decode_rtp_midi ERROR: missing command section header\n");
+    }
+    return -1;
+  }
 
   uint8_t cmd = stream[0]; // layout: BJZP<LEN> - JZP are ignored so far!
   // J: journal leads to complicated handling, currently we discard this section... TODO
@@ -503,115 +1598,248 @@ static int32_t applemidi_decode_rtp_midi(uint8_t applemidi_port, uint32_t timest
   // P: status byte was present in original MIDI command... TODO
 
   // Command Length: first 4bit + next byte if B flag is set
-  int32_t cmd_len = cmd & 0x0f;
+  size_t cmd_len = cmd & 0x0f;
   if( cmd & 0x80 ) { // B flag
+    if( len < 2 ) {
+      if( applemidi->debug_level >= 1 ) {
+        printf("decode_rtp_midi ERROR: missing command section header\n");
+      }
+      return -1;
+    }
     cmd_len = (cmd_len << 8) | stream[1];
     stream += 2;
+    len -= 2;
   } else {
     stream += 1;
+    len -= 1;
   }
 
-  if( applemidi_debug_level >= 3 ) {
-    printf("decode_rtp_midi: RTP MIDI port #%d (%d bytes)\n", applemidi_port, cmd_len);
+  if( applemidi->debug_level >= 3 ) {
+    printf("decode_rtp_midi: RTP MIDI port #%d (%d bytes)\n", applemidi_port, (int)cmd_len);
     //esp_log_buffer_hex(APPLEMIDI_LOG_TAG, stream, cmd_len);
   }
 
+  if( cmd_len > len ) {
+    if( applemidi->debug_level >= 1 ) {
+      printf("decode_rtp_midi ERROR: command section of %d bytes exceeds datagram (%d bytes)\n", (int)cmd_len, (int)len);
+    }
+    return -1;
+  }
+
+  uint8_t *cmd_end = stream + cmd_len; // the journal (if any) is following here and will be discarded
   uint32_t cmd_count = 0;
   uint8_t midi_status = 0;
-  while( cmd_len > 0 ) {
+  int32_t status = 0;
+  applemidi_peer_t *src_peer = &applemidi->peer[applemidi_port];
+  uint32_t dst_mask; // destinations of the message, see applemidi_set_route()
+  const applemidi_filter_t *filter_in = src_peer->filter_in;
+
+  applemidi_event_t events[APPLEMIDI_MAX_EVENTS]; // only used with callback_midi_events_received
+  size_t num_events = 0;
+
+  while( stream < cmd_end ) {
     if( cmd_count || (cmd & 0x20) ) { // cmd: Z flag means delta time for first MIDI event
       // compressed timestamp - remembers me on MIDI File standard... see MID_PARSER_ReadVarLen() in MIOS32
       int i;
       uint32_t delta = 0;
       for(i=0; i<4; ++i) {
+        if( stream >= cmd_end ) {
+          break;
+        }
         delta = (delta << 7) | (*stream & 0x7f);
         if( !(*(stream++) & 0x80) )
           break;
       }
-      cmd_len -= i+1;
       timestamp += delta;
+
+      if( stream >= cmd_end ) {
+        if( applemidi->debug_level >= 1 ) {
+          printf("decode_rtp_midi ERROR: missing MIDI event after delta time\n");
+        }
+        status = -1;
+        break;
+      }
     }
 
-    if( applemidi_callback_midi_message_received != NULL ) {
-      if( stream[0] & 0x80 ) {
-        midi_status = *(stream++);
-        cmd_len -= 1;
+    if( stream[0] & 0x80 ) {
+      midi_status = *(stream++);
+    } else if( midi_status == 0 ) {
+      if( applemidi->debug_level >= 1 ) {
+        printf("decode_rtp_midi ERROR: running status without previous status byte\n");
       }
+      status = -1;
+      break;
+    }
+
+    // detect continued SysEx
+    uint8_t continued_sysex = 0;
+    if( (cmd_end - stream) > 1 && midi_status == 0xf7) {
+      continued_sysex = 1;
+      midi_status = 0xf0;
+    } else if( midi_status < 0xf8 ) { // Realtime messages can be interleaved with SysEx segments
+      applemidi->peer[applemidi_port].continued_sysex_pos = 0;
+    }
+
+    if( midi_status == 0xf0 ) {
+      size_t num_bytes;
+      size_t max_bytes = cmd_end - stream;
+      for(num_bytes=0; num_bytes < max_bytes && stream[num_bytes] < 0x80; ++num_bytes);
 
-      // detect continued SysEx
-      uint8_t continued_sysex = 0;
-      if( cmd_len > 1 && midi_status == 0xf7) {
-        continued_sysex = 1;
-        midi_status = 0xf0;
+      if( filter_in != NULL && filter_in->status_map[0xf0 - 0x80] == 0 ) {
+        dst_mask = 0; // dropped by the filter, the stream is only parsed
+        ++src_peer->filter_dropped;
       } else {
-        applemidi_peer[applemidi_port].continued_sysex_pos = 0;
+        dst_mask = APPLEMIDI_ROUTE_GET(src_peer, midi_status);
       }
-
-      if( midi_status == 0xf0 ) {
-        size_t num_bytes;
-        for(num_bytes=0; stream[num_bytes] < 0x80; ++num_bytes) {
-          if( num_bytes >= cmd_len ) {
-            break;
-          }
+      if( dst_mask & APPLEMIDI_ROUTE_LOCAL ) {
+        applemidi_deliver_midi_message(applemidi, events, &num_events, applemidi_port, timestamp, midi_status, stream, num_bytes);
+      }
+      if( (dst_mask & ~APPLEMIDI_ROUTE_LOCAL) && num_bytes < max_bytes && (stream[num_bytes] == 0xf0 || stream[num_bytes] == 0xf7) ) {
+        // forwarded together with the tail status octet, which is already known here
+        applemidi_route_sysex(applemidi, applemidi_port, dst_mask, continued_sysex ? 0xf7 : 0xf0, stream, num_bytes, stream[num_bytes]);
+      }
+      stream += num_bytes;
+      ++cmd_count;
+      applemidi->peer[applemidi_port].continued_sysex_pos += num_bytes; // we expect another packet with the remaining SysEx stream
+
+      if( stream < cmd_end && stream[0] == 0xf0 ) {
+        // expect continued sysex...
+        stream += 1;
+      } else if( stream < cmd_end && stream[0] == 0xf7 ) {
+        // last SysEx - propagate to app
+        midi_status = 0xf7;
+        stream += 1;
+        applemidi->peer[applemidi_port].continued_sysex_pos = 0;
+        if( dst_mask & APPLEMIDI_ROUTE_LOCAL ) {
+          applemidi_deliver_midi_message(applemidi, events, &num_events, applemidi_port, timestamp, midi_status, stream, 0);
         }
+      } else {
+        if( applemidi->debug_level >= 1 ) {
+          printf("decode_rtp_midi ERROR: unexpected termination of SysEx message\n");
+        }
+        status = -1;
+        break;
+      }
+    } else {
+      uint8_t num_bytes = applemidi_midi_expected_bytes[midi_status];
 
-        applemidi_callback_midi_message_received(applemidi_port, timestamp, midi_status, stream, num_bytes, applemidi_peer[applemidi_port].continued_sysex_pos);
-        stream += num_bytes;
-        cmd_len -= num_bytes;
-        ++cmd_count;
-        applemidi_peer[applemidi_port].continued_sysex_pos += num_bytes; // we expect another packet with the remaining SysEx stream
-
-        if( stream[0] == 0xf0 ) {
-          // expect continued sysex...
-          stream += 1;
-          cmd_len -= 1;
-        } else if( stream[0] == 0xf7 ) {
-          // last SysEx - propagate to app
-          midi_status = 0xf7;
-          stream += 1;
-          cmd_len -= 1;
-          applemidi_peer[applemidi_port].continued_sysex_pos = 0;
-          applemidi_callback_midi_message_received(applemidi_port, timestamp, midi_status, stream, 0, applemidi_peer[applemidi_port].continued_sysex_pos);
-        } else {
-          if( applemidi_debug_level >= 1 ) {
-            printf("decode_rtp_midi ERROR: unexpected termination of SysEx message\n");
-          }
-          return -1;
+      if( num_bytes > (cmd_end - stream) ) {
+        if( applemidi->debug_level >= 1 ) {
+          printf("decode_rtp_midi ERROR: missing %d bytes in parsed message\n", num_bytes);
         }
+        status = -1;
+        break;
       } else {
-        uint8_t num_bytes = midi_expected_bytes_common[(midi_status >> 4) & 0x7];
-        if( num_bytes == 0 ) { // System Message
-          num_bytes = midi_expected_bytes_system[midi_status & 0xf];
+        uint8_t message_status = midi_status; // midi_status is kept for running status
+        uint8_t *message = stream;
+        uint8_t filtered[2];
+        if( filter_in != NULL ) {
+          memcpy(filtered, stream, num_bytes);
+          message_status = applemidi_filter_apply(filter_in, midi_status, filtered, num_bytes);
+          message = filtered;
         }
 
-        if( num_bytes > cmd_len ) {
-          if( applemidi_debug_level >= 1 ) {
-            printf("decode_rtp_midi ERROR: missing %d bytes in parsed message\n", num_bytes);
-          }
-          return -1;
+        if( message_status == 0 ) {
+          ++src_peer->filter_dropped; // rejected before any callback or buffer work
         } else {
-          applemidi_callback_midi_message_received(applemidi_port, timestamp, midi_status, stream, num_bytes, applemidi_peer[applemidi_port].continued_sysex_pos);
-          ++cmd_count;
-          stream += num_bytes;
-          cmd_len -= num_bytes;
+          dst_mask = APPLEMIDI_ROUTE_GET(src_peer, message_status);
+          if( dst_mask & APPLEMIDI_ROUTE_LOCAL ) {
+            applemidi_deliver_midi_message(applemidi, events, &num_events, applemidi_port, timestamp, message_status, message, num_bytes);
+          }
+          if( dst_mask & ~APPLEMIDI_ROUTE_LOCAL ) {
+            applemidi_route_message(applemidi, applemidi_port, dst_mask, message_status, message, num_bytes);
+          }
         }
+        ++cmd_count;
+        stream += num_bytes;
       }
     }
   }
 
-  return 0; // no error
+  // messages which have been decoded before an error are delivered as well
+  applemidi_deliver_midi_events(applemidi, events, num_events);
+
+  return status;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// IP Addresses: IPv4 addresses are stored as IPv4-mapped IPv6 addresses, so that all
+// addresses can be compared with 4 word operations regardless of the address family
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static const uint8_t applemidi_ipv4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+void applemidi_ip_addr_set_ipv4(uint8_t *ip_addr, uint8_t *ipv4)
+{
+  uint8_t tmp[4];
+  memcpy(tmp, ipv4, 4); // ipv4 could point to ip_addr
+  memcpy(&ip_addr[0], applemidi_ipv4_mapped_prefix, 12);
+  memcpy(&ip_addr[12], tmp, 4);
+}
+
+applemidi_addr_family_t applemidi_ip_addr_get_family(uint8_t *ip_addr)
+{
+  return (memcmp(ip_addr, applemidi_ipv4_mapped_prefix, 12) == 0) ? APPLEMIDI_ADDR_FAMILY_IPV4 : APPLEMIDI_ADDR_FAMILY_IPV6;
+}
+
+char *applemidi_ip_addr_to_str(uint8_t *ip_addr, char *str, size_t len)
+{
+  if( applemidi_ip_addr_get_family(ip_addr) == APPLEMIDI_ADDR_FAMILY_IPV4 ) {
+    snprintf(str, len, "%d.%d.%d.%d", ip_addr[12], ip_addr[13], ip_addr[14], ip_addr[15]);
+  } else {
+    // the longest run of (at least 2) zero groups is abbreviated with "::"
+    int i;
+    int zero_pos = -1;
+    int zero_len = 1;
+    int run_pos = -1;
+    for(i=0; i<8; ++i) {
+      if( ip_addr[2*i+0] == 0 && ip_addr[2*i+1] == 0 ) {
+        if( run_pos < 0 )
+          run_pos = i;
+        if( (i - run_pos + 1) > zero_len ) {
+          zero_pos = run_pos;
+          zero_len = i - run_pos + 1;
+        }
+      } else {
+        run_pos = -1;
+      }
+    }
+
+    size_t pos = 0;
+    str[0] = 0;
+    for(i=0; i<8 && pos<len; ++i) {
+      if( i == zero_pos ) {
+        pos += snprintf(&str[pos], len - pos, "::");
+        i += zero_len - 1;
+      } else {
+        uint8_t separator = i > 0 && i != (zero_pos + zero_len);
+        pos += snprintf(&str[pos], len - pos, "%s%x", separator ? ":" : "", (ip_addr[2*i+0] << 8) | ip_addr[2*i+1]);
+      }
+    }
+  }
+
+  return str;
+}
+
+static inline uint8_t applemidi_ip_addr_equal(uint8_t *ip_addr1, uint8_t *ip_addr2)
+{
+  uint32_t w1[4];
+  uint32_t w2[4];
+  memcpy(w1, ip_addr1, 16);
+  memcpy(w2, ip_addr2, 16);
+  return ((w1[0] ^ w2[0]) | (w1[1] ^ w2[1]) | (w1[2] ^ w2[2]) | (w1[3] ^ w2[3])) == 0;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Searches for a matching peer
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static applemidi_peer_t *applemidi_search_peer_slot(uint8_t *ip_addr, uint32_t ssrc)
+static applemidi_peer_t *applemidi_search_peer_slot(applemidi_t *applemidi, uint8_t *ip_addr, uint32_t ssrc)
 {
   int i;
-  applemidi_peer_t *peer = &applemidi_peer[1]; // starting at 1 (because I'm 0)
-  for(i=1; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
-    if( peer->ssrc == ssrc && memcmp(peer->ip_addr, ip_addr, 4) == 0 ) { // TODO: support for IPv6
+  applemidi_peer_t *peer = &applemidi->peer[1]; // starting at 1 (because I'm 0)
+  for(i=1; i<applemidi->num_peers; ++i, ++peer) {
+    if( peer->ssrc == ssrc && applemidi_ip_addr_equal(peer->ip_addr, ip_addr) ) { // SSRC first: it's unique in most cases
       return peer;
     }
   }
@@ -619,35 +1847,63 @@ static applemidi_peer_t *applemidi_search_peer_slot(uint8_t *ip_addr, uint32_t s
   return NULL; // no slot found
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copies the peer name of a received invitation; the name isn't necessarily zero terminated,
+// therefore the copy is limited by the remaining datagram length as well
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_copy_peer_name(char *name, uint8_t *rx_name, size_t rx_name_len)
+{
+  size_t i;
+
+  if( rx_name_len > (APPLEMIDI_MAX_NAME_LEN-1) )
+    rx_name_len = APPLEMIDI_MAX_NAME_LEN-1;
+
+  for(i=0; i<rx_name_len && rx_name[i] != 0; ++i) {
+    name[i] = rx_name[i];
+  }
+  name[i] = 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Searches for a free peer slot, returns pointer to peer slot if a free one has been found, otherwise NULL
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static applemidi_peer_t *applemidi_get_free_peer_slot(uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc, char *name, size_t name_len)
+static applemidi_peer_t *applemidi_get_free_peer_slot(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint32_t token, uint32_t ssrc, char *name, size_t name_len)
 {
-  int32_t applemidi_port = applemidi_search_free_port();
+  int32_t applemidi_port = applemidi_search_free_port(applemidi);
 
   if( applemidi_port >= 1 ) {
-    applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+    applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
 
     peer->control_port = port;
     peer->data_port = port; // we expect an update with the next invitation message
     peer->token = token;
     peer->ssrc = ssrc;
     memcpy(&peer->ip_addr, ip_addr, sizeof(peer->ip_addr));
+    peer->addr_family = applemidi_ip_addr_get_family(peer->ip_addr);
+    peer->data_addr_cache.valid = 0;
 
-    if( name_len > APPLEMIDI_MAX_NAME_LEN )
-      name_len = APPLEMIDI_MAX_NAME_LEN;
-    strncpy(peer->name, name, APPLEMIDI_MAX_NAME_LEN);
-    peer->name[name_len-1] = 0;
+    applemidi_copy_peer_name(peer->name, (uint8_t *)name, name_len);
 
     peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE;
     peer->connection_sync_done_timestamp = 0;
+    peer->connection_is_master = 0; // invited by the remote: never re-invite it
+    peer->connection_auto_reconnect = 0;
 
     peer->continued_sysex_pos = 0;
     peer->outbuffer_len = 0;
+#if APPLEMIDI_ENABLE_ROUTING
+    peer->route_sysex_owner = 0;
+#endif
+    peer->mtu = applemidi->peer[0].mtu; // default of new sessions
     peer->seq_nr = 0;
     peer->outbuffer_timestamp_last_flush = 0;
+    peer->timestamp_session_start = get_timestamp_100us();
+    applemidi_peer_activity(peer);
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+    applemidi_peer_histograms_clear(peer);
+#endif
 
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_SESSION_START, peer->applemidi_port, port, 0);
     return peer;
   }
 
@@ -655,57 +1911,77 @@ static applemidi_peer_t *applemidi_get_free_peer_slot(uint8_t *ip_addr, uint16_t
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Releases a peer slot
+// Releases the peer slot with the given address and SSRC
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static applemidi_peer_t *applemidi_release_peer_slot(uint32_t ssrc)
+static applemidi_peer_t *applemidi_release_peer_slot(applemidi_t *applemidi, uint8_t *ip_addr, uint32_t ssrc)
 {
-  int i;
-  applemidi_peer_t *peer = &applemidi_peer[1]; // starting at 1 (because I'm 0)
-  for(i=1; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
-    if( peer->ssrc == ssrc ) {
-      peer->ssrc = 0;
-      peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE;
-      return peer;
-    }
-  }
+  if( ssrc == 0 )
+    return NULL; // free slots and pending invitations have no SSRC, they can't be released by a remote peer
+
+  applemidi_peer_t *peer = applemidi_search_peer_slot(applemidi, ip_addr, ssrc);
+  if( peer == NULL )
+    return NULL; // peer not found
+
+  // timestamp_session_start is only valid while the slot holds a session
+  uint8_t had_session = peer->ssrc != 0;
+
+  applemidi_master_connection_lost(applemidi, peer, get_timestamp_100us()); // frees the slot, or prepares a reconnect if master
 
-  return NULL; // peer not found
+  if( had_session ) {
+    peer->last_session_hold_time_ms = applemidi_time_elapsed(get_timestamp_100us(), peer->timestamp_session_start) / 10;
+    applemidi->peer[0].last_session_hold_time_ms = peer->last_session_hold_time_ms;
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_SESSION_END, peer->applemidi_port, 0, 0);
+  }
+  return peer;
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns a word of a received datagram like a native 32bit load would do.
+// The datagram doesn't need to be word aligned, e.g. if it's parsed directly from a lwIP pbuf
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t applemidi_rx_word(uint8_t *rx_data, int ix)
+{
+  uint32_t word;
+  memcpy(&word, &rx_data[4*ix], 4);
+  return word;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Parses a UDP Datagram for RTP and Apple MIDI messages
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport)
+int32_t applemidi_parse_udp_datagram(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us)
 {
-  uint32_t *rx_data_words = (uint32_t *)rx_data;
 
-  if( rx_len >= 4 && (rx_data_words[0] & 0xffff) == 0xffff ) {
-    uint16_t cmd = htons(rx_data_words[0] >> 16);
+  if( rx_len >= 4 && (applemidi_rx_word(rx_data, 0) & 0xffff) == 0xffff ) {
+    uint16_t cmd = htons(applemidi_rx_word(rx_data, 0) >> 16);
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_RX_CONTROL, 0xff, cmd, rx_len);
     switch( cmd ) {
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_INVITATION: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_INVITATION\n");
       }
       if( rx_len >= 16 ) {
-        uint32_t version = htonl(rx_data_words[1]);
-        uint32_t token = htonl(rx_data_words[2]);
-        uint32_t ssrc = htonl(rx_data_words[3]);
+        uint32_t version = htonl(applemidi_rx_word(rx_data, 1));
+        uint32_t token = htonl(applemidi_rx_word(rx_data, 2));
+        uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 3));
         if( rx_len > 16 ) {
-          applemidi_peer_t *peer = applemidi_search_peer_slot(ip_addr, ssrc);
+          applemidi_peer_t *peer = applemidi_search_peer_slot(applemidi, ip_addr, ssrc);
           if( peer == NULL ) {
-            peer = applemidi_get_free_peer_slot(ip_addr, port, token, ssrc, (char *)&rx_data[16], rx_len-16);
+            peer = applemidi_get_free_peer_slot(applemidi, ip_addr, port, token, ssrc, (char *)&rx_data[16], rx_len-16);
             if( peer == NULL ) {
-              if( applemidi_debug_level >= 1 ) {
+              APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_SESSION_REJECT, 0xff, port, 0);
+              if( applemidi->debug_level >= 1 ) {
                 printf(APPLEMIDI_LOG_TAG "COMMAND_INVITATION: no free slot for peer: Version=0x%08x, Token=0x%08x, SSRC=0x%08x\n", version, token, ssrc);
               }
             } else {
-              if( applemidi_debug_level >= 1 ) {
-                printf(APPLEMIDI_LOG_TAG "COMMAND_INVITATION: new peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
+              if( applemidi->debug_level >= 1 ) {
+                char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+                printf(APPLEMIDI_LOG_TAG "COMMAND_INVITATION: new peer at applemidi_port=%d: IP=%s:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
                   peer->applemidi_port,
-                  ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                  applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                   version,
                   token,
                   peer->ssrc,
@@ -713,10 +1989,11 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
               }
             }
           } else {
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "COMMAND_INVITATION: peer already registered for applemidi_port=%d: IP=%d.%d.%d.%d:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_INVITATION: peer already registered for applemidi_port=%d: IP=%s:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
                 peer->applemidi_port,
-                ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                 version,
                 token,
                 peer->ssrc,
@@ -727,21 +2004,23 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
           if( peer != NULL ) {
             if( is_dataport ) {
               peer->data_port = port;
+              peer->data_addr_cache.valid = 0;
             } else {
               peer->control_port = port;
             }
+            applemidi_peer_activity(peer);
           }
 
           // send confirmation
           if( peer != NULL ) {
-            applemidi_send_invitation_accepted(peer, ip_addr, port, token, applemidi_peer[0].ssrc);
+            applemidi_send_invitation_accepted(applemidi, peer, ip_addr, port, is_dataport, token, applemidi->peer[0].ssrc, applemidi->peer[0].name);
           } else {
-            applemidi_send_invitation_rejected(peer, ip_addr, port, token, applemidi_peer[0].ssrc); // function can handle peer == NULL
+            applemidi_send_invitation_rejected(applemidi, peer, ip_addr, port, is_dataport, token, applemidi->peer[0].ssrc); // function can handle peer == NULL
           }
 
 #ifdef APPLEMIDI_BITRATE_RECEIVE_LIMIT
           if( !is_dataport ) {
-            applemidi_send_bitrate_receive_limit(peer, ip_addr, port, applemidi_peer[0].ssrc, APPLEMIDI_BITRATE_RECEIVE_LIMIT);
+            applemidi_send_bitrate_receive_limit(applemidi, peer, ip_addr, port, is_dataport, applemidi->peer[0].ssrc, APPLEMIDI_BITRATE_RECEIVE_LIMIT);
           }
 #endif
         }
@@ -750,37 +2029,36 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_INVITATION_ACCEPTED: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_ACCEPTED\n");
       }
 
       if( rx_len >= 16 ) {
-        uint32_t version = htonl(rx_data_words[1]);
-        uint32_t token = htonl(rx_data_words[2]);
-        uint32_t ssrc = htonl(rx_data_words[3]);
+        uint32_t version = htonl(applemidi_rx_word(rx_data, 1));
+        uint32_t token = htonl(applemidi_rx_word(rx_data, 2));
+        uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 3));
 
         // check for invites
         int i;
-        applemidi_peer_t *peer = &applemidi_peer[1]; // starting at 1 (because I'm 0)
-        for(i=1; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
+        applemidi_peer_t *peer = &applemidi->peer[1]; // starting at 1 (because I'm 0)
+        for(i=1; i<applemidi->num_peers; ++i, ++peer) {
           if( peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL &&
               !is_dataport &&
               peer->control_port == port &&
               peer->token == token ) {
 
             peer->ssrc = ssrc;
+            peer->timestamp_session_start = get_timestamp_100us();
+            applemidi_peer_activity(peer);
             if( rx_len > 16 ) {
-              size_t name_len = rx_len - 16;
-              if( name_len > APPLEMIDI_MAX_NAME_LEN )
-                name_len = APPLEMIDI_MAX_NAME_LEN;
-              strncpy(peer->name, (char *)&rx_data[16], APPLEMIDI_MAX_NAME_LEN);
-              peer->name[name_len-1] = 0;
+              applemidi_copy_peer_name(peer->name, &rx_data[16], rx_len - 16);
             }
 
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: new peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: new peer at applemidi_port=%d: IP=%s:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
                 peer->applemidi_port,
-                ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                 version,
                 token,
                 peer->ssrc,
@@ -789,12 +2067,15 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
             // send session invite over data port
             peer->connection_state = APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA;
-            applemidi_send_invitation(peer, peer->ip_addr, peer->data_port, token, applemidi_peer[0].ssrc, applemidi_peer[0].name);
+            peer->connection_attempts = 1;
+            peer->connection_retry_timestamp = get_timestamp_100us() + applemidi_master_retry_delay(0);
+            applemidi_send_invitation(applemidi, peer, peer->ip_addr, peer->data_port, 1, token, applemidi->peer[0].ssrc, applemidi->peer[0].name);
 
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: Invited peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d\n",
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: Invited peer at applemidi_port=%d: IP=%s:%d\n",
                 peer->applemidi_port,
-                peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3], peer->data_port);
+                applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->data_port);
             }
           } else if( peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA &&
               is_dataport &&
@@ -803,20 +2084,23 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
             // got response
             peer->connection_state = APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED;
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: new peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
+            peer->connection_attempts = 0;
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: new peer at applemidi_port=%d: IP=%s:%d, Version=0x%08x, Token=0x%08x, SSRC=0x%08x, Name='%s'\n",
                 peer->applemidi_port,
-                ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                 version,
                 token,
                 peer->ssrc,
                 peer->name);
             }
 
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: Invited peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d\n",
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_ACCEPTED: Invited peer at applemidi_port=%d: IP=%s:%d\n",
                 peer->applemidi_port,
-                peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3], peer->data_port);
+                applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->data_port);
             }
 
             // initiate synchronization
@@ -829,37 +2113,33 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_INVITATION_REJECTED: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_REJECTED\n");
+      }
 
-        if( rx_len >= 16 ) {
-          uint32_t version = htonl(rx_data_words[1]);
-          uint32_t token = htonl(rx_data_words[2]);
-          uint32_t ssrc = htonl(rx_data_words[3]);
-
-          // check for invites
-          int i;
-          applemidi_peer_t *peer = &applemidi_peer[1]; // starting at 1 (because I'm 0)
-          for(i=1; i<APPLEMIDI_MAX_PEERS; ++i, ++peer) {
-            if( (peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL ||
-                peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA ) &&
-                peer->token == token ) {
-              if( applemidi_debug_level >= 1 ) {
-                printf(APPLEMIDI_LOG_TAG "COMMAND_REJECTED: peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d doesn't like us - skip him\n",
-                  peer->applemidi_port,
-                  peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3], peer->control_port);
-              }
-
-              // send endsession
-              applemidi_send_endsession(peer, peer->ip_addr, peer->control_port, peer->token, applemidi_peer[0].ssrc);
+      if( rx_len >= 16 ) {
+        uint32_t token = htonl(applemidi_rx_word(rx_data, 2));
 
-              if( applemidi_release_peer_slot(peer->ssrc) == NULL ) {
-                if( applemidi_debug_level >= 1 ) {
-                  printf(APPLEMIDI_LOG_TAG "COMMAND_REJECTED: failed to release slot for SSRC=0x%08x\n",
-                    peer->ssrc);
-                }
-              }
+        // check for invites
+        int i;
+        applemidi_peer_t *peer = &applemidi->peer[1]; // starting at 1 (because I'm 0)
+        for(i=1; i<applemidi->num_peers; ++i, ++peer) {
+          if( (peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL ||
+              peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA ) &&
+              peer->token == token ) {
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "COMMAND_REJECTED: peer at applemidi_port=%d: IP=%s:%d doesn't like us - skip him\n",
+                peer->applemidi_port,
+                applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port);
             }
+
+            // send endsession
+            applemidi_send_endsession(applemidi, peer, peer->ip_addr, peer->control_port, 0, peer->token, applemidi->peer[0].ssrc);
+
+            // frees the slot, or retries later if auto-reconnect is enabled
+            // Note: the SSRC isn't known before the invitation on the control port has been accepted, therefore we can't use applemidi_release_peer_slot()
+            applemidi_master_connection_lost(applemidi, peer, get_timestamp_100us());
           }
         }
       }
@@ -867,27 +2147,30 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_ENDSESSION: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_ENDSESSION\n");
       }
 
       if( rx_len >= 16 ) {
-        uint32_t version = htonl(rx_data_words[1]);
-        uint32_t token = htonl(rx_data_words[2]);
-        uint32_t ssrc = htonl(rx_data_words[3]);
+        uint32_t version = htonl(applemidi_rx_word(rx_data, 1));
+        uint32_t token = htonl(applemidi_rx_word(rx_data, 2));
+        uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 3));
 
-        applemidi_peer_t *peer = applemidi_release_peer_slot(ssrc);
+        applemidi_peer_t *peer = applemidi_release_peer_slot(applemidi, ip_addr, ssrc);
         if( peer != NULL ) {
-          if( applemidi_debug_level >= 1 ) {
-            printf(APPLEMIDI_LOG_TAG "COMMAND_ENDSESSION: Removed peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d, SSRC=0x%08x, Name='%s'\n",
+          if( applemidi->debug_level >= 1 ) {
+            char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+            printf(APPLEMIDI_LOG_TAG "COMMAND_ENDSESSION: Removed peer at applemidi_port=%d: IP=%s:%d, SSRC=0x%08x, Name='%s'\n",
               peer->applemidi_port,
-              ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+              applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
               ssrc,
               peer->name);
           }
         } else {
-          if( applemidi_debug_level >= 1 ) {
-            printf(APPLEMIDI_LOG_TAG "COMMAND_ENDSESSION: peer with SSRC:0x%08x isn't registered!\n", ssrc);
+          if( applemidi->debug_level >= 1 ) {
+            char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+            printf(APPLEMIDI_LOG_TAG "COMMAND_ENDSESSION: peer with IP=%s, SSRC:0x%08x isn't registered!\n",
+              applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), ssrc);
           }
         }
       }
@@ -895,17 +2178,17 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_SYNCHRONIZATION: {
-      if( applemidi_debug_level >= 3 ) {
+      if( applemidi->debug_level >= 3 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_SYNCHRONIZATION\n");
       }
 
       if( rx_len >= 36 ) {
-        uint32_t ssrc = htonl(rx_data_words[1]);
-        uint8_t  count = htonl(rx_data_words[2]) >> 24;
-        uint64_t timestamp1 = ((uint64_t)htonl(rx_data_words[3]) << 32) | htonl(rx_data_words[4]);
-        uint64_t timestamp2 = ((uint64_t)htonl(rx_data_words[5]) << 32) | htonl(rx_data_words[6]);
-        uint64_t timestamp3 = ((uint64_t)htonl(rx_data_words[7]) << 32) | htonl(rx_data_words[8]);
-        if( applemidi_debug_level >= 3 ) {
+        uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 1));
+        uint8_t  count = htonl(applemidi_rx_word(rx_data, 2)) >> 24;
+        uint64_t timestamp1 = ((uint64_t)htonl(applemidi_rx_word(rx_data, 3)) << 32) | htonl(applemidi_rx_word(rx_data, 4));
+        uint64_t timestamp2 = ((uint64_t)htonl(applemidi_rx_word(rx_data, 5)) << 32) | htonl(applemidi_rx_word(rx_data, 6));
+        uint64_t timestamp3 = ((uint64_t)htonl(applemidi_rx_word(rx_data, 7)) << 32) | htonl(applemidi_rx_word(rx_data, 8));
+        if( applemidi->debug_level >= 3 ) {
           printf(APPLEMIDI_LOG_TAG "COMMAND_SYNCHRONIZATION: SSRC=0x%08x, Count=%d, Timestamp1=0x%016llx, Timestamp2=0x%016llx, Timestamp3=0x%016llx\n", ssrc, count, timestamp1, timestamp2, timestamp3);
         }
 
@@ -914,7 +2197,11 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
           uint64_t my_timestamp1 = timestamp1;
           uint64_t my_timestamp2 = timestamp2;
           uint64_t my_timestamp3 = timestamp3;
-          uint64_t now = get_timestamp_100us();
+          uint64_t now = get_rx_timestamp_us(rx_timestamp_us) / 100; // arrival time, so that the scheduling delay of the receiving task doesn't bias the clock offset
+          applemidi_peer_t *peer = applemidi_search_peer_slot(applemidi, ip_addr, ssrc); // Note: send_udp_datagram can handle peer == NULL
+          if( peer != NULL ) {
+            applemidi_peer_activity(peer);
+          }
 
           switch( count ) {
           case 0: {
@@ -924,11 +2211,21 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
           case 1: {
             my_count = 2;
             my_timestamp3 = now;
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+            if( peer != NULL && now >= timestamp1 ) { // timestamp1 was sent by myself
+              applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_CK_RTT, 100 * (uint32_t)(now - timestamp1));
+            }
+#endif
           } break;
           case 2: {
-            my_count = 3;
+            my_count = 3; // synchronization completed, no response
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+            if( peer != NULL && now >= timestamp2 ) { // timestamp2 was sent by myself
+              applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_CK_RTT, 100 * (uint32_t)(now - timestamp2));
+            }
+#endif
 
-            if( applemidi_debug_level >= 3 ) {
+            if( applemidi->debug_level >= 3 ) {
               uint64_t peer_diff = timestamp3 - timestamp1;
               uint64_t my_diff = now - timestamp2;
 
@@ -936,43 +2233,46 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
             }
           } break;
           default: {
-            my_count = 0;
-            my_timestamp1 = now;
+            my_count = 3; // invalid count, no response (otherwise two instances of this driver would synchronize endlessly)
           }
           }
 
-          applemidi_peer_t *peer = applemidi_search_peer_slot(ip_addr, ssrc); // Note: send_udp_datagram can handle peer == NULL
-          applemidi_send_synchronization(peer, ip_addr, port, applemidi_peer[0].ssrc, my_count, my_timestamp1, my_timestamp2, my_timestamp3);
+          if( my_count < 3 ) {
+            applemidi_send_synchronization(applemidi, peer, ip_addr, port, is_dataport, applemidi->peer[0].ssrc, my_count, my_timestamp1, my_timestamp2, my_timestamp3);
+          }
         }
       }
     } break;
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_RECEIVER_FEEDBACK: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_RECEIVER_FEEDBACK\n");
       }
 
       if( rx_len >= 12 ) {
-        uint32_t ssrc = htonl(rx_data_words[1]);
-        uint16_t seq_nr = htons(rx_data_words[2]);
+        uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 1));
+        uint16_t seq_nr = htons(applemidi_rx_word(rx_data, 2));
 
         // check if the incoming seq_nr is matching with that of peer #0 (myself)
-        applemidi_peer_t *peer = applemidi_search_peer_slot(ip_addr, ssrc);
+        applemidi_peer_t *peer = applemidi_search_peer_slot(applemidi, ip_addr, ssrc);
         if( peer == NULL ) {
-          if( applemidi_debug_level >= 1 ) {
+          if( applemidi->debug_level >= 1 ) {
             printf(APPLEMIDI_LOG_TAG "RECEIVER_FEEDBACK: unregistered peer with SSRC=0x%08x tried to give feedback!\n", ssrc);
           }
         } else {
-          if( applemidi_peer[0].seq_nr > 0 ) {
-            uint16_t expected_seq_nr = applemidi_peer[0].seq_nr - 1;
-            uint16_t expected_seq_nr2 = applemidi_peer[0].seq_nr - 2;
+          applemidi_peer_activity(peer);
+
+          if( applemidi->peer[0].seq_nr > 0 ) {
+            uint16_t expected_seq_nr = applemidi->peer[0].seq_nr - 1;
+            uint16_t expected_seq_nr2 = applemidi->peer[0].seq_nr - 2;
             if( seq_nr != expected_seq_nr &&
                 seq_nr != expected_seq_nr2 ) { // in case we already transmitted a new one, but peer hasn't received yet
-              if( applemidi_debug_level >= 1 ) {
-                printf(APPLEMIDI_LOG_TAG "RECEIVER_FEEDBACK: detected packet loss at applemidi_port=%d: IP=%d.%d.%d.%d:%d, SSRC=0x%08x, Name='%s' (seq_nr=%d instead of %d)\n",
+              if( applemidi->debug_level >= 1 ) {
+                char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+                printf(APPLEMIDI_LOG_TAG "RECEIVER_FEEDBACK: detected packet loss at applemidi_port=%d: IP=%s:%d, SSRC=0x%08x, Name='%s' (seq_nr=%d instead of %d)\n",
                   peer->applemidi_port,
-                  ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                  applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                   ssrc,
                   peer->name,
                   seq_nr, expected_seq_nr);
@@ -984,51 +2284,57 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
               }
 
               // my own stats
-              if( applemidi_peer[0].packets_loss != ~0 ) {
-                applemidi_peer[0].packets_loss += 1;
+              if( applemidi->peer[0].packets_loss != ~0 ) {
+                applemidi->peer[0].packets_loss += 1;
               }
             }
           }
 
           // feedback the seq_nr that we know from the peer
-          applemidi_send_receiver_feedback(peer, ip_addr, port, applemidi_peer[0].ssrc, peer->seq_nr);
+          applemidi_send_receiver_feedback(applemidi, peer, ip_addr, port, is_dataport, applemidi->peer[0].ssrc, peer->seq_nr);
         }
       }
     } break;
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     case APPLEMIDI_COMMAND_BITRATE_RECEIVE_LIMIT: {
-      if( applemidi_debug_level >= 2 ) {
+      if( applemidi->debug_level >= 2 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND_BITRATE_RECEIVE_LIMIT\n");
       }
     } break;
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     default: {
-      if( applemidi_debug_level >= 1 ) {
+      if( applemidi->debug_level >= 1 ) {
         printf(APPLEMIDI_LOG_TAG "APPLEMIDI_COMMAND unknown: 0x%04x\n", cmd);
       }
     }
     }
   } else {
-    if( (rx_data_words[0] & 0xffff) == 0x6180 ) {
-      uint16_t seq_nr = htons(rx_data_words[0] >> 16);
-      uint32_t timestamp = htonl(rx_data_words[1]);
-      uint32_t ssrc = htonl(rx_data_words[2]);
+    if( rx_len >= 12 && (applemidi_rx_word(rx_data, 0) & 0xffff) == 0x6180 ) {
+      uint16_t seq_nr = htons(applemidi_rx_word(rx_data, 0) >> 16);
+      uint32_t timestamp = htonl(applemidi_rx_word(rx_data, 1));
+      uint32_t ssrc = htonl(applemidi_rx_word(rx_data, 2));
 
-      applemidi_peer_t *peer = applemidi_search_peer_slot(ip_addr, ssrc);
+      applemidi_peer_t *peer = applemidi_search_peer_slot(applemidi, ip_addr, ssrc);
       if( peer == NULL ) {
-        if( applemidi_debug_level >= 1 ) {
+        APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_RX_UNKNOWN, 0xff, seq_nr, rx_len);
+        if( applemidi->debug_level >= 1 ) {
           printf(APPLEMIDI_LOG_TAG "parse_udb_datagram: unregistered peer with SSRC=0x%08x tried to send a MIDI message!\n", ssrc);
         }
       } else {
+        APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_RX_RTP, peer->applemidi_port, seq_nr, rx_len);
+        applemidi_peer_activity(peer);
+
         if( peer->seq_nr > 0 ) {
           uint16_t expected_seq_nr = peer->seq_nr + 1;
           if( seq_nr != expected_seq_nr ) {
-            if( applemidi_debug_level >= 1 ) {
-              printf(APPLEMIDI_LOG_TAG "parse_udb_datagram: detected packet loss at applemidi_port=%d: IP=%d.%d.%d.%d:%d, SSRC=0x%08x, Name='%s' (seq_nr=%d instead of %d)\n",
+            APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_RX_LOSS, peer->applemidi_port, expected_seq_nr, rx_len);
+            if( applemidi->debug_level >= 1 ) {
+              char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+              printf(APPLEMIDI_LOG_TAG "parse_udb_datagram: detected packet loss at applemidi_port=%d: IP=%s:%d, SSRC=0x%08x, Name='%s' (seq_nr=%d instead of %d)\n",
                 peer->applemidi_port,
-                ip_addr[0], ip_addr[1], ip_addr[2], ip_addr[3], port,
+                applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)), port,
                 ssrc,
                 peer->name,
                 seq_nr, expected_seq_nr);
@@ -1040,8 +2346,8 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
             }
 
             // my own stats
-            if( applemidi_peer[0].packets_loss != ~0 ) {
-              applemidi_peer[0].packets_loss += 1;
+            if( applemidi->peer[0].packets_loss != ~0 ) {
+              applemidi->peer[0].packets_loss += 1;
             }
 
             // TODO: how to handle packet loss? Using the Journal?
@@ -1049,23 +2355,41 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
         }
         peer->seq_nr = seq_nr;
 
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+        {
+          // inter-arrival jitter based on RFC 3550 - transit is measured in units of the RTP clock rate
+          uint32_t transit = get_rtp_timestamp(applemidi, get_rx_timestamp_us(rx_timestamp_us)) - timestamp;
+          if( peer->rx_transit_valid ) {
+            int32_t d = (int32_t)(transit - peer->rx_transit);
+            uint32_t d_us = (uint32_t)(((uint64_t)((d < 0) ? -d : d) * 1000000) / applemidi->rtp_clock_rate);
+            peer->rx_jitter_us += ((int32_t)d_us - (int32_t)peer->rx_jitter_us) / 16;
+            applemidi_peer_histogram_add(applemidi, peer, APPLEMIDI_HISTOGRAM_JITTER, d_us);
+          }
+          peer->rx_transit = transit;
+          peer->rx_transit_valid = 1;
+        }
+#endif
+
         // peer stats
         if( peer->packets_received != ~0 ) {
           peer->packets_received += 1;
         }
 
         // my own stats
-        if( applemidi_peer[0].packets_received != ~0 ) {
-          applemidi_peer[0].packets_received += 1;
+        if( applemidi->peer[0].packets_received != ~0 ) {
+          applemidi->peer[0].packets_received += 1;
         }
 
         // the actual RTP MIDI Stream is starting here - create pointer and max len (might include journal which has to be discarded)
-        applemidi_decode_rtp_midi(peer->applemidi_port, timestamp, ssrc, (uint8_t *)&rx_data[3*4], rx_len-12);
+        if( applemidi_decode_rtp_midi(applemidi, peer->applemidi_port, timestamp, ssrc, (uint8_t *)&rx_data[3*4], rx_len-12) < 0 ) {
+          APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_DECODE_ERROR, peer->applemidi_port, seq_nr, rx_len);
+        }
       }
 
     } else {
-      if( applemidi_debug_level >= 1 ) {
-        printf(APPLEMIDI_LOG_TAG "parse_udb_datagram: unknown command: 0x%08x\n", rx_data_words[0]);
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_RX_UNKNOWN, 0xff, 0, rx_len);
+      if( applemidi->debug_level >= 1 ) {
+        printf(APPLEMIDI_LOG_TAG "parse_udb_datagram: unknown command: 0x%08x (%d bytes)\n", (rx_len >= 4) ? applemidi_rx_word(rx_data, 0) : 0, (int)rx_len);
       }
     }
   }
@@ -1076,36 +2400,60 @@ int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *r
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Invites a peer for the given applemidi_port
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_start_session(uint8_t applemidi_port, uint8_t *ip_addr, uint16_t control_port)
+int32_t applemidi_start_session(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t *ip_addr, uint16_t control_port)
 {
-  if( applemidi_port == 0 || applemidi_port >= APPLEMIDI_MAX_PEERS ) {
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers ) {
     return -1; // invalid port
   }
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
 
-  if( peer->ssrc != 0 ) {
-    if( applemidi_debug_level >= 1 ) {
+  if( peer->ssrc != 0 ||
+      peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL ||
+      peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA ) {
+    if( applemidi->debug_level >= 1 ) {
       printf(APPLEMIDI_LOG_TAG "start_session: can't invited peer at applemidi_port=%d (port already allocated)\n",
         peer->applemidi_port);
     }
     return -2; // port already allocated - we should terminate it first!
   }
 
-  memcpy(peer->ip_addr, ip_addr, 4); // TODO: support for IPv6
+  memcpy(peer->ip_addr, ip_addr, sizeof(peer->ip_addr));
+  peer->addr_family = applemidi_ip_addr_get_family(peer->ip_addr);
   peer->control_port = control_port;
   peer->data_port = control_port + 1;
-  peer->token = rand();
-  if( peer->token == 0 ) // just to ensure that we never get a token with 0
-    peer->token = 42;
+  peer->data_addr_cache.valid = 0;
+  peer->connection_is_master = 1;
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+  applemidi_peer_histograms_clear(peer);
+#endif
 
-  // send session invite
-  peer->connection_state = APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL;
-  applemidi_send_invitation(peer, peer->ip_addr, peer->control_port, peer->token, applemidi_peer[0].ssrc, applemidi_peer[0].name);
+  // send session invite, retries are handled by applemidi_tick()
+  applemidi_master_invite(applemidi, peer, get_timestamp_100us());
 
-  if( applemidi_debug_level >= 1 ) {
-    printf(APPLEMIDI_LOG_TAG "start_session: Invited peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d\n",
+  if( applemidi->debug_level >= 1 ) {
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+    printf(APPLEMIDI_LOG_TAG "start_session: Invited peer at applemidi_port=%d: IP=%s:%d\n",
       peer->applemidi_port,
-      peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3], peer->control_port);
+      applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port);
+  }
+
+  return 0; // no error
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Enables/Disables automatic reconnection for the given applemidi_port
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_set_auto_reconnect(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t enable)
+{
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers ) {
+    return -1; // invalid port
+  }
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  peer->connection_auto_reconnect = enable;
+
+  if( !enable && peer->connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT ) {
+    peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE; // free the slot
   }
 
   return 0; // no error
@@ -1114,15 +2462,27 @@ int32_t applemidi_start_session(uint8_t applemidi_port, uint8_t *ip_addr, uint16
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Terminates a session for the given applemidi_port
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_terminate_session(uint8_t applemidi_port)
+int32_t applemidi_terminate_session(applemidi_t *applemidi, uint8_t applemidi_port)
 {
-  if( applemidi_port == 0 || applemidi_port >= APPLEMIDI_MAX_PEERS ) {
+  if( applemidi_port == 0 || applemidi_port >= applemidi->num_peers ) {
     return -1; // invalid port
   }
-  applemidi_peer_t *peer = &applemidi_peer[applemidi_port];
+  applemidi_peer_t *peer = &applemidi->peer[applemidi_port];
+
+  // terminated by user: don't reconnect
+  peer->connection_auto_reconnect = 0;
+
+  if( peer->ssrc == 0 && peer->connection_state != APPLEMIDI_CONNECTION_STATE_SLAVE ) {
+    // cancel pending invitation or reconnect
+    if( peer->connection_state != APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT ) {
+      applemidi_send_endsession(applemidi, peer, peer->ip_addr, peer->control_port, 0, peer->token, applemidi->peer[0].ssrc);
+    }
+    peer->connection_state = APPLEMIDI_CONNECTION_STATE_SLAVE;
+    return 0; // no error
+  }
 
   if( peer->ssrc == 0 ) {
-    if( applemidi_debug_level >= 1 ) {
+    if( applemidi->debug_level >= 1 ) {
       printf(APPLEMIDI_LOG_TAG "terminate_session: no known peer at applemidi_port=%d\n",
         peer->applemidi_port);
     }
@@ -1130,16 +2490,17 @@ int32_t applemidi_terminate_session(uint8_t applemidi_port)
   }
 
   // send endsession
-  applemidi_send_endsession(peer, peer->ip_addr, peer->control_port, peer->token, applemidi_peer[0].ssrc);
+  applemidi_send_endsession(applemidi, peer, peer->ip_addr, peer->control_port, 0, peer->token, applemidi->peer[0].ssrc);
 
-  if( applemidi_debug_level >= 1 ) {
-    printf(APPLEMIDI_LOG_TAG "terminate_session: with peer at applemidi_port=%d: IP=%d.%d.%d.%d:%d\n",
+  if( applemidi->debug_level >= 1 ) {
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+    printf(APPLEMIDI_LOG_TAG "terminate_session: with peer at applemidi_port=%d: IP=%s:%d\n",
       peer->applemidi_port,
-      peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3], peer->control_port);
+      applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), peer->control_port);
   }
 
-  if( applemidi_release_peer_slot(peer->ssrc) == NULL ) {
-    if( applemidi_debug_level >= 1 ) {
+  if( applemidi_release_peer_slot(applemidi, peer->ip_addr, peer->ssrc) == NULL ) {
+    if( applemidi->debug_level >= 1 ) {
       printf(APPLEMIDI_LOG_TAG "terminate_session: failed to release slot for SSRC=0x%08x\n",
         peer->ssrc);
     }
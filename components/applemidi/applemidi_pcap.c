@@ -0,0 +1,287 @@
+/*
+ * Apple MIDI Driver - Packet Capture Ring (pcap)
+ *
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include "applemidi_pcap.h"
+
+#if APPLEMIDI_PCAP_ENABLED
+
+#include <stdio.h>
+
+
+#if (APPLEMIDI_PCAP_RING_SIZE & (APPLEMIDI_PCAP_RING_SIZE-1)) != 0
+# error "APPLEMIDI_PCAP_RING_SIZE must be a power of 2"
+#endif
+
+#define APPLEMIDI_PCAP_MAX_HEADER_SIZE (40 + 8) // IPv6 + UDP
+
+static applemidi_pcap_record_t applemidi_pcap_ring[APPLEMIDI_PCAP_RING_SIZE];
+static uint32_t applemidi_pcap_wr_ix;
+static uint8_t applemidi_pcap_enabled = 1;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stores a datagram in the capture ring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_pcap_capture(uint8_t is_tx, uint8_t *ip_addr, uint16_t remote_port, uint16_t local_port, applemidi_iovec_t *iov, size_t iovcnt, uint64_t timestamp_us)
+{
+  if( !applemidi_pcap_enabled )
+    return;
+
+  uint32_t ix = __atomic_fetch_add(&applemidi_pcap_wr_ix, 1, __ATOMIC_RELAXED);
+  applemidi_pcap_record_t *record = &applemidi_pcap_ring[ix & (APPLEMIDI_PCAP_RING_SIZE-1)];
+
+  applemidi_seqlock_write_begin(&record->ix);
+  record->timestamp_us = (timestamp_us != 0) ? timestamp_us : applemidi_get_timestamp_us();
+  record->is_tx = is_tx;
+  record->local_port = local_port;
+  record->remote_port = remote_port;
+  memcpy(record->ip_addr, ip_addr, 16);
+
+  size_t orig_len = 0;
+  size_t len = 0;
+  int i;
+  for(i=0; i<iovcnt; ++i) {
+    orig_len += iov[i].len;
+    if( len < APPLEMIDI_PCAP_SNAPLEN ) {
+      size_t chunk = (iov[i].len < (APPLEMIDI_PCAP_SNAPLEN - len)) ? iov[i].len : (APPLEMIDI_PCAP_SNAPLEN - len);
+      memcpy(&record->data[len], iov[i].base, chunk);
+      len += chunk;
+    }
+  }
+  record->len = len;
+  record->orig_len = orig_len;
+  applemidi_seqlock_write_end(&record->ix, ix);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Enables/Disables the capturing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_pcap_set_enabled(uint8_t enabled)
+{
+  applemidi_pcap_enabled = enabled;
+}
+
+uint8_t applemidi_pcap_get_enabled(void)
+{
+  return applemidi_pcap_enabled;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writes the capture ring in pcap format
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// synthesizes the IP and UDP header in front of the payload, returns the header length
+static size_t applemidi_pcap_create_header(applemidi_pcap_record_t *record, uint8_t *header)
+{
+  // the local IP is not known by the interface layers, it's written as 0.0.0.0 resp. ::
+  uint8_t local_ip_addr[16];
+  memset(local_ip_addr, 0, sizeof(local_ip_addr));
+
+  uint8_t *src_ip = record->is_tx ? local_ip_addr : record->ip_addr;
+  uint8_t *dst_ip = record->is_tx ? record->ip_addr : local_ip_addr;
+  uint16_t src_port = record->is_tx ? record->local_port : record->remote_port;
+  uint16_t dst_port = record->is_tx ? record->remote_port : record->local_port;
+  uint16_t udp_len = 8 + record->orig_len;
+  size_t ip_header_len;
+
+  if( applemidi_ip_addr_get_family(record->ip_addr) == APPLEMIDI_ADDR_FAMILY_IPV4 ) {
+    uint16_t total_len = 20 + udp_len;
+    ip_header_len = 20;
+    memset(header, 0, ip_header_len);
+    header[0] = 0x45; // IPv4, 5 words
+    header[2] = total_len >> 8;
+    header[3] = total_len & 0xff;
+    header[8] = 64;   // TTL
+    header[9] = 17;   // UDP
+    memcpy(&header[12], &src_ip[12], 4);
+    memcpy(&header[16], &dst_ip[12], 4);
+
+    uint32_t checksum = 0;
+    int i;
+    for(i=0; i<20; i+=2) {
+      checksum += (header[i] << 8) | header[i+1];
+    }
+    while( checksum >> 16 ) {
+      checksum = (checksum & 0xffff) + (checksum >> 16);
+    }
+    checksum = ~checksum & 0xffff;
+    header[10] = checksum >> 8;
+    header[11] = checksum & 0xff;
+  } else {
+    ip_header_len = 40;
+    memset(header, 0, ip_header_len);
+    header[0] = 0x60; // IPv6
+    header[4] = udp_len >> 8;
+    header[5] = udp_len & 0xff;
+    header[6] = 17;   // next header: UDP
+    header[7] = 64;   // hop limit
+    memcpy(&header[8], src_ip, 16);
+    memcpy(&header[24], dst_ip, 16);
+  }
+
+  uint8_t *udp = &header[ip_header_len];
+  udp[0] = src_port >> 8;
+  udp[1] = src_port & 0xff;
+  udp[2] = dst_port >> 8;
+  udp[3] = dst_port & 0xff;
+  udp[4] = udp_len >> 8;
+  udp[5] = udp_len & 0xff;
+  udp[6] = 0; // no checksum
+  udp[7] = 0;
+
+  return ip_header_len + 8;
+}
+
+int32_t applemidi_pcap_write(int32_t (*write)(void *ctx, const uint8_t *buf, size_t len), void *ctx, size_t max_records)
+{
+  // global header in host byte order, readers detect it from the magic number
+  struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  timezone;
+    uint32_t accuracy;
+    uint32_t snaplen;
+    uint32_t linktype;
+  } file_header = {
+    .magic = 0xa1b2c3d4, // uS resolution
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = APPLEMIDI_PCAP_MAX_HEADER_SIZE + APPLEMIDI_PCAP_SNAPLEN,
+    .linktype = APPLEMIDI_PCAP_LINKTYPE_RAW,
+  };
+
+  if( write(ctx, (uint8_t *)&file_header, sizeof(file_header)) < 0 )
+    return -1; // write error
+
+  uint32_t wr_ix = __atomic_load_n(&applemidi_pcap_wr_ix, __ATOMIC_ACQUIRE);
+  uint32_t num = (wr_ix < APPLEMIDI_PCAP_RING_SIZE) ? wr_ix : APPLEMIDI_PCAP_RING_SIZE;
+  if( max_records > 0 && num > max_records )
+    num = max_records;
+
+  int32_t written = 0;
+  uint32_t ix;
+  for(ix=wr_ix-num; ix != wr_ix; ++ix) {
+    applemidi_pcap_record_t *ring_record = &applemidi_pcap_ring[ix & (APPLEMIDI_PCAP_RING_SIZE-1)];
+
+    applemidi_pcap_record_t record;
+    if( !applemidi_seqlock_read(&ring_record->ix, ix, &record, ring_record, sizeof(applemidi_pcap_record_t)) )
+      continue; // record is currently written, or has already been overwritten
+
+    uint8_t packet[16 + APPLEMIDI_PCAP_MAX_HEADER_SIZE + APPLEMIDI_PCAP_SNAPLEN];
+    size_t header_len = applemidi_pcap_create_header(&record, &packet[16]);
+    uint32_t *record_header = (uint32_t *)packet;
+    record_header[0] = record.timestamp_us / 1000000;
+    record_header[1] = record.timestamp_us % 1000000;
+    record_header[2] = header_len + record.len;      // captured length
+    record_header[3] = header_len + record.orig_len; // original length
+    memcpy(&packet[16 + header_len], record.data, record.len);
+
+    if( write(ctx, packet, 16 + header_len + record.len) < 0 )
+      return -1; // write error
+
+    ++written;
+  }
+
+  return written;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stores the capture ring in a file
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_pcap_write_file(void *ctx, const uint8_t *buf, size_t len)
+{
+  return (fwrite(buf, 1, len, (FILE *)ctx) == len) ? 0 : -1;
+}
+
+int32_t applemidi_pcap_save(const char *path, size_t max_records)
+{
+  FILE *file = fopen(path, "wb");
+  if( file == NULL )
+    return -1; // file can't be created
+
+  int32_t status = applemidi_pcap_write(applemidi_pcap_write_file, file, max_records);
+  if( fclose(file) != 0 && status >= 0 )
+    status = -1; // write error
+
+  return status;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Streams the capture ring as hex dump
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_pcap_write_hex(void *ctx, const uint8_t *buf, size_t len)
+{
+  size_t *column = (size_t *)ctx;
+  size_t i;
+  for(i=0; i<len; ++i) {
+    printf("%02x", buf[i]);
+    if( ++*column >= 32 ) {
+      printf("\n");
+      *column = 0;
+    }
+  }
+  return 0; // no error
+}
+
+int32_t applemidi_pcap_dump(size_t max_records)
+{
+  size_t column = 0;
+
+  printf("applemidi_pcap begin\n");
+  int32_t status = applemidi_pcap_write(applemidi_pcap_write_hex, &column, max_records);
+  if( column > 0 ) {
+    printf("\n");
+  }
+  printf("applemidi_pcap end\n");
+
+  return status;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Clears the capture ring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_pcap_clear(void)
+{
+  int i;
+  for(i=0; i<APPLEMIDI_PCAP_RING_SIZE; ++i) {
+    __atomic_store_n(&applemidi_pcap_ring[i].ix, 0, __ATOMIC_RELAXED);
+  }
+}
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Apple MIDI Driver - Memory Pools
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include "applemidi_pool.h"
+
+#include <stdlib.h>
+
+
+#if APPLEMIDI_POOL_SMALL_NUM_BLOCKS > 32 || APPLEMIDI_POOL_LARGE_NUM_BLOCKS > 32
+# error "a pool can't handle more than 32 blocks"
+#endif
+
+static applemidi_alloc_stats_t applemidi_alloc_stats;
+static void (*applemidi_alloc_hook)(size_t size, void *ptr);
+
+
+#if APPLEMIDI_STATIC_ALLOCATION
+//! a pool of fixed size blocks, a set bit in the usage map marks an allocated block
+typedef struct {
+  uint8_t *blocks;
+  size_t block_size;
+  size_t num_blocks;
+  uint32_t usage_map;
+} applemidi_pool_t;
+
+static uint32_t applemidi_pool_small_blocks[(APPLEMIDI_POOL_SMALL_NUM_BLOCKS * APPLEMIDI_POOL_SMALL_BLOCK_SIZE + 3) / 4];
+static uint32_t applemidi_pool_large_blocks[(APPLEMIDI_POOL_LARGE_NUM_BLOCKS * APPLEMIDI_POOL_LARGE_BLOCK_SIZE + 3) / 4];
+
+// sorted by block size, the first pool which fits will be taken
+static applemidi_pool_t applemidi_pool[2] = {
+  { (uint8_t *)applemidi_pool_small_blocks, APPLEMIDI_POOL_SMALL_BLOCK_SIZE, APPLEMIDI_POOL_SMALL_NUM_BLOCKS, 0 },
+  { (uint8_t *)applemidi_pool_large_blocks, APPLEMIDI_POOL_LARGE_BLOCK_SIZE, APPLEMIDI_POOL_LARGE_NUM_BLOCKS, 0 },
+};
+#define APPLEMIDI_NUM_POOLS (sizeof(applemidi_pool) / sizeof(applemidi_pool_t))
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Takes a free block from the pool
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void *applemidi_pool_take(applemidi_pool_t *pool)
+{
+  uint32_t all_blocks = (pool->num_blocks >= 32) ? 0xffffffff : ((1UL << pool->num_blocks) - 1);
+  uint32_t usage_map = __atomic_load_n(&pool->usage_map, __ATOMIC_RELAXED);
+
+  while( (usage_map & all_blocks) != all_blocks ) {
+    int block = __builtin_ctz(~usage_map);
+    if( __atomic_compare_exchange_n(&pool->usage_map, &usage_map, usage_map | (1UL << block), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+      return &pool->blocks[block * pool->block_size];
+    }
+    // usage_map has been updated by the failed exchange, try again
+  }
+
+  return NULL; // pool exhausted
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Updates the statistics and notifies the hook
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void *applemidi_alloc_done(size_t size, void *ptr)
+{
+  if( ptr == NULL ) {
+    __atomic_fetch_add(&applemidi_alloc_stats.failures, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&applemidi_alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    uint32_t in_use = __atomic_add_fetch(&applemidi_alloc_stats.in_use, 1, __ATOMIC_RELAXED);
+    uint32_t max_in_use = __atomic_load_n(&applemidi_alloc_stats.max_in_use, __ATOMIC_RELAXED);
+    while( in_use > max_in_use &&
+           !__atomic_compare_exchange_n(&applemidi_alloc_stats.max_in_use, &max_in_use, in_use, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+    }
+  }
+
+  void (*hook)(size_t size, void *ptr) = applemidi_alloc_hook;
+  if( hook != NULL ) {
+    hook(size, ptr);
+  }
+
+  return ptr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocates memory
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void *applemidi_alloc(size_t size)
+{
+#if APPLEMIDI_STATIC_ALLOCATION
+  int i;
+  for(i=0; i<APPLEMIDI_NUM_POOLS; ++i) {
+    applemidi_pool_t *pool = &applemidi_pool[i];
+    if( size <= pool->block_size ) {
+      void *ptr = applemidi_pool_take(pool);
+      if( ptr != NULL ) {
+        return applemidi_alloc_done(size, ptr);
+      }
+      // try next pool with bigger blocks
+    }
+  }
+
+  return applemidi_alloc_done(size, NULL);
+#else
+  return applemidi_alloc_done(size, malloc(size));
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Releases memory
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_free(void *ptr)
+{
+  if( ptr == NULL )
+    return;
+
+#if APPLEMIDI_STATIC_ALLOCATION
+  int i;
+  for(i=0; i<APPLEMIDI_NUM_POOLS; ++i) {
+    applemidi_pool_t *pool = &applemidi_pool[i];
+    uint8_t *block_ptr = (uint8_t *)ptr;
+    if( block_ptr >= pool->blocks && block_ptr < &pool->blocks[pool->num_blocks * pool->block_size] ) {
+      int block = (block_ptr - pool->blocks) / pool->block_size;
+      __atomic_fetch_and(&pool->usage_map, ~(1UL << block), __ATOMIC_RELEASE);
+      break;
+    }
+  }
+
+  if( i >= APPLEMIDI_NUM_POOLS ) {
+    return; // not allocated from a pool
+  }
+#else
+  free(ptr);
+#endif
+
+  __atomic_fetch_add(&applemidi_alloc_stats.frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&applemidi_alloc_stats.in_use, 1, __ATOMIC_RELAXED);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_get_alloc_stats(applemidi_alloc_stats_t *stats)
+{
+  stats->allocs = __atomic_load_n(&applemidi_alloc_stats.allocs, __ATOMIC_RELAXED);
+  stats->frees = __atomic_load_n(&applemidi_alloc_stats.frees, __ATOMIC_RELAXED);
+  stats->failures = __atomic_load_n(&applemidi_alloc_stats.failures, __ATOMIC_RELAXED);
+  stats->in_use = __atomic_load_n(&applemidi_alloc_stats.in_use, __ATOMIC_RELAXED);
+  stats->max_in_use = __atomic_load_n(&applemidi_alloc_stats.max_in_use, __ATOMIC_RELAXED);
+}
+
+void applemidi_reset_alloc_stats(void)
+{
+  __atomic_store_n(&applemidi_alloc_stats.allocs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&applemidi_alloc_stats.frees, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&applemidi_alloc_stats.failures, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&applemidi_alloc_stats.max_in_use, __atomic_load_n(&applemidi_alloc_stats.in_use, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+void applemidi_set_alloc_hook(void (*hook)(size_t size, void *ptr))
+{
+  applemidi_alloc_hook = hook;
+}
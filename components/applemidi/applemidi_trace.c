@@ -0,0 +1,175 @@
+/*
+ * Apple MIDI Driver - Binary Trace Ring
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include "applemidi_trace.h"
+
+#if APPLEMIDI_TRACE_ENABLED
+
+#include <stdio.h>
+
+#ifdef ESP_PLATFORM
+# include "esp_timer.h"
+#else
+# include <time.h>
+#endif
+
+
+#if (APPLEMIDI_TRACE_RING_SIZE & (APPLEMIDI_TRACE_RING_SIZE-1)) != 0
+# error "APPLEMIDI_TRACE_RING_SIZE must be a power of 2"
+#endif
+
+applemidi_trace_record_t applemidi_trace_ring[APPLEMIDI_TRACE_RING_SIZE];
+uint32_t applemidi_trace_wr_ix;
+
+static const char *applemidi_trace_event_name[APPLEMIDI_TRACE_NUM_EVENTS] = {
+  "-",
+  "IF_RX",
+  "IF_TX",
+  "IF_TX_ERROR",
+  "RX_CONTROL",
+  "RX_RTP",
+  "RX_LOSS",
+  "RX_UNKNOWN",
+  "DECODE_ERROR",
+  "TX_RTP",
+  "TX_ERROR",
+  "SESSION_START",
+  "SESSION_END",
+  "SESSION_REJECT",
+  "IF_RX_ERROR",
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the uS based timestamp of a trace record
+////////////////////////////////////////////////////////////////////////////////////////////////////
+uint32_t applemidi_trace_get_timestamp_us(void)
+{
+#ifdef ESP_PLATFORM
+  return (uint32_t)esp_timer_get_time();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copies a single record, returns 0 if it is currently written or has already been overwritten
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint8_t applemidi_trace_copy_record(uint32_t ix, applemidi_trace_record_t *copy)
+{
+  applemidi_trace_record_t *record = &applemidi_trace_ring[ix & (APPLEMIDI_TRACE_RING_SIZE-1)];
+  return applemidi_seqlock_read(&record->ix, ix, copy, record, sizeof(applemidi_trace_record_t));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copies the latest records (oldest first)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t applemidi_trace_read(applemidi_trace_record_t *records, size_t max_records)
+{
+  uint32_t wr_ix = __atomic_load_n(&applemidi_trace_wr_ix, __ATOMIC_ACQUIRE);
+  uint32_t num = (wr_ix < APPLEMIDI_TRACE_RING_SIZE) ? wr_ix : APPLEMIDI_TRACE_RING_SIZE;
+  if( num > max_records )
+    num = max_records;
+
+  size_t copied = 0;
+  uint32_t ix;
+  for(ix=wr_ix-num; ix != wr_ix; ++ix) {
+    if( applemidi_trace_copy_record(ix, &records[copied]) )
+      ++copied;
+  }
+
+  return copied;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Prints decoded trace records
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_trace_dump(size_t max_records)
+{
+  uint32_t wr_ix = __atomic_load_n(&applemidi_trace_wr_ix, __ATOMIC_ACQUIRE);
+  uint32_t num = (wr_ix < APPLEMIDI_TRACE_RING_SIZE) ? wr_ix : APPLEMIDI_TRACE_RING_SIZE;
+  if( max_records > 0 && num > max_records )
+    num = max_records;
+
+  uint32_t prev_timestamp = 0;
+  uint8_t first = 1;
+  uint32_t ix;
+  for(ix=wr_ix-num; ix != wr_ix; ++ix) {
+    // copied record by record, so that the whole ring doesn't have to be buffered on the stack
+    applemidi_trace_record_t record;
+    if( !applemidi_trace_copy_record(ix, &record) )
+      continue;
+
+    if( first ) {
+      first = 0;
+      prev_timestamp = record.timestamp;
+    }
+
+    printf("#%-8u %10u uS (+%6u) %-14s peer=%-3d seq=%-5u len=%u\n",
+      (unsigned)ix,
+      (unsigned)record.timestamp,
+      (unsigned)(record.timestamp - prev_timestamp),
+      applemidi_trace_get_event_name(record.event),
+      (record.peer == 0xff) ? -1 : record.peer,
+      record.seq_nr,
+      record.len);
+    prev_timestamp = record.timestamp;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Clears the trace ring
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void applemidi_trace_clear(void)
+{
+  int i;
+  for(i=0; i<APPLEMIDI_TRACE_RING_SIZE; ++i) {
+    __atomic_store_n(&applemidi_trace_ring[i].ix, 0, __ATOMIC_RELAXED);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the name of a trace event
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *applemidi_trace_get_event_name(uint8_t event)
+{
+  return (event < APPLEMIDI_TRACE_NUM_EVENTS) ? applemidi_trace_event_name[event] : "UNKNOWN";
+}
+
+#endif
@@ -32,6 +32,8 @@
  */
 
 #include "if/lwip/applemidi_if.h"
+#include "applemidi_trace.h"
+#include "applemidi_pcap.h"
 
 #include "freertos/FreeRTOS.h"
 
@@ -39,6 +41,7 @@
 
 #if APPLEMIDI_IF_ENABLE_CONSOLE
 # include "applemidi.h"
+# include "applemidi_pool.h"
 # include "esp_console.h"
 # include "argtable3/argtable3.h"
 #endif
@@ -49,64 +52,69 @@
 #include <lwip/netdb.h>
 
 
-//! We need 2 sockets: 1 for control, 1 for data packets
-typedef struct {
-  int handle;
-  struct sockaddr_in socket_addr;
-} applemidi_if_socket_t;
-
-typedef enum {
-  APPLEMIDI_IF_SOCKET_CONTROL = 0,
-  APPLEMIDI_IF_SOCKET_DATA,
-  APPLEMIDI_IF_NUM_SOCKETS
-} applemidi_if_socket_e;
-
-static applemidi_if_socket_t applemidi_if_socket[APPLEMIDI_IF_NUM_SOCKETS];
-
+#if !APPLEMIDI_IF_USE_NETCONN // otherwise the socket layer is provided by applemidi_if_netconn.c
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Initializes the UDP sockets
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_if_init(uint16_t port)
+int32_t applemidi_if_init(applemidi_if_t *applemidi_if, applemidi_t *applemidi, uint16_t port)
 {
+  applemidi_if->applemidi = applemidi;
+  applemidi_if->port = port;
+
+  applemidi_if->socket_ipv6 = 0;
+  applemidi_if->ipv6_scope_id = 0;
+
   int i;
-  applemidi_if_socket_t *s = &applemidi_if_socket[0];
-  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i, ++s) {
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    applemidi_if->socket_handle[i] = -1;
+  }
+
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
     uint16_t rx_port = port + i;
-    memset(s, 0, sizeof(applemidi_if_socket_t));
-#if 1
-    s->socket_addr.sin_family = AF_INET;
-    s->socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    s->socket_addr.sin_port = htons(rx_port);
-    int addr_family = AF_INET;
-    int ip_protocol = IPPROTO_IP;
-    //inet_ntoa_r(s->socket_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-#else // IPV6
-    applemidi_socket_addr.sin6_family = AF_INET6;
-    applemidi_socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    applemidi_socket_addr.sin6_port = htons(rx_port);
+#if LWIP_IPV6
+    // dual-stack socket: IPv4 peers are delivered with IPv4-mapped addresses
+    struct sockaddr_in6 socket_addr;
+    memset(&socket_addr, 0, sizeof(socket_addr));
+    socket_addr.sin6_family = AF_INET6;
+    socket_addr.sin6_addr = in6addr_any;
+    socket_addr.sin6_port = htons(rx_port);
     int addr_family = AF_INET6;
     int ip_protocol = IPPROTO_IPV6;
-    //inet6_ntoa_r(s->socket_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+    applemidi_if->socket_ipv6 = 1;
+#else
+    struct sockaddr_in socket_addr;
+    memset(&socket_addr, 0, sizeof(socket_addr));
+    socket_addr.sin_family = AF_INET;
+    socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socket_addr.sin_port = htons(rx_port);
+    int addr_family = AF_INET;
+    int ip_protocol = IPPROTO_IP;
 #endif
 
-    s->handle = socket(addr_family, SOCK_DGRAM, ip_protocol);
-    if( s->handle < 0 ) {
-      if( applemidi_get_debug_level() >= 1 ) {
+    int handle = socket(addr_family, SOCK_DGRAM, ip_protocol);
+    if( handle < 0 ) {
+      if( applemidi_get_debug_level(applemidi) >= 1 ) {
         printf(APPLEMIDI_IF_LOG_TAG "Unable to create socket #%d: errno %d\n", i, errno);
       }
       return -1;
     } else {
-      lwip_fcntl(s->handle, F_SETFL, lwip_fcntl(s->handle, F_GETFL, 0) | O_NONBLOCK);
+      lwip_fcntl(handle, F_SETFL, lwip_fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
 
-      if( bind(s->handle, (struct sockaddr *)&s->socket_addr, sizeof(s->socket_addr)) < 0 ) {
-        close(s->handle);
-        s->handle = -1;
-        if( applemidi_get_debug_level() >= 1 ) {
+#if LWIP_IPV6
+      int v6only = 0;
+      setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+#endif
+
+      if( bind(handle, (struct sockaddr *)&socket_addr, sizeof(socket_addr)) < 0 ) {
+        close(handle);
+        if( applemidi_get_debug_level(applemidi) >= 1 ) {
           printf(APPLEMIDI_IF_LOG_TAG "Unable to bind socket #%d: errno %d\n", i, errno);
         }
         return -2;
       }
+
+      applemidi_if->socket_handle[i] = handle;
     }
   }
 
@@ -117,15 +125,15 @@ int32_t applemidi_if_init(uint16_t port)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // De-Initializes the UDP sockets
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_if_deinit(void)
+int32_t applemidi_if_deinit(applemidi_if_t *applemidi_if)
 {
   int i;
-  applemidi_if_socket_t *s = &applemidi_if_socket[0];
-  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i, ++s) {
-    if( s->handle >= 0 ) {
-      shutdown(s->handle, 0);
-      close(s->handle);
-      s->handle = -1;
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    int handle = applemidi_if->socket_handle[i];
+    if( handle >= 0 ) {
+      shutdown(handle, 0);
+      close(handle);
+      applemidi_if->socket_handle[i] = -1;
     }
   }
 
@@ -133,49 +141,87 @@ int32_t applemidi_if_deinit(void)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the destination address of a datagram, prebuilt in the address cache if available
+// Returns NULL if an IPv6 peer can't be reached since lwIP has been built without IPv6 support
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static struct sockaddr *applemidi_if_get_tx_socket_addr(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_addr_cache_t *addr_cache, struct sockaddr_storage *tmp_socket_addr, socklen_t *socklen)
+{
+  struct sockaddr *tx_socket_addr = (addr_cache != NULL) ? (struct sockaddr *)addr_cache->storage : (struct sockaddr *)tmp_socket_addr;
+
+  if( addr_cache == NULL || !addr_cache->valid ) {
+#if LWIP_IPV6
+    struct sockaddr_in6 *tx_socket_addr6 = (struct sockaddr_in6 *)tx_socket_addr;
+    memset(tx_socket_addr6, 0, sizeof(struct sockaddr_in6));
+    tx_socket_addr6->sin6_family = AF_INET6;
+    memcpy(&tx_socket_addr6->sin6_addr, ip_addr, 16); // IPv4-mapped addresses are sent over IPv4 by lwIP
+    tx_socket_addr6->sin6_port = htons(port);
+    if( APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(ip_addr) ) {
+      tx_socket_addr6->sin6_scope_id = applemidi_if->ipv6_scope_id;
+    }
+#else
+    if( applemidi_ip_addr_get_family(ip_addr) != APPLEMIDI_ADDR_FAMILY_IPV4 ) {
+      return NULL; // IPv6 peer, but no IPv6 support
+    }
+
+    struct sockaddr_in *tx_socket_addr4 = (struct sockaddr_in *)tx_socket_addr;
+    memset(tx_socket_addr4, 0, sizeof(struct sockaddr_in));
+    tx_socket_addr4->sin_family = AF_INET;
+    memcpy(&tx_socket_addr4->sin_addr.s_addr, &ip_addr[12], 4);
+    tx_socket_addr4->sin_port = htons(port);
+#endif
+
+    if( addr_cache != NULL ) {
+      addr_cache->valid = 1;
+    }
+  }
+
+  *socklen = (tx_socket_addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  return tx_socket_addr;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Sends an UTP datagram
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_if_send_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len)
+int32_t applemidi_if_send_udp_datagram(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
 {
-  applemidi_if_socket_t *s = (port == htons(applemidi_if_socket[APPLEMIDI_IF_SOCKET_CONTROL].socket_addr.sin_port))
-    ? &applemidi_if_socket[APPLEMIDI_IF_SOCKET_CONTROL]
-    : &applemidi_if_socket[APPLEMIDI_IF_SOCKET_DATA];
+  int handle = applemidi_if->socket_handle[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
 
-  if( s->handle < 0 ) {
+  if( handle < 0 ) {
     return -1; // socket not open
   } else {
-    struct sockaddr_in tx_socket_addr = s->socket_addr;
-    memcpy(&tx_socket_addr.sin_addr.s_addr, ip_addr, 4); // TODO: consider IPv6
-    tx_socket_addr.sin_port = htons(port);
+    struct sockaddr_storage tmp_socket_addr;
+    socklen_t socklen;
+    struct sockaddr *tx_socket_addr = applemidi_if_get_tx_socket_addr(applemidi_if, ip_addr, port, NULL, &tmp_socket_addr, &socklen);
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
 
-    if( applemidi_get_debug_level() >= 2 ) {
-      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %d.%d.%d.%d:%d\n",
+    if( debug_level >= 2 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %s:%d\n",
         tx_len,
-        (tx_socket_addr.sin_addr.s_addr & 0x000000ff) >> 0,
-        (tx_socket_addr.sin_addr.s_addr & 0x0000ff00) >> 8,
-        (tx_socket_addr.sin_addr.s_addr & 0x00ff0000) >> 16,
-        (tx_socket_addr.sin_addr.s_addr & 0xff000000) >> 24,
-        htons(tx_socket_addr.sin_port));
+        applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+        port);
     }
-    if( applemidi_get_debug_level() >= 3 ) {
+    if( debug_level >= 3 ) {
       esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, tx_data, tx_len);
     }
 
-    int err = sendto(s->handle, tx_data, tx_len, 0, (struct sockaddr *)&tx_socket_addr, sizeof(tx_socket_addr));
+    int err = (tx_socket_addr == NULL) ? -1 : sendto(handle, tx_data, tx_len, 0, tx_socket_addr, socklen);
     if( err < 0 ) {
-      if( applemidi_get_debug_level() >= 1 ) {
-        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %d.%d.%d.%d:%d - errno %d\n",
-          (tx_socket_addr.sin_addr.s_addr & 0x000000ff) >> 0,
-          (tx_socket_addr.sin_addr.s_addr & 0x0000ff00) >> 8,
-          (tx_socket_addr.sin_addr.s_addr & 0x00ff0000) >> 16,
-          (tx_socket_addr.sin_addr.s_addr & 0xff000000) >> 24,
-          htons(tx_socket_addr.sin_port),
-          errno);
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, port, tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+          port,
+          (tx_socket_addr == NULL) ? EAFNOSUPPORT : errno);
       }
 
       return -2; // no packet sent
     }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, port, tx_len);
+    APPLEMIDI_PCAP_CAPTURE(1, ip_addr, port, applemidi_if->port + is_dataport, tx_data, tx_len, 0);
   }
 
   return 0; // no error
@@ -183,66 +229,345 @@ int32_t applemidi_if_send_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Handles incoming UDP datagrams
+// Sends multiple UDP datagrams in a tight loop, destination addresses are taken from the address cache
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t applemidi_if_tick(void *_parse_udp_datagram)
+int32_t applemidi_if_send_udp_datagrams(applemidi_if_t *applemidi_if, applemidi_udp_datagram_t *datagrams, size_t num_datagrams)
 {
-  int32_t (*parse_udp_datagram)(uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport) = _parse_udp_datagram;
-  uint8_t rx_data[APPLEMIDI_IF_MAX_PACKET_SIZE];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+  char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+  int32_t sent;
+
+  for(sent=0; sent<num_datagrams; ++sent) {
+    applemidi_udp_datagram_t *datagram = &datagrams[sent];
+    int handle = applemidi_if->socket_handle[datagram->is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+    if( handle < 0 ) {
+      break; // socket not open
+    }
 
-  int i;
-  applemidi_if_socket_t *s = &applemidi_if_socket[0];
-  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i, ++s) {
-    socklen_t socklen = sizeof(s->socket_addr);
-    int rx_len = recvfrom(s->handle, rx_data, sizeof(rx_data), 0, (struct sockaddr *)&s->socket_addr, &socklen);
-
-    if( rx_len < 0 ) {
-      if( errno != EWOULDBLOCK ) {
-        if( applemidi_get_debug_level() >= 1 ) {
-          printf(APPLEMIDI_IF_LOG_TAG "recvfrom of %s socket failed: errno %d\n",
-            i == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
-            errno);
-        }
-        break;
+    // prebuilt destination address
+    struct sockaddr_storage tmp_socket_addr;
+    socklen_t socklen;
+    struct sockaddr *tx_socket_addr = applemidi_if_get_tx_socket_addr(applemidi_if, datagram->ip_addr, datagram->port, datagram->addr_cache, &tmp_socket_addr, &socklen);
+
+    if( debug_level >= 2 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %s:%d (batch)\n",
+        datagram->tx_len,
+        applemidi_ip_addr_to_str(datagram->ip_addr, ip_str, sizeof(ip_str)),
+        datagram->port);
+    }
+    if( debug_level >= 3 ) {
+      esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, datagram->tx_data, datagram->tx_len);
+    }
+
+    if( tx_socket_addr == NULL || sendto(handle, datagram->tx_data, datagram->tx_len, 0, tx_socket_addr, socklen) < 0 ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, datagram->port, datagram->tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(datagram->ip_addr, ip_str, sizeof(ip_str)),
+          datagram->port,
+          (tx_socket_addr == NULL) ? EAFNOSUPPORT : errno);
+      }
+      break;
+    }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, datagram->port, datagram->tx_len);
+    APPLEMIDI_PCAP_CAPTURE(1, datagram->ip_addr, datagram->port, applemidi_if->port + datagram->is_dataport, datagram->tx_data, datagram->tx_len, 0);
+  }
+
+  return sent;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends an UDP datagram which is scattered over multiple fragments with a single sendmsg() call
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagram_iov(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache)
+{
+  int handle = applemidi_if->socket_handle[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( handle < 0 ) {
+    return -1; // socket not open
+  } else if( iovcnt > APPLEMIDI_MAX_IOV ) {
+    return -3; // too many fragments
+  } else {
+    struct sockaddr_storage tmp_socket_addr;
+    struct iovec msg_iov[APPLEMIDI_MAX_IOV];
+    struct msghdr msg;
+    socklen_t socklen;
+    size_t tx_len = 0;
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+    int i;
+
+    for(i=0; i<iovcnt; ++i) {
+      msg_iov[i].iov_base = iov[i].base;
+      msg_iov[i].iov_len = iov[i].len;
+      tx_len += iov[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = applemidi_if_get_tx_socket_addr(applemidi_if, ip_addr, port, addr_cache, &tmp_socket_addr, &socklen);
+    msg.msg_namelen = socklen;
+    msg.msg_iov = msg_iov;
+    msg.msg_iovlen = iovcnt;
+
+    if( debug_level >= 2 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes in %d fragments to %s:%d\n",
+        tx_len,
+        iovcnt,
+        applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+        port);
+    }
+    if( debug_level >= 3 ) {
+      for(i=0; i<iovcnt; ++i) {
+        esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, iov[i].base, iov[i].len);
+      }
+    }
+
+    // note: lwIP assembles the fragments into a single pbuf, this saves the intermediate packet buffer of the driver
+    int err = (msg.msg_name == NULL) ? -1 : sendmsg(handle, &msg, 0);
+    if( err < 0 ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, port, tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+          port,
+          (msg.msg_name == NULL) ? EAFNOSUPPORT : errno);
+      }
+
+      return -2; // no packet sent
+    }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, port, tx_len);
+    APPLEMIDI_PCAP_CAPTURE_IOV(1, ip_addr, port, applemidi_if->port + is_dataport, iov, iovcnt, 0);
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Receives a datagram from the given socket (if available) and forwards it to the driver
+// rx_timestamp_us: arrival time if already known, otherwise 0 (LWIP doesn't timestamp datagrams)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_if_receive(applemidi_if_t *applemidi_if, int socket_ix, int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us), uint8_t *rx_data, uint64_t rx_timestamp_us)
+{
+  int handle = applemidi_if->socket_handle[socket_ix];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( handle < 0 ) {
+    return 0; // socket not open
+  }
+
+  struct sockaddr_storage rx_socket_addr;
+  socklen_t socklen = sizeof(rx_socket_addr);
+  int rx_len = recvfrom(handle, rx_data, APPLEMIDI_IF_MAX_PACKET_SIZE, 0, (struct sockaddr *)&rx_socket_addr, &socklen);
+  if( rx_timestamp_us == 0 ) {
+    rx_timestamp_us = applemidi_get_timestamp_us(); // before the debug messages are printed
+  }
+
+  if( rx_len < 0 ) {
+    if( errno != EWOULDBLOCK ) {
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "recvfrom of %s socket failed: errno %d\n",
+          socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+          errno);
       }
-    } else { // Data received
-      if( applemidi_get_debug_level() >= 2 ) {
-        printf(APPLEMIDI_IF_LOG_TAG "%s socket received %d bytes from %d.%d.%d.%d:%d\n",
-          i == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
-          rx_len,
-          (s->socket_addr.sin_addr.s_addr & 0x000000ff) >> 0,
-          (s->socket_addr.sin_addr.s_addr & 0x0000ff00) >> 8,
-          (s->socket_addr.sin_addr.s_addr & 0x00ff0000) >> 16,
-          (s->socket_addr.sin_addr.s_addr & 0xff000000) >> 24,
-          htons(s->socket_addr.sin_port));
+      return -1; // receive error
+    }
+  } else { // Data received
+    // the driver stores IPv6 sized addresses, IPv4 peers are IPv4-mapped
+    uint8_t peer_ip_addr[16];
+    uint16_t port;
+#if LWIP_IPV6
+    if( rx_socket_addr.ss_family == AF_INET6 ) {
+      struct sockaddr_in6 *rx_socket_addr6 = (struct sockaddr_in6 *)&rx_socket_addr;
+      memcpy(peer_ip_addr, &rx_socket_addr6->sin6_addr, 16); // dual-stack sockets deliver IPv4 peers already mapped
+      port = ntohs(rx_socket_addr6->sin6_port);
+      if( APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(peer_ip_addr) ) {
+        applemidi_if->ipv6_scope_id = rx_socket_addr6->sin6_scope_id;
       }
-      if( applemidi_get_debug_level() >= 3 ) {
-        esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, rx_data, rx_len);
+    } else
+#endif
+    {
+      struct sockaddr_in *rx_socket_addr4 = (struct sockaddr_in *)&rx_socket_addr;
+      applemidi_ip_addr_set_ipv4(peer_ip_addr, (uint8_t *)&rx_socket_addr4->sin_addr.s_addr);
+      port = ntohs(rx_socket_addr4->sin_port);
+    }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_RX, 0xff, port, rx_len);
+
+    if( debug_level >= 2 ) {
+      char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+      printf(APPLEMIDI_IF_LOG_TAG "%s socket received %d bytes from %s:%d\n",
+        socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+        rx_len,
+        applemidi_ip_addr_to_str(peer_ip_addr, ip_str, sizeof(ip_str)),
+        port);
+    }
+    if( debug_level >= 3 ) {
+      esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, rx_data, rx_len);
+    }
+
+    uint8_t is_dataport = socket_ix == APPLEMIDI_IF_SOCKET_DATA;
+    APPLEMIDI_PCAP_CAPTURE(0, peer_ip_addr, port, applemidi_if->port + is_dataport, rx_data, rx_len, rx_timestamp_us);
+    parse_udp_datagram(applemidi_if->applemidi, peer_ip_addr, port, rx_data, rx_len, is_dataport, rx_timestamp_us);
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick(applemidi_if_t *applemidi_if, void *_parse_udp_datagram)
+{
+  return applemidi_if_tick_multi(&applemidi_if, 1, _parse_udp_datagram);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams of multiple endpoints with a single wait
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick_multi(applemidi_if_t **applemidi_if, size_t num_endpoints, void *_parse_udp_datagram)
+{
+  int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us) = _parse_udp_datagram;
+  uint8_t rx_data[APPLEMIDI_IF_MAX_PACKET_SIZE];
+  uint64_t rx_timestamp_us = 0;
+  int endpoint, i;
+
+  if( num_endpoints > APPLEMIDI_IF_MAX_ENDPOINTS )
+    return -1; // too many endpoints
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+  fd_set rx_fds;
+  int max_handle = -1;
+  FD_ZERO(&rx_fds);
+  for(endpoint=0; endpoint<num_endpoints; ++endpoint) {
+    for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+      int handle = applemidi_if[endpoint]->socket_handle[i];
+      if( handle >= 0 ) {
+        FD_SET(handle, &rx_fds);
+        if( handle > max_handle )
+          max_handle = handle;
       }
+    }
+  }
+
+  if( max_handle < 0 ) {
+    return 0; // no socket open
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = APPLEMIDI_IF_TICK_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (APPLEMIDI_IF_TICK_TIMEOUT_MS % 1000) * 1000;
+  if( select(max_handle + 1, &rx_fds, NULL, NULL, &timeout) <= 0 ) {
+    return 0; // timeout (or interrupted)
+  }
+
+  // all pending datagrams arrived before the task woke up, this excludes the time spent in the callbacks of other sockets
+  rx_timestamp_us = applemidi_get_timestamp_us();
+#endif
 
-      uint8_t is_dataport = i == APPLEMIDI_IF_SOCKET_DATA;
-      parse_udp_datagram((uint8_t *)&s->socket_addr.sin_addr.s_addr, htons(s->socket_addr.sin_port), rx_data, rx_len, is_dataport);
+  for(endpoint=0; endpoint<num_endpoints; ++endpoint) {
+    for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+      int handle = applemidi_if[endpoint]->socket_handle[i];
+      if( handle < 0 || !FD_ISSET(handle, &rx_fds) ) {
+        continue;
+      }
+#endif
+      if( applemidi_if_receive(applemidi_if[endpoint], i, parse_udp_datagram, rx_data, rx_timestamp_us) < 0 ) {
+        break; // continue with next endpoint
+      }
     }
   }
 
   return 0; // no error
 }
 
+#endif /* !APPLEMIDI_IF_USE_NETCONN */
+
 
 #if APPLEMIDI_IF_ENABLE_CONSOLE
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Optional Console Commands
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-static int cmd_info(int argc, char **argv)
+
+// the interface (and driver) instances which are controlled by the console
+static applemidi_if_t **applemidi_if_console;
+static size_t applemidi_if_console_num_endpoints;
+
+// returns the endpoint selected with --endpoint (default: 0), or NULL if it doesn't exist
+static applemidi_if_t *get_endpoint(struct arg_int *endpoint_arg)
 {
+  int endpoint = 0;
+  if( endpoint_arg->count > 0 ) {
+    endpoint = endpoint_arg->ival[0];
+  }
+
+  if( endpoint < 0 || endpoint >= applemidi_if_console_num_endpoints ) {
+    ESP_LOGE(__func__, "Invalid endpoint number, should be within 0..%d!", applemidi_if_console_num_endpoints-1);
+    return NULL;
+  }
+
+  return applemidi_if_console[endpoint];
+}
+
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+static void print_histograms(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t reset)
+{
+  applemidi_histogram_t histogram[APPLEMIDI_NUM_HISTOGRAMS];
+  if( applemidi_peer_get_histograms(applemidi, applemidi_port, histogram, reset) < 0 ) {
+    return;
+  }
+
   int i;
+  applemidi_histogram_t *h = &histogram[0];
+  for(i=0; i<APPLEMIDI_NUM_HISTOGRAMS; ++i, ++h) {
+    printf("  - %s: ", applemidi_histogram_get_name(i));
+    if( h->count == 0 ) {
+      printf("no samples\n");
+    } else {
+      printf("%u samples, min=%u, avg=%u, max=%u\n", h->count, h->min, (uint32_t)(h->sum / h->count), h->max);
+
+      int bucket;
+      for(bucket=0; bucket<APPLEMIDI_HISTOGRAM_BUCKETS; ++bucket) {
+        if( h->bucket[bucket] ) {
+          uint32_t min, max;
+          applemidi_histogram_get_bucket_range(bucket, &min, &max);
+          if( max == ~0 ) {
+            printf("      >= %u: %u\n", min, h->bucket[bucket]);
+          } else {
+            printf("      %u..%u: %u\n", min, max, h->bucket[bucket]);
+          }
+        }
+      }
+    }
+  }
+}
+#endif
 
-  printf("Control UDP Socket: %s\n", (applemidi_if_socket[APPLEMIDI_IF_SOCKET_CONTROL].handle >= 0) ? "up" : "down");
-  printf("Data UDP Socket: %s\n", (applemidi_if_socket[APPLEMIDI_IF_SOCKET_CONTROL].handle >= 0) ? "up" : "down");
+static struct {
+  struct arg_lit *histograms;
+  struct arg_lit *reset;
+  struct arg_int *endpoint;
+  struct arg_end *end;
+} applemidi_if_info_args;
+
+static void print_endpoint_info(int endpoint, applemidi_if_t *applemidi_if)
+{
+  applemidi_t *applemidi = applemidi_if->applemidi;
+  int i;
+
+  printf("Endpoint #%d '%s'\n", endpoint, applemidi_peer_get_info(applemidi, 0)->name);
+  printf("Control UDP Socket: %s (port %d)\n", APPLEMIDI_IF_SOCKET_IS_OPEN(applemidi_if, APPLEMIDI_IF_SOCKET_CONTROL) ? "up" : "down", applemidi_if->port);
+  printf("Data UDP Socket: %s (port %d)\n", APPLEMIDI_IF_SOCKET_IS_OPEN(applemidi_if, APPLEMIDI_IF_SOCKET_DATA) ? "up" : "down", applemidi_if->port + 1);
   printf("\n");
 
-  for(i=0; i<APPLEMIDI_MAX_PEERS; ++i) {
-    applemidi_peer_t *peer = applemidi_peer_get_info(i);
+  for(i=0; i<applemidi->num_peers; ++i) {
+    applemidi_peer_t *peer = applemidi_peer_get_info(applemidi, i);
 
     printf("Peer #%d (%s)\n", i, (i == 0) ? "local" : "remote");
 
@@ -252,22 +577,82 @@ static int cmd_info(int argc, char **argv)
     case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL: printf("Master sent Invite over Control Port\n"); break;
     case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA: printf("Master sent Invite over Data Port\n"); break;
     case APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED: printf("Master is connected\n"); break;
+    case APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT: printf("Master waits for reconnect\n"); break;
     default: printf("Unknown!\n");
     }
 
     printf("  - SSRC: 0x%08x\n", peer->ssrc);
     printf("  - Name: '%s'\n", peer->name);
-    printf("  - IP: %d.%d.%d.%d\n", peer->ip_addr[0], peer->ip_addr[1], peer->ip_addr[2], peer->ip_addr[3]); // TODO: IPv6 support
+    {
+      char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+      printf("  - IP: %s (%s)\n", applemidi_ip_addr_to_str(peer->ip_addr, ip_str, sizeof(ip_str)), (peer->addr_family == APPLEMIDI_ADDR_FAMILY_IPV6) ? "IPv6" : "IPv4");
+    }
     printf("  - Control Port: %d\n", peer->control_port);
     printf("  - Data Port: %d\n", peer->data_port);
+    printf("  - MTU: %d%s\n", peer->mtu, (i == 0) ? " (default for new sessions)" : "");
     printf("  - Last Sequence Number: %d\n", peer->seq_nr);
     printf("  - Packets Sent: %d\n", peer->packets_sent);
     printf("  - Packets Received: %d\n", peer->packets_received);
     printf("  - Packets Loss: %d\n", peer->packets_loss);
+    {
+      int32_t idle_time = applemidi_peer_get_idle_time_ms(applemidi, i);
+      if( idle_time >= 0 ) {
+        printf("  - Idle Time: %d mS\n", idle_time);
+      }
+    }
+    printf("  - Sessions Evicted: %d\n", peer->sessions_evicted);
+    printf("  - Last Slot Hold Time: %u mS\n", peer->last_session_hold_time_ms);
+#if APPLEMIDI_ENABLE_ROUTING
+    if( i > 0 ) {
+      printf("  - Routed Messages: %u forwarded, %u dropped\n", peer->route_forwarded, peer->route_dropped);
+    }
+#endif
+    if( peer->filter_in != NULL || peer->filter_out != NULL ) {
+      printf("  - Filters: %s%s, %u messages dropped\n", peer->filter_in ? "in" : "", peer->filter_out ? (peer->filter_in ? "+out" : "out") : "", peer->filter_dropped);
+    }
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+    printf("  - Jitter: %u uS\n", peer->rx_jitter_us);
+    if( applemidi_if_info_args.histograms->count > 0 ) {
+      print_histograms(applemidi, i, applemidi_if_info_args.reset->count > 0);
+    }
+#endif
     printf("\n");
   }
 
-  printf("Current Debug Level: %d\n", applemidi_get_debug_level());
+  printf("Current Debug Level: %d\n", applemidi_get_debug_level(applemidi));
+}
+
+static int cmd_info(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **)&applemidi_if_info_args);
+  if( nerrors != 0 ) {
+      arg_print_errors(stderr, applemidi_if_info_args.end, argv[0]);
+      return 1;
+  }
+
+  if( applemidi_if_info_args.endpoint->count > 0 ) {
+    applemidi_if_t *applemidi_if = get_endpoint(applemidi_if_info_args.endpoint);
+    if( applemidi_if == NULL ) {
+      return 1;
+    }
+    print_endpoint_info(applemidi_if_info_args.endpoint->ival[0], applemidi_if);
+  } else {
+    int endpoint;
+    for(endpoint=0; endpoint<applemidi_if_console_num_endpoints; ++endpoint) {
+      if( endpoint > 0 ) {
+        printf("\n");
+      }
+      print_endpoint_info(endpoint, applemidi_if_console[endpoint]);
+    }
+  }
+
+  {
+    applemidi_alloc_stats_t stats;
+    applemidi_get_alloc_stats(&stats);
+    printf("Allocations (%s): %u allocs, %u frees, %u failures, %u in use (max %u)\n",
+      APPLEMIDI_STATIC_ALLOCATION ? "static pools" : "heap",
+      stats.allocs, stats.frees, stats.failures, stats.in_use, stats.max_in_use);
+  }
 
   return 0;
 }
@@ -276,6 +661,7 @@ static int cmd_info(int argc, char **argv)
 static struct {
   struct arg_str *on_off;
   struct arg_int *verbosity;
+  struct arg_int *endpoint;
   struct arg_end *end;
 } applemidi_if_debug_args;
 
@@ -287,26 +673,128 @@ static int cmd_debug(int argc, char **argv)
       return 1;
   }
 
+  uint8_t verbosity;
   if( strcasecmp(applemidi_if_debug_args.on_off->sval[0], "on") == 0 ) {
-    uint8_t verbosity = 2;
+    verbosity = 2;
     if( applemidi_if_debug_args.verbosity->count > 0) {
       verbosity = applemidi_if_debug_args.verbosity->ival[0];
     }
     printf("Enabled debug messages with verbosity=%d\n", verbosity);
-    applemidi_set_debug_level(verbosity);
   } else {
+    verbosity = 1;
     printf("Disabled debug messages - they can be re-enabled with 'applemidi_debug on'\n");
-    applemidi_set_debug_level(1);
+  }
+
+  // without --endpoint: change the debug level of all endpoints
+  if( applemidi_if_debug_args.endpoint->count > 0 ) {
+    applemidi_if_t *applemidi_if = get_endpoint(applemidi_if_debug_args.endpoint);
+    if( applemidi_if == NULL ) {
+      return 1;
+    }
+    applemidi_set_debug_level(applemidi_if->applemidi, verbosity);
+  } else {
+    int endpoint;
+    for(endpoint=0; endpoint<applemidi_if_console_num_endpoints; ++endpoint) {
+      applemidi_set_debug_level(applemidi_if_console[endpoint]->applemidi, verbosity);
+    }
   }
 
   return 0; // no error
 }
 
 
+#if APPLEMIDI_TRACE_ENABLED
+static struct {
+  struct arg_str *action;
+  struct arg_int *num;
+  struct arg_end *end;
+} applemidi_if_trace_args;
+
+static int cmd_trace(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **)&applemidi_if_trace_args);
+  if( nerrors != 0 ) {
+      arg_print_errors(stderr, applemidi_if_trace_args.end, argv[0]);
+      return 1;
+  }
+
+  if( strcasecmp(applemidi_if_trace_args.action->sval[0], "dump") == 0 ) {
+    size_t num = 0;
+    if( applemidi_if_trace_args.num->count > 0 ) {
+      num = applemidi_if_trace_args.num->ival[0];
+    }
+    applemidi_trace_dump(num);
+  } else if( strcasecmp(applemidi_if_trace_args.action->sval[0], "clear") == 0 ) {
+    applemidi_trace_clear();
+    printf("Trace ring cleared.\n");
+  } else {
+    printf("Unknown action '%s' - expecting 'dump' or 'clear'\n", applemidi_if_trace_args.action->sval[0]);
+    return 1;
+  }
+
+  return 0; // no error
+}
+#endif
+
+
+#if APPLEMIDI_PCAP_ENABLED
+static struct {
+  struct arg_str *action;
+  struct arg_int *num;
+  struct arg_str *file;
+  struct arg_end *end;
+} applemidi_if_pcap_args;
+
+static int cmd_pcap(int argc, char **argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **)&applemidi_if_pcap_args);
+  if( nerrors != 0 ) {
+      arg_print_errors(stderr, applemidi_if_pcap_args.end, argv[0]);
+      return 1;
+  }
+
+  size_t num = 0;
+  if( applemidi_if_pcap_args.num->count > 0 ) {
+    num = applemidi_if_pcap_args.num->ival[0];
+  }
+
+  const char *action = applemidi_if_pcap_args.action->sval[0];
+  if( strcasecmp(action, "dump") == 0 ) {
+    applemidi_pcap_dump(num);
+  } else if( strcasecmp(action, "save") == 0 ) {
+    if( applemidi_if_pcap_args.file->count == 0 ) {
+      printf("Please specify the file with --file=<path>, e.g. --file=/spiffs/capture.pcap\n");
+      return 1;
+    }
+    const char *path = applemidi_if_pcap_args.file->sval[0];
+    int32_t num_written = applemidi_pcap_save(path, num);
+    if( num_written < 0 ) {
+      printf("Failed to write %s\n", path);
+      return 1;
+    }
+    printf("%d datagrams written to %s\n", num_written, path);
+  } else if( strcasecmp(action, "clear") == 0 ) {
+    applemidi_pcap_clear();
+    printf("Capture ring cleared.\n");
+  } else if( strcasecmp(action, "on") == 0 || strcasecmp(action, "off") == 0 ) {
+    applemidi_pcap_set_enabled(strcasecmp(action, "on") == 0);
+    printf("Packet capture %s.\n", applemidi_pcap_get_enabled() ? "enabled" : "disabled");
+  } else {
+    printf("Unknown action '%s' - expecting 'dump', 'save', 'clear', 'on' or 'off'\n", action);
+    return 1;
+  }
+
+  return 0; // no error
+}
+#endif
+
+
 static struct {
   struct arg_str *ip;
   struct arg_int *control_port;
   struct arg_int *peer_port;
+  struct arg_lit *reconnect;
+  struct arg_int *endpoint;
   struct arg_end *end;
 } applemidi_if_start_session_args;
 
@@ -318,6 +806,11 @@ static int cmd_start_session(int argc, char **argv)
       return 1;
   }
 
+  applemidi_if_t *applemidi_if = get_endpoint(applemidi_if_start_session_args.endpoint);
+  if( applemidi_if == NULL ) {
+    return 1;
+  }
+
   int control_port;
   if( applemidi_if_start_session_args.control_port->count == 0) {
     control_port = 5004;
@@ -332,7 +825,7 @@ static int cmd_start_session(int argc, char **argv)
 
   int applemidi_port;
   if( applemidi_if_start_session_args.peer_port->count == 0) {
-    applemidi_port = applemidi_search_free_port();
+    applemidi_port = applemidi_search_free_port(applemidi_if->applemidi);
     if( applemidi_port < 0 ) {
       ESP_LOGE(__func__, "No free peer port available!");
       return 1;
@@ -340,19 +833,31 @@ static int cmd_start_session(int argc, char **argv)
   } else {
     applemidi_port = applemidi_if_start_session_args.peer_port->ival[0];
 
-    if( applemidi_port < 1 || applemidi_port >= APPLEMIDI_MAX_PEERS ) {
-      ESP_LOGE(__func__, "Invalid peer port number, should be within 1..%d!", APPLEMIDI_MAX_PEERS-1);
+    if( applemidi_port < 1 || applemidi_port >= applemidi_if->applemidi->num_peers ) {
+      ESP_LOGE(__func__, "Invalid peer port number, should be within 1..%d!", applemidi_if->applemidi->num_peers-1);
       return 1;
     }
   }
 
-  struct sockaddr_in dest_addr;
-  dest_addr.sin_addr.s_addr = inet_addr(applemidi_if_start_session_args.ip->sval[0]);
-  uint8_t *ip_addr = (uint8_t *)&dest_addr.sin_addr.s_addr;
+  // the driver stores IPv6 sized addresses, IPv4 addresses are IPv4-mapped
+  uint8_t ip_addr[16];
+#if LWIP_IPV6
+  if( inet_pton(AF_INET6, applemidi_if_start_session_args.ip->sval[0], ip_addr) != 1 )
+#endif
+  {
+    if( inet_pton(AF_INET, applemidi_if_start_session_args.ip->sval[0], ip_addr) != 1 ) {
+      ESP_LOGE(__func__, "Invalid IP address!");
+      return 1;
+    }
+    applemidi_ip_addr_set_ipv4(ip_addr, ip_addr);
+  }
 
-  int status = applemidi_start_session(applemidi_port, ip_addr, control_port);
+  int status = applemidi_start_session(applemidi_if->applemidi, applemidi_port, ip_addr, control_port);
   if( status < 0 ) {
     ESP_LOGE(__func__, "Command failed!");
+  } else {
+    // only for the session we've just invited - a failed start must not modify the running session
+    applemidi_set_auto_reconnect(applemidi_if->applemidi, applemidi_port, applemidi_if_start_session_args.reconnect->count > 0);
   }
 
   return 0; // no error
@@ -360,6 +865,7 @@ static int cmd_start_session(int argc, char **argv)
 
 static struct {
   struct arg_int *peer_port;
+  struct arg_int *endpoint;
   struct arg_end *end;
 } applemidi_if_end_session_args;
 
@@ -371,6 +877,11 @@ static int cmd_end_session(int argc, char **argv)
       return 1;
   }
 
+  applemidi_if_t *applemidi_if = get_endpoint(applemidi_if_end_session_args.endpoint);
+  if( applemidi_if == NULL ) {
+    return 1;
+  }
+
   int applemidi_port;
   if( applemidi_if_end_session_args.peer_port->count == 0) {
     ESP_LOGE(__func__, "Please specify the --peer_port!");
@@ -378,13 +889,13 @@ static int cmd_end_session(int argc, char **argv)
   } else {
     applemidi_port = applemidi_if_end_session_args.peer_port->ival[0];
 
-    if( applemidi_port < 1 || applemidi_port >= APPLEMIDI_MAX_PEERS ) {
-      ESP_LOGE(__func__, "Invalid peer port number, should be within 1..%d!", APPLEMIDI_MAX_PEERS-1);
+    if( applemidi_port < 1 || applemidi_port >= applemidi_if->applemidi->num_peers ) {
+      ESP_LOGE(__func__, "Invalid peer port number, should be within 1..%d!", applemidi_if->applemidi->num_peers-1);
       return 1;
     }
   }
 
-  int status = applemidi_terminate_session(applemidi_port);
+  int status = applemidi_terminate_session(applemidi_if->applemidi, applemidi_port);
   if( status < 0 ) {
     ESP_LOGE(__func__, "Command failed!");
   }
@@ -393,15 +904,68 @@ static int cmd_end_session(int argc, char **argv)
 }
 
 
-void applemidi_if_register_console_commands(void)
+static struct {
+  struct arg_int *mtu;
+  struct arg_int *peer_port;
+  struct arg_int *endpoint;
+  struct arg_end *end;
+} applemidi_if_mtu_args;
+
+static int cmd_mtu(int argc, char **argv)
 {
+  int nerrors = arg_parse(argc, argv, (void **)&applemidi_if_mtu_args);
+  if( nerrors != 0 ) {
+      arg_print_errors(stderr, applemidi_if_mtu_args.end, argv[0]);
+      return 1;
+  }
+
+  applemidi_if_t *applemidi_if = get_endpoint(applemidi_if_mtu_args.endpoint);
+  if( applemidi_if == NULL ) {
+    return 1;
+  }
+
+  int applemidi_port = 0;
+  if( applemidi_if_mtu_args.peer_port->count > 0 ) {
+    applemidi_port = applemidi_if_mtu_args.peer_port->ival[0];
+
+    if( applemidi_port < 0 || applemidi_port >= applemidi_if->applemidi->num_peers ) {
+      ESP_LOGE(__func__, "Invalid peer port number, should be within 0..%d!", applemidi_if->applemidi->num_peers-1);
+      return 1;
+    }
+  }
+
+  int mtu = applemidi_if_mtu_args.mtu->ival[0];
+  if( mtu < APPLEMIDI_MIN_MTU || mtu > APPLEMIDI_OUTBUFFER_SIZE ) {
+    ESP_LOGE(__func__, "Invalid MTU, should be within %d..%d!", APPLEMIDI_MIN_MTU, APPLEMIDI_OUTBUFFER_SIZE);
+    return 1;
+  }
+
+  int status = applemidi_set_mtu(applemidi_if->applemidi, applemidi_port, mtu);
+  if( status < 0 ) {
+    ESP_LOGE(__func__, "Command failed!");
+  }
+
+  return 0; // no error
+}
+
+
+void applemidi_if_register_console_commands(applemidi_if_t **applemidi_if, size_t num_endpoints)
+{
+  applemidi_if_console = applemidi_if;
+  applemidi_if_console_num_endpoints = num_endpoints;
+
   {
+    applemidi_if_info_args.histograms = arg_lit0("H", "histograms", "Prints latency, jitter and packet size histograms (peer #0: aggregate)");
+    applemidi_if_info_args.reset = arg_lit0("r", "reset", "Clears the histograms after printing");
+    applemidi_if_info_args.endpoint = arg_int0("e", "endpoint", "<endpoint>", "Only prints the given local endpoint (default: all)");
+    applemidi_if_info_args.end = arg_end(20);
+
     const esp_console_cmd_t info_cmd = {
       .command = "applemidi_info",
       .help = "Information about the AppleMIDI Interface",
       .hint = NULL,
       .func = &cmd_info,
-      .argtable = NULL
+      .argtable = &applemidi_if_info_args
     };
 
     ESP_ERROR_CHECK( esp_console_cmd_register(&info_cmd) );
@@ -410,6 +974,7 @@ void applemidi_if_register_console_commands(void)
   {
     applemidi_if_debug_args.on_off = arg_str1(NULL, NULL, "<on/off>", "Enables/Disables debug messages");
     applemidi_if_debug_args.verbosity = arg_int0(NULL, "verbosity", "<level>", "Verbosity Level (0..3)");
+    applemidi_if_debug_args.endpoint = arg_int0("e", "endpoint", "<endpoint>", "Local endpoint (default: all)");
     applemidi_if_debug_args.end = arg_end(20);
 
     const esp_console_cmd_t debug_cmd = {
@@ -423,10 +988,49 @@ void applemidi_if_register_console_commands(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&debug_cmd) );
   }
 
+#if APPLEMIDI_TRACE_ENABLED
+  {
+    applemidi_if_trace_args.action = arg_str1(NULL, NULL, "<dump/clear>", "Dumps or clears the trace ring");
+    applemidi_if_trace_args.num = arg_int0("n", "num", "<records>", "Number of latest records which should be dumped (default: all)");
+    applemidi_if_trace_args.end = arg_end(20);
+
+    const esp_console_cmd_t trace_cmd = {
+      .command = "applemidi_trace",
+      .help = "Dumps/Clears the binary trace ring",
+      .hint = NULL,
+      .func = &cmd_trace,
+      .argtable = &applemidi_if_trace_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&trace_cmd) );
+  }
+#endif
+
+#if APPLEMIDI_PCAP_ENABLED
+  {
+    applemidi_if_pcap_args.action = arg_str1(NULL, NULL, "<dump/save/clear/on/off>", "Dumps, stores or clears the capture ring, or enables/disables capturing");
+    applemidi_if_pcap_args.num = arg_int0("n", "num", "<datagrams>", "Number of latest datagrams which should be dumped/stored (default: all)");
+    applemidi_if_pcap_args.file = arg_str0(NULL, "file", "<path>", "pcap file which should be written by 'save'");
+    applemidi_if_pcap_args.end = arg_end(20);
+
+    const esp_console_cmd_t pcap_cmd = {
+      .command = "applemidi_pcap",
+      .help = "Dumps/Stores/Clears the packet capture ring",
+      .hint = NULL,
+      .func = &cmd_pcap,
+      .argtable = &applemidi_if_pcap_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&pcap_cmd) );
+  }
+#endif
+
   {
     applemidi_if_start_session_args.ip = arg_str1(NULL, NULL, "<ip>", "IP of remote peer");
     applemidi_if_start_session_args.control_port = arg_int0(NULL, "port", "<port-number>", "Port number of remote peer (default: 5004)");
     applemidi_if_start_session_args.peer_port = arg_int0(NULL, "peer_port", "<session-number>", "Session number (1..4)"); // TODO: insert APPLEMIDI_MAX_SESSIONS
+    applemidi_if_start_session_args.reconnect = arg_lit0(NULL, "reconnect", "Re-invite the peer whenever the session drops");
+    applemidi_if_start_session_args.endpoint = arg_int0("e", "endpoint", "<endpoint>", "Local endpoint which initiates the session (default: 0)");
     applemidi_if_start_session_args.end = arg_end(20);
 
     const esp_console_cmd_t start_session_cmd = {
@@ -442,6 +1046,7 @@ void applemidi_if_register_console_commands(void)
 
   {
     applemidi_if_end_session_args.peer_port = arg_int1(NULL, "peer_port", "<session-number>", "Session number (1..4)"); // TODO: insert APPLEMIDI_MAX_SESSIONS
+    applemidi_if_end_session_args.endpoint = arg_int0("e", "endpoint", "<endpoint>", "Local endpoint of the session (default: 0)");
     applemidi_if_end_session_args.end = arg_end(20);
 
     const esp_console_cmd_t end_session_cmd = {
@@ -455,5 +1060,22 @@ void applemidi_if_register_console_commands(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&end_session_cmd) );
   }
 
+  {
+    applemidi_if_mtu_args.mtu = arg_int1(NULL, NULL, "<bytes>", "Max. size of outgoing RTP packets w/o UDP/IP header");
+    applemidi_if_mtu_args.peer_port = arg_int0(NULL, "peer_port", "<session-number>", "Session number (default: 0 - applies to new sessions)");
+    applemidi_if_mtu_args.endpoint = arg_int0("e", "endpoint", "<endpoint>", "Local endpoint of the session (default: 0)");
+    applemidi_if_mtu_args.end = arg_end(20);
+
+    const esp_console_cmd_t mtu_cmd = {
+      .command = "applemidi_mtu",
+      .help = "Sets the path MTU of a session",
+      .hint = NULL,
+      .func = &cmd_mtu,
+      .argtable = &applemidi_if_mtu_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&mtu_cmd) );
+  }
+
 }
 #endif
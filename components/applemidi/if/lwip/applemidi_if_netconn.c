@@ -0,0 +1,553 @@
+/*
+ * Interface Layer for Apple MIDI Driver
+ * LWIP Variant based on the netconn API (APPLEMIDI_IF_USE_NETCONN=1)
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+
+#include "if/lwip/applemidi_if.h"
+
+#if APPLEMIDI_IF_USE_NETCONN
+
+#include "applemidi_trace.h"
+#include "applemidi_pcap.h"
+#include "applemidi_pool.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+
+#include "lwip/err.h"
+#include "lwip/api.h"
+#include "lwip/pbuf.h"
+#include "lwip/sys.h"
+
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+// signalled from the tcpip thread whenever a datagram has been received by one of the connections,
+// applemidi_if_tick_multi() waits on it, so that all endpoints can be served by a single task
+static sys_sem_t applemidi_if_rx_sem;
+
+// arrival times of the datagrams which are queued in the receive mailbox of a connection
+// head is only written by the tcpip thread, tail and missed only by the task which calls applemidi_if_tick_multi().
+// The tcpip thread and the task can run on different cores: head and tail are accessed with release/acquire
+// semantics, so that the entries (incl. the 64bit timestamp) are complete before the index is visible.
+typedef struct {
+  struct netconn *conn;
+  uint8_t head;
+  uint8_t tail;
+  uint8_t overrun; // set by the tcpip thread if a timestamp couldn't be queued
+  uint8_t missed;  // datagrams which have been received before their timestamp was queued
+  uint16_t len[APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE];
+  uint64_t timestamp_us[APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE];
+} applemidi_if_rx_timestamps_t;
+
+static applemidi_if_rx_timestamps_t applemidi_if_rx_timestamps[APPLEMIDI_IF_MAX_ENDPOINTS * APPLEMIDI_IF_NUM_SOCKETS];
+
+static applemidi_if_rx_timestamps_t *applemidi_if_search_rx_timestamps(struct netconn *conn)
+{
+  int i;
+  for(i=0; i<(APPLEMIDI_IF_MAX_ENDPOINTS * APPLEMIDI_IF_NUM_SOCKETS); ++i) {
+    if( applemidi_if_rx_timestamps[i].conn == conn ) {
+      return &applemidi_if_rx_timestamps[i];
+    }
+  }
+
+  return NULL;
+}
+
+// returns the arrival time of the next datagram of a connection, 0 if it hasn't been recorded
+static uint64_t applemidi_if_pop_rx_timestamp(struct netconn *conn, size_t len)
+{
+  applemidi_if_rx_timestamps_t *rx_timestamps = applemidi_if_search_rx_timestamps(conn);
+  uint64_t timestamp_us = 0;
+
+  if( rx_timestamps == NULL )
+    return 0;
+
+  // lwIP posts the datagram to the mailbox before NETCONN_EVT_RCVPLUS is fired, therefore a datagram can be
+  // received before its timestamp has been queued. Such late timestamps belong to datagrams which have
+  // already been processed and are skipped, otherwise each datagram would get the arrival time of its predecessor.
+  uint8_t head = __atomic_load_n(&rx_timestamps->head, __ATOMIC_ACQUIRE);
+  uint8_t tail = rx_timestamps->tail;
+  while( rx_timestamps->missed > 0 && head != tail ) {
+    rx_timestamps->missed -= 1;
+    tail += 1;
+  }
+
+  if( head == tail ) {
+    if( rx_timestamps->missed < 0xff ) {
+      rx_timestamps->missed += 1;
+    }
+  } else {
+    uint8_t ix = tail & (APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE - 1);
+    if( rx_timestamps->len[ix] == len ) { // otherwise the queue is out of sync after an overrun
+      timestamp_us = rx_timestamps->timestamp_us[ix];
+    }
+    tail += 1;
+  }
+
+  __atomic_store_n(&rx_timestamps->tail, tail, __ATOMIC_RELEASE);
+
+  return timestamp_us;
+}
+
+// re-synchronizes the queue after an overrun, called when the receive mailbox is empty
+static void applemidi_if_sync_rx_timestamps(struct netconn *conn)
+{
+  applemidi_if_rx_timestamps_t *rx_timestamps = applemidi_if_search_rx_timestamps(conn);
+
+  if( rx_timestamps != NULL && __atomic_exchange_n(&rx_timestamps->overrun, 0, __ATOMIC_RELAXED) ) {
+    rx_timestamps->missed = 0;
+    __atomic_store_n(&rx_timestamps->tail, __atomic_load_n(&rx_timestamps->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  }
+}
+
+static void applemidi_if_netconn_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
+{
+  if( evt == NETCONN_EVT_RCVPLUS ) {
+    // called when the datagram is posted to the receive mailbox, this is the earliest point where we can timestamp it
+    applemidi_if_rx_timestamps_t *rx_timestamps = applemidi_if_search_rx_timestamps(conn);
+    uint8_t head = (rx_timestamps != NULL) ? rx_timestamps->head : 0;
+    if( rx_timestamps != NULL && (uint8_t)(head - __atomic_load_n(&rx_timestamps->tail, __ATOMIC_ACQUIRE)) < APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE ) {
+      uint8_t ix = head & (APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE - 1);
+      rx_timestamps->len[ix] = len;
+      rx_timestamps->timestamp_us[ix] = applemidi_get_timestamp_us();
+      __atomic_store_n(&rx_timestamps->head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+    } else if( rx_timestamps != NULL ) {
+      __atomic_store_n(&rx_timestamps->overrun, 1, __ATOMIC_RELAXED);
+    }
+
+    if( sys_sem_valid(&applemidi_if_rx_sem) ) {
+      sys_sem_signal(&applemidi_if_rx_sem);
+    }
+  }
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Initializes the UDP connections
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_init(applemidi_if_t *applemidi_if, applemidi_t *applemidi, uint16_t port)
+{
+  applemidi_if->applemidi = applemidi;
+  applemidi_if->port = port;
+  applemidi_if->socket_ipv6 = 0;
+  applemidi_if->ipv6_scope_id = 0;
+
+  int i;
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    applemidi_if->conn[i] = NULL;
+  }
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+  if( !sys_sem_valid(&applemidi_if_rx_sem) ) {
+    if( sys_sem_new(&applemidi_if_rx_sem, 0) != ERR_OK ) {
+      if( applemidi_get_debug_level(applemidi) >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Unable to create receive semaphore\n");
+      }
+      return -1;
+    }
+  }
+#endif
+
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    uint16_t rx_port = port + i;
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+    struct netconn *conn = netconn_new_with_callback(NETCONN_UDP, applemidi_if_netconn_callback);
+#else
+    struct netconn *conn = netconn_new(NETCONN_UDP);
+#endif
+    if( conn == NULL ) {
+      if( applemidi_get_debug_level(applemidi) >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Unable to create connection #%d\n", i);
+      }
+      return -1;
+    } else {
+      netconn_set_nonblocking(conn, 1);
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+      // allocate the timestamp queue before datagrams can be received
+      applemidi_if_rx_timestamps_t *rx_timestamps = applemidi_if_search_rx_timestamps(NULL);
+      if( rx_timestamps != NULL ) {
+        rx_timestamps->head = 0;
+        rx_timestamps->tail = 0;
+        rx_timestamps->overrun = 0;
+        rx_timestamps->missed = 0;
+        rx_timestamps->conn = conn;
+      }
+#endif
+
+#if LWIP_IPV6
+      // dual-stack: accept IPv4 and IPv6 peers
+      err_t err = netconn_bind(conn, IP_ANY_TYPE, rx_port);
+      applemidi_if->socket_ipv6 = 1;
+#else
+      err_t err = netconn_bind(conn, IP_ADDR_ANY, rx_port);
+#endif
+      if( err != ERR_OK ) {
+        netconn_delete(conn);
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+        if( rx_timestamps != NULL ) {
+          rx_timestamps->conn = NULL;
+        }
+#endif
+        if( applemidi_get_debug_level(applemidi) >= 1 ) {
+          printf(APPLEMIDI_IF_LOG_TAG "Unable to bind connection #%d: err %d\n", i, err);
+        }
+        return -2;
+      }
+
+      applemidi_if->conn[i] = conn;
+    }
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Closes the UDP connections
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_deinit(applemidi_if_t *applemidi_if)
+{
+  int i;
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    struct netconn *conn = applemidi_if->conn[i];
+    if( conn != NULL ) {
+      netconn_delete(conn);
+      applemidi_if->conn[i] = NULL;
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+      applemidi_if_rx_timestamps_t *rx_timestamps = applemidi_if_search_rx_timestamps(conn);
+      if( rx_timestamps != NULL ) {
+        rx_timestamps->conn = NULL;
+      }
+#endif
+    }
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the destination address of a datagram, prebuilt in the address cache if available
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static ip_addr_t *applemidi_if_get_tx_addr(applemidi_if_t *applemidi_if, uint8_t *ip_addr, applemidi_addr_cache_t *addr_cache, ip_addr_t *tmp_addr)
+{
+  ip_addr_t *tx_addr = (addr_cache != NULL) ? (ip_addr_t *)addr_cache->storage : tmp_addr;
+
+  if( addr_cache == NULL || !addr_cache->valid ) {
+    if( applemidi_ip_addr_get_family(ip_addr) == APPLEMIDI_ADDR_FAMILY_IPV4 ) {
+      IP_ADDR4(tx_addr, ip_addr[12], ip_addr[13], ip_addr[14], ip_addr[15]);
+    } else {
+#if LWIP_IPV6
+      ip6_addr_t *tx_addr6 = ip_2_ip6(tx_addr);
+      memcpy(tx_addr6->addr, ip_addr, 16);
+      IP_SET_TYPE_VAL(*tx_addr, IPADDR_TYPE_V6);
+# if LWIP_IPV6_SCOPES
+      ip6_addr_set_zone(tx_addr6, APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(ip_addr) ? applemidi_if->ipv6_scope_id : IP6_NO_ZONE);
+# endif
+#else
+      return NULL; // IPv6 peer, but lwIP has been built without IPv6 support
+#endif
+    }
+
+    if( addr_cache != NULL ) {
+      addr_cache->valid = 1;
+    }
+  }
+
+  return tx_addr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends a datagram which is scattered over multiple fragments.
+// The fragments are referenced by a pbuf chain, so that they are not copied by the driver
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_if_netconn_send(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache)
+{
+  struct netconn *conn = applemidi_if->conn[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+  size_t tx_len = 0;
+  int i;
+
+  if( conn == NULL ) {
+    return -1; // connection not open
+  }
+
+  for(i=0; i<iovcnt; ++i) {
+    tx_len += iov[i].len;
+  }
+
+  if( debug_level >= 2 ) {
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+    printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %s:%d\n",
+      tx_len,
+      applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+      port);
+  }
+  if( debug_level >= 3 ) {
+    for(i=0; i<iovcnt; ++i) {
+      esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, iov[i].base, iov[i].len);
+    }
+  }
+
+  struct netbuf *buf = netbuf_new();
+  err_t err = (buf != NULL) ? netbuf_ref(buf, iov[0].base, iov[0].len) : ERR_MEM;
+  for(i=1; i<iovcnt && err == ERR_OK; ++i) {
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, iov[i].len, PBUF_REF);
+    if( p == NULL ) {
+      err = ERR_MEM;
+    } else {
+      p->payload = iov[i].base;
+      pbuf_cat(buf->p, p);
+    }
+  }
+
+  if( err == ERR_OK ) {
+    ip_addr_t tmp_addr;
+    ip_addr_t *tx_addr = applemidi_if_get_tx_addr(applemidi_if, ip_addr, addr_cache, &tmp_addr);
+    err = (tx_addr != NULL) ? netconn_sendto(conn, buf, tx_addr, port) : ERR_VAL;
+  }
+
+  if( buf != NULL ) {
+    netbuf_delete(buf);
+  }
+
+  if( err != ERR_OK ) {
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, port, tx_len);
+    if( debug_level >= 1 ) {
+      char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+      printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - err %d\n",
+        applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+        port,
+        err);
+    }
+
+    return -2; // no packet sent
+  }
+
+  APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, port, tx_len);
+  APPLEMIDI_PCAP_CAPTURE_IOV(1, ip_addr, port, applemidi_if->port + is_dataport, iov, iovcnt, 0);
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends an UTP datagram
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagram(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  applemidi_iovec_t iov = { tx_data, tx_len };
+  return applemidi_if_netconn_send(applemidi_if, ip_addr, port, &iov, 1, is_dataport, NULL);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends multiple UDP datagrams in a tight loop, destination addresses are taken from the address cache
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagrams(applemidi_if_t *applemidi_if, applemidi_udp_datagram_t *datagrams, size_t num_datagrams)
+{
+  int32_t sent;
+
+  for(sent=0; sent<num_datagrams; ++sent) {
+    applemidi_udp_datagram_t *datagram = &datagrams[sent];
+    applemidi_iovec_t iov = { datagram->tx_data, datagram->tx_len };
+    if( applemidi_if_netconn_send(applemidi_if, datagram->ip_addr, datagram->port, &iov, 1, datagram->is_dataport, datagram->addr_cache) < 0 ) {
+      break;
+    }
+  }
+
+  return sent;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends an UDP datagram which is scattered over multiple fragments
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagram_iov(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache)
+{
+  if( iovcnt < 1 || iovcnt > APPLEMIDI_MAX_IOV ) {
+    return -3; // invalid number of fragments
+  }
+
+  return applemidi_if_netconn_send(applemidi_if, ip_addr, port, iov, iovcnt, is_dataport, addr_cache);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Forwards all datagrams which have been received by a connection to the driver.
+// The datagram is parsed directly from the pbuf, it's only copied if lwIP delivers a pbuf chain
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t applemidi_if_receive(applemidi_if_t *applemidi_if, int socket_ix, int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us))
+{
+  struct netconn *conn = applemidi_if->conn[socket_ix];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( conn == NULL ) {
+    return 0; // connection not open
+  }
+
+  struct netbuf *buf;
+  err_t err;
+  while( (err = netconn_recv(conn, &buf)) == ERR_OK ) {
+    ip_addr_t *rx_addr = netbuf_fromaddr(buf);
+    uint16_t rx_port = netbuf_fromport(buf);
+    size_t rx_len = netbuf_len(buf);
+    uint8_t *rx_data = (uint8_t *)buf->p->payload;
+    uint8_t *rx_copy = NULL;
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+    uint64_t rx_timestamp_us = applemidi_if_pop_rx_timestamp(conn, rx_len);
+#else
+    uint64_t rx_timestamp_us = applemidi_get_timestamp_us();
+#endif
+
+    if( buf->p->next != NULL ) {
+      // chained pbuf: the driver expects a contiguous datagram
+      rx_copy = (rx_len <= APPLEMIDI_IF_MAX_PACKET_SIZE) ? applemidi_alloc(rx_len) : NULL;
+      if( rx_copy != NULL ) {
+        netbuf_copy(buf, rx_copy, rx_len);
+      }
+      rx_data = rx_copy;
+    }
+
+    if( rx_data == NULL ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_RX_ERROR, 0xff, rx_port, rx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "dropped datagram of %d bytes\n", rx_len);
+      }
+    } else {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_RX, 0xff, rx_port, rx_len);
+
+      // the driver stores IPv6 sized addresses, IPv4 peers are IPv4-mapped
+      uint8_t peer_ip_addr[16];
+#if LWIP_IPV6
+      if( IP_IS_V6(rx_addr) ) {
+        memcpy(peer_ip_addr, ip_2_ip6(rx_addr)->addr, 16);
+# if LWIP_IPV6_SCOPES
+        if( APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(peer_ip_addr) ) {
+          applemidi_if->ipv6_scope_id = ip6_addr_zone(ip_2_ip6(rx_addr));
+        }
+# endif
+      } else
+#endif
+      {
+        uint32_t rx_addr_u32 = ip4_addr_get_u32(ip_2_ip4(rx_addr));
+        applemidi_ip_addr_set_ipv4(peer_ip_addr, (uint8_t *)&rx_addr_u32);
+      }
+
+      if( debug_level >= 2 ) {
+        char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+        printf(APPLEMIDI_IF_LOG_TAG "%s connection received %d bytes from %s:%d\n",
+          socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+          rx_len,
+          applemidi_ip_addr_to_str(peer_ip_addr, ip_str, sizeof(ip_str)),
+          rx_port);
+      }
+      if( debug_level >= 3 ) {
+        esp_log_buffer_hex(APPLEMIDI_IF_LOG_TAG, rx_data, rx_len);
+      }
+
+      uint8_t is_dataport = socket_ix == APPLEMIDI_IF_SOCKET_DATA;
+      APPLEMIDI_PCAP_CAPTURE(0, peer_ip_addr, rx_port, applemidi_if->port + is_dataport, rx_data, rx_len, rx_timestamp_us);
+      parse_udp_datagram(applemidi_if->applemidi, peer_ip_addr, rx_port, rx_data, rx_len, is_dataport, rx_timestamp_us);
+    }
+
+    if( rx_copy != NULL ) {
+      applemidi_free(rx_copy);
+    }
+    netbuf_delete(buf);
+  }
+
+  if( err != ERR_WOULDBLOCK ) {
+    if( debug_level >= 1 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "netconn_recv of %s connection failed: err %d\n",
+        socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+        err);
+    }
+    return -1; // receive error
+  }
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+  applemidi_if_sync_rx_timestamps(conn);
+#endif
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams, should be called from a task each mS
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick(applemidi_if_t *applemidi_if, void *_parse_udp_datagram)
+{
+  return applemidi_if_tick_multi(&applemidi_if, 1, _parse_udp_datagram);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams of multiple endpoints
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick_multi(applemidi_if_t **applemidi_if, size_t num_endpoints, void *_parse_udp_datagram)
+{
+  int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us) = _parse_udp_datagram;
+  int endpoint, i;
+
+  if( num_endpoints > APPLEMIDI_IF_MAX_ENDPOINTS )
+    return -1; // too many endpoints
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+  if( !sys_sem_valid(&applemidi_if_rx_sem) ) {
+    return 0; // no connection open
+  }
+
+  if( sys_arch_sem_wait(&applemidi_if_rx_sem, APPLEMIDI_IF_TICK_TIMEOUT_MS) == SYS_ARCH_TIMEOUT ) {
+    return 0; // timeout
+  }
+#endif
+
+  for(endpoint=0; endpoint<num_endpoints; ++endpoint) {
+    for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+      if( applemidi_if_receive(applemidi_if[endpoint], i, parse_udp_datagram) < 0 ) {
+        break; // continue with next endpoint
+      }
+    }
+  }
+
+  return 0; // no error
+}
+
+#endif /* APPLEMIDI_IF_USE_NETCONN */
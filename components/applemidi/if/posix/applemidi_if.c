@@ -0,0 +1,598 @@
+/*
+ * Interface Layer for Apple MIDI Driver
+ * POSIX Variant (Linux/MacOS hosts)
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE // for sendmmsg()
+#endif
+
+#include "if/posix/applemidi_if.h"
+#include "applemidi_trace.h"
+#include "applemidi_pcap.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Prints a datagram in hex format (replacement for esp_log_buffer_hex)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_if_print_hex(uint8_t *data, size_t len)
+{
+  int i;
+  for(i=0; i<len; ++i) {
+    if( (i % 16) == 0 ) {
+      printf("%s" APPLEMIDI_IF_LOG_TAG, i ? "\n" : "");
+    }
+    printf("%02x ", data[i]);
+  }
+  printf("\n");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Initializes the UDP sockets
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_init(applemidi_if_t *applemidi_if, applemidi_t *applemidi, uint16_t port)
+{
+  applemidi_if->applemidi = applemidi;
+  applemidi_if->port = port;
+
+  applemidi_if->socket_ipv6 = 0;
+  applemidi_if->ipv6_scope_id = 0;
+
+  int i;
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    applemidi_if->socket_handle[i] = -1;
+  }
+
+#if APPLEMIDI_IF_ENABLE_IPV6
+  {
+    // probe for IPv6 support, hosts without IPv6 stack return EAFNOSUPPORT and we continue with IPv4 sockets
+    int handle = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if( handle >= 0 ) {
+      applemidi_if->socket_ipv6 = 1;
+      close(handle);
+    }
+  }
+#endif
+
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    uint16_t rx_port = port + i;
+    struct sockaddr_in socket_addr;
+    memset(&socket_addr, 0, sizeof(socket_addr));
+    socket_addr.sin_family = AF_INET;
+    socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socket_addr.sin_port = htons(rx_port);
+
+    struct sockaddr_in6 socket_addr6;
+    memset(&socket_addr6, 0, sizeof(socket_addr6));
+    socket_addr6.sin6_family = AF_INET6;
+    socket_addr6.sin6_addr = in6addr_any;
+    socket_addr6.sin6_port = htons(rx_port);
+
+    int handle = socket(applemidi_if->socket_ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if( handle < 0 ) {
+      if( applemidi_get_debug_level(applemidi) >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Unable to create socket #%d: errno %d\n", i, errno);
+      }
+      return -1;
+    } else {
+      fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+
+#if APPLEMIDI_IF_RX_TIMESTAMPS
+      {
+        int enable = 1;
+# ifdef SO_TIMESTAMPNS
+        setsockopt(handle, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+# else
+        setsockopt(handle, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable));
+# endif
+      }
+#endif
+
+      if( applemidi_if->socket_ipv6 ) {
+        // accept IPv4 peers as well, they are delivered with IPv4-mapped addresses
+        int v6only = 0;
+        setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+      }
+
+      struct sockaddr *bind_addr = applemidi_if->socket_ipv6 ? (struct sockaddr *)&socket_addr6 : (struct sockaddr *)&socket_addr;
+      socklen_t bind_addr_len = applemidi_if->socket_ipv6 ? sizeof(socket_addr6) : sizeof(socket_addr);
+      if( bind(handle, bind_addr, bind_addr_len) < 0 ) {
+        close(handle);
+        if( applemidi_get_debug_level(applemidi) >= 1 ) {
+          printf(APPLEMIDI_IF_LOG_TAG "Unable to bind socket #%d: errno %d\n", i, errno);
+        }
+        return -2;
+      }
+
+      applemidi_if->socket_handle[i] = handle;
+    }
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// De-Initializes the UDP sockets
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_deinit(applemidi_if_t *applemidi_if)
+{
+  int i;
+  for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+    int handle = applemidi_if->socket_handle[i];
+    if( handle >= 0 ) {
+      shutdown(handle, SHUT_RDWR);
+      close(handle);
+      applemidi_if->socket_handle[i] = -1;
+    }
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the destination address of a datagram, prebuilt in the address cache if available
+// IPv4-mapped addresses are sent as plain IPv4 addresses if the sockets don't support IPv6,
+// returns NULL if an IPv6 peer can't be reached over the sockets
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static struct sockaddr *applemidi_if_get_tx_socket_addr(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_addr_cache_t *addr_cache, struct sockaddr_in6 *tmp_socket_addr, socklen_t *socklen)
+{
+  struct sockaddr *tx_socket_addr = (addr_cache != NULL) ? (struct sockaddr *)addr_cache->storage : (struct sockaddr *)tmp_socket_addr;
+
+  if( addr_cache == NULL || !addr_cache->valid ) {
+    if( applemidi_if->socket_ipv6 ) {
+      struct sockaddr_in6 *tx_socket_addr6 = (struct sockaddr_in6 *)tx_socket_addr;
+      memset(tx_socket_addr6, 0, sizeof(struct sockaddr_in6));
+      tx_socket_addr6->sin6_family = AF_INET6;
+      memcpy(&tx_socket_addr6->sin6_addr, ip_addr, 16);
+      tx_socket_addr6->sin6_port = htons(port);
+      if( APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(ip_addr) ) {
+        tx_socket_addr6->sin6_scope_id = applemidi_if->ipv6_scope_id;
+      }
+    } else if( applemidi_ip_addr_get_family(ip_addr) == APPLEMIDI_ADDR_FAMILY_IPV4 ) {
+      struct sockaddr_in *tx_socket_addr4 = (struct sockaddr_in *)tx_socket_addr;
+      memset(tx_socket_addr4, 0, sizeof(struct sockaddr_in));
+      tx_socket_addr4->sin_family = AF_INET;
+      memcpy(&tx_socket_addr4->sin_addr.s_addr, &ip_addr[12], 4);
+      tx_socket_addr4->sin_port = htons(port);
+    } else {
+      return NULL; // IPv6 peer, but no IPv6 socket
+    }
+
+    if( addr_cache != NULL ) {
+      addr_cache->valid = 1;
+    }
+  }
+
+  *socklen = (tx_socket_addr->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  return tx_socket_addr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends an UTP datagram
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagram(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  int handle = applemidi_if->socket_handle[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( handle < 0 ) {
+    return -1; // socket not open
+  } else {
+    struct sockaddr_in6 tmp_socket_addr;
+    socklen_t socklen;
+    struct sockaddr *tx_socket_addr = applemidi_if_get_tx_socket_addr(applemidi_if, ip_addr, port, NULL, &tmp_socket_addr, &socklen);
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+
+    if( debug_level >= 2 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %s:%d\n",
+        (int)tx_len,
+        applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+        port);
+    }
+    if( debug_level >= 3 ) {
+      applemidi_if_print_hex(tx_data, tx_len);
+    }
+
+    ssize_t err = (tx_socket_addr == NULL) ? -1 : sendto(handle, tx_data, tx_len, 0, tx_socket_addr, socklen);
+    if( err < 0 ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, port, tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+          port,
+          (tx_socket_addr == NULL) ? EAFNOSUPPORT : errno);
+      }
+
+      return -2; // no packet sent
+    }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, port, tx_len);
+    APPLEMIDI_PCAP_CAPTURE(1, ip_addr, port, applemidi_if->port + is_dataport, tx_data, tx_len, 0);
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends multiple UDP datagrams, consecutive datagrams for the same socket are passed to a single sendmmsg() call
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagrams(applemidi_if_t *applemidi_if, applemidi_udp_datagram_t *datagrams, size_t num_datagrams)
+{
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+  struct sockaddr_in6 tmp_socket_addr[APPLEMIDI_IF_MAX_BATCH_SIZE];
+  struct sockaddr *tx_socket_addr[APPLEMIDI_IF_MAX_BATCH_SIZE];
+  socklen_t socklen[APPLEMIDI_IF_MAX_BATCH_SIZE];
+  char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+  int32_t sent = 0;
+
+  while( sent < num_datagrams ) {
+    // collect the next run of datagrams for the same socket
+    uint8_t is_dataport = datagrams[sent].is_dataport;
+    size_t num = 0;
+    while( (sent + num) < num_datagrams && num < APPLEMIDI_IF_MAX_BATCH_SIZE && datagrams[sent + num].is_dataport == is_dataport ) {
+      ++num;
+    }
+
+    int handle = applemidi_if->socket_handle[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+    if( handle < 0 ) {
+      return sent; // socket not open
+    }
+
+    // the run ends at a datagram which can't be addressed over this socket, it will be reported as failed
+    int i;
+    for(i=0; i<num; ++i) {
+      applemidi_udp_datagram_t *datagram = &datagrams[sent + i];
+      tx_socket_addr[i] = applemidi_if_get_tx_socket_addr(applemidi_if, datagram->ip_addr, datagram->port, datagram->addr_cache, &tmp_socket_addr[i], &socklen[i]);
+      if( tx_socket_addr[i] == NULL ) {
+        break;
+      }
+    }
+    size_t num_addressed = i;
+
+    for(i=0; i<num_addressed; ++i) {
+      applemidi_udp_datagram_t *datagram = &datagrams[sent + i];
+      if( debug_level >= 2 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes to %s:%d (batch)\n",
+          (int)datagram->tx_len,
+          applemidi_ip_addr_to_str(datagram->ip_addr, ip_str, sizeof(ip_str)),
+          datagram->port);
+      }
+      if( debug_level >= 3 ) {
+        applemidi_if_print_hex(datagram->tx_data, datagram->tx_len);
+      }
+    }
+
+#ifdef __linux__
+    struct mmsghdr msg[APPLEMIDI_IF_MAX_BATCH_SIZE];
+    struct iovec iov[APPLEMIDI_IF_MAX_BATCH_SIZE];
+    memset(msg, 0, num_addressed * sizeof(struct mmsghdr));
+    for(i=0; i<num_addressed; ++i) {
+      applemidi_udp_datagram_t *datagram = &datagrams[sent + i];
+      iov[i].iov_base = datagram->tx_data;
+      iov[i].iov_len = datagram->tx_len;
+      msg[i].msg_hdr.msg_name = tx_socket_addr[i];
+      msg[i].msg_hdr.msg_namelen = socklen[i];
+      msg[i].msg_hdr.msg_iov = &iov[i];
+      msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int num_sent = (num_addressed > 0) ? sendmmsg(handle, msg, num_addressed, 0) : -1;
+#else
+    int num_sent;
+    for(num_sent=0; num_sent<num_addressed; ++num_sent) {
+      applemidi_udp_datagram_t *datagram = &datagrams[sent + num_sent];
+      if( sendto(handle, datagram->tx_data, datagram->tx_len, 0, tx_socket_addr[num_sent], socklen[num_sent]) < 0 ) {
+        break;
+      }
+    }
+    if( num_sent == 0 ) {
+      num_sent = -1;
+    }
+#endif
+
+    for(i=0; i<num_sent; ++i) {
+      applemidi_udp_datagram_t *datagram = &datagrams[sent + i];
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, datagram->port, datagram->tx_len);
+      APPLEMIDI_PCAP_CAPTURE(1, datagram->ip_addr, datagram->port, applemidi_if->port + datagram->is_dataport, datagram->tx_data, datagram->tx_len, 0);
+    }
+
+    if( num_sent < (int)num ) {
+      int failed_ix = sent + ((num_sent < 0) ? 0 : num_sent);
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, datagrams[failed_ix].port, datagrams[failed_ix].tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(datagrams[failed_ix].ip_addr, ip_str, sizeof(ip_str)),
+          datagrams[failed_ix].port,
+          (failed_ix == (sent + num_addressed)) ? EAFNOSUPPORT : errno);
+      }
+      return failed_ix; // number of sent datagrams
+    }
+
+    sent += num;
+  }
+
+  return sent;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sends an UDP datagram which is scattered over multiple fragments with a single sendmsg() call
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_send_udp_datagram_iov(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache)
+{
+  int handle = applemidi_if->socket_handle[is_dataport ? APPLEMIDI_IF_SOCKET_DATA : APPLEMIDI_IF_SOCKET_CONTROL];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( handle < 0 ) {
+    return -1; // socket not open
+  } else if( iovcnt > APPLEMIDI_MAX_IOV ) {
+    return -3; // too many fragments
+  } else {
+    struct sockaddr_in6 tmp_socket_addr;
+    struct iovec msg_iov[APPLEMIDI_MAX_IOV];
+    struct msghdr msg;
+    socklen_t socklen;
+    size_t tx_len = 0;
+    char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+    int i;
+
+    for(i=0; i<iovcnt; ++i) {
+      msg_iov[i].iov_base = iov[i].base;
+      msg_iov[i].iov_len = iov[i].len;
+      tx_len += iov[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = applemidi_if_get_tx_socket_addr(applemidi_if, ip_addr, port, addr_cache, &tmp_socket_addr, &socklen);
+    msg.msg_namelen = socklen;
+    msg.msg_iov = msg_iov;
+    msg.msg_iovlen = iovcnt;
+
+    if( debug_level >= 2 ) {
+      printf(APPLEMIDI_IF_LOG_TAG "sending %d bytes in %d fragments to %s:%d\n",
+        (int)tx_len,
+        (int)iovcnt,
+        applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+        port);
+    }
+    if( debug_level >= 3 ) {
+      for(i=0; i<iovcnt; ++i) {
+        applemidi_if_print_hex(iov[i].base, iov[i].len);
+      }
+    }
+
+    ssize_t err = (msg.msg_name == NULL) ? -1 : sendmsg(handle, &msg, 0);
+    if( err < 0 ) {
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX_ERROR, 0xff, port, tx_len);
+      if( debug_level >= 1 ) {
+        printf(APPLEMIDI_IF_LOG_TAG "Failed to send datagram to %s:%d - errno %d\n",
+          applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+          port,
+          (msg.msg_name == NULL) ? EAFNOSUPPORT : errno);
+      }
+
+      return -2; // no packet sent
+    }
+
+    APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_TX, 0xff, port, tx_len);
+    APPLEMIDI_PCAP_CAPTURE_IOV(1, ip_addr, port, applemidi_if->port + is_dataport, iov, iovcnt, 0);
+  }
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns the arrival time of a received datagram on the time base of the driver, 0 if not available
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t applemidi_if_get_rx_timestamp_us(struct msghdr *msg)
+{
+#if APPLEMIDI_IF_RX_TIMESTAMPS
+  uint64_t kernel_us = 0;
+  struct cmsghdr *cmsg;
+
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+# ifdef SO_TIMESTAMPNS
+    if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS ) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      kernel_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+# else
+    if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP ) {
+      struct timeval tv;
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      kernel_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+# endif
+  }
+
+  if( kernel_us != 0 ) {
+    // kernel timestamps are based on the wall clock, convert the age of the datagram to the time base of the driver
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    uint64_t age_us = (now_us > kernel_us) ? (now_us - kernel_us) : 0;
+    if( age_us < 1000000 ) { // otherwise the wall clock has been stepped in between
+      return applemidi_get_timestamp_us() - age_us;
+    }
+  }
+#endif
+
+  return 0; // now
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reads a socket until it is empty, so that bursts are handled within a single tick
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void applemidi_if_receive(applemidi_if_t *applemidi_if, int socket_ix, int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us), uint8_t *rx_data)
+{
+  int handle = applemidi_if->socket_handle[socket_ix];
+  uint8_t debug_level = applemidi_get_debug_level(applemidi_if->applemidi);
+
+  if( handle < 0 ) {
+    return;
+  }
+
+  while( 1 ) {
+    struct sockaddr_storage rx_socket_addr;
+    struct iovec rx_iov = { rx_data, APPLEMIDI_IF_MAX_PACKET_SIZE };
+    uint64_t rx_control[8]; // ancillary data (timestamp), aligned for struct cmsghdr
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &rx_socket_addr;
+    msg.msg_namelen = sizeof(rx_socket_addr);
+    msg.msg_iov = &rx_iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = rx_control;
+    msg.msg_controllen = sizeof(rx_control);
+    ssize_t rx_len = recvmsg(handle, &msg, 0);
+
+    if( rx_len < 0 ) {
+      if( errno != EWOULDBLOCK && errno != EAGAIN ) {
+        if( debug_level >= 1 ) {
+          printf(APPLEMIDI_IF_LOG_TAG "recvmsg of %s socket failed: errno %d\n",
+            socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+            errno);
+        }
+      }
+      break;
+    } else { // Data received
+      // the driver stores IPv6 sized addresses, IPv4 peers are IPv4-mapped
+      uint8_t ip_addr[16];
+      uint16_t port;
+      if( rx_socket_addr.ss_family == AF_INET6 ) {
+        struct sockaddr_in6 *rx_socket_addr6 = (struct sockaddr_in6 *)&rx_socket_addr;
+        memcpy(ip_addr, &rx_socket_addr6->sin6_addr, 16); // dual-stack sockets deliver IPv4 peers already mapped
+        port = ntohs(rx_socket_addr6->sin6_port);
+        if( APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(ip_addr) ) {
+          applemidi_if->ipv6_scope_id = rx_socket_addr6->sin6_scope_id;
+        }
+      } else {
+        struct sockaddr_in *rx_socket_addr4 = (struct sockaddr_in *)&rx_socket_addr;
+        applemidi_ip_addr_set_ipv4(ip_addr, (uint8_t *)&rx_socket_addr4->sin_addr.s_addr);
+        port = ntohs(rx_socket_addr4->sin_port);
+      }
+
+      APPLEMIDI_TRACE(APPLEMIDI_TRACE_EVENT_IF_RX, 0xff, port, rx_len);
+
+      if( debug_level >= 2 ) {
+        char ip_str[APPLEMIDI_IP_ADDR_STR_LEN];
+        printf(APPLEMIDI_IF_LOG_TAG "%s socket received %d bytes from %s:%d\n",
+          socket_ix == APPLEMIDI_IF_SOCKET_CONTROL ? "Control" : "Data",
+          (int)rx_len,
+          applemidi_ip_addr_to_str(ip_addr, ip_str, sizeof(ip_str)),
+          port);
+      }
+      if( debug_level >= 3 ) {
+        applemidi_if_print_hex(rx_data, rx_len);
+      }
+
+      uint8_t is_dataport = socket_ix == APPLEMIDI_IF_SOCKET_DATA;
+      uint64_t rx_timestamp_us = applemidi_if_get_rx_timestamp_us(&msg);
+      APPLEMIDI_PCAP_CAPTURE(0, ip_addr, port, applemidi_if->port + is_dataport, rx_data, rx_len, rx_timestamp_us);
+      parse_udp_datagram(applemidi_if->applemidi, ip_addr, port, rx_data, rx_len, is_dataport, rx_timestamp_us);
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick(applemidi_if_t *applemidi_if, void *_parse_udp_datagram)
+{
+  return applemidi_if_tick_multi(&applemidi_if, 1, _parse_udp_datagram);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handles incoming UDP datagrams of multiple endpoints with a single wait
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int32_t applemidi_if_tick_multi(applemidi_if_t **applemidi_if, size_t num_endpoints, void *_parse_udp_datagram)
+{
+  int32_t (*parse_udp_datagram)(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us) = _parse_udp_datagram;
+  uint8_t rx_data[APPLEMIDI_IF_MAX_PACKET_SIZE];
+  int endpoint, i;
+
+  if( num_endpoints > APPLEMIDI_IF_MAX_ENDPOINTS )
+    return -1; // too many endpoints
+
+#if APPLEMIDI_IF_TICK_TIMEOUT_MS > 0
+  {
+    struct pollfd fds[APPLEMIDI_IF_MAX_ENDPOINTS * APPLEMIDI_IF_NUM_SOCKETS];
+    size_t num_fds = 0;
+    for(endpoint=0; endpoint<num_endpoints; ++endpoint) {
+      for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+        fds[num_fds].fd = applemidi_if[endpoint]->socket_handle[i]; // negative handles are ignored by poll()
+        fds[num_fds].events = POLLIN;
+        fds[num_fds].revents = 0;
+        ++num_fds;
+      }
+    }
+
+    if( poll(fds, num_fds, APPLEMIDI_IF_TICK_TIMEOUT_MS) <= 0 ) {
+      return 0; // timeout (or interrupted)
+    }
+
+    for(i=0; i<num_fds; ++i) {
+      if( fds[i].revents & POLLIN ) {
+        applemidi_if_receive(applemidi_if[i / APPLEMIDI_IF_NUM_SOCKETS], i % APPLEMIDI_IF_NUM_SOCKETS, parse_udp_datagram, rx_data);
+      }
+    }
+  }
+#else
+  for(endpoint=0; endpoint<num_endpoints; ++endpoint) {
+    for(i=0; i<APPLEMIDI_IF_NUM_SOCKETS; ++i) {
+      applemidi_if_receive(applemidi_if[endpoint], i, parse_udp_datagram, rx_data);
+    }
+  }
+#endif
+
+  return 0; // no error
+}
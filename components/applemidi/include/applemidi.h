@@ -45,6 +45,8 @@ extern "C" {
 #define APPLEMIDI_DEFAULT_DEBUG_LEVEL 1
 #endif
 
+// number of peer slots which are embedded into applemidi_t for applemidi_init() (including myself)
+// 0: no embedded slots, they have to be passed with applemidi_init_with_peers() (e.g. by applemidi.hpp)
 #ifndef APPLEMIDI_MAX_PEERS
 #define APPLEMIDI_MAX_PEERS 5 // including myself
 #endif
@@ -70,8 +72,33 @@ extern "C" {
 //#define APPLEMIDI_BITRATE_RECEIVE_LIMIT 1000
 #endif
 
+// size of the output buffer of each peer, limits the max. path MTU (max. RTP packet size w/o UDP/IP header)
 #ifndef APPLEMIDI_OUTBUFFER_SIZE
-#define APPLEMIDI_OUTBUFFER_SIZE 512
+#define APPLEMIDI_OUTBUFFER_SIZE 1472 /* based on Ethernet MTU of 1500, see also APPLEMIDI_IF_MAX_PACKET_SIZE */
+#endif
+
+// path MTU of new sessions, can be changed with applemidi_set_mtu()
+#ifndef APPLEMIDI_DEFAULT_MTU
+#define APPLEMIDI_DEFAULT_MTU APPLEMIDI_OUTBUFFER_SIZE
+#endif
+
+#define APPLEMIDI_MIN_MTU 64
+
+// buffer size for applemidi_ip_addr_to_str() (like INET6_ADDRSTRLEN)
+#define APPLEMIDI_IP_ADDR_STR_LEN 46
+
+// max. number of fragments which are passed to callback_send_udp_datagram_iov
+#define APPLEMIDI_MAX_IOV 4
+
+// max. number of datagrams which are passed to callback_send_udp_datagrams at once
+#ifndef APPLEMIDI_FLUSH_BATCH_SIZE
+#define APPLEMIDI_FLUSH_BATCH_SIZE 8
+#endif
+
+// max. number of MIDI events which are passed to callback_midi_events_received at once
+// (the batch is located on the stack of the receiving task)
+#ifndef APPLEMIDI_MAX_EVENTS
+#define APPLEMIDI_MAX_EVENTS 16
 #endif
 
 #ifndef APPLEMIDI_OUTBUFFER_FLUSH_MS
@@ -87,25 +114,211 @@ extern "C" {
 #define APPLEMIDI_MASTER_REGULAR_SYNC_MS 20*1000
 #endif
 
+// if master: invitations are retransmitted with exponential backoff (RETRY_MS, 2*RETRY_MS, ... up to RETRY_MAX_MS)
+#ifndef APPLEMIDI_MASTER_INVITE_RETRY_MS
+#define APPLEMIDI_MASTER_INVITE_RETRY_MS 250
+#endif
+
+#ifndef APPLEMIDI_MASTER_INVITE_RETRY_MAX_MS
+#define APPLEMIDI_MASTER_INVITE_RETRY_MAX_MS 4000
+#endif
+
+// if master: give up after the given number of invitations (the delay until a reconnect uses the same backoff)
+#ifndef APPLEMIDI_MASTER_INVITE_MAX_ATTEMPTS
+#define APPLEMIDI_MASTER_INVITE_MAX_ATTEMPTS 8
+#endif
+
+// rate of the RTP timestamps in MIDI packets (Hz), can be changed with applemidi_set_rtp_clock_rate()
+// AppleMIDI uses 10 kHz, 44100 or 48000 lets the timestamps line up with the sample clock of audio applications.
+// Note that CK synchronization timestamps are always in 100 uS units as specified by AppleMIDI.
+#ifndef APPLEMIDI_RTP_CLOCK_RATE
+#define APPLEMIDI_RTP_CLOCK_RATE 10000
+#endif
+
+// liveness detection: a peer which doesn't send any data or CK packet within the probe time
+// will get a synchronization request, if it's still silent after the timeout the slot will be released
+// APPLEMIDI_PEER_TIMEOUT_MS=0 disables liveness detection
+#ifndef APPLEMIDI_PEER_PROBE_MS
+#define APPLEMIDI_PEER_PROBE_MS 30*1000
+#endif
+
+#ifndef APPLEMIDI_PEER_TIMEOUT_MS
+#define APPLEMIDI_PEER_TIMEOUT_MS 60*1000
+#endif
+
+// fixed-memory histograms per peer for latency diagnosis (see applemidi_peer_get_histograms)
+#ifndef APPLEMIDI_ENABLE_HISTOGRAMS
+#define APPLEMIDI_ENABLE_HISTOGRAMS 1
+#endif
+
+#ifndef APPLEMIDI_HISTOGRAM_BUCKETS
+#define APPLEMIDI_HISTOGRAM_BUCKETS 20
+#endif
+
+// routing matrix which forwards received messages to other sessions (see applemidi_set_route)
+#ifndef APPLEMIDI_ENABLE_ROUTING
+#define APPLEMIDI_ENABLE_ROUTING 1
+#endif
+
+// a forwarded SysEx stream which hasn't been terminated blocks other sources of the destination session
+// as long as the next segment arrives within this time, afterwards the destination is released
+#ifndef APPLEMIDI_ROUTE_SYSEX_TIMEOUT_MS
+#define APPLEMIDI_ROUTE_SYSEX_TIMEOUT_MS 1000
+#endif
+
+//! destinations of the routing matrix: bit 0 delivers to the application, bit n forwards to applemidi_port n (1..31)
+#define APPLEMIDI_ROUTE_LOCAL                (1UL << 0)
+#define APPLEMIDI_ROUTE_PORT(applemidi_port) (1UL << (applemidi_port))
+
+//! sources of the routing matrix: MIDI channel 0..15, SysEx/System Common/Realtime messages, or all of them
+#define APPLEMIDI_ROUTE_SYSTEM   16
+#define APPLEMIDI_ROUTE_CHANNELS 17
+#define APPLEMIDI_ROUTE_ALL      0xff
+
+//! initializer of the decoder table with the number of expected data bytes, indexed by the status byte
+//! Data bytes (0x00..0x7f) never select an entry. SysEx (F0) is handled separately (endless until F7),
+//! Realtime Messages don't take data bytes. Shared with applemidi.hpp, so that both can't drift apart.
+#define APPLEMIDI_X16(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+#define APPLEMIDI_MIDI_EXPECTED_BYTES_INIT { \
+  APPLEMIDI_X16(0), APPLEMIDI_X16(0), APPLEMIDI_X16(0), APPLEMIDI_X16(0), /* 0x00..0x3f: data bytes */ \
+  APPLEMIDI_X16(0), APPLEMIDI_X16(0), APPLEMIDI_X16(0), APPLEMIDI_X16(0), /* 0x40..0x7f: data bytes */ \
+  APPLEMIDI_X16(2), /* 0x8n: Note Off */ \
+  APPLEMIDI_X16(2), /* 0x9n: Note On */ \
+  APPLEMIDI_X16(2), /* 0xan: Poly Pressure */ \
+  APPLEMIDI_X16(2), /* 0xbn: Controller */ \
+  APPLEMIDI_X16(1), /* 0xcn: Program Change */ \
+  APPLEMIDI_X16(1), /* 0xdn: Channel Pressure */ \
+  APPLEMIDI_X16(2), /* 0xen: Pitch Bender */ \
+  1, /* 0xf0: SysEx Begin (endless until SysEx End F7) */ \
+  1, /* 0xf1: MTC Data frame */ \
+  2, /* 0xf2: Song Position */ \
+  1, /* 0xf3: Song Select */ \
+  0, /* 0xf4: Reserved */ \
+  0, /* 0xf5: Reserved */ \
+  0, /* 0xf6: Request Tuning Calibration */ \
+  0, /* 0xf7: SysEx End */ \
+  0, /* 0xf8: MIDI Clock */ \
+  0, /* 0xf9: MIDI Tick */ \
+  0, /* 0xfa: MIDI Start */ \
+  0, /* 0xfb: MIDI Continue */ \
+  0, /* 0xfc: MIDI Stop */ \
+  0, /* 0xfd: Reserved */ \
+  0, /* 0xfe: Active Sense */ \
+  0, /* 0xff: Reset */ \
+}
+
 
 typedef enum {
   APPLEMIDI_CONNECTION_STATE_SLAVE = 0,
   APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_CTRL,
   APPLEMIDI_CONNECTION_STATE_MASTER_CONNECT_DATA,
   APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED,
+  APPLEMIDI_CONNECTION_STATE_MASTER_RECONNECT_WAIT,
 } applemidi_connection_state_t;
 
+typedef enum {
+  APPLEMIDI_HISTOGRAM_CK_RTT = 0,           // round trip time of CK synchronization in uS
+  APPLEMIDI_HISTOGRAM_JITTER,               // inter-arrival jitter of incoming RTP packets in uS
+  APPLEMIDI_HISTOGRAM_EVENTS_PER_PACKET,    // MIDI events per outgoing packet
+  APPLEMIDI_HISTOGRAM_BYTES_PER_PACKET,     // bytes per outgoing packet
+  APPLEMIDI_HISTOGRAM_OUTBUFFER_RESIDENCY,  // time between first event in output buffer and flush in uS
+  APPLEMIDI_NUM_HISTOGRAMS
+} applemidi_histogram_e;
+
+//! log2 based histogram:
+//! bucket 0 counts the value 0, bucket n counts values 2^(n-1)..2^n-1, the last bucket counts all bigger values
+typedef struct {
+  uint32_t bucket[APPLEMIDI_HISTOGRAM_BUCKETS];
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+} applemidi_histogram_t;
+
+//! address family of a peer
+typedef enum {
+  APPLEMIDI_ADDR_FAMILY_IPV4 = 0,
+  APPLEMIDI_ADDR_FAMILY_IPV6,
+} applemidi_addr_family_t;
+
+//! link-local IPv6 addresses (fe80::/10) have to be sent over the interface (zone) on which the peer was received
+#define APPLEMIDI_IP_ADDR_IS_LINK_LOCAL(ip_addr) ((ip_addr)[0] == 0xfe && ((ip_addr)[1] & 0xc0) == 0x80)
+
+//! prebuilt destination address of a peer, the content is owned by the interface layer
+typedef struct {
+  uint8_t  valid; // cleared by the driver whenever the IP address or data port of the peer changes
+  uint32_t storage[8]; // large enough for a sockaddr_in6
+} applemidi_addr_cache_t;
+
+//! a datagram which is sent with callback_send_udp_datagrams
+typedef struct {
+  uint8_t *ip_addr;
+  uint16_t port;
+  uint8_t  is_dataport;
+  uint8_t *tx_data;
+  size_t   tx_len;
+  applemidi_addr_cache_t *addr_cache; // can be NULL
+} applemidi_udp_datagram_t;
+
+//! a fragment of a datagram which is sent with callback_send_udp_datagram_iov (layout independent from struct iovec)
+typedef struct {
+  uint8_t *base;
+  size_t   len;
+} applemidi_iovec_t;
+
+//! a received MIDI message which is passed to callback_midi_events_received
+typedef struct {
+  uint32_t timestamp; // RTP timestamp incl. delta time of the message
+  uint32_t sysex_pos; // SysEx: position of the chunk in the SysEx stream (like continued_sysex_pos)
+  uint8_t *sysex; // SysEx: chunk w/o F0/F7, points into the received datagram (only valid during the callback); NULL for other messages
+  uint16_t sysex_len; // SysEx: number of bytes in the chunk
+  uint8_t  applemidi_port;
+  uint8_t  midi_status; // 0xf0: SysEx chunk, 0xf7: end of SysEx
+  uint8_t  data1; // 0 if not used by the message
+  uint8_t  data2; // 0 if not used by the message
+} applemidi_event_t;
+
+//! drops a status byte in applemidi_filter_config_t::drop: a Channel Voice message of a channel (e.g. 0xb3: CC on channel #4),
+//! or a System message (e.g. 0xfe: Active Sense, 0xf8: MIDI Clock, 0xf0: SysEx)
+#define APPLEMIDI_FILTER_DROP(config, status) ((config)->drop[((status) >> 4) - 8] |= (1 << ((status) & 0x0f)))
+
+//! configuration of a MIDI filter, all-zero passes all messages unchanged; it's compiled with applemidi_filter_compile()
+typedef struct {
+  uint16_t drop[8]; // [0..6]: Channel Voice messages 0x8n..0xen, bit n: channel n; [7]: System messages 0xf0+n, see APPLEMIDI_FILTER_DROP
+  uint8_t  channel_map[16]; // 0: channel unchanged, 1..16: Channel Voice messages of channel n are sent as this channel
+  int8_t   transpose; // added to the note number of Note Off/On and Poly Pressure, notes out of range are dropped
+  const uint8_t *velocity_curve; // 128 entries which replace the velocity of Note On messages, NULL: unchanged
+  uint8_t  velocity_min; // Note On velocities are clamped to velocity_min..velocity_max (0: 1..127)
+  uint8_t  velocity_max;
+} applemidi_filter_config_t;
+
+//! a compiled MIDI filter, it can be shared between sessions and instances
+typedef struct {
+  uint8_t status_map[128]; // indexed by status byte - 0x80: new status byte, 0: message dropped
+  uint8_t note_map[128]; // transposed note number, 0xff: out of range
+  uint8_t velocity_map[128]; // Note On velocity (0 stays Note Off)
+  uint8_t transform; // APPLEMIDI_FILTER_TRANSFORM_* flags, 0: only status_map is used
+} applemidi_filter_t;
+
+#define APPLEMIDI_FILTER_TRANSFORM_NOTE     0x01
+#define APPLEMIDI_FILTER_TRANSFORM_VELOCITY 0x02
+
 //! contains information about the peers
 //! Peer 0 is always myself, peer 1..APPLEMIDI_MAX_NAME_LEN-1 are remote connections
 typedef struct {
   applemidi_connection_state_t connection_state;
   uint32_t  connection_sync_done_timestamp;
   uint8_t   connection_sync_ctr;
+  uint32_t  connection_retry_timestamp; // if master: deadline for the next invitation
+  uint8_t   connection_attempts;
+  uint8_t   connection_is_master; // session has been started with applemidi_start_session
+  uint8_t   connection_auto_reconnect; // if master: re-invite the peer whenever the session drops
 
   uint32_t ssrc;
   uint32_t token;
   char name[APPLEMIDI_MAX_NAME_LEN];
-  uint8_t  ip_addr[16]; // for IPv4 and IPv6
+  uint8_t  ip_addr[16]; // IPv6 address, IPv4 addresses are stored as IPv4-mapped IPv6 address (::ffff:a.b.c.d)
+  uint8_t  addr_family; // applemidi_addr_family_t, derived from ip_addr
   uint16_t control_port; // if 0: no connection, if >0: peer is active
   uint16_t data_port; // if 0: no connection, if >0: peer is active
   uint8_t  applemidi_port; // internal port number
@@ -116,49 +329,275 @@ typedef struct {
   uint32_t outbuffer_timestamp_last_flush;
   uint32_t outbuffer[APPLEMIDI_OUTBUFFER_SIZE/4];
   uint16_t outbuffer_len;
+  uint16_t mtu; // max. size of outgoing RTP packets (peer 0: default for new sessions)
+  applemidi_addr_cache_t data_addr_cache; // destination of the output buffer
 
   // statistics
   uint32_t packets_sent;
   uint32_t packets_received;
   uint32_t packets_loss;
+
+  // liveness detection
+  uint32_t timestamp_session_start; // when the slot has been allocated
+  uint32_t timestamp_last_activity; // last data or CK packet received from peer
+  uint8_t  probe_sent;
+  uint32_t sessions_evicted; // number of sessions which have been terminated due to a timeout (peer 0: overall)
+  uint32_t last_session_hold_time_ms; // how long the slot was held by the last released session (peer 0: last release on any slot)
+
+#if APPLEMIDI_ENABLE_ROUTING
+  uint32_t route[APPLEMIDI_ROUTE_CHANNELS]; // destinations of the messages received from this peer, indexed by MIDI channel/APPLEMIDI_ROUTE_SYSTEM
+  uint8_t  outbuffer_running_status; // status of the last forwarded message in the output buffer (0: none), the next one can omit it
+  uint8_t  route_sysex_owner; // port which forwards an unfinished SysEx stream to this peer (0: none)
+  uint32_t route_sysex_timestamp; // when the last segment of this stream has been forwarded
+  uint32_t route_forwarded; // messages which have been forwarded to this peer
+  uint32_t route_dropped; // messages which have been dropped, since they would interrupt a forwarded SysEx stream
+#endif
+
+  // MIDI filters (see applemidi_set_filter), NULL: messages pass unchanged
+  const applemidi_filter_t *filter_in; // messages received from this peer
+  const applemidi_filter_t *filter_out; // messages sent or forwarded to this peer
+  uint32_t filter_dropped; // messages which have been dropped by the filters
+
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+  uint32_t outbuffer_timestamp_first_push;
+  uint16_t outbuffer_events;
+  uint8_t  rx_transit_valid;
+  uint32_t rx_transit; // arrival time - RTP timestamp of the last received packet
+  uint32_t rx_jitter_us; // smoothed inter-arrival jitter as defined in RFC 3550
+  applemidi_histogram_t histogram[APPLEMIDI_NUM_HISTOGRAMS];
+#endif
 } applemidi_peer_t;
 
+//! an instance of the driver, contains the complete state
+typedef struct {
+  //! Peer 0 is always myself, peer 1..num_peers-1 are remote connections
+  applemidi_peer_t *peer; // peer_storage, or the slots passed to applemidi_init_with_peers()
+  uint8_t num_peers;
+
+  uint8_t debug_level;
+  uint32_t rtp_clock_rate; // Hz, see applemidi_set_rtp_clock_rate()
+
+  // callbacks
+  void (*callback_midi_message_received)(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos);
+  void *callback_midi_message_received_ctx;
+  void (*callback_midi_events_received)(void *ctx, applemidi_event_t *events, size_t num_events); // optional, replaces callback_midi_message_received
+  void *callback_midi_events_received_ctx;
+  int32_t (*callback_send_udp_datagram)(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport);
+  void *callback_send_udp_datagram_ctx;
+  int32_t (*callback_send_udp_datagrams)(void *ctx, applemidi_udp_datagram_t *datagrams, size_t num_datagrams); // optional, gets callback_send_udp_datagram_ctx
+  int32_t (*callback_send_udp_datagram_iov)(void *ctx, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache); // optional, gets callback_send_udp_datagram_ctx
+
+#if APPLEMIDI_MAX_PEERS > 0
+  applemidi_peer_t peer_storage[APPLEMIDI_MAX_PEERS]; // used by applemidi_init()
+#endif
+} applemidi_t;
+
 
 /**
- * @brief Initializes the Apple MIDI Driver
+ * @brief Initializes an instance of the Apple MIDI Driver
+ *        Multiple instances can be operated independently, e.g. one per task or core.
+ *        Note that a single instance is not thread-safe: all functions which get the same instance have to be called from the same task.
  *
+ * @param  applemidi    the instance which should be initialized
  * @param  callback_midi_message_received References the callback function which is called whenever a new MIDI message has been received.
  *         API see applemidi_receive_packet_callback_for_debugging
  *         Specify NULL if no callback required in your application.
+ * @param  callback_midi_message_received_ctx user context, will be passed to callback_midi_message_received
  * @param  callback_send_packet References the callback function which is called whenever a UDP datagram should be sent.
  *         API see applemidi_send_udp_datagram_for_debugging
  *         Specify NULL if no callback required in your application (very unlikely... ;-)
+ * @param  callback_send_udp_datagram_ctx user context, will be passed to callback_send_udp_datagram (e.g. the interface instance)
+ */
+extern int32_t applemidi_init(applemidi_t *applemidi, void *callback_midi_message_received, void *callback_midi_message_received_ctx, void *callback_send_udp_datagram, void *callback_send_udp_datagram_ctx);
+
+/**
+ * @brief Initializes an instance like applemidi_init(), but the peer slots are provided by the caller,
+ *        so that instances with different capacities can be operated in the same application.
+ *        The slots have to stay valid as long as the instance is used.
+ *
+ * @param  peers        array of peer slots, peers[0] is myself
+ * @param  num_peers    number of slots including myself (2..255)
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_init_with_peers(applemidi_t *applemidi, applemidi_peer_t *peers, uint8_t num_peers, void *callback_midi_message_received, void *callback_midi_message_received_ctx, void *callback_send_udp_datagram, void *callback_send_udp_datagram_ctx);
+
+/**
+ * @brief Installs an optional callback which sends multiple UDP datagrams at once.
+ *        If available, applemidi_tick() hands over the output buffers of all peers which are due to be flushed in a single call.
+ *        The callback gets the same context like callback_send_udp_datagram.
+ *        API see applemidi_callback_send_udp_datagrams_for_debugging
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_callback_send_udp_datagrams(applemidi_t *applemidi, void *callback_send_udp_datagrams);
+
+/**
+ * @brief Installs an optional callback which receives the MIDI messages of an RTP MIDI packet as array of decoded events.
+ *        Up to APPLEMIDI_MAX_EVENTS events are handed over in a single call, the message length is already resolved and
+ *        data bytes are available in data1/data2, so that the application doesn't need to parse the stream again.
+ *        If installed, callback_midi_message_received won't be called anymore. Pass NULL to disable the callback.
+ *        API see applemidi_midi_events_received_callback_for_debugging
+ *
+ * @param  callback_midi_events_received_ctx user context, will be passed to callback_midi_events_received
+ *
+ * @return < 0 on errors
  */
-extern int32_t applemidi_init(void *callback_midi_message_received, void *_callback_send_udp_datagram);
+extern int32_t applemidi_set_callback_midi_events_received(applemidi_t *applemidi, void *callback_midi_events_received, void *callback_midi_events_received_ctx);
+
+/**
+ * @brief Installs an optional callback which sends a UDP datagram which is scattered over multiple fragments.
+ *        If available, RTP packets which don't fit into the output buffer (big messages, SysEx chunks) are sent
+ *        with a separate header fragment straight from the caller's memory, otherwise they are copied into a
+ *        contiguous packet first.
+ *        The callback gets the same context like callback_send_udp_datagram.
+ *        API see applemidi_callback_send_udp_datagram_iov_for_debugging
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_callback_send_udp_datagram_iov(applemidi_t *applemidi, void *callback_send_udp_datagram_iov);
 
 /**
  * @brief Returns information about a peer
  *
  */
-extern applemidi_peer_t *applemidi_peer_get_info(uint8_t applemidi_port);
+extern applemidi_peer_t *applemidi_peer_get_info(applemidi_t *applemidi, uint8_t applemidi_port);
+
+#if APPLEMIDI_ENABLE_HISTOGRAMS
+/**
+ * @brief Copies the histograms of a peer (peer 0: aggregate over all peers)
+ *
+ * @param  applemidi_port the peer
+ * @param  snapshot       array of APPLEMIDI_NUM_HISTOGRAMS entries which will be filled
+ * @param  reset          if 1: histograms will be cleared after the copy (reset-on-read)
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_peer_get_histograms(applemidi_t *applemidi, uint8_t applemidi_port, applemidi_histogram_t *snapshot, uint8_t reset);
+
+/**
+ * @brief Returns the name of a histogram
+ *
+ */
+extern const char *applemidi_histogram_get_name(applemidi_histogram_e histogram);
+
+/**
+ * @brief Returns the value range of a histogram bucket
+ *
+ */
+extern void applemidi_histogram_get_bucket_range(uint8_t bucket, uint32_t *min, uint32_t *max);
+#endif
+
+/**
+ * @brief Returns the number of mS since the last data or CK packet of the peer has been received
+ *
+ * @return < 0 if the peer isn't connected
+ */
+extern int32_t applemidi_peer_get_idle_time_ms(applemidi_t *applemidi, uint8_t applemidi_port);
 
 /**
- * @brief Returns free applemidi_port (1..APPLEMIDI_MAX_PEERS-1), or < 0 if all ports allocated
+ * @brief Returns free applemidi_port (1..num_peers-1), or < 0 if all ports allocated
  *
  */
-extern int32_t applemidi_search_free_port(void);
+extern int32_t applemidi_search_free_port(applemidi_t *applemidi);
 
 /**
  * @brief Sets the verbosity level
  *
  */
-extern int32_t applemidi_set_debug_level(uint8_t verbosity);
+extern int32_t applemidi_set_debug_level(applemidi_t *applemidi, uint8_t verbosity);
 
 /**
  * @brief Returns the verbosity level
  *
  */
-extern int32_t applemidi_get_debug_level(void);
+extern int32_t applemidi_get_debug_level(applemidi_t *applemidi);
+
+/**
+ * @brief Sets the rate of the RTP timestamps of sent MIDI packets, and the rate which is expected for the timestamps
+ *        of received packets (used for the jitter statistics). Both sides of a session should use the same rate.
+ *
+ * @param  rtp_clock_rate in Hz, e.g. 10000 (default, like AppleMIDI), 44100 or 48000
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_rtp_clock_rate(applemidi_t *applemidi, uint32_t rtp_clock_rate);
+
+/**
+ * @brief Sets the session name which is announced by this instance (peer #0) in invitations
+ *        Each instance represents an independent local endpoint, so that multiple endpoints can be presented
+ *        under different names (e.g. "Keys", "Pads", "Clock")
+ *
+ * @param  applemidi the driver instance
+ * @param  name      will be truncated to APPLEMIDI_MAX_NAME_LEN-1 characters
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_name(applemidi_t *applemidi, const char *name);
+
+/**
+ * @brief Sets the path MTU of a session: outgoing messages are packed into RTP packets up to this size,
+ *        bigger SysEx streams are split accordingly.
+ *        Sessions which are initiated by a remote peer start with the MTU of peer #0, so that applemidi_port=0
+ *        changes the default for new sessions
+ *
+ * @param  applemidi_port the peer (0: default for new sessions)
+ * @param  mtu max. RTP packet size w/o UDP/IP header, will be clipped to APPLEMIDI_MIN_MTU..APPLEMIDI_OUTBUFFER_SIZE
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_mtu(applemidi_t *applemidi, uint8_t applemidi_port, uint16_t mtu);
+
+/**
+ * @brief Sets the destinations of the messages which are received from a session
+ *        Messages are forwarded from the receive buffer into the output buffers of the destination sessions without
+ *        an intermediate copy, they are sent together with the messages of applemidi_send_message().
+ *        Forwarded messages omit the status byte if it matches the previous forwarded message in the same packet.
+ *        A SysEx stream which is forwarded in segments owns the destination until it's terminated: messages of other
+ *        sources are dropped meanwhile (except for Realtime messages), the destination is released if the source stalls
+ *        (APPLEMIDI_ROUTE_SYSEX_TIMEOUT_MS) or continues with another message.
+ *        Routes belong to the port number and are kept when sessions come and go.
+ *        By default all messages are delivered to the application only (APPLEMIDI_ROUTE_LOCAL).
+ *
+ * @param  applemidi_port source port (1..num_peers-1)
+ * @param  channel      MIDI channel (0..15), APPLEMIDI_ROUTE_SYSTEM, or APPLEMIDI_ROUTE_ALL
+ * @param  dst_mask     APPLEMIDI_ROUTE_LOCAL and/or APPLEMIDI_ROUTE_PORT(n) of the destinations, 0 drops the messages.
+ *                      Only ports below 32 can be destinations, the source itself can be a destination (loopback)
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_route(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t channel, uint32_t dst_mask);
+
+/**
+ * @brief Returns the destinations of a MIDI channel (0..15) or APPLEMIDI_ROUTE_SYSTEM, 0 on invalid arguments
+ */
+extern uint32_t applemidi_get_route(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t channel);
+
+/**
+ * @brief Compiles a filter configuration into lookup tables: the status byte of each message is translated with a
+ *        single table access (dropped messages don't reach callbacks or output buffers), note and velocity tables are
+ *        only accessed if transpose or velocity settings are used.
+ *
+ * @param  filter       the compiled filter, referenced by applemidi_set_filter(), has to stay valid while it's installed
+ * @param  config       see applemidi_filter_config_t
+ *
+ * @return < 0 on invalid settings
+ */
+extern int32_t applemidi_filter_compile(applemidi_filter_t *filter, const applemidi_filter_config_t *config);
+
+/**
+ * @brief Installs the filters of a session, they belong to the port number and are kept when sessions come and go.
+ *        The input filter is applied before messages are delivered to the application or forwarded by the routing matrix,
+ *        the output filter to messages of applemidi_send_message() (one message per call) and forwarded messages.
+ *        The channel and notes of Channel Voice messages are changed in the filter, routes select the new channel.
+ *
+ * @param  applemidi_port the session (1..num_peers-1)
+ * @param  filter_in    filter for received messages, NULL: no filter
+ * @param  filter_out   filter for outgoing messages, NULL: no filter
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_set_filter(applemidi_t *applemidi, uint8_t applemidi_port, const applemidi_filter_t *filter_in, const applemidi_filter_t *filter_out);
 
 /**
  * @brief Sends a Apple MIDI packet
@@ -170,14 +609,24 @@ extern int32_t applemidi_get_debug_level(void);
  * @return < 0 on errors
  *
  */
-extern int32_t applemidi_send_message(uint8_t applemidi_port, uint8_t *stream, size_t len);
+extern int32_t applemidi_send_message(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t *stream, size_t len);
 
 /**
  * @brief This function should be called each mS to handle the output buffers and synchronization
  *
  * @return < 0 on errors
  */
-extern void applemidi_tick(void);
+extern void applemidi_tick(applemidi_t *applemidi);
+
+/**
+ * @brief Resumes all sessions after the network link was temporarily lost (e.g. Wi-Fi roaming)
+ *        Peers, SSRC and sequence numbers are kept, established sessions get an immediate CK synchronization,
+ *        pending invitations are retransmitted.
+ *        Call this function after the interface layer has been re-initialized, instead of applemidi_init()
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_resync(applemidi_t *applemidi);
 
 /**
  * @brief Flush Output Buffer (normally done by applemidi_tick each 5 mS)
@@ -187,13 +636,14 @@ extern void applemidi_tick(void);
  * @return < 0 on errors
  *
  */
-extern int32_t applemidi_outbuffer_flush(uint8_t applemidi_port);
+extern int32_t applemidi_outbuffer_flush(applemidi_t *applemidi, uint8_t applemidi_port);
 
 /**
  * @brief A dummy callback which demonstrates the usage.
  *        It will just print out incoming MIDI messages on the terminal.
  *        You might want to implement your own for doing something more useful!
 
+ * @param  ctx          the user context which has been passed to applemidi_init()
  * @param  applemidi_port currently always 0 expected (we might support multiple ports in future)
  * @param  timestamp    the timestamp
  * @param  midi_status  the MIDI status byte (first byte of a MIDI message)
@@ -203,41 +653,136 @@ extern int32_t applemidi_outbuffer_flush(uint8_t applemidi_port);
  *
  * @return < 0 on errors
  */
-extern void applemidi_receive_packet_callback_for_debugging(uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos);
+extern void applemidi_receive_packet_callback_for_debugging(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos);
+
+/**
+ * @brief A dummy callback which demonstrates the usage of applemidi_set_callback_midi_events_received().
+ *        It will just print out incoming MIDI events on the terminal.
+ *
+ * @param  ctx          the user context which has been passed to applemidi_set_callback_midi_events_received()
+ * @param  events       the decoded MIDI messages in the order of reception
+ * @param  num_events   number of events (max. APPLEMIDI_MAX_EVENTS)
+ */
+extern void applemidi_midi_events_received_callback_for_debugging(void *ctx, applemidi_event_t *events, size_t num_events);
 
 /**
  * @brief A dummy callback which demonstrates the usage.
  *        It will just print out the UDP datagram which should be sent on the terminal.
  *        To get Apple MIDI communication working, this callback has to be implemented in your application.
  *
- * @param  ip_addr pointer to the IP address (4 or 16 bytes, depending in IPv4 and IPv6)
+ * @param  ctx     the user context which has been passed to applemidi_init()
+ * @param  ip_addr pointer to the IP address (16 bytes, IPv4 is given as IPv4-mapped IPv6 address)
  * @param  port port number
  * @param  tx_data data which should be sent
  * @param  tx_len packet size
+ * @param  is_dataport 1 if the datagram has to be sent over the data socket, 0 for the control socket
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_callback_send_udp_datagram_for_debugging(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport);
+
+/**
+ * @brief Optional callback which sends multiple UDP datagrams at once, see applemidi_set_callback_send_udp_datagrams()
+ *
+ * @param  ctx     the user context which has been passed to applemidi_init() for callback_send_udp_datagram
+ * @param  datagrams datagrams which should be sent. If addr_cache is not NULL, the callback can store a prebuilt
+ *                   destination address in it and re-use it as long as addr_cache->valid is set
+ * @param  num_datagrams number of datagrams
+ *
+ * @return number of sent datagrams, < 0 on errors
+ */
+extern int32_t applemidi_callback_send_udp_datagrams_for_debugging(void *ctx, applemidi_udp_datagram_t *datagrams, size_t num_datagrams);
+
+/**
+ * @brief Optional callback which sends a scattered UDP datagram, see applemidi_set_callback_send_udp_datagram_iov()
+ *
+ * @param  ctx     the user context which has been passed to applemidi_init() for callback_send_udp_datagram
+ * @param  ip_addr pointer to the IP address
+ * @param  port port number
+ * @param  iov fragments of the datagram, they have to be sent in this order as a single datagram
+ * @param  iovcnt number of fragments (max. APPLEMIDI_MAX_IOV)
+ * @param  is_dataport 1 if the datagram has to be sent over the data socket, 0 for the control socket
+ * @param  addr_cache prebuilt destination address like for callback_send_udp_datagrams, can be NULL
  *
  * @return < 0 on errors
  */
-extern int32_t applemidi_callback_send_udp_datagram_for_debugging(uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len);
+extern int32_t applemidi_callback_send_udp_datagram_iov_for_debugging(void *ctx, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache);
 
 /**
  * @brief Parses an incoming UDP Datagram for RTP and Apple MIDI messages
  *
+ * @param  ip_addr sender address (16 bytes, IPv4 has to be given as IPv4-mapped IPv6 address, see applemidi_ip_addr_set_ipv4())
+ * @param  rx_timestamp_us arrival time of the datagram on the time base of applemidi_get_timestamp_us(), 0: now
+ *         Interface layers should capture it as early as possible (e.g. from the kernel), so that CK replies,
+ *         RTT and jitter measurements don't include the scheduling delay of the receiving task.
+ *
  * @return < 0 on errors
  */
-extern int32_t applemidi_parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport);
+extern int32_t applemidi_parse_udp_datagram(applemidi_t *applemidi, uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, size_t rx_len, uint8_t is_dataport, uint64_t rx_timestamp_us);
+
+/**
+ * @brief Returns the time base of the driver in uS, used by interface layers to timestamp incoming datagrams
+ *        It's a monotonic clock (esp_timer on ESP32, CLOCK_MONOTONIC on POSIX hosts) unless another source has been
+ *        installed with applemidi_set_clock_source()
+ */
+extern uint64_t applemidi_get_timestamp_us(void);
+
+/**
+ * @brief Installs the clock source of the driver, e.g. to derive all timestamps from an audio sample counter
+ *        The clock has to be monotonic, and it's shared by all driver instances, therefore it should be installed
+ *        before the first instance is initialized.
+ *
+ * @param  get_time_us returns the current time in uS, NULL selects the default clock
+ */
+extern void applemidi_set_clock_source(uint64_t (*get_time_us)(void));
+
+
+/**
+ * @brief Stores an IPv4 address as IPv4-mapped IPv6 address (::ffff:a.b.c.d), which is the format used by the driver
+ *        ip_addr and ipv4 can point to the same buffer.
+ *
+ * @param  ip_addr 16 bytes
+ * @param  ipv4    4 bytes in network order
+ */
+extern void applemidi_ip_addr_set_ipv4(uint8_t *ip_addr, uint8_t *ipv4);
+
+/**
+ * @brief Returns the address family of an address
+ *
+ * @return APPLEMIDI_ADDR_FAMILY_IPV4 for IPv4-mapped addresses, otherwise APPLEMIDI_ADDR_FAMILY_IPV6
+ */
+extern applemidi_addr_family_t applemidi_ip_addr_get_family(uint8_t *ip_addr);
 
+/**
+ * @brief Converts an address into a string, dotted decimal for IPv4, RFC 5952 notation for IPv6
+ *
+ * @param  str buffer with at least APPLEMIDI_IP_ADDR_STR_LEN bytes
+ *
+ * @return str
+ */
+extern char *applemidi_ip_addr_to_str(uint8_t *ip_addr, char *str, size_t len);
 
 /**
  * @brief Invites a peer for the given applemidi_port
  *
+ * @param  ip_addr peer address (16 bytes, IPv4 has to be given as IPv4-mapped IPv6 address)
+ */
+extern int32_t applemidi_start_session(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t *ip_addr, uint16_t control_port);
+
+/**
+ * @brief Enables/Disables automatic reconnection for the given applemidi_port
+ *        If enabled, the peer which has been invited with applemidi_start_session will be invited again
+ *        whenever the invitation fails or the session drops. applemidi_terminate_session disables it.
+ *        Sessions which have been invited by the remote side are never re-invited.
+ *
  */
-extern int32_t applemidi_start_session(uint8_t applemidi_port, uint8_t *ip_addr, uint16_t control_port);
+extern int32_t applemidi_set_auto_reconnect(applemidi_t *applemidi, uint8_t applemidi_port, uint8_t enable);
 
 /**
  * @brief Terminates a session for the given applemidi_port
  *
  */
-extern int32_t applemidi_terminate_session(uint8_t applemidi_port);
+extern int32_t applemidi_terminate_session(applemidi_t *applemidi, uint8_t applemidi_port);
 
 
 #ifdef __cplusplus
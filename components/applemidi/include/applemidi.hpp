@@ -0,0 +1,208 @@
+/*
+ * Apple MIDI Driver - C++17 Interface
+ *
+ * Header-only layer around the C driver:
+ *   - the number of peer slots is a template parameter, instances with different capacities can be
+ *     used in the same application (the slots are passed with applemidi_init_with_peers())
+ *   - handlers are passed as lambdas/function objects, they are called from a typed trampoline, so that
+ *     the compiler can inline them into the loop over the received event batch
+ *   - message lengths are available as constexpr table
+ *
+ * Usage:
+ *   static auto midi = applemidi::make_instance<5>(
+ *     [](const applemidi::Event &event) { ... },
+ *     [](uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, bool is_dataport) -> int32_t { ... });
+ *
+ * Compile the C driver with APPLEMIDI_MAX_PEERS=0 if all instances are created from C++, otherwise
+ * applemidi_t still contains the slots for applemidi_init().
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_HPP
+#define _APPLEMIDI_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "applemidi.h"
+
+
+namespace applemidi {
+
+using Event = applemidi_event_t;
+using Peer = applemidi_peer_t;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Message Lengths
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! lookup table, indexed by the status byte (the same initializer like the table of the decoder)
+//! SysEx (F0) returns 1, since the stream is endless until F7; data bytes (0x00..0x7f) return 0
+inline constexpr std::array<uint8_t, 256> expected_data_bytes_table = APPLEMIDI_MIDI_EXPECTED_BYTES_INIT;
+
+//! Number of data bytes of a MIDI message
+constexpr uint8_t expected_data_bytes(uint8_t status)
+{
+  return expected_data_bytes_table[status];
+}
+
+//! Complete length of a (non-SysEx) MIDI message incl. status byte
+constexpr std::size_t message_length(uint8_t status)
+{
+  return 1 + expected_data_bytes_table[status];
+}
+
+static_assert(message_length(0x90) == 3, "Note On");
+static_assert(message_length(0xc5) == 2, "Program Change");
+static_assert(message_length(0xf2) == 3, "Song Position");
+static_assert(message_length(0xf8) == 1, "MIDI Clock");
+static_assert(expected_data_bytes(0x40) == 0, "data byte");
+static_assert(expected_data_bytes(0xd3) == 1, "Channel Pressure");
+static_assert(expected_data_bytes(0xf1) == 1, "MTC Data frame");
+static_assert(expected_data_bytes(0xff) == 0, "Reset");
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Default Handlers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! ignores all received MIDI events
+struct IgnoreEvents {
+  void operator()(const Event &) const {}
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Driver Instance
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief An instance of the Apple MIDI Driver with NumPeers slots (including myself)
+ *
+ * @tparam EventHandler  called for each received MIDI message: void(const Event &)
+ * @tparam SendHandler   sends a UDP datagram: int32_t(uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, bool is_dataport)
+ *
+ * The instance can't be copied or moved, since the driver references it in the callback contexts.
+ * Like the C driver it's not thread-safe: all methods have to be called from the same task.
+ */
+template <uint8_t NumPeers, typename EventHandler, typename SendHandler>
+class Instance {
+  static_assert(NumPeers >= 2, "peer 0 is myself, at least one remote peer is required");
+
+public:
+  static constexpr uint8_t num_peers = NumPeers;
+
+  Instance(EventHandler event_handler, SendHandler send_handler)
+    : event_handler_(std::move(event_handler))
+    , send_handler_(std::move(send_handler))
+  {
+    applemidi_init_with_peers(&applemidi_, peers_.data(), NumPeers,
+                              nullptr, nullptr,
+                              reinterpret_cast<void *>(&Instance::send_udp_datagram_trampoline), this);
+    applemidi_set_callback_midi_events_received(&applemidi_, reinterpret_cast<void *>(&Instance::midi_events_received_trampoline), this);
+  }
+
+  Instance(const Instance &) = delete;
+  Instance &operator=(const Instance &) = delete;
+
+  //! the C instance, e.g. for applemidi_if_init()
+  applemidi_t *get() { return &applemidi_; }
+
+  Peer *peer(uint8_t applemidi_port) { return applemidi_peer_get_info(&applemidi_, applemidi_port); }
+
+  int32_t parse_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *rx_data, std::size_t rx_len, bool is_dataport, uint64_t rx_timestamp_us = 0)
+  {
+    return applemidi_parse_udp_datagram(&applemidi_, ip_addr, port, rx_data, rx_len, is_dataport ? 1 : 0, rx_timestamp_us);
+  }
+
+  int32_t send_message(uint8_t applemidi_port, uint8_t *stream, std::size_t len) { return applemidi_send_message(&applemidi_, applemidi_port, stream, len); }
+
+  //! sends a MIDI message w/o SysEx, the length is taken from the status byte
+  //! SysEx (F0/F7) and data bytes are rejected, use the stream variant for them
+  int32_t send_message(uint8_t applemidi_port, uint8_t status, uint8_t data1 = 0, uint8_t data2 = 0)
+  {
+    if( status < 0x80 || status == 0xf0 || status == 0xf7 )
+      return -1; // not a complete message
+    uint8_t stream[3] = { status, data1, data2 };
+    return applemidi_send_message(&applemidi_, applemidi_port, stream, message_length(status));
+  }
+
+  void tick() { applemidi_tick(&applemidi_); }
+
+  int32_t start_session(uint8_t applemidi_port, uint8_t *ip_addr, uint16_t control_port) { return applemidi_start_session(&applemidi_, applemidi_port, ip_addr, control_port); }
+  int32_t terminate_session(uint8_t applemidi_port) { return applemidi_terminate_session(&applemidi_, applemidi_port); }
+  int32_t set_auto_reconnect(uint8_t applemidi_port, bool enable) { return applemidi_set_auto_reconnect(&applemidi_, applemidi_port, enable ? 1 : 0); }
+  int32_t search_free_port() { return applemidi_search_free_port(&applemidi_); }
+
+  int32_t set_name(const char *name) { return applemidi_set_name(&applemidi_, name); }
+  int32_t set_mtu(uint8_t applemidi_port, uint16_t mtu) { return applemidi_set_mtu(&applemidi_, applemidi_port, mtu); }
+  int32_t set_debug_level(uint8_t verbosity) { return applemidi_set_debug_level(&applemidi_, verbosity); }
+  int32_t set_rtp_clock_rate(uint32_t rtp_clock_rate) { return applemidi_set_rtp_clock_rate(&applemidi_, rtp_clock_rate); }
+  int32_t set_route(uint8_t applemidi_port, uint8_t channel, uint32_t dst_mask) { return applemidi_set_route(&applemidi_, applemidi_port, channel, dst_mask); }
+  int32_t set_filter(uint8_t applemidi_port, const applemidi_filter_t *filter_in, const applemidi_filter_t *filter_out) { return applemidi_set_filter(&applemidi_, applemidi_port, filter_in, filter_out); }
+
+  EventHandler &event_handler() { return event_handler_; }
+  SendHandler &send_handler() { return send_handler_; }
+
+private:
+  static void midi_events_received_trampoline(void *ctx, applemidi_event_t *events, std::size_t num_events)
+  {
+    Instance *self = static_cast<Instance *>(ctx);
+    for(std::size_t i=0; i<num_events; ++i) {
+      self->event_handler_(static_cast<const Event &>(events[i]));
+    }
+  }
+
+  static int32_t send_udp_datagram_trampoline(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, std::size_t tx_len, uint8_t is_dataport)
+  {
+    Instance *self = static_cast<Instance *>(ctx);
+    return self->send_handler_(ip_addr, port, tx_data, tx_len, is_dataport != 0);
+  }
+
+  applemidi_t applemidi_;
+  std::array<Peer, NumPeers> peers_;
+  EventHandler event_handler_;
+  SendHandler send_handler_;
+};
+
+//! creates an instance, the handler types are deduced from the arguments
+template <uint8_t NumPeers, typename EventHandler, typename SendHandler>
+Instance<NumPeers, std::decay_t<EventHandler>, std::decay_t<SendHandler>> make_instance(EventHandler &&event_handler, SendHandler &&send_handler)
+{
+  return { std::forward<EventHandler>(event_handler), std::forward<SendHandler>(send_handler) };
+}
+
+} // namespace applemidi
+
+#endif /* _APPLEMIDI_HPP */
@@ -0,0 +1,159 @@
+/*
+ * Apple MIDI Driver - Packet Capture Ring (pcap)
+ *
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_PCAP_H
+#define _APPLEMIDI_PCAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "applemidi.h"
+#include "applemidi_seqlock.h"
+
+
+// capture points can be removed completely at compile time
+#ifndef APPLEMIDI_PCAP_ENABLED
+#define APPLEMIDI_PCAP_ENABLED 0
+#endif
+
+// number of captured datagrams, must be a power of 2
+#ifndef APPLEMIDI_PCAP_RING_SIZE
+#define APPLEMIDI_PCAP_RING_SIZE 64
+#endif
+
+// max. number of payload bytes which are stored per datagram, longer datagrams are truncated
+#ifndef APPLEMIDI_PCAP_SNAPLEN
+#define APPLEMIDI_PCAP_SNAPLEN 256
+#endif
+
+// pcap link type of the written files: raw IPv4/IPv6 packets, the IP and UDP headers are synthesized
+#define APPLEMIDI_PCAP_LINKTYPE_RAW 101
+
+
+//! a captured datagram
+typedef struct {
+  uint32_t ix;           // ring index + 1, written at last - allows the reader to detect incomplete or overwritten records
+  uint8_t  is_tx;        // 0: received, 1: sent
+  uint8_t  reserved;
+  uint16_t local_port;
+  uint16_t remote_port;
+  uint16_t len;          // number of stored payload bytes
+  uint16_t orig_len;     // length of the datagram
+  uint8_t  ip_addr[16];  // remote IP, IPv4 addresses are IPv4-mapped
+  uint64_t timestamp_us; // see applemidi_get_timestamp_us()
+  uint8_t  data[APPLEMIDI_PCAP_SNAPLEN];
+} applemidi_pcap_record_t;
+
+
+#if APPLEMIDI_PCAP_ENABLED
+
+/**
+ * @brief Stores a datagram in the capture ring. Lock-free, can be called from multiple tasks/cores.
+ *        Use the APPLEMIDI_PCAP_CAPTURE() macros instead, so that capture points will be removed if APPLEMIDI_PCAP_ENABLED=0
+ *
+ * @param  is_tx        0: received, 1: sent
+ * @param  ip_addr      remote IP (16 bytes)
+ * @param  remote_port  remote UDP port
+ * @param  local_port   local UDP port
+ * @param  iov          the datagram, can be scattered over multiple fragments
+ * @param  iovcnt       number of fragments
+ * @param  timestamp_us arrival/send time, 0: now
+ */
+extern void applemidi_pcap_capture(uint8_t is_tx, uint8_t *ip_addr, uint16_t remote_port, uint16_t local_port, applemidi_iovec_t *iov, size_t iovcnt, uint64_t timestamp_us);
+
+static inline void applemidi_pcap_capture_datagram(uint8_t is_tx, uint8_t *ip_addr, uint16_t remote_port, uint16_t local_port, uint8_t *data, size_t len, uint64_t timestamp_us)
+{
+  applemidi_iovec_t iov = { .base = data, .len = len };
+  applemidi_pcap_capture(is_tx, ip_addr, remote_port, local_port, &iov, 1, timestamp_us);
+}
+
+# define APPLEMIDI_PCAP_CAPTURE(is_tx, ip_addr, remote_port, local_port, data, len, timestamp_us) \
+  applemidi_pcap_capture_datagram(is_tx, ip_addr, remote_port, local_port, data, len, timestamp_us)
+# define APPLEMIDI_PCAP_CAPTURE_IOV(is_tx, ip_addr, remote_port, local_port, iov, iovcnt, timestamp_us) \
+  applemidi_pcap_capture(is_tx, ip_addr, remote_port, local_port, iov, iovcnt, timestamp_us)
+
+/**
+ * @brief Enables/Disables the capturing during runtime (enabled by default)
+ */
+extern void applemidi_pcap_set_enabled(uint8_t enabled);
+
+/**
+ * @brief Returns 1 if capturing is enabled
+ */
+extern uint8_t applemidi_pcap_get_enabled(void);
+
+/**
+ * @brief Writes the latest records in pcap format (oldest first), skips records which are currently written
+ *
+ * @param  write       called for each chunk of the file, returns < 0 on errors
+ * @param  ctx         passed to write
+ * @param  max_records writes the latest max_records records (0: the whole ring)
+ *
+ * @return number of written records, < 0 on errors
+ */
+extern int32_t applemidi_pcap_write(int32_t (*write)(void *ctx, const uint8_t *buf, size_t len), void *ctx, size_t max_records);
+
+/**
+ * @brief Stores the capture ring in a pcap file, e.g. on a mounted SPIFFS/FAT partition
+ *
+ * @return number of written records, < 0 on errors
+ */
+extern int32_t applemidi_pcap_save(const char *path, size_t max_records);
+
+/**
+ * @brief Streams the capture ring as hex dump on the terminal, framed by "applemidi_pcap begin" and
+ *        "applemidi_pcap end" lines. The console log can be converted with tools/applemidi_replay
+ *
+ * @return number of written records
+ */
+extern int32_t applemidi_pcap_dump(size_t max_records);
+
+/**
+ * @brief Clears the capture ring
+ */
+extern void applemidi_pcap_clear(void);
+
+#else
+# define APPLEMIDI_PCAP_CAPTURE(is_tx, ip_addr, remote_port, local_port, data, len, timestamp_us) do {} while(0)
+# define APPLEMIDI_PCAP_CAPTURE_IOV(is_tx, ip_addr, remote_port, local_port, iov, iovcnt, timestamp_us) do {} while(0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _APPLEMIDI_PCAP_H */
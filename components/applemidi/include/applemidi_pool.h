@@ -0,0 +1,117 @@
+/*
+ * Apple MIDI Driver - Memory Pools
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_POOL_H
+#define _APPLEMIDI_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+
+// 0: applemidi_alloc() is a thin wrapper around malloc() (allocations are still counted)
+// 1: all memory is taken from fixed block pools, the heap is never touched
+#ifndef APPLEMIDI_STATIC_ALLOCATION
+#define APPLEMIDI_STATIC_ALLOCATION 0
+#endif
+
+// small blocks are used for single MIDI events (max. 32 blocks per pool)
+#ifndef APPLEMIDI_POOL_SMALL_BLOCK_SIZE
+#define APPLEMIDI_POOL_SMALL_BLOCK_SIZE 64
+#endif
+
+#ifndef APPLEMIDI_POOL_SMALL_NUM_BLOCKS
+#define APPLEMIDI_POOL_SMALL_NUM_BLOCKS 16
+#endif
+
+// large blocks are used for complete packets and SysEx streams (max. 32 blocks per pool)
+#ifndef APPLEMIDI_POOL_LARGE_BLOCK_SIZE
+#define APPLEMIDI_POOL_LARGE_BLOCK_SIZE 1536
+#endif
+
+#ifndef APPLEMIDI_POOL_LARGE_NUM_BLOCKS
+#define APPLEMIDI_POOL_LARGE_NUM_BLOCKS 4
+#endif
+
+
+//! allocation statistics (counted in both allocation modes)
+typedef struct {
+  uint32_t allocs;     // successful allocations
+  uint32_t frees;
+  uint32_t failures;   // pool exhausted, or requested size too large
+  uint32_t in_use;
+  uint32_t max_in_use;
+} applemidi_alloc_stats_t;
+
+
+/**
+ * @brief Allocates memory for packets, SysEx streams and events.
+ *        Lock-free, can be called from multiple tasks/cores.
+ *
+ * @param  size number of bytes
+ *
+ * @return NULL if no memory is available
+ */
+extern void *applemidi_alloc(size_t size);
+
+/**
+ * @brief Releases memory which has been allocated with applemidi_alloc()
+ */
+extern void applemidi_free(void *ptr);
+
+/**
+ * @brief Copies the allocation statistics.
+ *        In the steady state allocs should be equal to frees, and failures should stay 0
+ */
+extern void applemidi_get_alloc_stats(applemidi_alloc_stats_t *stats);
+
+/**
+ * @brief Clears the allocs/frees/failures counters, max_in_use restarts from the current value
+ */
+extern void applemidi_reset_alloc_stats(void);
+
+/**
+ * @brief Installs a hook which is called on each allocation attempt (ptr is NULL on failure).
+ *        Use it to assert once the application reached the steady state, so that any allocation
+ *        on the hot path is detected during development. Pass NULL to remove the hook.
+ */
+extern void applemidi_set_alloc_hook(void (*hook)(size_t size, void *ptr));
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _APPLEMIDI_POOL_H */
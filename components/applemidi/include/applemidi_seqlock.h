@@ -0,0 +1,83 @@
+/*
+ * Apple MIDI Driver - Seqlock for lock-free Record Rings
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_SEQLOCK_H
+#define _APPLEMIDI_SEQLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+
+// The trace and capture rings are written by multiple tasks/cores without a lock.
+// Each record starts with an index field: 0 while the record is written, ring index + 1 once it's complete.
+// A reader copies the record and accepts the copy only if the index hasn't changed meanwhile.
+// The fences are required on weakly ordered CPUs, so that no field store is visible before the
+// invalidation, and that the copy can't be moved past the re-check.
+
+//! invalidates a record before its fields are written
+static inline void applemidi_seqlock_write_begin(uint32_t *record_ix)
+{
+  __atomic_store_n(record_ix, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+//! publishes a record after all fields have been written
+static inline void applemidi_seqlock_write_end(uint32_t *record_ix, uint32_t ix)
+{
+  __atomic_store_n(record_ix, ix + 1, __ATOMIC_RELEASE);
+}
+
+//! copies the record with the given ring index, returns 0 if it is currently written or has already been overwritten
+static inline uint8_t applemidi_seqlock_read(uint32_t *record_ix, uint32_t ix, void *copy, const void *record, size_t size)
+{
+  if( __atomic_load_n(record_ix, __ATOMIC_ACQUIRE) != (ix + 1) )
+    return 0; // record is currently written, or has already been overwritten
+
+  memcpy(copy, record, size);
+
+  // consistency check: record could have been overwritten while copying
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if( __atomic_load_n(record_ix, __ATOMIC_RELAXED) != (ix + 1) )
+    return 0;
+
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _APPLEMIDI_SEQLOCK_H */
@@ -0,0 +1,146 @@
+/*
+ * Apple MIDI Driver - Binary Trace Ring
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_TRACE_H
+#define _APPLEMIDI_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "applemidi_seqlock.h"
+
+
+// trace points can be removed completely at compile time
+#ifndef APPLEMIDI_TRACE_ENABLED
+#define APPLEMIDI_TRACE_ENABLED 1
+#endif
+
+// number of records, must be a power of 2
+#ifndef APPLEMIDI_TRACE_RING_SIZE
+#define APPLEMIDI_TRACE_RING_SIZE 256
+#endif
+
+
+typedef enum {
+  APPLEMIDI_TRACE_EVENT_NONE = 0,
+  APPLEMIDI_TRACE_EVENT_IF_RX,          // interface received datagram (seq_nr: remote port)
+  APPLEMIDI_TRACE_EVENT_IF_TX,          // interface sent datagram (seq_nr: remote port)
+  APPLEMIDI_TRACE_EVENT_IF_TX_ERROR,    // interface failed to send datagram (seq_nr: remote port)
+  APPLEMIDI_TRACE_EVENT_RX_CONTROL,     // session protocol command received (seq_nr: command)
+  APPLEMIDI_TRACE_EVENT_RX_RTP,         // RTP MIDI packet received (seq_nr: RTP sequence number)
+  APPLEMIDI_TRACE_EVENT_RX_LOSS,        // packet loss detected (seq_nr: expected sequence number)
+  APPLEMIDI_TRACE_EVENT_RX_UNKNOWN,     // packet from unregistered peer or unknown packet type
+  APPLEMIDI_TRACE_EVENT_DECODE_ERROR,   // RTP MIDI command section couldn't be decoded
+  APPLEMIDI_TRACE_EVENT_TX_RTP,         // RTP MIDI packet sent (seq_nr: RTP sequence number)
+  APPLEMIDI_TRACE_EVENT_TX_ERROR,       // driver failed to send a packet
+  APPLEMIDI_TRACE_EVENT_SESSION_START,  // peer slot allocated
+  APPLEMIDI_TRACE_EVENT_SESSION_END,    // peer slot released
+  APPLEMIDI_TRACE_EVENT_SESSION_REJECT, // invitation rejected (no free slot)
+  APPLEMIDI_TRACE_EVENT_IF_RX_ERROR,    // interface dropped a received datagram (seq_nr: remote port)
+  APPLEMIDI_TRACE_NUM_EVENTS
+} applemidi_trace_event_t;
+
+//! compact binary trace record
+typedef struct {
+  uint32_t ix;        // ring index + 1, written at last - allows the reader to detect incomplete or overwritten records
+  uint32_t timestamp; // uS
+  uint8_t  event;     // applemidi_trace_event_t
+  uint8_t  peer;      // applemidi_port, 0xff if unknown
+  uint16_t seq_nr;    // event specific, see applemidi_trace_event_t
+  uint16_t len;
+  uint16_t reserved;
+} applemidi_trace_record_t;
+
+
+#if APPLEMIDI_TRACE_ENABLED
+
+extern applemidi_trace_record_t applemidi_trace_ring[APPLEMIDI_TRACE_RING_SIZE];
+extern uint32_t applemidi_trace_wr_ix;
+extern uint32_t applemidi_trace_get_timestamp_us(void);
+
+/**
+ * @brief Adds a record to the trace ring. Lock-free, can be called from multiple tasks/cores.
+ *        Use the APPLEMIDI_TRACE() macro instead, so that trace points will be removed if APPLEMIDI_TRACE_ENABLED=0
+ */
+static inline void applemidi_trace_add(applemidi_trace_event_t event, uint8_t peer, uint16_t seq_nr, uint16_t len)
+{
+  uint32_t ix = __atomic_fetch_add(&applemidi_trace_wr_ix, 1, __ATOMIC_RELAXED);
+  applemidi_trace_record_t *record = &applemidi_trace_ring[ix & (APPLEMIDI_TRACE_RING_SIZE-1)];
+
+  applemidi_seqlock_write_begin(&record->ix);
+  record->timestamp = applemidi_trace_get_timestamp_us();
+  record->event = event;
+  record->peer = peer;
+  record->seq_nr = seq_nr;
+  record->len = len;
+  applemidi_seqlock_write_end(&record->ix, ix);
+}
+
+# define APPLEMIDI_TRACE(event, peer, seq_nr, len) applemidi_trace_add(event, peer, seq_nr, len)
+
+/**
+ * @brief Copies the latest records into the given buffer (oldest first), skips records which are currently written
+ *
+ * @return number of copied records
+ */
+extern size_t applemidi_trace_read(applemidi_trace_record_t *records, size_t max_records);
+
+/**
+ * @brief Prints decoded trace records on the terminal
+ *
+ * @param  max_records prints the latest max_records records (0: the whole ring)
+ */
+extern void applemidi_trace_dump(size_t max_records);
+
+/**
+ * @brief Clears the trace ring
+ */
+extern void applemidi_trace_clear(void);
+
+/**
+ * @brief Returns the name of a trace event
+ */
+extern const char *applemidi_trace_get_event_name(uint8_t event);
+
+#else
+# define APPLEMIDI_TRACE(event, peer, seq_nr, len) do {} while(0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _APPLEMIDI_TRACE_H */
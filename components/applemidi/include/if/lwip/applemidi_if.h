@@ -52,46 +52,143 @@ extern "C" {
 #define APPLEMIDI_IF_MAX_PACKET_SIZE 1472 /* based on Ethernet MTU of 1500 */
 #endif
 
+// max. time applemidi_if_tick() waits for incoming datagrams (0: don't wait, just poll the sockets)
+#ifndef APPLEMIDI_IF_TICK_TIMEOUT_MS
+#define APPLEMIDI_IF_TICK_TIMEOUT_MS 0
+#endif
+
 #ifndef APPLEMIDI_IF_ENABLE_CONSOLE
 #define APPLEMIDI_IF_ENABLE_CONSOLE 1
 #endif
 
+// 1: use the lwIP netconn API instead of BSD sockets (applemidi_if_netconn.c)
+// Datagrams are parsed directly from the received pbufs, no receive buffer is allocated on the stack of the calling task.
+#ifndef APPLEMIDI_IF_USE_NETCONN
+#define APPLEMIDI_IF_USE_NETCONN 0
+#endif
+
+// netconn only: number of arrival timestamps which are queued per connection, recorded by the tcpip thread when a
+// datagram is posted to the receive mailbox (requires APPLEMIDI_IF_TICK_TIMEOUT_MS > 0).
+// Has to be a power of two, and shouldn't be smaller than the UDP receive mailbox (CONFIG_LWIP_UDP_RECVMBOX_SIZE)
+#ifndef APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE
+#define APPLEMIDI_IF_RX_TIMESTAMP_QUEUE_SIZE 16
+#endif
+
+// max. number of local endpoints which can be served by applemidi_if_tick_multi()
+#ifndef APPLEMIDI_IF_MAX_ENDPOINTS
+#define APPLEMIDI_IF_MAX_ENDPOINTS 4
+#endif
+
+// max. number of datagrams which are passed to the network stack at once by applemidi_if_send_udp_datagrams()
+#ifndef APPLEMIDI_IF_MAX_BATCH_SIZE
+#define APPLEMIDI_IF_MAX_BATCH_SIZE 16
+#endif
+
+//! We need 2 sockets: 1 for control, 1 for data packets
+typedef enum {
+  APPLEMIDI_IF_SOCKET_CONTROL = 0,
+  APPLEMIDI_IF_SOCKET_DATA,
+  APPLEMIDI_IF_NUM_SOCKETS
+} applemidi_if_socket_e;
+
+#if APPLEMIDI_IF_USE_NETCONN
+struct netconn;
+#endif
+
+//! an instance of the interface layer, serves a single driver instance
+typedef struct {
+  applemidi_t *applemidi;
+  uint16_t port; // control port, the data port is port+1
+#if APPLEMIDI_IF_USE_NETCONN
+  struct netconn *conn[APPLEMIDI_IF_NUM_SOCKETS];
+#else
+  int socket_handle[APPLEMIDI_IF_NUM_SOCKETS];
+#endif
+  uint8_t socket_ipv6; // 1: dual-stack IPv6 sockets (only with LWIP_IPV6)
+  uint32_t ipv6_scope_id; // zone over which link-local IPv6 peers are reached (taken from the last received link-local datagram)
+} applemidi_if_t;
+
+#if APPLEMIDI_IF_USE_NETCONN
+#define APPLEMIDI_IF_SOCKET_IS_OPEN(applemidi_if, socket_ix) ((applemidi_if)->conn[socket_ix] != NULL)
+#else
+#define APPLEMIDI_IF_SOCKET_IS_OPEN(applemidi_if, socket_ix) ((applemidi_if)->socket_handle[socket_ix] >= 0)
+#endif
+
+
 /**
  * @brief Initializes the UDP sockets (we assume that the network interface is already configured by the application)
  *
+ * @param  applemidi_if the interface instance
+ * @param  applemidi    the driver instance which is served by this interface, incoming datagrams will be forwarded to it
+ * @param  port         the control port, the data port is port+1
+ *
  * @return < 0 on errors
  */
-extern int32_t applemidi_if_init(uint16_t port);
+extern int32_t applemidi_if_init(applemidi_if_t *applemidi_if, applemidi_t *applemidi, uint16_t port);
 
 /**
  * @brief De-Initializes the UDP sockets
  *
  * @return < 0 on errors
  */
-extern int32_t applemidi_if_deinit(void);
+extern int32_t applemidi_if_deinit(applemidi_if_t *applemidi_if);
 
 /**
- * @brief Sends a UDP Datagram
+ * @brief Sends a UDP Datagram over the control or data socket
+ *        Pass this function together with the interface instance as callback_send_udp_datagram(_ctx) to applemidi_init()
  *
  * @return < 0 on errors
  */
-extern int32_t applemidi_if_send_udp_datagram(uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len);
+extern int32_t applemidi_if_send_udp_datagram(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport);
+
+/**
+ * @brief Sends multiple UDP Datagrams with a tight sendto() loop, destination addresses are prebuilt in the address caches of the peers
+ *        Pass this function to applemidi_set_callback_send_udp_datagrams()
+ *
+ * @return number of sent datagrams, < 0 on errors
+ */
+extern int32_t applemidi_if_send_udp_datagrams(applemidi_if_t *applemidi_if, applemidi_udp_datagram_t *datagrams, size_t num_datagrams);
+
+/**
+ * @brief Sends a UDP Datagram which is scattered over multiple fragments with a single sendmsg() call
+ *        Pass this function to applemidi_set_callback_send_udp_datagram_iov()
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_send_udp_datagram_iov(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache);
 
 /**
  * @brief Handles incoming UDP datagrams, should be periodically called from a task
+ *        Waits up to APPLEMIDI_IF_TICK_TIMEOUT_MS for incoming datagrams
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_tick(applemidi_if_t *applemidi_if, void *_parse_udp_datagram);
+
+/**
+ * @brief Handles incoming UDP datagrams of multiple local endpoints (each with its own driver instance and port pair)
+ *        All sockets are multiplexed in a single wait of up to APPLEMIDI_IF_TICK_TIMEOUT_MS,
+ *        datagrams are forwarded to the driver instance of the endpoint which received them
+ *
+ * @param  applemidi_if  array of interface instances
+ * @param  num_endpoints number of interface instances (max. APPLEMIDI_IF_MAX_ENDPOINTS)
  *
  * @return < 0 on errors
  */
-extern int32_t applemidi_if_tick(void *_parse_udp_datagram);
+extern int32_t applemidi_if_tick_multi(applemidi_if_t **applemidi_if, size_t num_endpoints, void *_parse_udp_datagram);
 
 
 #if APPLEMIDI_IF_ENABLE_CONSOLE
 /**
  * @brief Register Console Commands
  *
+ * @param  applemidi_if  array of interface instances (and their driver instances) which should be controlled by the console,
+ *                       the commands select them with --endpoint (default: 0)
+ * @param  num_endpoints number of interface instances (max. APPLEMIDI_IF_MAX_ENDPOINTS)
+ *
  * @return < 0 on errors
  */
-extern void applemidi_if_register_console_commands(void);
+extern void applemidi_if_register_console_commands(applemidi_if_t **applemidi_if, size_t num_endpoints);
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,165 @@
+/*
+ * Interface Layer for Apple MIDI Driver
+ * POSIX Variant (Linux/MacOS hosts)
+ *
+ * See README.md for usage hints
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#ifndef _APPLEMIDI_IF_H
+#define _APPLEMIDI_IF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "applemidi.h"
+
+
+#ifndef APPLEMIDI_IF_LOG_TAG
+#define APPLEMIDI_IF_LOG_TAG "[APPLEMIDI_IF] "
+#endif
+
+#ifndef APPLEMIDI_IF_MAX_PACKET_SIZE
+#define APPLEMIDI_IF_MAX_PACKET_SIZE 1472 /* based on Ethernet MTU of 1500 */
+#endif
+
+// max. time applemidi_if_tick() waits for incoming datagrams (0: don't wait, just poll the sockets)
+#ifndef APPLEMIDI_IF_TICK_TIMEOUT_MS
+#define APPLEMIDI_IF_TICK_TIMEOUT_MS 0
+#endif
+
+
+// max. number of local endpoints which can be served by applemidi_if_tick_multi()
+#ifndef APPLEMIDI_IF_MAX_ENDPOINTS
+#define APPLEMIDI_IF_MAX_ENDPOINTS 4
+#endif
+
+// max. number of datagrams which are passed to the network stack at once by applemidi_if_send_udp_datagrams()
+#ifndef APPLEMIDI_IF_MAX_BATCH_SIZE
+#define APPLEMIDI_IF_MAX_BATCH_SIZE 16
+#endif
+
+// 1: take the arrival time of datagrams from the kernel (SO_TIMESTAMPNS, SO_TIMESTAMP on MacOS)
+#ifndef APPLEMIDI_IF_RX_TIMESTAMPS
+#define APPLEMIDI_IF_RX_TIMESTAMPS 1
+#endif
+
+// 1: dual-stack sockets which accept IPv4 and IPv6 peers (falls back to IPv4 if the host doesn't support IPv6)
+#ifndef APPLEMIDI_IF_ENABLE_IPV6
+#define APPLEMIDI_IF_ENABLE_IPV6 1
+#endif
+
+//! We need 2 sockets: 1 for control, 1 for data packets
+typedef enum {
+  APPLEMIDI_IF_SOCKET_CONTROL = 0,
+  APPLEMIDI_IF_SOCKET_DATA,
+  APPLEMIDI_IF_NUM_SOCKETS
+} applemidi_if_socket_e;
+
+//! an instance of the interface layer, serves a single driver instance
+typedef struct {
+  applemidi_t *applemidi;
+  uint16_t port; // control port, the data port is port+1
+  int socket_handle[APPLEMIDI_IF_NUM_SOCKETS];
+  uint8_t socket_ipv6; // 1: the sockets are dual-stack AF_INET6 sockets
+  uint32_t ipv6_scope_id; // interface over which link-local IPv6 peers are reached (taken from the last received link-local datagram)
+} applemidi_if_t;
+
+
+/**
+ * @brief Initializes the UDP sockets (we assume that the network interface is already configured by the application)
+ *
+ * @param  applemidi_if the interface instance
+ * @param  applemidi    the driver instance which is served by this interface, incoming datagrams will be forwarded to it
+ * @param  port         the control port, the data port is port+1
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_init(applemidi_if_t *applemidi_if, applemidi_t *applemidi, uint16_t port);
+
+/**
+ * @brief De-Initializes the UDP sockets
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_deinit(applemidi_if_t *applemidi_if);
+
+/**
+ * @brief Sends a UDP Datagram over the control or data socket
+ *        Pass this function together with the interface instance as callback_send_udp_datagram(_ctx) to applemidi_init()
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_send_udp_datagram(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport);
+
+/**
+ * @brief Sends multiple UDP Datagrams with sendmmsg() on Linux, destination addresses are prebuilt in the address caches of the peers
+ *        Pass this function to applemidi_set_callback_send_udp_datagrams()
+ *
+ * @return number of sent datagrams, < 0 on errors
+ */
+extern int32_t applemidi_if_send_udp_datagrams(applemidi_if_t *applemidi_if, applemidi_udp_datagram_t *datagrams, size_t num_datagrams);
+
+/**
+ * @brief Sends a UDP Datagram which is scattered over multiple fragments with a single sendmsg() call
+ *        Pass this function to applemidi_set_callback_send_udp_datagram_iov()
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_send_udp_datagram_iov(applemidi_if_t *applemidi_if, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache);
+
+/**
+ * @brief Handles incoming UDP datagrams, should be periodically called from a task
+ *        Waits up to APPLEMIDI_IF_TICK_TIMEOUT_MS for incoming datagrams
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_tick(applemidi_if_t *applemidi_if, void *_parse_udp_datagram);
+
+/**
+ * @brief Handles incoming UDP datagrams of multiple local endpoints (each with its own driver instance and port pair)
+ *        All sockets are multiplexed in a single wait of up to APPLEMIDI_IF_TICK_TIMEOUT_MS,
+ *        datagrams are forwarded to the driver instance of the endpoint which received them
+ *
+ * @param  applemidi_if  array of interface instances
+ * @param  num_endpoints number of interface instances (max. APPLEMIDI_IF_MAX_ENDPOINTS)
+ *
+ * @return < 0 on errors
+ */
+extern int32_t applemidi_if_tick_multi(applemidi_if_t **applemidi_if, size_t num_endpoints, void *_parse_udp_datagram);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _APPLEMIDI_IF_H */
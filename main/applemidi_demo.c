@@ -28,6 +28,7 @@
  * =============================================================================
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -45,38 +46,58 @@
 
 #define TAG "MIDIbox"
 
+// number of local endpoints, each one is announced as separate session with its own name on its own port pair
+#ifndef APPLEMIDI_DEMO_NUM_ENDPOINTS
+#define APPLEMIDI_DEMO_NUM_ENDPOINTS 1
+#endif
+
+// the BSD socket variant of applemidi_if_tick_multi() allocates the receive buffer on the stack of the UDP task,
+// the netconn variant parses the datagrams directly from the lwIP buffers
+#if APPLEMIDI_IF_USE_NETCONN
+#define UDP_TASK_STACK_SIZE (4096 - APPLEMIDI_IF_MAX_PACKET_SIZE)
+#else
+#define UDP_TASK_STACK_SIZE 4096
+#endif
+
+// the driver instances and their interface layers
+static applemidi_t applemidi[APPLEMIDI_DEMO_NUM_ENDPOINTS];
+static applemidi_if_t applemidi_if[APPLEMIDI_DEMO_NUM_ENDPOINTS];
+static applemidi_if_t *applemidi_if_ptr[APPLEMIDI_DEMO_NUM_ENDPOINTS];
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // This function is called from the Apple MIDI Driver whenever a new MIDI message has been received
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void applemidi_callback_midi_message_received(uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+void applemidi_callback_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
 {
-  if( applemidi_get_debug_level() >= 3 ) {
+  applemidi_t *applemidi = (applemidi_t *)ctx;
+
+  if( applemidi_get_debug_level(applemidi) >= 3 ) {
     // Note: with these messages enabled, we potentially get packet loss!
     ESP_LOGI(TAG, "receive_packet CALLBACK applemidi_port=%d, timestamp=%d, midi_status=0x%02x, len=%d, continued_sysex_pos=%d, remaining_message:", applemidi_port, timestamp, midi_status, len, continued_sysex_pos);
     esp_log_buffer_hex(TAG, remaining_message, len);
   }
 
+#if !APPLEMIDI_ENABLE_ROUTING
   // loopback received message
   {
-    // TODO: more comfortable packet creation via special APIs
-
     // Note: by intention we create new packets for each incoming message
     // this shows that running status is maintained, and that SysEx streams work as well
 
+    // the message can't be sent in two pieces (status + remaining bytes), since each
+    // applemidi_send_message() call starts a new command, therefore it's assembled in a buffer.
+    // A received SysEx chunk can't exceed the packet size. The buffer is static to keep it off
+    // the stack of the UDP task - this callback is only invoked from there.
+    static uint8_t loopback_packet[1 + APPLEMIDI_IF_MAX_PACKET_SIZE];
     size_t loopback_packet_len = 1 + len; // includes MIDI status and remaining bytes
-    uint8_t *loopback_packet = (uint8_t *)malloc(loopback_packet_len * sizeof(uint8_t));
-    if( loopback_packet == NULL ) {
-      // no memory...
-    } else {
+    if( loopback_packet_len <= sizeof(loopback_packet) ) {
       loopback_packet[0] = midi_status;
       memcpy(&loopback_packet[1], remaining_message, len);
 
-      applemidi_send_message(applemidi_port, loopback_packet, loopback_packet_len);
-
-      free(loopback_packet);
+      applemidi_send_message(applemidi, applemidi_port, loopback_packet, loopback_packet_len);
     }
   }
+#endif
 }
 
 
@@ -85,7 +106,7 @@ void applemidi_callback_midi_message_received(uint8_t applemidi_port, uint32_t t
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static void console_task(void *pvParameters)
 {
-  console_init();
+  console_init(applemidi_if_ptr, APPLEMIDI_DEMO_NUM_ENDPOINTS);
 
   while( 1 ) {
     console_tick();
@@ -98,21 +119,43 @@ static void console_task(void *pvParameters)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 static void udp_task(void *pvParameters)
 {
+  int i;
+
   wifi_init();
 
   while( 1 ) {
     if( !wifi_connected() ) {
       vTaskDelay(1 / portTICK_PERIOD_MS);
     } else {
-      applemidi_if_init(APPLEMIDI_DEFAULT_PORT);
-      applemidi_init(applemidi_callback_midi_message_received, applemidi_if_send_udp_datagram);
+      // (re-)bind the sockets, endpoint #i uses the port pair APPLEMIDI_DEFAULT_PORT+2*i and +1
+      int32_t status = 0;
+      for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS && status >= 0; ++i) {
+        status = applemidi_if_init(&applemidi_if[i], &applemidi[i], APPLEMIDI_DEFAULT_PORT + 2*i);
+      }
+
+      if( status < 0 ) {
+        for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS; ++i) {
+          applemidi_if_deinit(&applemidi_if[i]);
+        }
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+        continue; // retry
+      }
+
+      // resume the sessions which were established before the link loss
+      for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS; ++i) {
+        applemidi_resync(&applemidi[i]);
+      }
 
       while( wifi_connected() ) {
-        applemidi_if_tick(applemidi_parse_udp_datagram);
-        applemidi_tick();
+        applemidi_if_tick_multi(applemidi_if_ptr, APPLEMIDI_DEMO_NUM_ENDPOINTS, applemidi_parse_udp_datagram);
+        for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS; ++i) {
+          applemidi_tick(&applemidi[i]);
+        }
       }
 
-      applemidi_if_deinit();
+      for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS; ++i) {
+        applemidi_if_deinit(&applemidi_if[i]);
+      }
     }
   }
 
@@ -136,7 +179,42 @@ void app_main()
   // start with random seed
   srand(esp_random());
 
+  // initialized only once: sessions, SSRC and sequence numbers should survive a temporary loss of the Wi-Fi connection
+  int i;
+  for(i=0; i<APPLEMIDI_DEMO_NUM_ENDPOINTS; ++i) {
+    applemidi_init(&applemidi[i], applemidi_callback_midi_message_received, &applemidi[i], applemidi_if_send_udp_datagram, &applemidi_if[i]);
+    applemidi_set_callback_send_udp_datagrams(&applemidi[i], applemidi_if_send_udp_datagrams); // flush all peers in one go
+    applemidi_set_callback_send_udp_datagram_iov(&applemidi[i], applemidi_if_send_udp_datagram_iov); // big packets w/o intermediate copy
+
+#if APPLEMIDI_ENABLE_ROUTING
+    // loopback: each session gets its messages back, forwarded by the driver w/o copying them in the callback
+    {
+      uint8_t port;
+      for(port=1; port<APPLEMIDI_MAX_PEERS; ++port) {
+        applemidi_set_route(&applemidi[i], port, APPLEMIDI_ROUTE_ALL, APPLEMIDI_ROUTE_LOCAL | APPLEMIDI_ROUTE_PORT(port));
+      }
+    }
+#endif
+
+    if( i > 0 ) {
+      char name[APPLEMIDI_MAX_NAME_LEN];
+      snprintf(name, sizeof(name), "%s #%d", APPLEMIDI_MY_DEFAULT_NAME, i + 1);
+      applemidi_set_name(&applemidi[i], name);
+    }
+
+#if APPLEMIDI_IF_USE_NETCONN
+    applemidi_if[i].conn[APPLEMIDI_IF_SOCKET_CONTROL] = NULL; // connections will be opened once Wi-Fi is connected
+    applemidi_if[i].conn[APPLEMIDI_IF_SOCKET_DATA] = NULL;
+#else
+    applemidi_if[i].socket_handle[APPLEMIDI_IF_SOCKET_CONTROL] = -1; // sockets will be opened once Wi-Fi is connected
+    applemidi_if[i].socket_handle[APPLEMIDI_IF_SOCKET_DATA] = -1;
+#endif
+    applemidi_if[i].port = APPLEMIDI_DEFAULT_PORT + 2*i;
+    applemidi_if[i].applemidi = &applemidi[i];
+    applemidi_if_ptr[i] = &applemidi_if[i];
+  }
+
   // launch tasks
-  xTaskCreate(udp_task, "udp", 4096, NULL, 5, NULL);
+  xTaskCreate(udp_task, "udp", UDP_TASK_STACK_SIZE, NULL, 5, NULL);
   xTaskCreate(console_task, "console", 4096, NULL, 5, NULL);
 }
@@ -49,7 +49,7 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Initializes the Console
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int32_t console_init(void)
+int32_t console_init(void *applemidi_if, size_t num_endpoints)
 {
   /* Disable buffering on stdin */
   setvbuf(stdin, NULL, _IONBF, 0);
@@ -109,7 +109,7 @@ int32_t console_init(void)
   esp_console_register_help_command();
   wifi_register_console_commands();
 #if APPLEMIDI_IF_ENABLE_CONSOLE
-  applemidi_if_register_console_commands();
+  applemidi_if_register_console_commands((applemidi_if_t **)applemidi_if, num_endpoints);
 #endif
 
   /* Figure out if the terminal supports escape sequences */
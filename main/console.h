@@ -35,7 +35,7 @@
 extern "C" {
 #endif
 
-extern int32_t console_init(void);
+extern int32_t console_init(void *applemidi_if, size_t num_endpoints);
 extern int32_t console_tick(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,547 @@
+/*
+ * Host Microbenchmark for the Apple MIDI Driver
+ *
+ * Drives the parser and encoder hot paths with a stub send callback and
+ * reports ns/message, messages/s and heap allocations per run.
+ *
+ * Build & run on the host (from the repository root):
+ *   gcc -O2 -Icomponents/applemidi/include -o applemidi_bench tools/applemidi_bench/applemidi_bench.c
+ *   ./applemidi_bench [iterations]
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// count heap allocations of the driver: the driver is compiled into this translation unit,
+// so that also static functions (decoder, output buffer) can be measured directly
+static size_t bench_alloc_ctr;
+
+static void *bench_malloc(size_t size)
+{
+  ++bench_alloc_ctr;
+  return malloc(size);
+}
+
+#define malloc(size) bench_malloc(size)
+#include "../../components/applemidi/applemidi.c"
+#include "../../components/applemidi/applemidi_trace.c"
+#include "../../components/applemidi/applemidi_pool.c"
+#undef malloc
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stubs & Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static applemidi_t bench_applemidi;
+
+static uint8_t bench_peer_ip[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 192, 168, 1, 42 }; // IPv4-mapped, since the driver stores IPv6 sized addresses
+static const uint32_t bench_peer_ssrc = 0x12345678;
+
+static size_t bench_tx_packets;
+static size_t bench_tx_bytes;
+static size_t bench_rx_messages;
+
+typedef enum {
+  BENCH_THRU_NONE = 0,
+  BENCH_THRU_CALLBACK,   // received messages are copied and sent back from the callback (like the demo did before routing)
+  BENCH_THRU_ROUTE,      // received messages are forwarded back by the routing matrix
+} bench_thru_t;
+
+static bench_thru_t bench_thru;
+
+static int32_t bench_send_udp_datagram(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  ++bench_tx_packets;
+  bench_tx_bytes += tx_len;
+  return 0; // no error
+}
+
+static int32_t bench_send_udp_datagram_iov(void *ctx, uint8_t *ip_addr, uint16_t port, applemidi_iovec_t *iov, size_t iovcnt, uint8_t is_dataport, applemidi_addr_cache_t *addr_cache)
+{
+  int i;
+  ++bench_tx_packets;
+  for(i=0; i<iovcnt; ++i) {
+    bench_tx_bytes += iov[i].len;
+  }
+  return 0; // no error
+}
+
+static void bench_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  ++bench_rx_messages;
+
+  if( bench_thru == BENCH_THRU_CALLBACK ) {
+    uint8_t *packet = (uint8_t *)applemidi_alloc(1 + len);
+    if( packet != NULL ) {
+      packet[0] = midi_status;
+      memcpy(&packet[1], remaining_message, len);
+      applemidi_send_message(&bench_applemidi, applemidi_port, packet, 1 + len);
+      applemidi_free(packet);
+    }
+  }
+}
+
+static void bench_midi_events_received(void *ctx, applemidi_event_t *events, size_t num_events)
+{
+  bench_rx_messages += num_events;
+}
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_put32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value >> 0;
+}
+
+// registers the remote peer which sends the RTP MIDI packets (invitation over control and data port)
+static void bench_register_peer(void)
+{
+  uint8_t packet[4*4 + 8];
+  bench_put32(&packet[0], 0xffff0000 | APPLEMIDI_COMMAND_INVITATION);
+  bench_put32(&packet[4], 0x00000002);
+  bench_put32(&packet[8], 0xcafe0001);
+  bench_put32(&packet[12], bench_peer_ssrc);
+  strcpy((char *)&packet[16], "Bench");
+  size_t packet_len = 16 + strlen("Bench") + 1;
+
+  applemidi_parse_udp_datagram(&bench_applemidi, bench_peer_ip, APPLEMIDI_DEFAULT_PORT + 0, packet, packet_len, 0, 0);
+  applemidi_parse_udp_datagram(&bench_applemidi, bench_peer_ip, APPLEMIDI_DEFAULT_PORT + 1, packet, packet_len, 1, 0);
+}
+
+// creates a RTP MIDI packet with the given MIDI list, returns the packet length
+static size_t bench_create_rtp_midi_packet(uint32_t *packet_words, size_t max_len, uint8_t *midi_list, size_t midi_list_len)
+{
+  uint8_t *packet = (uint8_t *)packet_words;
+  if( (3*4 + 2 + midi_list_len) > max_len ) {
+    return 0;
+  }
+
+  bench_put32(&packet[0], 0x80610000);
+  bench_put32(&packet[4], 0);
+  bench_put32(&packet[8], bench_peer_ssrc);
+  packet[12] = 0x80 | ((midi_list_len >> 8) & 0x0f); // always long header
+  packet[13] = midi_list_len & 0xff;
+  memcpy(&packet[14], midi_list, midi_list_len);
+
+  return 3*4 + 2 + midi_list_len;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Workloads
+////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef enum {
+  BENCH_PATH_PARSE = 0,  // applemidi_parse_udp_datagram(), includes applemidi_decode_rtp_midi()
+  BENCH_PATH_DECODE,     // applemidi_decode_rtp_midi() only
+  BENCH_PATH_PUSH,       // applemidi_outbuffer_push()
+  BENCH_PATH_SEND,       // applemidi_send_message()
+} bench_path_t;
+
+typedef struct {
+  const char *name;
+  bench_path_t path;
+  uint8_t is_control;      // control packet: each parsed datagram counts as one message
+  uint8_t data[1400];
+  size_t  len;
+  size_t  messages;        // number of MIDI messages in data (for encoder paths: per call)
+  uint16_t mtu;            // for encoder paths: path MTU of the peer (0: APPLEMIDI_DEFAULT_MTU)
+  uint8_t iov;             // for encoder paths: install the scatter-gather send callback
+  uint8_t events;          // for decoder paths: install callback_midi_events_received
+  bench_thru_t thru;       // for decoder paths: send the received messages back to the peer
+  const applemidi_filter_t *filter; // input filter for decoder paths, output filter for encoder paths
+} bench_workload_t;
+
+static applemidi_filter_t bench_filter_pass;      // passes all messages
+static applemidi_filter_t bench_filter_drop;      // drops MIDI Clock, Program Change #4 and Channel Pressure #5
+static applemidi_filter_t bench_filter_transform; // channel remap, transpose and velocity curve
+
+static void bench_create_filters(void)
+{
+  static uint8_t velocity_curve[128];
+  applemidi_filter_config_t config;
+  int i;
+
+  memset(&config, 0, sizeof(config));
+  applemidi_filter_compile(&bench_filter_pass, &config);
+
+  APPLEMIDI_FILTER_DROP(&config, 0xf8);
+  APPLEMIDI_FILTER_DROP(&config, 0xc3);
+  APPLEMIDI_FILTER_DROP(&config, 0xd4);
+  applemidi_filter_compile(&bench_filter_drop, &config);
+
+  memset(&config, 0, sizeof(config));
+  for(i=0; i<16; ++i) {
+    config.channel_map[i] = 16 - i;
+  }
+  for(i=0; i<128; ++i) {
+    velocity_curve[i] = (i * i) / 127;
+  }
+  config.transpose = -12;
+  config.velocity_curve = velocity_curve;
+  config.velocity_min = 10;
+  applemidi_filter_compile(&bench_filter_transform, &config);
+}
+
+static size_t bench_midi_list_single_note(uint8_t *buf)
+{
+  buf[0] = 0x90; buf[1] = 0x3c; buf[2] = 0x7f;
+  return 3;
+}
+
+static size_t bench_midi_list_cc_flood(uint8_t *buf, size_t num)
+{
+  size_t len = 0;
+  int i;
+  for(i=0; i<num; ++i) {
+    if( i > 0 )
+      buf[len++] = 0x00; // delta time
+    buf[len++] = 0xb0 | (i & 0x0f);
+    buf[len++] = i & 0x7f;
+    buf[len++] = (i * 3) & 0x7f;
+  }
+  return len;
+}
+
+static size_t bench_midi_list_running_status(uint8_t *buf, size_t num)
+{
+  size_t len = 0;
+  int i;
+  for(i=0; i<num; ++i) {
+    if( i > 0 ) {
+      buf[len++] = 0x00; // delta time
+    } else {
+      buf[len++] = 0x90;
+    }
+    buf[len++] = (0x30 + i) & 0x7f;
+    buf[len++] = 0x64;
+  }
+  return len;
+}
+
+static size_t bench_midi_list_multi_command(uint8_t *buf, size_t num)
+{
+  const uint8_t pattern[][3] = {
+    { 0x90, 0x3c, 0x7f }, // Note On
+    { 0xb1, 0x07, 0x64 }, // CC
+    { 0xe2, 0x00, 0x40 }, // Pitch Bender
+    { 0xc3, 0x05, 0x00 }, // Program Change (2 bytes)
+    { 0x80, 0x3c, 0x00 }, // Note Off
+    { 0xd4, 0x30, 0x00 }, // Channel Pressure (2 bytes)
+    { 0xf8, 0x00, 0x00 }, // MIDI Clock (1 byte)
+  };
+  const uint8_t pattern_len[] = { 3, 3, 3, 2, 3, 2, 1 };
+  const size_t num_patterns = sizeof(pattern_len);
+
+  size_t len = 0;
+  int i;
+  for(i=0; i<num; ++i) {
+    if( i > 0 )
+      buf[len++] = 0x00; // delta time
+    memcpy(&buf[len], pattern[i % num_patterns], pattern_len[i % num_patterns]);
+    len += pattern_len[i % num_patterns];
+  }
+  return len;
+}
+
+static size_t bench_midi_list_sysex(uint8_t *buf, size_t payload_len)
+{
+  size_t len = 0;
+  int i;
+  buf[len++] = 0xf0;
+  for(i=0; i<payload_len; ++i) {
+    buf[len++] = i & 0x7f;
+  }
+  buf[len++] = 0xf7;
+  return len;
+}
+
+static size_t bench_create_ck_packet(uint8_t *buf)
+{
+  bench_put32(&buf[0], 0xffff0000 | APPLEMIDI_COMMAND_SYNCHRONIZATION);
+  bench_put32(&buf[4], bench_peer_ssrc);
+  bench_put32(&buf[8], 0 << 24);
+  memset(&buf[12], 0, 6*4);
+  bench_put32(&buf[16], 0x11223344);
+  return 9*4;
+}
+
+static size_t bench_create_rs_packet(uint8_t *buf)
+{
+  bench_put32(&buf[0], 0xffff0000 | APPLEMIDI_COMMAND_RECEIVER_FEEDBACK);
+  bench_put32(&buf[4], bench_peer_ssrc);
+  bench_put32(&buf[8], 0x00010000);
+  return 3*4;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Runs a single workload and prints the results
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void bench_run(bench_workload_t *w, size_t iterations)
+{
+  uint32_t rx_packet[(sizeof(w->data) + 16) / 4];
+  size_t rx_len = 0;
+  size_t messages = 0;
+
+  if( w->path == BENCH_PATH_PARSE && !w->is_control ) {
+    rx_len = bench_create_rtp_midi_packet(rx_packet, sizeof(rx_packet), w->data, w->len);
+  } else if( w->path == BENCH_PATH_PARSE ) {
+    memcpy(rx_packet, w->data, w->len);
+    rx_len = w->len;
+  }
+
+  applemidi_set_mtu(&bench_applemidi, 1, w->mtu ? w->mtu : APPLEMIDI_DEFAULT_MTU);
+  applemidi_set_callback_send_udp_datagram_iov(&bench_applemidi, w->iov ? bench_send_udp_datagram_iov : NULL);
+  applemidi_set_callback_midi_events_received(&bench_applemidi, w->events ? bench_midi_events_received : NULL, NULL);
+  applemidi_set_route(&bench_applemidi, 1, APPLEMIDI_ROUTE_ALL, APPLEMIDI_ROUTE_LOCAL | ((w->thru == BENCH_THRU_ROUTE) ? APPLEMIDI_ROUTE_PORT(1) : 0));
+  bench_thru = w->thru;
+  if( w->path == BENCH_PATH_PARSE || w->path == BENCH_PATH_DECODE ) {
+    applemidi_set_filter(&bench_applemidi, 1, w->filter, NULL);
+  } else {
+    applemidi_set_filter(&bench_applemidi, 1, NULL, w->filter);
+  }
+
+  bench_alloc_ctr = 0;
+  bench_tx_packets = 0;
+  bench_tx_bytes = 0;
+  bench_rx_messages = 0;
+
+  uint64_t t_start = bench_now_ns();
+  int i;
+  for(i=0; i<iterations; ++i) {
+    switch( w->path ) {
+    case BENCH_PATH_PARSE: {
+      if( !w->is_control ) {
+        // consecutive sequence numbers, so that no packet loss will be detected
+        uint16_t seq_nr = bench_applemidi.peer[1].seq_nr + 1;
+        ((uint8_t *)rx_packet)[2] = seq_nr >> 8;
+        ((uint8_t *)rx_packet)[3] = seq_nr & 0xff;
+      }
+      applemidi_parse_udp_datagram(&bench_applemidi, bench_peer_ip, APPLEMIDI_DEFAULT_PORT + 1, (uint8_t *)rx_packet, rx_len, 1, 0);
+      messages += w->is_control ? 1 : w->messages;
+    } break;
+
+    case BENCH_PATH_DECODE: {
+      uint8_t cmd_section[sizeof(w->data) + 2];
+      cmd_section[0] = 0x80 | ((w->len >> 8) & 0x0f);
+      cmd_section[1] = w->len & 0xff;
+      memcpy(&cmd_section[2], w->data, w->len);
+      applemidi_decode_rtp_midi(&bench_applemidi, 1, 0, bench_peer_ssrc, cmd_section, w->len + 2);
+      messages += w->messages;
+    } break;
+
+    case BENCH_PATH_PUSH: {
+      applemidi_outbuffer_push(&bench_applemidi, 1, w->data, w->len);
+      messages += w->messages;
+    } break;
+
+    case BENCH_PATH_SEND: {
+      applemidi_send_message(&bench_applemidi, 1, w->data, w->len);
+      messages += w->messages;
+    } break;
+    }
+  }
+  applemidi_outbuffer_flush(&bench_applemidi, 1);
+  uint64_t t_end = bench_now_ns();
+
+  double ns = (double)(t_end - t_start);
+  double ns_per_message = messages ? (ns / messages) : 0.0;
+  double messages_per_s = ns > 0 ? (messages * 1e9 / ns) : 0.0;
+
+  double packets_per_message = messages ? ((double)bench_tx_packets / messages) : 0.0;
+
+  printf("%-38s %10zu msgs %10.1f ns/msg %12.0f msgs/s %8zu allocs %10zu rx_cbs %8zu tx_pkts %8.4f pkts/msg %10zu tx_bytes\n",
+         w->name, messages, ns_per_message, messages_per_s, bench_alloc_ctr, bench_rx_messages, bench_tx_packets, packets_per_message, bench_tx_bytes);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  size_t iterations = 200000;
+  if( argc > 1 ) {
+    iterations = strtoul(argv[1], NULL, 0);
+  }
+
+  srand(1);
+  applemidi_init(&bench_applemidi, bench_midi_message_received, NULL, bench_send_udp_datagram, NULL);
+  applemidi_set_debug_level(&bench_applemidi, 0);
+  bench_register_peer();
+  bench_create_filters();
+
+  static bench_workload_t w;
+
+  printf("Apple MIDI host benchmark, %zu iterations per workload\n\n", iterations);
+
+  // receive path
+  w = (bench_workload_t){ .name = "parse: single note", .path = BENCH_PATH_PARSE, .messages = 1 };
+  w.len = bench_midi_list_single_note(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "parse: CC flood (100 msgs)", .path = BENCH_PATH_PARSE, .messages = 100 };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: running status (100 msgs)", .path = BENCH_PATH_PARSE, .messages = 100 };
+  w.len = bench_midi_list_running_status(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: multi command (50 msgs)", .path = BENCH_PATH_PARSE, .messages = 50 };
+  w.len = bench_midi_list_multi_command(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: SysEx (1000 bytes)", .path = BENCH_PATH_PARSE, .messages = 1 };
+  w.len = bench_midi_list_sysex(w.data, 1000);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "decode: CC flood (100 msgs)", .path = BENCH_PATH_DECODE, .messages = 100 };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: CC flood (100 msgs, events)", .path = BENCH_PATH_PARSE, .messages = 100, .events = 1 };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: multi command (50 msgs, events)", .path = BENCH_PATH_PARSE, .messages = 50, .events = 1 };
+  w.len = bench_midi_list_multi_command(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "decode: CC flood (100 msgs, events)", .path = BENCH_PATH_DECODE, .messages = 100, .events = 1 };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: CC flood (100 msgs, filter pass)", .path = BENCH_PATH_PARSE, .messages = 100, .filter = &bench_filter_pass };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: running status (100 msgs, filter transform)", .path = BENCH_PATH_PARSE, .messages = 100, .filter = &bench_filter_transform };
+  w.len = bench_midi_list_running_status(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: multi command (50 msgs, filter drop)", .path = BENCH_PATH_PARSE, .messages = 50, .filter = &bench_filter_drop };
+  w.len = bench_midi_list_multi_command(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: CC flood (100 msgs, callback)", .path = BENCH_PATH_PARSE, .messages = 100, .thru = BENCH_THRU_CALLBACK };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: CC flood (100 msgs, route)", .path = BENCH_PATH_PARSE, .messages = 100, .thru = BENCH_THRU_ROUTE };
+  w.len = bench_midi_list_cc_flood(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: running status (100 msgs, callback)", .path = BENCH_PATH_PARSE, .messages = 100, .thru = BENCH_THRU_CALLBACK };
+  w.len = bench_midi_list_running_status(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: running status (100 msgs, route)", .path = BENCH_PATH_PARSE, .messages = 100, .thru = BENCH_THRU_ROUTE };
+  w.len = bench_midi_list_running_status(w.data, w.messages);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: SysEx (1000 bytes, callback)", .path = BENCH_PATH_PARSE, .messages = 1, .thru = BENCH_THRU_CALLBACK };
+  w.len = bench_midi_list_sysex(w.data, 1000);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "thru: SysEx (1000 bytes, route)", .path = BENCH_PATH_PARSE, .messages = 1, .thru = BENCH_THRU_ROUTE };
+  w.len = bench_midi_list_sysex(w.data, 1000);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "parse: CK control packet", .path = BENCH_PATH_PARSE, .is_control = 1 };
+  w.len = bench_create_ck_packet(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "parse: RS control packet", .path = BENCH_PATH_PARSE, .is_control = 1 };
+  w.len = bench_create_rs_packet(w.data);
+  bench_run(&w, iterations);
+
+  printf("\n");
+
+  // send path
+  w = (bench_workload_t){ .name = "push: single note", .path = BENCH_PATH_PUSH, .messages = 1 };
+  w.len = bench_midi_list_single_note(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "send: single note", .path = BENCH_PATH_SEND, .messages = 1 };
+  w.len = bench_midi_list_single_note(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "send: single note (MTU 512)", .path = BENCH_PATH_SEND, .messages = 1, .mtu = 512 };
+  w.len = bench_midi_list_single_note(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "send: single note (filter transform)", .path = BENCH_PATH_SEND, .messages = 1, .filter = &bench_filter_transform };
+  w.len = bench_midi_list_single_note(w.data);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "send: CC", .path = BENCH_PATH_SEND, .messages = 1 };
+  w.len = bench_midi_list_cc_flood(w.data, 1);
+  bench_run(&w, iterations);
+
+  w = (bench_workload_t){ .name = "send: SysEx (200 bytes)", .path = BENCH_PATH_SEND, .messages = 1 };
+  w.len = bench_midi_list_sysex(w.data, 200);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "send: SysEx (1200 bytes)", .path = BENCH_PATH_SEND, .messages = 1 };
+  w.len = bench_midi_list_sysex(w.data, 1200);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "send: SysEx (1200 bytes, MTU 512)", .path = BENCH_PATH_SEND, .messages = 1, .mtu = 512 };
+  w.len = bench_midi_list_sysex(w.data, 1200);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "send: SysEx (1200 bytes, MTU 512, iov)", .path = BENCH_PATH_SEND, .messages = 1, .mtu = 512, .iov = 1 };
+  w.len = bench_midi_list_sysex(w.data, 1200);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "push: big message (600 bytes)", .path = BENCH_PATH_PUSH, .messages = 1 };
+  w.len = bench_midi_list_sysex(w.data, 598);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "push: big message (1200 bytes, MTU 512)", .path = BENCH_PATH_PUSH, .messages = 1, .mtu = 512 };
+  w.len = bench_midi_list_sysex(w.data, 1198);
+  bench_run(&w, iterations / 10);
+
+  w = (bench_workload_t){ .name = "push: big message (1200 bytes, MTU 512, iov)", .path = BENCH_PATH_PUSH, .messages = 1, .mtu = 512, .iov = 1 };
+  w.len = bench_midi_list_sysex(w.data, 1198);
+  bench_run(&w, iterations / 10);
+
+  return 0;
+}
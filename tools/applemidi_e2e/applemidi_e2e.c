@@ -0,0 +1,441 @@
+/*
+ * Localhost End-to-End Benchmark for the Apple MIDI Driver
+ *
+ * Two processes are connected over loopback UDP: the master invites the slave
+ * via applemidi_start_session(), waits for the CK synchronization, and sends
+ * MIDI events which are looped back by the slave.
+ *
+ * Measured:
+ *   - round-trip latency percentiles (ping-pong, one event in flight)
+ *   - sustained messages/s before loss (rate ramp)
+ *   - CPU time per message of master and slave
+ *
+ * Results are written in JSON format, so that they can be tracked across releases.
+ *
+ * Build & run on the host (from the repository root):
+ *   gcc -O2 -DAPPLEMIDI_IF_TICK_TIMEOUT_MS=1 -Icomponents/applemidi/include -o applemidi_e2e \
+ *       tools/applemidi_e2e/applemidi_e2e.c components/applemidi/applemidi.c components/applemidi/applemidi_trace.c \
+ *       components/applemidi/applemidi_pool.c components/applemidi/if/posix/applemidi_if.c
+ *   ./applemidi_e2e [-n <latency-samples>] [-d <step-duration-ms>] [-p <base-port>] [-o <result.json>]
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "applemidi.h"
+#include "if/posix/applemidi_if.h"
+
+
+#define E2E_LATENCY_TIMEOUT_NS (100*1000*1000ULL)
+#define E2E_SETUP_TIMEOUT_NS   (3000*1000*1000ULL)
+#define E2E_DRAIN_NS           (200*1000*1000ULL)
+#define E2E_SLAVE_IDLE_NS      (10000*1000*1000ULL)
+
+static const uint32_t e2e_rates[] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000 };
+#define E2E_NUM_RATES (sizeof(e2e_rates)/sizeof(e2e_rates[0]))
+
+typedef enum {
+  E2E_PHASE_IDLE = 0,
+  E2E_PHASE_LATENCY,
+  E2E_PHASE_THROUGHPUT,
+} e2e_phase_t;
+
+static e2e_phase_t e2e_phase;
+static uint32_t e2e_expected_id;
+static uint8_t  e2e_expected_id_received;
+static uint64_t e2e_rx_ctr;
+static uint64_t e2e_slave_echo_ctr;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t e2e_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// each process (master/slave) runs its own driver instance
+static applemidi_t e2e_applemidi;
+static applemidi_if_t e2e_applemidi_if;
+
+static uint64_t e2e_cpu_ns(int who)
+{
+  struct rusage usage;
+  getrusage(who, &usage);
+  return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+         ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void e2e_poll(void)
+{
+  applemidi_if_tick(&e2e_applemidi_if, applemidi_parse_udp_datagram);
+  applemidi_tick(&e2e_applemidi);
+}
+
+static int e2e_compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double e2e_percentile_us(uint64_t *sorted_ns, size_t num, double percentile)
+{
+  if( num == 0 )
+    return 0.0;
+  size_t ix = (size_t)(percentile / 100.0 * (num - 1) + 0.5);
+  return sorted_ns[ix] / 1000.0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Slave: loops back each received MIDI message
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void e2e_slave_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  uint8_t packet[4];
+  if( len <= 3 ) { // only short messages are sent by the master
+    packet[0] = midi_status;
+    memcpy(&packet[1], remaining_message, len);
+    applemidi_send_message(&e2e_applemidi, applemidi_port, packet, len + 1);
+    ++e2e_slave_echo_ctr;
+  }
+}
+
+static int e2e_run_slave(uint16_t port)
+{
+  applemidi_init(&e2e_applemidi, e2e_slave_midi_message_received, NULL, applemidi_if_send_udp_datagram, &e2e_applemidi_if);
+  applemidi_set_callback_send_udp_datagrams(&e2e_applemidi, applemidi_if_send_udp_datagrams);
+  applemidi_set_callback_send_udp_datagram_iov(&e2e_applemidi, applemidi_if_send_udp_datagram_iov);
+  applemidi_set_debug_level(&e2e_applemidi, 0);
+  if( applemidi_if_init(&e2e_applemidi_if, &e2e_applemidi, port) < 0 ) {
+    fprintf(stderr, "slave: failed to open port %d\n", port);
+    return 1;
+  }
+
+  uint8_t connected = 0;
+  uint64_t last_activity = e2e_now_ns();
+  uint64_t last_echo_ctr = 0;
+  while( 1 ) {
+    e2e_poll();
+
+    uint64_t now = e2e_now_ns();
+    if( e2e_slave_echo_ctr != last_echo_ctr ) {
+      last_echo_ctr = e2e_slave_echo_ctr;
+      last_activity = now;
+    }
+
+    applemidi_peer_t *peer = applemidi_peer_get_info(&e2e_applemidi, 1);
+    if( peer->ssrc != 0 ) {
+      connected = 1;
+    } else if( connected ) {
+      break; // master has terminated the session
+    }
+
+    if( (now - last_activity) > E2E_SLAVE_IDLE_NS || getppid() == 1 ) {
+      break;
+    }
+  }
+
+  applemidi_if_deinit(&e2e_applemidi_if);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Master: sends MIDI events and measures the loopback
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void e2e_master_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  if( (midi_status & 0xf0) != 0x90 || len != 2 )
+    return;
+
+  ++e2e_rx_ctr;
+
+  if( e2e_phase == E2E_PHASE_LATENCY ) {
+    uint32_t id = ((midi_status & 0x0f) << 14) | (remaining_message[1] << 7) | remaining_message[0];
+    if( id == e2e_expected_id ) {
+      e2e_expected_id_received = 1;
+    }
+  }
+}
+
+static void e2e_send_id(uint32_t id)
+{
+  // the ID is encoded into channel, note number and velocity of a Note On event
+  uint8_t packet[3] = { 0x90 | ((id >> 14) & 0x0f), id & 0x7f, (id >> 7) & 0x7f };
+  applemidi_send_message(&e2e_applemidi, 1, packet, sizeof(packet));
+}
+
+typedef struct {
+  uint32_t rate;
+  uint64_t sent;
+  uint64_t received;
+  double   master_cpu_ns_per_msg;
+} e2e_throughput_result_t;
+
+static int e2e_run_master(uint16_t port, uint16_t slave_port, size_t num_samples, uint32_t step_duration_ms, FILE *out)
+{
+  applemidi_init(&e2e_applemidi, e2e_master_midi_message_received, NULL, applemidi_if_send_udp_datagram, &e2e_applemidi_if);
+  applemidi_set_callback_send_udp_datagrams(&e2e_applemidi, applemidi_if_send_udp_datagrams);
+  applemidi_set_callback_send_udp_datagram_iov(&e2e_applemidi, applemidi_if_send_udp_datagram_iov);
+  applemidi_set_debug_level(&e2e_applemidi, 0);
+  if( applemidi_if_init(&e2e_applemidi_if, &e2e_applemidi, port) < 0 ) {
+    fprintf(stderr, "master: failed to open port %d\n", port);
+    return 1;
+  }
+
+  // invitation -> CK sync
+  uint8_t ipv4[4] = { 127, 0, 0, 1 };
+  uint8_t ip_addr[16];
+  applemidi_ip_addr_set_ipv4(ip_addr, ipv4);
+  uint64_t t_setup = e2e_now_ns();
+  applemidi_start_session(&e2e_applemidi, 1, ip_addr, slave_port);
+  applemidi_peer_t *peer = applemidi_peer_get_info(&e2e_applemidi, 1);
+  while( peer->connection_state != APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED || peer->connection_sync_ctr < 1 ) {
+    e2e_poll();
+    if( (e2e_now_ns() - t_setup) > E2E_SETUP_TIMEOUT_NS ) {
+      fprintf(stderr, "master: session setup timed out\n");
+      applemidi_if_deinit(&e2e_applemidi_if);
+      return 1;
+    }
+  }
+  uint64_t setup_ns = e2e_now_ns() - t_setup;
+
+  // round-trip latency: one event in flight
+  uint64_t *rtt_ns = calloc(num_samples, sizeof(uint64_t));
+  size_t num_rtt = 0;
+  size_t num_lost = 0;
+  e2e_phase = E2E_PHASE_LATENCY;
+  {
+    uint32_t id;
+    for(id=0; id<num_samples; ++id) {
+      e2e_expected_id = id & 0x3ffff;
+      e2e_expected_id_received = 0;
+      uint64_t t_sent = e2e_now_ns();
+      e2e_send_id(e2e_expected_id);
+
+      uint64_t now;
+      do {
+        e2e_poll();
+        now = e2e_now_ns();
+      } while( !e2e_expected_id_received && (now - t_sent) < E2E_LATENCY_TIMEOUT_NS );
+
+      if( e2e_expected_id_received ) {
+        rtt_ns[num_rtt++] = now - t_sent;
+      } else {
+        ++num_lost;
+      }
+    }
+  }
+  qsort(rtt_ns, num_rtt, sizeof(uint64_t), e2e_compare_u64);
+
+  // throughput: rate ramp until first loss
+  e2e_throughput_result_t results[E2E_NUM_RATES];
+  size_t num_results = 0;
+  uint32_t sustained_rate = 0;
+  uint64_t total_sent = num_samples;
+  e2e_phase = E2E_PHASE_THROUGHPUT;
+  {
+    int r;
+    for(r=0; r<E2E_NUM_RATES; ++r) {
+      e2e_throughput_result_t *result = &results[num_results++];
+      result->rate = e2e_rates[r];
+      result->sent = 0;
+      e2e_rx_ctr = 0;
+
+      uint64_t cpu_start = e2e_cpu_ns(RUSAGE_SELF);
+      uint64_t t_start = e2e_now_ns();
+      uint64_t duration_ns = (uint64_t)step_duration_ms * 1000000ULL;
+      uint64_t now;
+      while( (now = e2e_now_ns()) - t_start < duration_ns ) {
+        uint64_t due = (now - t_start) * result->rate / 1000000000ULL;
+        while( result->sent < due ) {
+          e2e_send_id(result->sent++ & 0x3ffff);
+        }
+        e2e_poll();
+      }
+      uint64_t t_drain = e2e_now_ns();
+      while( e2e_now_ns() - t_drain < E2E_DRAIN_NS ) {
+        e2e_poll();
+      }
+      result->received = e2e_rx_ctr;
+      result->master_cpu_ns_per_msg = result->sent ? ((double)(e2e_cpu_ns(RUSAGE_SELF) - cpu_start) / result->sent) : 0.0;
+      total_sent += result->sent;
+
+      if( result->received < result->sent ) {
+        break;
+      }
+      sustained_rate = result->rate;
+    }
+  }
+  e2e_phase = E2E_PHASE_IDLE;
+
+  // terminate session, the slave will exit thereafter
+  applemidi_terminate_session(&e2e_applemidi, 1);
+  {
+    uint64_t t_end = e2e_now_ns();
+    while( e2e_now_ns() - t_end < (50*1000*1000ULL) ) {
+      e2e_poll();
+    }
+  }
+  applemidi_if_deinit(&e2e_applemidi_if);
+
+  // results
+  double mean_us = 0.0;
+  {
+    int i;
+    for(i=0; i<num_rtt; ++i)
+      mean_us += rtt_ns[i] / 1000.0;
+    if( num_rtt )
+      mean_us /= num_rtt;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"tool\": \"applemidi_e2e\",\n");
+  fprintf(out, "  \"session_setup_us\": %.1f,\n", setup_ns / 1000.0);
+  fprintf(out, "  \"latency\": {\n");
+  fprintf(out, "    \"samples\": %zu,\n", num_rtt);
+  fprintf(out, "    \"lost\": %zu,\n", num_lost);
+  fprintf(out, "    \"min_us\": %.1f,\n", e2e_percentile_us(rtt_ns, num_rtt, 0.0));
+  fprintf(out, "    \"mean_us\": %.1f,\n", mean_us);
+  fprintf(out, "    \"p50_us\": %.1f,\n", e2e_percentile_us(rtt_ns, num_rtt, 50.0));
+  fprintf(out, "    \"p99_us\": %.1f,\n", e2e_percentile_us(rtt_ns, num_rtt, 99.0));
+  fprintf(out, "    \"p99_9_us\": %.1f,\n", e2e_percentile_us(rtt_ns, num_rtt, 99.9));
+  fprintf(out, "    \"max_us\": %.1f\n", e2e_percentile_us(rtt_ns, num_rtt, 100.0));
+  fprintf(out, "  },\n");
+  fprintf(out, "  \"throughput\": [\n");
+  {
+    int i;
+    for(i=0; i<num_results; ++i) {
+      fprintf(out, "    { \"rate\": %u, \"sent\": %llu, \"received\": %llu, \"loss\": %llu, \"master_cpu_ns_per_msg\": %.1f }%s\n",
+        results[i].rate,
+        (unsigned long long)results[i].sent,
+        (unsigned long long)results[i].received,
+        (unsigned long long)(results[i].sent > results[i].received ? results[i].sent - results[i].received : 0),
+        results[i].master_cpu_ns_per_msg,
+        (i < (num_results-1)) ? "," : "");
+    }
+  }
+  fprintf(out, "  ],\n");
+  fprintf(out, "  \"sustained_msgs_per_s\": %u,\n", sustained_rate);
+  fprintf(out, "  \"total_messages_sent\": %llu,\n", (unsigned long long)total_sent);
+
+  free(rtt_ns);
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  size_t num_samples = 10000;
+  uint32_t step_duration_ms = 1000;
+  uint16_t base_port = 15004;
+  const char *output_file = NULL;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "n:d:p:o:")) != -1 ) {
+    switch( opt ) {
+    case 'n': num_samples = strtoul(optarg, NULL, 0); break;
+    case 'd': step_duration_ms = strtoul(optarg, NULL, 0); break;
+    case 'p': base_port = strtoul(optarg, NULL, 0); break;
+    case 'o': output_file = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <latency-samples>] [-d <step-duration-ms>] [-p <base-port>] [-o <result.json>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  uint16_t master_port = base_port;
+  uint16_t slave_port = base_port + 2;
+
+  pid_t slave_pid = fork();
+  if( slave_pid < 0 ) {
+    perror("fork");
+    return 1;
+  }
+
+  if( slave_pid == 0 ) {
+    srand(getpid());
+    return e2e_run_slave(slave_port);
+  }
+
+  srand(getpid());
+  usleep(100*1000); // give the slave some time to open the sockets
+
+  FILE *out = stdout;
+  if( output_file != NULL ) {
+    out = fopen(output_file, "w");
+    if( out == NULL ) {
+      perror(output_file);
+      kill(slave_pid, SIGTERM);
+      return 1;
+    }
+  }
+
+  int status = e2e_run_master(master_port, slave_port, num_samples, step_duration_ms, out);
+
+  // the slave terminates after the session has been closed
+  {
+    int i;
+    int wstatus;
+    for(i=0; i<100; ++i) {
+      if( waitpid(slave_pid, &wstatus, WNOHANG) == slave_pid )
+        break;
+      usleep(10*1000);
+    }
+    if( i == 100 ) {
+      kill(slave_pid, SIGTERM);
+      waitpid(slave_pid, &wstatus, 0);
+    }
+  }
+
+  if( status == 0 ) {
+    fprintf(out, "  \"slave_cpu_ms\": %.1f\n", e2e_cpu_ns(RUSAGE_CHILDREN) / 1000000.0);
+    fprintf(out, "}\n");
+  }
+
+  if( out != stdout ) {
+    fclose(out);
+  }
+
+  return status;
+}
@@ -0,0 +1,587 @@
+/*
+ * Fuzzing Harness for the Apple MIDI Parser
+ *
+ * Feeds arbitrary datagrams into applemidi_parse_udp_datagram() and applemidi_decode_rtp_midi() of a driver instance
+ * which has an established session, so that also the RTP MIDI decoder is reached. The first byte of an input selects
+ * the path, the remaining bytes are passed as datagram (in an exactly sized heap buffer, so that the address
+ * sanitizer detects each read beyond the end):
+ *   bit 0: received at the data port (otherwise control port)
+ *   bit 1: call the RTP MIDI decoder directly (the datagram is the MIDI command section)
+ *   bit 2: no MIDI receive callback installed
+ *   bit 3: a session to the sender has been started before (invitation accepted/rejected path of a master),
+ *          the token of control messages is patched, since it can't be guessed
+ *   bit 4: MIDI messages are received as event batches (callback_midi_events_received)
+ *   bit 5: MIDI messages are forwarded back to the sender by the routing matrix (with the minimum MTU, so that
+ *          SysEx segments are split again)
+ *   bit 6: input and output filters with channel remap, transpose, velocity limits and dropped messages are installed
+ *
+ * Each received MIDI message is checked for a valid status byte, and all bytes are read, so that out-of-bounds
+ * pointers passed to the application are caught as well.
+ *
+ * The harness can be used with:
+ *   - libFuzzer (clang):
+ *       clang -g -O1 -fsanitize=fuzzer,address,undefined -DAPPLEMIDI_FUZZ_LIBFUZZER=1 -Icomponents/applemidi/include \
+ *             -o applemidi_fuzz tools/applemidi_fuzz/applemidi_fuzz.c
+ *       ./applemidi_fuzz corpus/
+ *   - AFL (reads one input file per run):
+ *       afl-clang-fast -O2 -Icomponents/applemidi/include -o applemidi_fuzz tools/applemidi_fuzz/applemidi_fuzz.c
+ *       afl-fuzz -i corpus -o findings -- ./applemidi_fuzz @@
+ *   - any compiler with the built-in mutator, which starts from valid packets and runs until an error is found:
+ *       gcc -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all -Icomponents/applemidi/include \
+ *           -o applemidi_fuzz tools/applemidi_fuzz/applemidi_fuzz.c
+ *       ./applemidi_fuzz [-n <iterations>] [-s <seed>] [-c <corpus dir>] [<input file>...]
+ *     -c writes the initial packets into a directory which can be used as seed corpus for libFuzzer/AFL,
+ *     crashing inputs are stored as crash-<iteration>.bin
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef APPLEMIDI_FUZZ_LIBFUZZER
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+// called by the address/undefined behaviour sanitizer before the process is terminated
+extern void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+#endif
+
+// the driver is compiled into this translation unit, so that the static RTP MIDI decoder can be reached directly
+#include "../../components/applemidi/applemidi.c"
+#include "../../components/applemidi/applemidi_trace.c"
+#include "../../components/applemidi/applemidi_pool.c"
+
+#define FUZZ_FLAG_DATAPORT      0x01
+#define FUZZ_FLAG_DECODE        0x02
+#define FUZZ_FLAG_NO_CALLBACK   0x04
+#define FUZZ_FLAG_MASTER        0x08
+#define FUZZ_FLAG_EVENTS        0x10
+#define FUZZ_FLAG_ROUTE         0x20
+#define FUZZ_FLAG_FILTER        0x40
+
+#define FUZZ_MAX_DATAGRAM_LEN   2048
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static applemidi_t fuzz_applemidi;
+
+static uint8_t fuzz_peer_ip[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 192, 168, 1, 42 }; // IPv4-mapped, since the driver stores IPv6 sized addresses
+static const uint32_t fuzz_peer_ssrc = 0x12345678;
+
+static uint64_t fuzz_clock_us;
+static uint32_t fuzz_checksum; // consumes the received bytes, so that the reads can't be optimized away
+
+static uint64_t fuzz_get_time_us(void)
+{
+  // deterministic clock, so that a crashing input can be reproduced
+  fuzz_clock_us += 100;
+  return fuzz_clock_us;
+}
+
+static int32_t fuzz_send_udp_datagram(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  size_t i;
+  for(i=0; i<tx_len; ++i) {
+    fuzz_checksum += tx_data[i];
+  }
+  return 0; // no error
+}
+
+static void fuzz_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  size_t i;
+
+  if( !(midi_status & 0x80) ) {
+    fprintf(stderr, "applemidi_fuzz: MIDI message without status byte (0x%02x) forwarded to the application\n", midi_status);
+    abort();
+  }
+
+  if( applemidi_port == 0 || applemidi_port >= APPLEMIDI_MAX_PEERS ) {
+    fprintf(stderr, "applemidi_fuzz: MIDI message with invalid applemidi_port=%d\n", applemidi_port);
+    abort();
+  }
+
+  for(i=0; i<len; ++i) {
+    fuzz_checksum += remaining_message[i];
+  }
+}
+
+static void fuzz_midi_events_received(void *ctx, applemidi_event_t *events, size_t num_events)
+{
+  size_t i;
+
+  if( num_events == 0 || num_events > APPLEMIDI_MAX_EVENTS ) {
+    fprintf(stderr, "applemidi_fuzz: invalid number of events (%d)\n", (int)num_events);
+    abort();
+  }
+
+  for(i=0; i<num_events; ++i) {
+    applemidi_event_t *event = &events[i];
+    if( event->sysex != NULL ) {
+      fuzz_midi_message_received(ctx, event->applemidi_port, event->timestamp, event->midi_status, event->sysex, event->sysex_len, event->sysex_pos);
+    } else {
+      uint8_t data[2] = { event->data1, event->data2 };
+      fuzz_midi_message_received(ctx, event->applemidi_port, event->timestamp, event->midi_status, data, 2, 0);
+    }
+  }
+}
+
+static void fuzz_put32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value >> 0;
+}
+
+// resets the driver and registers the remote peer (invitation over control and data port)
+static void fuzz_setup(uint8_t flags)
+{
+  static applemidi_filter_t filter;
+  uint8_t packet[4*4 + 8];
+
+  srand(1);
+  fuzz_clock_us = 0;
+  applemidi_set_clock_source(fuzz_get_time_us);
+  applemidi_init(&fuzz_applemidi, (flags & FUZZ_FLAG_NO_CALLBACK) ? NULL : fuzz_midi_message_received, NULL, fuzz_send_udp_datagram, NULL);
+  applemidi_set_debug_level(&fuzz_applemidi, 0);
+  if( flags & FUZZ_FLAG_EVENTS ) {
+    applemidi_set_callback_midi_events_received(&fuzz_applemidi, fuzz_midi_events_received, NULL);
+  }
+
+  fuzz_put32(&packet[0], 0xffff0000 | APPLEMIDI_COMMAND_INVITATION);
+  fuzz_put32(&packet[4], 0x00000002);
+  fuzz_put32(&packet[8], 0xcafe0001);
+  fuzz_put32(&packet[12], fuzz_peer_ssrc);
+  strcpy((char *)&packet[16], "Fuzz");
+  size_t packet_len = 16 + strlen("Fuzz") + 1;
+
+  applemidi_parse_udp_datagram(&fuzz_applemidi, fuzz_peer_ip, APPLEMIDI_DEFAULT_PORT + 0, packet, packet_len, 0, 0);
+  applemidi_parse_udp_datagram(&fuzz_applemidi, fuzz_peer_ip, APPLEMIDI_DEFAULT_PORT + 1, packet, packet_len, 1, 0);
+
+  if( flags & FUZZ_FLAG_MASTER ) {
+    applemidi_start_session(&fuzz_applemidi, 2, fuzz_peer_ip, APPLEMIDI_DEFAULT_PORT);
+    applemidi_tick(&fuzz_applemidi);
+  }
+
+  if( flags & FUZZ_FLAG_ROUTE ) {
+    applemidi_set_route(&fuzz_applemidi, 1, APPLEMIDI_ROUTE_ALL, APPLEMIDI_ROUTE_LOCAL | APPLEMIDI_ROUTE_PORT(1));
+    applemidi_set_mtu(&fuzz_applemidi, 1, APPLEMIDI_MIN_MTU);
+  }
+
+  if( flags & FUZZ_FLAG_FILTER ) {
+    applemidi_filter_config_t config;
+    memset(&config, 0, sizeof(config));
+    APPLEMIDI_FILTER_DROP(&config, 0xfe);
+    APPLEMIDI_FILTER_DROP(&config, 0xb1);
+    config.channel_map[0] = 16;
+    config.transpose = 100;
+    config.velocity_min = 64;
+    applemidi_filter_compile(&filter, &config);
+    applemidi_set_filter(&fuzz_applemidi, 1, &filter, &filter);
+  }
+}
+
+// runs a single input: flags byte + datagram
+static void fuzz_run_input(const uint8_t *data, size_t size)
+{
+  if( size < 1 || size > (FUZZ_MAX_DATAGRAM_LEN + 1) )
+    return;
+
+  uint8_t flags = data[0];
+  size_t rx_len = size - 1;
+
+  fuzz_setup(flags);
+
+  // exactly sized copy: each read beyond rx_len is an error
+  uint8_t *rx_data = malloc(rx_len ? rx_len : 1);
+  memcpy(rx_data, &data[1], rx_len);
+
+  if( (flags & FUZZ_FLAG_MASTER) && rx_len >= 12 && rx_data[0] == 0xff && rx_data[1] == 0xff ) {
+    fuzz_put32(&rx_data[8], fuzz_applemidi.peer[2].token);
+  }
+
+  if( flags & FUZZ_FLAG_DECODE ) {
+    applemidi_decode_rtp_midi(&fuzz_applemidi, 1, 0, fuzz_peer_ssrc, rx_data, rx_len);
+  } else {
+    uint8_t is_dataport = (flags & FUZZ_FLAG_DATAPORT) ? 1 : 0;
+    applemidi_parse_udp_datagram(&fuzz_applemidi, fuzz_peer_ip, APPLEMIDI_DEFAULT_PORT + is_dataport, rx_data, rx_len, is_dataport, 0);
+  }
+
+  // peer names are printed by the application, they have to be terminated
+  int i;
+  for(i=0; i<APPLEMIDI_MAX_PEERS; ++i) {
+    if( strnlen(fuzz_applemidi.peer[i].name, APPLEMIDI_MAX_NAME_LEN) >= APPLEMIDI_MAX_NAME_LEN ) {
+      fprintf(stderr, "applemidi_fuzz: name of applemidi_port=%d isn't terminated\n", i);
+      abort();
+    }
+  }
+
+  applemidi_tick(&fuzz_applemidi);
+
+  free(rx_data);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// libFuzzer Entry
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  fuzz_run_input(data, size);
+  return 0;
+}
+
+
+#ifndef APPLEMIDI_FUZZ_LIBFUZZER
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Built-in Mutator
+////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  uint8_t data[FUZZ_MAX_DATAGRAM_LEN + 1];
+  size_t len;
+} fuzz_input_t;
+
+#define FUZZ_MAX_SEEDS 32
+static fuzz_input_t fuzz_seed[FUZZ_MAX_SEEDS];
+static size_t fuzz_num_seeds;
+
+static uint32_t fuzz_rand_state;
+
+static uint32_t fuzz_rand(void)
+{
+  // xorshift32 - independent from rand(), which is reseeded by fuzz_setup()
+  fuzz_rand_state ^= fuzz_rand_state << 13;
+  fuzz_rand_state ^= fuzz_rand_state >> 17;
+  fuzz_rand_state ^= fuzz_rand_state << 5;
+  return fuzz_rand_state;
+}
+
+static fuzz_input_t *fuzz_add_seed(uint8_t flags)
+{
+  fuzz_input_t *seed = &fuzz_seed[fuzz_num_seeds++];
+  seed->data[0] = flags;
+  seed->len = 1;
+  return seed;
+}
+
+static void fuzz_seed_put(fuzz_input_t *seed, const uint8_t *bytes, size_t len)
+{
+  memcpy(&seed->data[seed->len], bytes, len);
+  seed->len += len;
+}
+
+static void fuzz_seed_put32(fuzz_input_t *seed, uint32_t value)
+{
+  fuzz_put32(&seed->data[seed->len], value);
+  seed->len += 4;
+}
+
+static void fuzz_seed_rtp_header(fuzz_input_t *seed)
+{
+  fuzz_seed_put32(seed, 0x80610000 | 0x1234);
+  fuzz_seed_put32(seed, 0x00010000);
+  fuzz_seed_put32(seed, fuzz_peer_ssrc);
+}
+
+// valid packets of all message types which are handled by the parser
+static void fuzz_create_seeds(void)
+{
+  fuzz_input_t *seed;
+
+  {
+    const uint8_t midi[] = { 0x03, 0x90, 0x3c, 0x7f };
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+  }
+
+  {
+    // Z flag, delta times, running status, realtime
+    const uint8_t midi[] = { 0x2d, 0x81, 0x00, 0x90, 0x3c, 0x7f, 0x05, 0x3e, 0x7f, 0x00, 0xb0, 0x07, 0x64, 0x00, 0xf8 };
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT | FUZZ_FLAG_EVENTS);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT | FUZZ_FLAG_ROUTE);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT | FUZZ_FLAG_ROUTE | FUZZ_FLAG_FILTER);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+  }
+
+  {
+    // B flag with journal behind the command section
+    uint8_t midi[2 + 20 + 8];
+    int i;
+    midi[0] = 0x80;
+    midi[1] = 20;
+    midi[2] = 0xf0;
+    for(i=0; i<18; ++i)
+      midi[3+i] = i;
+    midi[21] = 0xf7;
+    for(i=0; i<8; ++i)
+      midi[22+i] = 0x55;
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT | FUZZ_FLAG_ROUTE);
+    fuzz_seed_rtp_header(seed);
+    fuzz_seed_put(seed, midi, sizeof(midi));
+  }
+
+  {
+    // SysEx segments: first / middle / last
+    const uint8_t first[] = { 0x05, 0xf0, 0x00, 0x00, 0x7e, 0xf0 };
+    const uint8_t middle[] = { 0x04, 0xf7, 0x01, 0x02, 0xf0 };
+    const uint8_t last[] = { 0x04, 0xf7, 0x03, 0x04, 0xf7 };
+    seed = fuzz_add_seed(FUZZ_FLAG_DECODE);
+    fuzz_seed_put(seed, first, sizeof(first));
+    seed = fuzz_add_seed(FUZZ_FLAG_DECODE);
+    fuzz_seed_put(seed, middle, sizeof(middle));
+    seed = fuzz_add_seed(FUZZ_FLAG_DECODE | FUZZ_FLAG_NO_CALLBACK);
+    fuzz_seed_put(seed, last, sizeof(last));
+    seed = fuzz_add_seed(FUZZ_FLAG_DECODE | FUZZ_FLAG_ROUTE);
+    fuzz_seed_put(seed, first, sizeof(first));
+  }
+
+  {
+    const uint32_t cmds[] = { APPLEMIDI_COMMAND_INVITATION, APPLEMIDI_COMMAND_INVITATION_ACCEPTED, APPLEMIDI_COMMAND_INVITATION_REJECTED, APPLEMIDI_COMMAND_ENDSESSION };
+    int i;
+    for(i=0; i<4; ++i) {
+      seed = fuzz_add_seed((i == 1 || i == 2) ? FUZZ_FLAG_MASTER : 0);
+      fuzz_seed_put32(seed, 0xffff0000 | cmds[i]);
+      fuzz_seed_put32(seed, 0x00000002);
+      fuzz_seed_put32(seed, 0xcafe0002);
+      fuzz_seed_put32(seed, (i == 3) ? fuzz_peer_ssrc : 0x87654321);
+      fuzz_seed_put(seed, (const uint8_t *)"Peer", 5);
+    }
+  }
+
+  {
+    seed = fuzz_add_seed(FUZZ_FLAG_DATAPORT);
+    fuzz_seed_put32(seed, 0xffff0000 | APPLEMIDI_COMMAND_SYNCHRONIZATION);
+    fuzz_seed_put32(seed, fuzz_peer_ssrc);
+    fuzz_seed_put32(seed, 0x00000000); // count=0
+    int i;
+    for(i=0; i<6; ++i)
+      fuzz_seed_put32(seed, i == 1 ? 1000 : 0);
+  }
+
+  {
+    seed = fuzz_add_seed(0);
+    fuzz_seed_put32(seed, 0xffff0000 | APPLEMIDI_COMMAND_RECEIVER_FEEDBACK);
+    fuzz_seed_put32(seed, fuzz_peer_ssrc);
+    fuzz_seed_put32(seed, 0x12340000);
+  }
+}
+
+static void fuzz_mutate(fuzz_input_t *input)
+{
+  int num_mutations = 1 + (fuzz_rand() % 8);
+  int i;
+
+  for(i=0; i<num_mutations; ++i) {
+    size_t pos = (input->len > 1) ? (1 + (fuzz_rand() % (input->len - 1))) : 1;
+
+    switch( fuzz_rand() % 8 ) {
+    case 0: // flip a bit
+      if( pos < input->len )
+        input->data[pos] ^= 1 << (fuzz_rand() % 8);
+      break;
+    case 1: // random byte
+      if( pos < input->len )
+        input->data[pos] = fuzz_rand();
+      break;
+    case 2: // interesting byte (status, length and termination values)
+      if( pos < input->len ) {
+        const uint8_t interesting[] = { 0x00, 0x7f, 0x80, 0x8f, 0xf0, 0xf7, 0xf8, 0xff };
+        input->data[pos] = interesting[fuzz_rand() % sizeof(interesting)];
+      }
+      break;
+    case 3: // truncate
+      input->len = pos;
+      break;
+    case 4: // insert a byte
+      if( input->len < sizeof(input->data) ) {
+        memmove(&input->data[pos+1], &input->data[pos], input->len - pos);
+        input->data[pos] = fuzz_rand();
+        ++input->len;
+      }
+      break;
+    case 5: // delete a byte
+      if( pos < input->len ) {
+        memmove(&input->data[pos], &input->data[pos+1], input->len - pos - 1);
+        --input->len;
+      }
+      break;
+    case 6: // append random bytes
+      while( input->len < sizeof(input->data) && (fuzz_rand() % 16) ) {
+        input->data[input->len++] = fuzz_rand();
+      }
+      break;
+    case 7: // change the path
+      input->data[0] = fuzz_rand() & 0x1f;
+      break;
+    }
+  }
+}
+
+static int32_t fuzz_write_file(const char *path, const uint8_t *data, size_t len)
+{
+  FILE *f = fopen(path, "wb");
+  if( f == NULL || fwrite(data, 1, len, f) != len ) {
+    perror(path);
+    if( f != NULL )
+      fclose(f);
+    return -1;
+  }
+  fclose(f);
+  return 0; // no error
+}
+
+static fuzz_input_t fuzz_current_input;
+static uint32_t fuzz_current_iteration;
+
+// stores the input which caused the crash, so that it can be reproduced by passing the file
+static void fuzz_store_crash(void)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "crash-%u.bin", fuzz_current_iteration);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644); // no stdio, we might be in a signal handler
+  if( fd >= 0 ) {
+    ssize_t written = write(fd, fuzz_current_input.data, fuzz_current_input.len);
+    close(fd);
+    if( written == (ssize_t)fuzz_current_input.len ) {
+      fprintf(stderr, "applemidi_fuzz: input stored in %s\n", path);
+    }
+  }
+}
+
+static void fuzz_signal_handler(int sig)
+{
+  fuzz_store_crash();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  uint32_t iterations = 1000000;
+  uint32_t seed = (uint32_t)time(NULL);
+  const char *corpus_dir = NULL;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "n:s:c:")) != -1 ) {
+    switch( opt ) {
+    case 'n': iterations = strtoul(optarg, NULL, 0); break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'c': corpus_dir = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <iterations>] [-s <seed>] [-c <corpus dir>] [<input file>...]\n"
+                      "  -n: number of mutated inputs (default: 1000000)\n"
+                      "  -s: seed of the mutator (default: current time)\n"
+                      "  -c: write the seed corpus for libFuzzer/AFL into the given directory\n"
+                      "  input files are executed once (e.g. AFL, or to reproduce a crash)\n", argv[0]);
+      return 1;
+    }
+  }
+
+  fuzz_create_seeds();
+
+  if( corpus_dir != NULL ) {
+    size_t i;
+    for(i=0; i<fuzz_num_seeds; ++i) {
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/seed-%02d.bin", corpus_dir, (int)i);
+      if( fuzz_write_file(path, fuzz_seed[i].data, fuzz_seed[i].len) < 0 )
+        return 1;
+    }
+    printf("%d seed inputs written to %s\n", (int)fuzz_num_seeds, corpus_dir);
+    return 0;
+  }
+
+  // AFL mode / reproduce
+  if( optind < argc ) {
+    int i;
+    for(i=optind; i<argc; ++i) {
+      static uint8_t data[FUZZ_MAX_DATAGRAM_LEN + 1];
+      FILE *f = fopen(argv[i], "rb");
+      if( f == NULL ) {
+        perror(argv[i]);
+        return 1;
+      }
+      size_t len = fread(data, 1, sizeof(data), f);
+      fclose(f);
+
+      uint8_t *input = malloc(len ? len : 1); // exactly sized
+      memcpy(input, data, len);
+      fuzz_run_input(input, len);
+      free(input);
+    }
+    return 0;
+  }
+
+  printf("applemidi_fuzz: %u iterations, seed=%u\n", iterations, seed);
+  fuzz_rand_state = seed ? seed : 1;
+
+  if( __sanitizer_set_death_callback != NULL ) {
+    __sanitizer_set_death_callback(fuzz_store_crash);
+  }
+  signal(SIGABRT, fuzz_signal_handler);
+  signal(SIGSEGV, fuzz_signal_handler);
+
+  struct timespec ts_start, ts_end;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+  for(fuzz_current_iteration=0; fuzz_current_iteration<iterations; ++fuzz_current_iteration) {
+    fuzz_current_input = fuzz_seed[fuzz_rand() % fuzz_num_seeds];
+    fuzz_mutate(&fuzz_current_input);
+
+    fuzz_run_input(fuzz_current_input.data, fuzz_current_input.len);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  double s = (ts_end.tv_sec - ts_start.tv_sec) + (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+  printf("applemidi_fuzz: no errors, %.0f execs/s (checksum 0x%08x)\n", iterations / s, fuzz_checksum);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,506 @@
+/*
+ * Multi-Peer Load Generator for the Apple MIDI Driver
+ *
+ * Simulates N remote AppleMIDI peers, each with its own IP/SSRC and control/data port pair,
+ * which invite, synchronize and stream RTP MIDI data into a single driver instance
+ * (applemidi_parse_udp_datagram). Replies of the driver are consumed by a stub send callback.
+ *
+ * Reported for each peer count:
+ *   - accepted/rejected invitations (slot exhaustion behaviour)
+ *   - offered vs. processed messages/s and time spent in the driver per message (throughput ceiling)
+ *   - per-peer fairness of delivered messages (Jain's index, min/max)
+ *
+ * Build & run on the host (from the repository root), the number of slots can be overruled with APPLEMIDI_MAX_PEERS:
+ *   gcc -O2 -DAPPLEMIDI_MAX_PEERS=51 -Icomponents/applemidi/include -o applemidi_loadgen \
+ *       tools/applemidi_loadgen/applemidi_loadgen.c components/applemidi/applemidi.c components/applemidi/applemidi_trace.c \
+ *       components/applemidi/applemidi_pool.c
+ *   ./applemidi_loadgen [-n <peers,...>] [-r <packets/s per peer, 0=unlimited>] [-k <messages per packet>]
+ *                       [-m note=<w>,cc=<w>,clock=<w>,sysex=<w>] [-c <CK interval ms>] [-d <duration ms>]
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "applemidi.h"
+
+
+#define LOADGEN_MAX_SIM_PEERS 1024
+#define LOADGEN_MAX_RUNS 32
+#define LOADGEN_CONTROL_PORT 5004
+#define LOADGEN_DATA_PORT    5005
+
+typedef enum {
+  LOADGEN_MSG_NOTE = 0,
+  LOADGEN_MSG_CC,
+  LOADGEN_MSG_CLOCK,
+  LOADGEN_MSG_SYSEX,
+  LOADGEN_NUM_MSG_TYPES
+} loadgen_msg_type_t;
+
+static const char *loadgen_msg_type_name[LOADGEN_NUM_MSG_TYPES] = { "note", "cc", "clock", "sysex" };
+
+typedef struct {
+  uint8_t  ip_addr[16];
+  uint32_t ssrc;
+  uint16_t seq_nr;
+  uint8_t  accepted_ctrl;
+  uint8_t  accepted_data;
+  uint8_t  rejected;
+  uint64_t next_packet_ns;
+  uint64_t next_ck_ns;
+  uint64_t messages_sent;
+  uint64_t messages_delivered;
+  uint64_t ck_replies;
+} loadgen_peer_t;
+
+typedef struct {
+  uint32_t packet_rate;   // packets/s per peer, 0: as fast as possible
+  uint32_t messages_per_packet;
+  uint32_t mix_weight[LOADGEN_NUM_MSG_TYPES];
+  uint32_t ck_interval_ms;
+  uint32_t duration_ms;
+} loadgen_config_t;
+
+static applemidi_t loadgen_applemidi;
+static loadgen_peer_t loadgen_peer[LOADGEN_MAX_SIM_PEERS];
+static size_t loadgen_num_peers;
+static uint32_t loadgen_rand_state = 1;
+static uint64_t loadgen_parse_ns;
+
+// cache of the last applemidi_port lookup, since messages of a packet are delivered in a row
+static uint8_t loadgen_last_applemidi_port = 0xff;
+static loadgen_peer_t *loadgen_last_sim = NULL;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t loadgen_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// deterministic xorshift PRNG, so that message mixes are reproducible
+static uint32_t loadgen_rand(void)
+{
+  loadgen_rand_state ^= loadgen_rand_state << 13;
+  loadgen_rand_state ^= loadgen_rand_state >> 17;
+  loadgen_rand_state ^= loadgen_rand_state << 5;
+  return loadgen_rand_state;
+}
+
+static void loadgen_put32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value >> 0;
+}
+
+static uint32_t loadgen_get32(uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static loadgen_peer_t *loadgen_search_peer_by_ip(uint8_t *ip_addr)
+{
+  // IP is ::ffff:10.0.<hi>.<lo> with index = (hi << 8) | lo
+  if( applemidi_ip_addr_get_family(ip_addr) != APPLEMIDI_ADDR_FAMILY_IPV4 || ip_addr[12] != 10 || ip_addr[13] != 0 )
+    return NULL;
+
+  size_t ix = (ip_addr[14] << 8) | ip_addr[15];
+  return (ix < loadgen_num_peers) ? &loadgen_peer[ix] : NULL;
+}
+
+static loadgen_peer_t *loadgen_search_peer_by_applemidi_port(uint8_t applemidi_port)
+{
+  applemidi_peer_t *peer = applemidi_peer_get_info(&loadgen_applemidi, applemidi_port);
+  if( peer == NULL )
+    return NULL;
+  return loadgen_search_peer_by_ip(peer->ip_addr);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Driver Callbacks
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t loadgen_send_udp_datagram(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  loadgen_peer_t *sim = loadgen_search_peer_by_ip(ip_addr);
+  if( sim == NULL || tx_len < 4 )
+    return 0;
+
+  uint32_t header = loadgen_get32(tx_data);
+  if( (header & 0xffff0000) == 0xffff0000 ) {
+    switch( header & 0xffff ) {
+    case 0x4f4b: // OK
+      if( is_dataport )
+        sim->accepted_data = 1;
+      else
+        sim->accepted_ctrl = 1;
+      break;
+    case 0x4e4f: // NO
+      sim->rejected = 1;
+      break;
+    case 0x434b: // CK
+      ++sim->ck_replies;
+      break;
+    }
+  }
+
+  return 0; // no error
+}
+
+static void loadgen_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  if( applemidi_port != loadgen_last_applemidi_port ) {
+    loadgen_last_applemidi_port = applemidi_port;
+    loadgen_last_sim = loadgen_search_peer_by_applemidi_port(applemidi_port);
+  }
+
+  // only count the begin of a SysEx stream, and not the F7 termination
+  if( loadgen_last_sim != NULL && midi_status != 0xf7 && continued_sysex_pos == 0 ) {
+    ++loadgen_last_sim->messages_delivered;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Packet Generators
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void loadgen_send_session_command(loadgen_peer_t *sim, uint16_t command, uint8_t is_dataport)
+{
+  uint8_t packet[4*4 + 16];
+  loadgen_put32(&packet[0], 0xffff0000 | command);
+  loadgen_put32(&packet[4], 0x00000002);
+  loadgen_put32(&packet[8], sim->ssrc ^ 0x55aa55aa); // token
+  loadgen_put32(&packet[12], sim->ssrc);
+  snprintf((char *)&packet[16], 16, "Peer%u", (unsigned)(sim - &loadgen_peer[0]));
+  size_t len = 16 + strlen((char *)&packet[16]) + 1;
+  applemidi_parse_udp_datagram(&loadgen_applemidi, sim->ip_addr, is_dataport ? LOADGEN_DATA_PORT : LOADGEN_CONTROL_PORT, packet, len, is_dataport, 0);
+}
+
+static void loadgen_send_ck(loadgen_peer_t *sim, uint64_t now)
+{
+  uint8_t packet[9*4];
+  memset(packet, 0, sizeof(packet));
+  loadgen_put32(&packet[0], 0xffff0000 | 0x434b);
+  loadgen_put32(&packet[4], sim->ssrc);
+  loadgen_put32(&packet[16], now / 100000); // timestamp1
+  applemidi_parse_udp_datagram(&loadgen_applemidi, sim->ip_addr, LOADGEN_DATA_PORT, packet, sizeof(packet), 1, 0);
+}
+
+static void loadgen_send_rs(loadgen_peer_t *sim)
+{
+  uint8_t packet[3*4];
+  loadgen_put32(&packet[0], 0xffff0000 | 0x5253);
+  loadgen_put32(&packet[4], sim->ssrc);
+  loadgen_put32(&packet[8], (uint32_t)sim->seq_nr << 16);
+  applemidi_parse_udp_datagram(&loadgen_applemidi, sim->ip_addr, LOADGEN_CONTROL_PORT, packet, sizeof(packet), 0, 0);
+}
+
+static size_t loadgen_create_message(loadgen_config_t *config, uint8_t *buf)
+{
+  uint32_t total_weight = 0;
+  int i;
+  for(i=0; i<LOADGEN_NUM_MSG_TYPES; ++i)
+    total_weight += config->mix_weight[i];
+
+  uint32_t r = total_weight ? (loadgen_rand() % total_weight) : 0;
+  loadgen_msg_type_t type = LOADGEN_MSG_NOTE;
+  for(i=0; i<LOADGEN_NUM_MSG_TYPES; ++i) {
+    if( r < config->mix_weight[i] ) {
+      type = i;
+      break;
+    }
+    r -= config->mix_weight[i];
+  }
+
+  switch( type ) {
+  case LOADGEN_MSG_CC:
+    buf[0] = 0xb0 | (loadgen_rand() & 0x0f); buf[1] = loadgen_rand() & 0x7f; buf[2] = loadgen_rand() & 0x7f;
+    return 3;
+  case LOADGEN_MSG_CLOCK:
+    buf[0] = 0xf8;
+    return 1;
+  case LOADGEN_MSG_SYSEX: {
+    size_t len = 0;
+    buf[len++] = 0xf0;
+    for(i=0; i<32; ++i)
+      buf[len++] = loadgen_rand() & 0x7f;
+    buf[len++] = 0xf7;
+    return len;
+  }
+  default:
+    buf[0] = 0x90 | (loadgen_rand() & 0x0f); buf[1] = loadgen_rand() & 0x7f; buf[2] = 1 + (loadgen_rand() % 127);
+    return 3;
+  }
+}
+
+static void loadgen_send_data_packet(loadgen_config_t *config, loadgen_peer_t *sim)
+{
+  uint8_t packet[1472];
+  size_t len = 3*4 + 2;
+  int i;
+
+  for(i=0; i<config->messages_per_packet; ++i) {
+    uint8_t msg[64];
+    size_t msg_len = loadgen_create_message(config, msg);
+    if( (len + 1 + msg_len) > sizeof(packet) )
+      break;
+    if( i > 0 )
+      packet[len++] = 0x00; // delta time
+    memcpy(&packet[len], msg, msg_len);
+    len += msg_len;
+  }
+
+  size_t midi_list_len = len - (3*4 + 2);
+  ++sim->seq_nr;
+  loadgen_put32(&packet[0], 0x80610000 | sim->seq_nr);
+  loadgen_put32(&packet[4], 0);
+  loadgen_put32(&packet[8], sim->ssrc);
+  packet[12] = 0x80 | ((midi_list_len >> 8) & 0x0f);
+  packet[13] = midi_list_len & 0xff;
+
+  sim->messages_sent += i;
+  uint64_t t_parse = loadgen_now_ns();
+  applemidi_parse_udp_datagram(&loadgen_applemidi, sim->ip_addr, LOADGEN_DATA_PORT, packet, len, 1, 0);
+  loadgen_parse_ns += loadgen_now_ns() - t_parse;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Runs the load for a given number of peers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void loadgen_run(loadgen_config_t *config, size_t num_peers)
+{
+  int i;
+
+  applemidi_init(&loadgen_applemidi, loadgen_midi_message_received, NULL, loadgen_send_udp_datagram, NULL);
+  applemidi_set_debug_level(&loadgen_applemidi, 0);
+
+  loadgen_num_peers = num_peers;
+  loadgen_parse_ns = 0;
+  loadgen_last_applemidi_port = 0xff;
+  loadgen_last_sim = NULL;
+  for(i=0; i<num_peers; ++i) {
+    loadgen_peer_t *sim = &loadgen_peer[i];
+    memset(sim, 0, sizeof(loadgen_peer_t));
+    uint8_t ipv4[4] = { 10, 0, i >> 8, i & 0xff };
+    applemidi_ip_addr_set_ipv4(sim->ip_addr, ipv4);
+    sim->ssrc = 0x10000000 + i;
+  }
+
+  // all peers invite simultaneously (control + data port)
+  for(i=0; i<num_peers; ++i) {
+    loadgen_send_session_command(&loadgen_peer[i], 0x494e, 0);
+  }
+  for(i=0; i<num_peers; ++i) {
+    loadgen_send_session_command(&loadgen_peer[i], 0x494e, 1);
+  }
+
+  size_t num_accepted = 0;
+  size_t num_rejected = 0;
+  for(i=0; i<num_peers; ++i) {
+    if( loadgen_peer[i].accepted_ctrl && loadgen_peer[i].accepted_data )
+      ++num_accepted;
+    if( loadgen_peer[i].rejected )
+      ++num_rejected;
+  }
+
+  // streaming: rejected peers keep sending as well, the driver has to drop their packets
+  uint64_t t_start = loadgen_now_ns();
+  uint64_t duration_ns = (uint64_t)config->duration_ms * 1000000ULL;
+  uint64_t period_ns = config->packet_rate ? (1000000000ULL / config->packet_rate) : 0;
+  uint64_t ck_period_ns = (uint64_t)config->ck_interval_ms * 1000000ULL;
+  uint64_t packets = 0;
+  uint64_t late_packets = 0;
+  uint64_t next_tick = t_start;
+
+  for(i=0; i<num_peers; ++i) {
+    // spread the packets of the peers over the period
+    loadgen_peer[i].next_packet_ns = t_start + (period_ns * i) / num_peers;
+    loadgen_peer[i].next_ck_ns = t_start + (ck_period_ns * i) / num_peers;
+  }
+
+  uint64_t now;
+  while( (now = loadgen_now_ns()) - t_start < duration_ns ) {
+    for(i=0; i<num_peers; ++i) {
+      loadgen_peer_t *sim = &loadgen_peer[i];
+
+      if( period_ns == 0 ) {
+        loadgen_send_data_packet(config, sim);
+        ++packets;
+      } else {
+        if( sim->next_packet_ns <= now ) {
+          if( (now - sim->next_packet_ns) > period_ns )
+            ++late_packets; // generator can't keep up with the offered load
+          loadgen_send_data_packet(config, sim);
+          ++packets;
+          sim->next_packet_ns += period_ns;
+        }
+      }
+
+      if( ck_period_ns && sim->next_ck_ns <= now ) {
+        loadgen_send_ck(sim, now);
+        loadgen_send_rs(sim);
+        sim->next_ck_ns += ck_period_ns;
+      }
+    }
+
+    if( now >= next_tick ) {
+      applemidi_tick(&loadgen_applemidi);
+      next_tick = now + 1000000ULL;
+    }
+  }
+  uint64_t elapsed_ns = loadgen_now_ns() - t_start;
+
+  // all peers leave
+  for(i=0; i<num_peers; ++i) {
+    loadgen_send_session_command(&loadgen_peer[i], 0x4259, 0);
+  }
+
+  // statistics
+  uint64_t sent = 0;
+  uint64_t delivered = 0;
+  uint64_t min_delivered = ~0ULL;
+  uint64_t max_delivered = 0;
+  double sum_sq = 0.0;
+  for(i=0; i<num_peers; ++i) {
+    loadgen_peer_t *sim = &loadgen_peer[i];
+    sent += sim->messages_sent;
+    delivered += sim->messages_delivered;
+    if( sim->messages_delivered < min_delivered )
+      min_delivered = sim->messages_delivered;
+    if( sim->messages_delivered > max_delivered )
+      max_delivered = sim->messages_delivered;
+    sum_sq += (double)sim->messages_delivered * sim->messages_delivered;
+  }
+  double jain = (sum_sq > 0.0) ? (((double)delivered * delivered) / (num_peers * sum_sq)) : 0.0;
+  double seconds = elapsed_ns / 1e9;
+
+  printf("%6zu %8zu %8zu %12.0f %12.0f %10.1f %8.3f %10llu %10llu %10llu\n",
+    num_peers,
+    num_accepted,
+    num_rejected,
+    sent / seconds,
+    delivered / seconds,
+    sent ? ((double)loadgen_parse_ns / sent) : 0.0,
+    jain,
+    (unsigned long long)min_delivered,
+    (unsigned long long)max_delivered,
+    (unsigned long long)late_packets);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  loadgen_config_t config = {
+    .packet_rate = 1000,
+    .messages_per_packet = 4,
+    .mix_weight = { 70, 20, 8, 2 },
+    .ck_interval_ms = 100,
+    .duration_ms = 1000,
+  };
+
+  size_t runs[LOADGEN_MAX_RUNS] = { 1, 2, 4, 8, 16, 32, 50 };
+  size_t num_runs = 7;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "n:r:k:m:c:d:")) != -1 ) {
+    switch( opt ) {
+    case 'n': {
+      char *s = optarg;
+      num_runs = 0;
+      while( *s && num_runs < LOADGEN_MAX_RUNS ) {
+        size_t n = strtoul(s, &s, 0);
+        if( n > 0 && n <= LOADGEN_MAX_SIM_PEERS )
+          runs[num_runs++] = n;
+        if( *s == ',' )
+          ++s;
+        else
+          break;
+      }
+    } break;
+    case 'r': config.packet_rate = strtoul(optarg, NULL, 0); break;
+    case 'k': config.messages_per_packet = strtoul(optarg, NULL, 0); break;
+    case 'c': config.ck_interval_ms = strtoul(optarg, NULL, 0); break;
+    case 'd': config.duration_ms = strtoul(optarg, NULL, 0); break;
+    case 'm': {
+      char *s = optarg;
+      memset(config.mix_weight, 0, sizeof(config.mix_weight));
+      while( *s ) {
+        int i;
+        for(i=0; i<LOADGEN_NUM_MSG_TYPES; ++i) {
+          size_t name_len = strlen(loadgen_msg_type_name[i]);
+          if( strncmp(s, loadgen_msg_type_name[i], name_len) == 0 && s[name_len] == '=' ) {
+            config.mix_weight[i] = strtoul(&s[name_len+1], &s, 0);
+            break;
+          }
+        }
+        if( i == LOADGEN_NUM_MSG_TYPES ) {
+          fprintf(stderr, "invalid message mix: %s\n", s);
+          return 1;
+        }
+        if( *s == ',' )
+          ++s;
+      }
+    } break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <peers,...>] [-r <packets/s per peer, 0=unlimited>] [-k <messages per packet>]\n"
+                      "          [-m note=<w>,cc=<w>,clock=<w>,sysex=<w>] [-c <CK interval ms>] [-d <duration ms>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  printf("Apple MIDI load generator: %d slots (APPLEMIDI_MAX_PEERS-1), %u packets/s per peer%s, %u messages/packet, mix note=%u cc=%u clock=%u sysex=%u, CK every %u ms, %u ms per run\n\n",
+    APPLEMIDI_MAX_PEERS-1,
+    config.packet_rate, config.packet_rate ? "" : " (unlimited)",
+    config.messages_per_packet,
+    config.mix_weight[LOADGEN_MSG_NOTE], config.mix_weight[LOADGEN_MSG_CC], config.mix_weight[LOADGEN_MSG_CLOCK], config.mix_weight[LOADGEN_MSG_SYSEX],
+    config.ck_interval_ms,
+    config.duration_ms);
+  printf("%6s %8s %8s %12s %12s %10s %8s %10s %10s %10s\n",
+    "peers", "accepted", "rejected", "offered/s", "delivered/s", "drv ns/msg", "jain", "min/peer", "max/peer", "late_pkts");
+
+  int r;
+  for(r=0; r<num_runs; ++r) {
+    loadgen_run(&config, runs[r]);
+  }
+
+  return 0;
+}
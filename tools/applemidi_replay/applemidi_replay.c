@@ -0,0 +1,538 @@
+/*
+ * Packet Capture Replay Driver for the Apple MIDI Driver
+ *
+ * Feeds the datagrams of a pcap file into applemidi_parse_udp_datagram(), either as fast as possible
+ * (parser throughput on a real workload) or with the original timing (debugging).
+ * Datagrams which are addressed to the local control/data port are replayed, everything else
+ * (e.g. datagrams which have been sent by the captured device) is skipped. Replies of the driver
+ * are consumed by a stub send callback.
+ *
+ * Accepted input:
+ *   - pcap files (uS/nS resolution, both byte orders) with link type RAW (as written by applemidi_pcap_save()),
+ *     Ethernet, BSD loopback or Linux cooked capture, e.g. recorded with tcpdump/Wireshark
+ *   - console logs which contain the output of "applemidi_pcap dump", they can be converted into a pcap file with -w
+ *
+ * In the fast mode the driver runs on the timestamps of the capture (applemidi_set_clock_source), so that the results
+ * are reproducible and session timeouts behave like in the captured scenario.
+ *
+ * Build & run on the host (from the repository root):
+ *   gcc -O2 -Icomponents/applemidi/include -o applemidi_replay \
+ *       tools/applemidi_replay/applemidi_replay.c components/applemidi/applemidi.c components/applemidi/applemidi_trace.c \
+ *       components/applemidi/applemidi_pool.c
+ *   ./applemidi_replay [-p <local control port>] [-r] [-l <loops>] [-i] [-v] [-d <debug level>] [-w <converted.pcap>] <capture>
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "applemidi.h"
+
+
+#define REPLAY_MAX_SESSIONS 64
+
+// pcap link types
+#define REPLAY_LINKTYPE_NULL      0
+#define REPLAY_LINKTYPE_ETHERNET  1
+#define REPLAY_LINKTYPE_RAW       101
+#define REPLAY_LINKTYPE_LINUX_SLL 113
+#define REPLAY_LINKTYPE_IPV4      228
+#define REPLAY_LINKTYPE_IPV6      229
+
+typedef struct {
+  uint64_t timestamp_us;
+  uint8_t  ip_addr[16];
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t *payload;
+  size_t   payload_len;
+} replay_datagram_t;
+
+typedef struct {
+  uint8_t  ip_addr[16];
+  uint32_t ssrc;
+} replay_session_t;
+
+typedef struct {
+  uint8_t *data;   // complete file, converted into pcap format if required
+  size_t   len;
+  uint8_t  swapped;
+  uint8_t  nanoseconds;
+  uint32_t linktype;
+} replay_capture_t;
+
+static applemidi_t replay_applemidi;
+static uint64_t replay_clock_now_us;
+static uint8_t replay_verbose;
+
+static replay_session_t replay_session[REPLAY_MAX_SESSIONS];
+static size_t replay_num_sessions;
+
+// statistics
+static uint64_t replay_messages_received;
+static uint64_t replay_datagrams_sent;
+static uint64_t replay_bytes_sent;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t replay_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t replay_clock_us(void)
+{
+  return replay_clock_now_us;
+}
+
+static uint16_t replay_get16(uint8_t *buf)
+{
+  return (buf[0] << 8) | buf[1];
+}
+
+static uint32_t replay_get32(uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static void replay_put32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value >> 0;
+}
+
+static uint32_t replay_file32(replay_capture_t *capture, uint8_t *buf)
+{
+  uint32_t value;
+  memcpy(&value, buf, 4);
+  return capture->swapped ? __builtin_bswap32(value) : value;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Capture File
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint8_t *replay_read_file(const char *path, size_t *len)
+{
+  FILE *file = fopen(path, "rb");
+  if( file == NULL )
+    return NULL;
+
+  size_t size = 0;
+  size_t capacity = 65536;
+  uint8_t *data = malloc(capacity);
+  size_t n;
+  while( data != NULL && (n = fread(&data[size], 1, capacity - size, file)) > 0 ) {
+    size += n;
+    if( size == capacity ) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  fclose(file);
+
+  *len = size;
+  return data;
+}
+
+// converts the hex dump between "applemidi_pcap begin" and "applemidi_pcap end" into binary (in place)
+static size_t replay_convert_hex_dump(uint8_t *data, size_t len)
+{
+  const char *begin_marker = "applemidi_pcap begin";
+  const char *end_marker = "applemidi_pcap end";
+  char *text = malloc(len + 1);
+  memcpy(text, data, len);
+  text[len] = 0;
+
+  char *begin = strstr(text, begin_marker);
+  if( begin == NULL ) {
+    free(text);
+    return 0;
+  }
+  begin += strlen(begin_marker);
+  char *end = strstr(begin, end_marker);
+  if( end == NULL )
+    end = &text[len];
+
+  size_t out_len = 0;
+  int nibble = -1;
+  char *s;
+  for(s=begin; s<end; ++s) {
+    if( !isxdigit((unsigned char)*s) )
+      continue; // line breaks, carriage returns
+    int value = isdigit((unsigned char)*s) ? (*s - '0') : (tolower((unsigned char)*s) - 'a' + 10);
+    if( nibble < 0 ) {
+      nibble = value;
+    } else {
+      data[out_len++] = (nibble << 4) | value;
+      nibble = -1;
+    }
+  }
+
+  free(text);
+  return out_len;
+}
+
+static int replay_open_capture(replay_capture_t *capture, const char *path)
+{
+  memset(capture, 0, sizeof(replay_capture_t));
+
+  capture->data = replay_read_file(path, &capture->len);
+  if( capture->data == NULL ) {
+    perror(path);
+    return -1;
+  }
+
+  int pass;
+  for(pass=0; pass<2; ++pass) {
+    if( capture->len >= 24 ) {
+      uint32_t magic;
+      memcpy(&magic, capture->data, 4);
+      switch( magic ) {
+      case 0xa1b2c3d4: capture->swapped = 0; capture->nanoseconds = 0; break;
+      case 0xd4c3b2a1: capture->swapped = 1; capture->nanoseconds = 0; break;
+      case 0xa1b23c4d: capture->swapped = 0; capture->nanoseconds = 1; break;
+      case 0x4d3cb2a1: capture->swapped = 1; capture->nanoseconds = 1; break;
+      default: magic = 0;
+      }
+
+      if( magic != 0 ) {
+        capture->linktype = replay_file32(capture, &capture->data[20]) & 0xffff;
+        return 0; // no error
+      }
+    }
+
+    // no pcap file: try to extract a console dump
+    if( pass == 0 ) {
+      capture->len = replay_convert_hex_dump(capture->data, capture->len);
+    }
+  }
+
+  fprintf(stderr, "%s: neither a pcap file nor a console log with an \"applemidi_pcap dump\"\n", path);
+  return -1;
+}
+
+// decodes a captured frame, returns 0 if it contains a complete UDP datagram
+static int replay_decode_frame(replay_capture_t *capture, uint8_t *frame, size_t len, replay_datagram_t *datagram)
+{
+  uint8_t *ip = frame;
+  size_t ip_len = len;
+
+  switch( capture->linktype ) {
+  case REPLAY_LINKTYPE_NULL:
+    if( len < 4 )
+      return -1;
+    ip += 4;
+    ip_len -= 4;
+    break;
+
+  case REPLAY_LINKTYPE_ETHERNET: {
+    size_t header_len = 14;
+    if( len < header_len )
+      return -1;
+    uint16_t ethertype = replay_get16(&frame[12]);
+    if( ethertype == 0x8100 && len >= 18 ) { // VLAN tag
+      ethertype = replay_get16(&frame[16]);
+      header_len = 18;
+    }
+    if( ethertype != 0x0800 && ethertype != 0x86dd )
+      return -1;
+    ip += header_len;
+    ip_len -= header_len;
+  } break;
+
+  case REPLAY_LINKTYPE_LINUX_SLL:
+    if( len < 16 )
+      return -1;
+    ip += 16;
+    ip_len -= 16;
+    break;
+
+  case REPLAY_LINKTYPE_RAW:
+  case REPLAY_LINKTYPE_IPV4:
+  case REPLAY_LINKTYPE_IPV6:
+    break;
+
+  default:
+    return -1; // unsupported link type
+  }
+
+  uint8_t *udp;
+  size_t udp_avail;
+  if( ip_len >= 20 && (ip[0] >> 4) == 4 ) {
+    size_t header_len = (ip[0] & 0x0f) * 4;
+    if( header_len < 20 || ip_len < (header_len + 8) || ip[9] != 17 )
+      return -1; // no UDP
+    if( replay_get16(&ip[6]) & 0x3fff )
+      return -1; // fragment
+    applemidi_ip_addr_set_ipv4(datagram->ip_addr, &ip[12]);
+    udp = &ip[header_len];
+    udp_avail = ip_len - header_len;
+  } else if( ip_len >= 48 && (ip[0] >> 4) == 6 ) {
+    if( ip[6] != 17 )
+      return -1; // no UDP (extension headers are not supported)
+    memcpy(datagram->ip_addr, &ip[8], 16);
+    udp = &ip[40];
+    udp_avail = ip_len - 40;
+  } else {
+    return -1;
+  }
+
+  size_t udp_len = replay_get16(&udp[4]);
+  if( udp_len < 8 || udp_len > udp_avail )
+    return -1; // truncated datagram (snaplen too small)
+
+  datagram->src_port = replay_get16(&udp[0]);
+  datagram->dst_port = replay_get16(&udp[2]);
+  datagram->payload = &udp[8];
+  datagram->payload_len = udp_len - 8;
+
+  return 0; // no error
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Driver Callbacks
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int32_t replay_send_udp_datagram(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  ++replay_datagrams_sent;
+  replay_bytes_sent += tx_len;
+  return 0; // no error
+}
+
+static void replay_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  ++replay_messages_received;
+
+  if( replay_verbose ) {
+    applemidi_receive_packet_callback_for_debugging(ctx, applemidi_port, timestamp, midi_status, remaining_message, len, continued_sysex_pos);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replay
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// sends invitations on behalf of a peer whose session has been established before the capture started
+static void replay_inject_invitation(replay_datagram_t *datagram, uint16_t local_port, uint8_t is_dataport)
+{
+  uint8_t *payload = datagram->payload;
+  uint32_t ssrc;
+
+  if( datagram->payload_len >= 12 && (payload[0] & 0xc0) == 0x80 && (payload[1] & 0x7f) == 0x61 ) {
+    ssrc = replay_get32(&payload[8]); // RTP MIDI
+  } else if( datagram->payload_len >= 8 && replay_get32(&payload[0]) == 0xffff434b ) {
+    ssrc = replay_get32(&payload[4]); // CK
+  } else if( datagram->payload_len >= 16 && replay_get32(&payload[0]) == 0xffff494e ) {
+    ssrc = replay_get32(&payload[12]); // IN: the peer establishes the session on its own
+  } else {
+    return;
+  }
+
+  int i;
+  for(i=0; i<replay_num_sessions; ++i) {
+    if( replay_session[i].ssrc == ssrc && memcmp(replay_session[i].ip_addr, datagram->ip_addr, 16) == 0 )
+      return; // already known
+  }
+  if( replay_num_sessions >= REPLAY_MAX_SESSIONS )
+    return;
+
+  replay_session_t *session = &replay_session[replay_num_sessions++];
+  memcpy(session->ip_addr, datagram->ip_addr, 16);
+  session->ssrc = ssrc;
+
+  if( replay_get32(&payload[0]) == 0xffff494e )
+    return;
+
+  uint16_t peer_control_port = is_dataport ? (datagram->src_port - 1) : datagram->src_port;
+  uint8_t packet[16 + 8];
+  replay_put32(&packet[0], 0xffff494e);
+  replay_put32(&packet[4], 0x00000002);
+  replay_put32(&packet[8], ssrc ^ 0x55aa55aa); // token
+  replay_put32(&packet[12], ssrc);
+  memcpy(&packet[16], "replay", 7);
+  applemidi_parse_udp_datagram(&replay_applemidi, datagram->ip_addr, peer_control_port, packet, 16 + 7, 0, 0);
+  applemidi_parse_udp_datagram(&replay_applemidi, datagram->ip_addr, peer_control_port + 1, packet, 16 + 7, 1, 0);
+}
+
+int main(int argc, char **argv)
+{
+  uint16_t local_port = 5004;
+  uint8_t realtime = 0;
+  uint32_t loops = 1;
+  uint8_t inject_invitations = 0;
+  uint8_t debug_level = 0;
+  const char *output_file = NULL;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "p:rl:ivd:w:")) != -1 ) {
+    switch( opt ) {
+    case 'p': local_port = strtoul(optarg, NULL, 0); break;
+    case 'r': realtime = 1; break;
+    case 'l': loops = strtoul(optarg, NULL, 0); break;
+    case 'i': inject_invitations = 1; break;
+    case 'v': replay_verbose = 1; break;
+    case 'd': debug_level = strtoul(optarg, NULL, 0); break;
+    case 'w': output_file = optarg; break;
+    default:
+      optind = argc; // print usage
+    }
+  }
+
+  if( optind != (argc - 1) ) {
+    fprintf(stderr, "Usage: %s [-p <local control port>] [-r] [-l <loops>] [-i] [-v] [-d <debug level>] [-w <converted.pcap>] <capture>\n"
+                    "  -r: replay with the original timing (default: as fast as possible)\n"
+                    "  -l: number of loops (default: 1)\n"
+                    "  -i: inject invitations for sessions which have been established before the capture started\n"
+                    "  -v: print received MIDI messages\n"
+                    "  -w: store the capture (e.g. extracted from a console log) as pcap file\n", argv[0]);
+    return 1;
+  }
+
+  replay_capture_t capture;
+  if( replay_open_capture(&capture, argv[optind]) < 0 )
+    return 1;
+
+  if( output_file != NULL ) {
+    FILE *out = fopen(output_file, "wb");
+    if( out == NULL || fwrite(capture.data, 1, capture.len, out) != capture.len ) {
+      perror(output_file);
+      return 1;
+    }
+    fclose(out);
+  }
+
+  if( !realtime ) {
+    applemidi_set_clock_source(replay_clock_us); // the driver runs on the timestamps of the capture
+  }
+  applemidi_init(&replay_applemidi, replay_midi_message_received, NULL, replay_send_udp_datagram, NULL);
+  applemidi_set_debug_level(&replay_applemidi, debug_level);
+
+  uint64_t datagrams = 0;
+  uint64_t skipped = 0;
+  uint64_t bytes = 0;
+  uint64_t parse_ns = 0;
+  uint64_t first_timestamp_us = 0;
+  uint64_t last_timestamp_us = 0;
+  uint64_t loop_offset_us = 0;
+  uint64_t t_start = replay_now_ns();
+  uint32_t loop;
+
+  for(loop=0; loop<loops; ++loop) {
+    uint64_t loop_start_ns = replay_now_ns();
+    uint64_t loop_first_timestamp_us = 0;
+    size_t pos = 24;
+
+    while( (pos + 16) <= capture.len ) {
+      uint8_t *record = &capture.data[pos];
+      uint32_t ts_sec = replay_file32(&capture, &record[0]);
+      uint32_t ts_frac = replay_file32(&capture, &record[4]);
+      uint32_t incl_len = replay_file32(&capture, &record[8]);
+      if( (pos + 16 + incl_len) > capture.len )
+        break; // truncated file
+      pos += 16 + incl_len;
+
+      replay_datagram_t datagram;
+      datagram.timestamp_us = (uint64_t)ts_sec * 1000000 + (capture.nanoseconds ? (ts_frac / 1000) : ts_frac);
+      if( replay_decode_frame(&capture, &record[16], incl_len, &datagram) < 0 ||
+          (datagram.dst_port != local_port && datagram.dst_port != (local_port + 1)) ) {
+        ++skipped;
+        continue;
+      }
+
+      if( first_timestamp_us == 0 )
+        first_timestamp_us = datagram.timestamp_us;
+      if( loop_first_timestamp_us == 0 )
+        loop_first_timestamp_us = datagram.timestamp_us;
+
+      if( realtime ) {
+        uint64_t due_ns = loop_start_ns + (datagram.timestamp_us - loop_first_timestamp_us) * 1000ULL;
+        uint64_t now_ns;
+        while( (now_ns = replay_now_ns()) < due_ns ) {
+          uint64_t wait_us = (due_ns - now_ns) / 1000;
+          usleep((wait_us > 1000) ? 1000 : (wait_us ? wait_us : 1));
+          applemidi_tick(&replay_applemidi);
+        }
+      } else {
+        uint64_t timestamp_us = loop_offset_us + datagram.timestamp_us;
+        if( timestamp_us > replay_clock_now_us ) {
+          replay_clock_now_us = timestamp_us;
+          applemidi_tick(&replay_applemidi); // time has passed: flush output buffers, CK, timeouts
+        }
+      }
+      last_timestamp_us = datagram.timestamp_us;
+
+      uint8_t is_dataport = (datagram.dst_port == (local_port + 1));
+      if( inject_invitations ) {
+        replay_inject_invitation(&datagram, local_port, is_dataport);
+      }
+
+      uint64_t t_parse = replay_now_ns();
+      applemidi_parse_udp_datagram(&replay_applemidi, datagram.ip_addr, datagram.src_port, datagram.payload, datagram.payload_len, is_dataport, realtime ? 0 : replay_clock_now_us);
+      parse_ns += replay_now_ns() - t_parse;
+
+      ++datagrams;
+      bytes += datagram.payload_len;
+    }
+
+    // the next loop continues after the last datagram, so that the virtual clock doesn't jump back
+    loop_offset_us += (last_timestamp_us - first_timestamp_us) + 1000;
+  }
+  double elapsed_s = (replay_now_ns() - t_start) / 1e9;
+  double parse_s = parse_ns / 1e9;
+
+  printf("%s: %u loop(s), link type %u, %s\n", argv[optind], loops, capture.linktype, realtime ? "original timing" : "max. speed");
+  printf("  replayed datagrams: %llu (%llu bytes), skipped frames: %llu, capture duration: %.3f s\n",
+    (unsigned long long)datagrams, (unsigned long long)bytes, (unsigned long long)skipped,
+    (last_timestamp_us - first_timestamp_us) / 1e6);
+  printf("  received MIDI messages: %llu, datagrams sent by the driver: %llu (%llu bytes)\n",
+    (unsigned long long)replay_messages_received, (unsigned long long)replay_datagrams_sent, (unsigned long long)replay_bytes_sent);
+  printf("  elapsed: %.3f s, in parser: %.3f s\n", elapsed_s, parse_s);
+  if( datagrams > 0 && parse_ns > 0 ) {
+    printf("  parser: %.1f ns/datagram, %.1f ns/message, %.0f datagrams/s, %.1f MB/s\n",
+      (double)parse_ns / datagrams,
+      replay_messages_received ? ((double)parse_ns / replay_messages_received) : 0.0,
+      datagrams / parse_s,
+      bytes / parse_s / 1e6);
+  }
+
+  free(capture.data);
+  return 0;
+}
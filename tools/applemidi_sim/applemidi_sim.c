@@ -0,0 +1,630 @@
+/*
+ * Deterministic Network Simulator for the Apple MIDI Driver
+ *
+ * Connects a master and N slave driver instances over an in-process simulated network,
+ * all running on a virtual clock (applemidi_set_clock_source), so that hours of session lifetime
+ * (CK cadence, flush window, invitation retries, liveness probes and timeouts) pass in seconds.
+ *
+ * The network delays each datagram by a base delay plus uniform jitter, drops datagrams with a given
+ * probability, holds back a share of the datagrams so that they are reordered, and can black out completely
+ * for a given period. Each node has its own clock offset and drift, the master streams Poly Pressure
+ * events with a sequence id to all slaves. Given the same options and seed, each run produces the same results.
+ *
+ * Reported: delivered/lost messages and one-way latency (incl. flush window), CK clock offset error
+ * against the true offset of the virtual clocks, session establishments, evictions and the number of RTP MIDI packets
+ * which the network dropped on the way to each node.
+ *
+ * Build & run on the host (from the repository root), the number of slaves is limited by APPLEMIDI_MAX_PEERS-1:
+ *   gcc -O2 -Icomponents/applemidi/include -o applemidi_sim \
+ *       tools/applemidi_sim/applemidi_sim.c components/applemidi/applemidi.c components/applemidi/applemidi_trace.c \
+ *       components/applemidi/applemidi_pool.c
+ *   ./applemidi_sim [-n <slaves>] [-t <virtual seconds>] [-r <messages/s per slave>] [-D <delay ms>] [-j <jitter ms>]
+ *                   [-l <loss %>] [-R <reorder %>] [-b <start s>:<duration s>] [-c <drift ppm>] [-T <start time s>]
+ *                   [-k <tick ms>] [-s <seed>] [-o <result.json>]
+ *
+ * =============================================================================
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 Thorsten Klose (tk@midibox.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * =============================================================================
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "applemidi.h"
+
+
+#define SIM_MAX_NODES (APPLEMIDI_MAX_PEERS) // master + slaves
+#define SIM_CONTROL_PORT 5004
+#define SIM_DATA_PORT    5005
+#define SIM_ID_RANGE     16384 // 14bit sequence id in the Poly Pressure events
+#define SIM_LATENCY_BUCKET_US 100
+#define SIM_NUM_LATENCY_BUCKETS 10000 // up to 1 second, the last bucket collects everything above
+
+typedef struct {
+  uint8_t  ip_addr[16];
+  int64_t  clock_offset_us;
+  int32_t  clock_drift_ppm;
+  applemidi_t applemidi;
+
+  // slave: received messages
+  uint64_t messages_received;
+  uint64_t messages_duplicated;
+  uint64_t midi_packets_dropped; // RTP MIDI datagrams which the network dropped on the way to this node
+
+  // master: sent messages and session state of each slot
+  uint64_t messages_sent[SIM_MAX_NODES];
+  uint16_t next_id[SIM_MAX_NODES];
+  uint64_t tx_time_us[SIM_MAX_NODES][SIM_ID_RANGE];
+  uint8_t  tx_pending[SIM_MAX_NODES][SIM_ID_RANGE];
+  applemidi_connection_state_t last_state[SIM_MAX_NODES];
+  uint32_t sessions_established[SIM_MAX_NODES];
+} sim_node_t;
+
+typedef struct {
+  uint64_t deliver_us;
+  uint64_t seq; // tie breaker, so that datagrams with the same delivery time keep their order
+  sim_node_t *src;
+  sim_node_t *dst;
+  uint16_t src_port;
+  uint8_t  is_dataport;
+  size_t   len;
+  uint8_t  data[APPLEMIDI_OUTBUFFER_SIZE];
+} sim_datagram_t;
+
+typedef struct {
+  uint32_t num_slaves;
+  uint32_t duration_s;
+  uint32_t message_rate;
+  uint32_t delay_us;
+  uint32_t jitter_us;
+  double   loss_percent;
+  double   reorder_percent;
+  uint32_t blackout_start_s;
+  uint32_t blackout_duration_s;
+  int32_t  drift_ppm;
+  uint64_t start_time_s;
+  uint32_t tick_us;
+  uint64_t seed;
+} sim_config_t;
+
+static sim_config_t sim_config;
+static sim_node_t *sim_node[SIM_MAX_NODES];
+static size_t sim_num_nodes;
+static sim_node_t *sim_current_node; // the node whose driver is executed, selects the clock
+static uint64_t sim_now_us; // true (network) time
+static uint64_t sim_rand_state;
+
+// in-flight datagrams, binary min-heap ordered by delivery time
+static sim_datagram_t **sim_queue;
+static size_t sim_queue_len;
+static size_t sim_queue_size;
+static uint64_t sim_queue_seq;
+
+// statistics
+static uint64_t sim_datagrams_sent;
+static uint64_t sim_datagrams_dropped;
+static uint64_t sim_datagrams_reordered;
+static uint64_t sim_latency_bucket[SIM_NUM_LATENCY_BUCKETS];
+static uint64_t sim_latency_num;
+static uint64_t sim_latency_sum_us;
+static uint64_t sim_latency_max_us;
+static uint64_t sim_sync_num;
+static double   sim_sync_error_sum_us;
+static double   sim_sync_error_max_us;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t sim_wallclock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// deterministic xorshift PRNG, so that impairments are reproducible
+static uint64_t sim_rand(void)
+{
+  sim_rand_state ^= sim_rand_state << 13;
+  sim_rand_state ^= sim_rand_state >> 7;
+  sim_rand_state ^= sim_rand_state << 17;
+  return sim_rand_state;
+}
+
+static uint8_t sim_rand_percent(double percent)
+{
+  return percent > 0.0 && (sim_rand() % 1000000) < (uint64_t)(percent * 10000.0);
+}
+
+static uint32_t sim_get32(uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static uint64_t sim_get64(uint8_t *buf)
+{
+  return ((uint64_t)sim_get32(&buf[0]) << 32) | sim_get32(&buf[4]);
+}
+
+// local time of a node
+static uint64_t sim_node_clock_us(sim_node_t *node)
+{
+  return sim_now_us + node->clock_offset_us + ((int64_t)sim_now_us * node->clock_drift_ppm) / 1000000;
+}
+
+// clock source of the driver instances
+static uint64_t sim_clock_us(void)
+{
+  return (sim_current_node != NULL) ? sim_node_clock_us(sim_current_node) : sim_now_us;
+}
+
+static sim_node_t *sim_search_node_by_ip(uint8_t *ip_addr)
+{
+  int i;
+  for(i=0; i<sim_num_nodes; ++i) {
+    if( memcmp(sim_node[i]->ip_addr, ip_addr, 16) == 0 )
+      return sim_node[i];
+  }
+  return NULL;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event Queue
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static uint8_t sim_queue_before(sim_datagram_t *a, sim_datagram_t *b)
+{
+  return (a->deliver_us < b->deliver_us) || (a->deliver_us == b->deliver_us && a->seq < b->seq);
+}
+
+static void sim_queue_push(sim_datagram_t *datagram)
+{
+  if( sim_queue_len >= sim_queue_size ) {
+    sim_queue_size = sim_queue_size ? (2*sim_queue_size) : 1024;
+    sim_queue = realloc(sim_queue, sim_queue_size * sizeof(sim_datagram_t *));
+  }
+
+  datagram->seq = sim_queue_seq++;
+  size_t ix = sim_queue_len++;
+  while( ix > 0 ) {
+    size_t parent = (ix - 1) / 2;
+    if( !sim_queue_before(datagram, sim_queue[parent]) )
+      break;
+    sim_queue[ix] = sim_queue[parent];
+    ix = parent;
+  }
+  sim_queue[ix] = datagram;
+}
+
+static sim_datagram_t *sim_queue_pop(void)
+{
+  if( sim_queue_len == 0 )
+    return NULL;
+
+  sim_datagram_t *top = sim_queue[0];
+  sim_datagram_t *last = sim_queue[--sim_queue_len];
+  size_t ix = 0;
+  while( 1 ) {
+    size_t child = 2*ix + 1;
+    if( child >= sim_queue_len )
+      break;
+    if( (child + 1) < sim_queue_len && sim_queue_before(sim_queue[child + 1], sim_queue[child]) )
+      ++child;
+    if( !sim_queue_before(sim_queue[child], last) )
+      break;
+    sim_queue[ix] = sim_queue[child];
+    ix = child;
+  }
+  if( sim_queue_len > 0 )
+    sim_queue[ix] = last;
+
+  return top;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Driver Callbacks
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void sim_check_synchronization(sim_node_t *src, sim_node_t *dst, uint8_t *tx_data, size_t tx_len)
+{
+  // CK with count 2 is sent by the initiator, it contains all timestamps for the offset calculation:
+  // offset = (timestamp1 + timestamp3)/2 - timestamp2 = initiator clock - responder clock (100 uS units)
+  if( tx_len < 36 || sim_get32(&tx_data[0]) != 0xffff434b || tx_data[8] != 2 )
+    return;
+
+  double timestamp1 = sim_get64(&tx_data[12]) * 100.0;
+  double timestamp2 = sim_get64(&tx_data[20]) * 100.0;
+  double timestamp3 = sim_get64(&tx_data[28]) * 100.0;
+  double estimated_offset_us = (timestamp1 + timestamp3) / 2.0 - timestamp2;
+  double true_offset_us = (double)((int64_t)sim_node_clock_us(src) - (int64_t)sim_node_clock_us(dst));
+  double error_us = estimated_offset_us - true_offset_us;
+  if( error_us < 0.0 )
+    error_us = -error_us;
+
+  ++sim_sync_num;
+  sim_sync_error_sum_us += error_us;
+  if( error_us > sim_sync_error_max_us )
+    sim_sync_error_max_us = error_us;
+}
+
+static int32_t sim_send_udp_datagram(void *ctx, uint8_t *ip_addr, uint16_t port, uint8_t *tx_data, size_t tx_len, uint8_t is_dataport)
+{
+  sim_node_t *src = (sim_node_t *)ctx;
+  sim_node_t *dst = sim_search_node_by_ip(ip_addr);
+  if( dst == NULL || tx_len > APPLEMIDI_OUTBUFFER_SIZE )
+    return -1; // unreachable
+
+  ++sim_datagrams_sent;
+  sim_check_synchronization(src, dst, tx_data, tx_len);
+
+  uint64_t blackout_start_us = (sim_config.start_time_s + sim_config.blackout_start_s) * 1000000ULL;
+  uint64_t blackout_end_us = blackout_start_us + sim_config.blackout_duration_s * 1000000ULL;
+  if( (sim_now_us >= blackout_start_us && sim_now_us < blackout_end_us) || sim_rand_percent(sim_config.loss_percent) ) {
+    ++sim_datagrams_dropped;
+    if( port == SIM_DATA_PORT && tx_len >= 12 && (tx_data[0] & 0xc0) == 0x80 && (tx_data[1] & 0x7f) == 0x61 )
+      ++dst->midi_packets_dropped;
+    return 0; // the sender doesn't notice
+  }
+
+  uint64_t delay_us = sim_config.delay_us;
+  if( sim_config.jitter_us )
+    delay_us += sim_rand() % (sim_config.jitter_us + 1);
+  if( sim_rand_percent(sim_config.reorder_percent) ) {
+    // hold back, so that the following datagrams overtake this one
+    delay_us += sim_config.delay_us + sim_config.jitter_us + 1000;
+    ++sim_datagrams_reordered;
+  }
+
+  sim_datagram_t *datagram = malloc(sizeof(sim_datagram_t));
+  datagram->deliver_us = sim_now_us + delay_us;
+  datagram->src = src;
+  datagram->dst = dst;
+  datagram->src_port = is_dataport ? SIM_DATA_PORT : SIM_CONTROL_PORT;
+  datagram->is_dataport = (port == SIM_DATA_PORT);
+  datagram->len = tx_len;
+  memcpy(datagram->data, tx_data, tx_len);
+  sim_queue_push(datagram);
+
+  return 0; // no error
+}
+
+static void sim_midi_message_received(void *ctx, uint8_t applemidi_port, uint32_t timestamp, uint8_t midi_status, uint8_t *remaining_message, size_t len, size_t continued_sysex_pos)
+{
+  sim_node_t *node = (sim_node_t *)ctx;
+  sim_node_t *master = sim_node[0];
+
+  if( (midi_status & 0xf0) != 0xa0 || len < 2 )
+    return;
+
+  // the slave index is transfered in the channel
+  size_t slave = (midi_status & 0x0f) + 1;
+  uint16_t id = (remaining_message[0] << 7) | remaining_message[1];
+  if( slave >= sim_num_nodes || sim_node[slave] != node )
+    return;
+
+  ++node->messages_received;
+  if( !master->tx_pending[slave][id] ) {
+    ++node->messages_duplicated;
+    return;
+  }
+  master->tx_pending[slave][id] = 0;
+
+  uint64_t latency_us = sim_now_us - master->tx_time_us[slave][id];
+  size_t bucket = latency_us / SIM_LATENCY_BUCKET_US;
+  ++sim_latency_bucket[(bucket < SIM_NUM_LATENCY_BUCKETS) ? bucket : (SIM_NUM_LATENCY_BUCKETS-1)];
+  ++sim_latency_num;
+  sim_latency_sum_us += latency_us;
+  if( latency_us > sim_latency_max_us )
+    sim_latency_max_us = latency_us;
+}
+
+static double sim_latency_percentile_us(double percentile)
+{
+  uint64_t target = (uint64_t)(percentile / 100.0 * sim_latency_num);
+  uint64_t sum = 0;
+  int i;
+  for(i=0; i<SIM_NUM_LATENCY_BUCKETS; ++i) {
+    sum += sim_latency_bucket[i];
+    if( sum > target ) {
+      double upper_us = (i + 1) * SIM_LATENCY_BUCKET_US; // upper bound of the bucket
+      return (upper_us < sim_latency_max_us) ? upper_us : sim_latency_max_us;
+    }
+  }
+  return sim_latency_max_us;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simulation
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void sim_deliver(sim_datagram_t *datagram)
+{
+  sim_current_node = datagram->dst;
+  applemidi_parse_udp_datagram(&datagram->dst->applemidi, datagram->src->ip_addr, datagram->src_port, datagram->data, datagram->len, datagram->is_dataport, sim_node_clock_us(datagram->dst));
+  sim_current_node = NULL;
+  free(datagram);
+}
+
+static void sim_send_events(void)
+{
+  sim_node_t *master = sim_node[0];
+  int slave;
+
+  sim_current_node = master;
+  for(slave=1; slave<sim_num_nodes; ++slave) {
+    applemidi_peer_t *peer = applemidi_peer_get_info(&master->applemidi, slave);
+    if( peer == NULL || peer->connection_state != APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED )
+      continue;
+
+    uint16_t id = master->next_id[slave]++ % SIM_ID_RANGE;
+    uint8_t event[3] = { 0xa0 | (slave - 1), (id >> 7) & 0x7f, id & 0x7f };
+    master->tx_time_us[slave][id] = sim_now_us;
+    master->tx_pending[slave][id] = 1;
+    if( applemidi_send_message(&master->applemidi, slave, event, sizeof(event)) >= 0 ) {
+      ++master->messages_sent[slave];
+    }
+  }
+  sim_current_node = NULL;
+}
+
+static void sim_tick(void)
+{
+  int i;
+  for(i=0; i<sim_num_nodes; ++i) {
+    sim_current_node = sim_node[i];
+    applemidi_tick(&sim_node[i]->applemidi);
+  }
+
+  // count session establishments of the master
+  sim_node_t *master = sim_node[0];
+  for(i=1; i<sim_num_nodes; ++i) {
+    applemidi_connection_state_t state = master->applemidi.peer[i].connection_state;
+    if( state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED && master->last_state[i] != state )
+      ++master->sessions_established[i];
+    master->last_state[i] = state;
+  }
+  sim_current_node = NULL;
+}
+
+static int sim_run(FILE *out)
+{
+  int i;
+
+  srand(sim_config.seed); // SSRCs and tokens of the driver
+  sim_rand_state = sim_config.seed ? sim_config.seed : 1;
+  sim_now_us = sim_config.start_time_s * 1000000ULL;
+  applemidi_set_clock_source(sim_clock_us);
+
+  sim_num_nodes = 1 + sim_config.num_slaves;
+  for(i=0; i<sim_num_nodes; ++i) {
+    sim_node_t *node = calloc(1, sizeof(sim_node_t));
+    sim_node[i] = node;
+    uint8_t ipv4[4] = { 10, 0, 0, 1 + i };
+    applemidi_ip_addr_set_ipv4(node->ip_addr, ipv4);
+
+    // slaves get different offsets and a drift with alternating sign against the master
+    node->clock_offset_us = i * 1234567;
+    node->clock_drift_ppm = (i == 0) ? 0 : ((i & 1) ? sim_config.drift_ppm : -sim_config.drift_ppm);
+
+    sim_current_node = node;
+    applemidi_init(&node->applemidi, sim_midi_message_received, node, sim_send_udp_datagram, node);
+    applemidi_set_debug_level(&node->applemidi, 0);
+  }
+
+  // the master invites all slaves, and re-invites them whenever a session drops
+  sim_current_node = sim_node[0];
+  for(i=1; i<sim_num_nodes; ++i) {
+    applemidi_start_session(&sim_node[0]->applemidi, i, sim_node[i]->ip_addr, SIM_CONTROL_PORT);
+    applemidi_set_auto_reconnect(&sim_node[0]->applemidi, i, 1);
+  }
+  sim_current_node = NULL;
+
+  uint64_t end_us = sim_now_us + sim_config.duration_s * 1000000ULL;
+  uint64_t next_tick_us = sim_now_us;
+  uint64_t event_period_us = sim_config.message_rate ? (1000000ULL / sim_config.message_rate) : 0;
+  uint64_t next_event_us = event_period_us ? sim_now_us : end_us;
+  uint64_t t_start = sim_wallclock_ns();
+
+  while( sim_now_us < end_us ) {
+    // advance to the next event
+    uint64_t next_us = next_tick_us;
+    if( next_event_us < next_us )
+      next_us = next_event_us;
+    if( sim_queue_len > 0 && sim_queue[0]->deliver_us < next_us )
+      next_us = sim_queue[0]->deliver_us;
+    sim_now_us = next_us;
+
+    while( sim_queue_len > 0 && sim_queue[0]->deliver_us <= sim_now_us ) {
+      sim_deliver(sim_queue_pop());
+    }
+
+    if( sim_now_us >= next_event_us ) {
+      sim_send_events();
+      next_event_us += event_period_us;
+    }
+
+    if( sim_now_us >= next_tick_us ) {
+      sim_tick();
+      next_tick_us += sim_config.tick_us;
+    }
+  }
+  double wallclock_s = (sim_wallclock_ns() - t_start) / 1e9;
+
+  // messages which are still in flight are not counted as lost
+  sim_node_t *master = sim_node[0];
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t duplicated = 0;
+  uint64_t in_flight = 0;
+  uint32_t established = 0;
+  uint32_t connected = 0;
+  for(i=1; i<sim_num_nodes; ++i) {
+    sent += master->messages_sent[i];
+    received += sim_node[i]->messages_received;
+    duplicated += sim_node[i]->messages_duplicated;
+    established += master->sessions_established[i];
+    if( master->applemidi.peer[i].connection_state == APPLEMIDI_CONNECTION_STATE_MASTER_CONNECTED )
+      ++connected;
+
+    int id;
+    for(id=0; id<SIM_ID_RANGE; ++id) {
+      if( master->tx_pending[i][id] && (sim_now_us - master->tx_time_us[i][id]) < 1000000ULL )
+        ++in_flight;
+    }
+  }
+  uint64_t delivered = received - duplicated;
+  uint64_t lost = (sent > (delivered + in_flight)) ? (sent - delivered - in_flight) : 0;
+
+  // packet loss is taken from the network and not from the packets_loss counters of the drivers:
+  // the master numbers the RTP packets of all sessions with a single sequence counter,
+  // so that a slave detects each packet which has been sent to another slave as lost
+  uint32_t evicted = 0;
+  uint64_t dropped_midi_packets = 0;
+  for(i=0; i<sim_num_nodes; ++i) {
+    evicted += sim_node[i]->applemidi.peer[0].sessions_evicted;
+    dropped_midi_packets += sim_node[i]->midi_packets_dropped;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"tool\": \"applemidi_sim\",\n");
+  fprintf(out, "  \"config\": { \"slaves\": %u, \"virtual_s\": %u, \"rate\": %u, \"delay_us\": %u, \"jitter_us\": %u, \"loss_percent\": %.3f, \"reorder_percent\": %.3f, \"blackout_s\": [%u, %u], \"drift_ppm\": %d, \"start_time_s\": %llu, \"tick_us\": %u, \"seed\": %llu },\n",
+    sim_config.num_slaves, sim_config.duration_s, sim_config.message_rate, sim_config.delay_us, sim_config.jitter_us,
+    sim_config.loss_percent, sim_config.reorder_percent, sim_config.blackout_start_s, sim_config.blackout_duration_s,
+    sim_config.drift_ppm, (unsigned long long)sim_config.start_time_s, sim_config.tick_us, (unsigned long long)sim_config.seed);
+  fprintf(out, "  \"wallclock_s\": %.3f,\n", wallclock_s);
+  fprintf(out, "  \"speedup\": %.1f,\n", wallclock_s > 0.0 ? (sim_config.duration_s / wallclock_s) : 0.0);
+  fprintf(out, "  \"datagrams\": { \"sent\": %llu, \"dropped\": %llu, \"reordered\": %llu },\n",
+    (unsigned long long)sim_datagrams_sent, (unsigned long long)sim_datagrams_dropped, (unsigned long long)sim_datagrams_reordered);
+  fprintf(out, "  \"messages\": { \"sent\": %llu, \"delivered\": %llu, \"lost\": %llu, \"duplicated\": %llu, \"in_flight\": %llu },\n",
+    (unsigned long long)sent, (unsigned long long)delivered, (unsigned long long)lost, (unsigned long long)duplicated, (unsigned long long)in_flight);
+  fprintf(out, "  \"latency_us\": { \"mean\": %.1f, \"p50\": %.0f, \"p99\": %.0f, \"p99_9\": %.0f, \"max\": %llu },\n",
+    sim_latency_num ? ((double)sim_latency_sum_us / sim_latency_num) : 0.0,
+    sim_latency_percentile_us(50.0), sim_latency_percentile_us(99.0), sim_latency_percentile_us(99.9),
+    (unsigned long long)sim_latency_max_us);
+  fprintf(out, "  \"sync\": { \"exchanges\": %llu, \"mean_error_us\": %.1f, \"max_error_us\": %.1f },\n",
+    (unsigned long long)sim_sync_num, sim_sync_num ? (sim_sync_error_sum_us / sim_sync_num) : 0.0, sim_sync_error_max_us);
+  fprintf(out, "  \"sessions\": { \"established\": %u, \"connected_at_end\": %u, \"evicted\": %u },\n",
+    established, connected, evicted);
+  fprintf(out, "  \"dropped_midi_packets\": { \"total\": %llu, \"per_node\": [", (unsigned long long)dropped_midi_packets);
+  for(i=0; i<sim_num_nodes; ++i) {
+    fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)sim_node[i]->midi_packets_dropped);
+  }
+  fprintf(out, "] }\n");
+  fprintf(out, "}\n");
+
+  while( sim_queue_len > 0 ) {
+    free(sim_queue_pop());
+  }
+  free(sim_queue);
+  for(i=0; i<sim_num_nodes; ++i) {
+    free(sim_node[i]);
+  }
+  applemidi_set_clock_source(NULL);
+
+  return (connected == sim_config.num_slaves) ? 0 : 2;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  sim_config_t *config = &sim_config;
+  config->num_slaves = 1;
+  config->duration_s = 3600;
+  config->message_rate = 100;
+  config->delay_us = 1000;
+  config->jitter_us = 0;
+  config->loss_percent = 0.0;
+  config->reorder_percent = 0.0;
+  config->drift_ppm = 50;
+  config->start_time_s = 1000;
+  config->tick_us = 1000;
+  config->seed = 1;
+
+  const char *output_file = NULL;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "n:t:r:D:j:l:R:b:c:T:k:s:o:")) != -1 ) {
+    switch( opt ) {
+    case 'n': config->num_slaves = strtoul(optarg, NULL, 0); break;
+    case 't': config->duration_s = strtoul(optarg, NULL, 0); break;
+    case 'r': config->message_rate = strtoul(optarg, NULL, 0); break;
+    case 'D': config->delay_us = strtod(optarg, NULL) * 1000.0; break;
+    case 'j': config->jitter_us = strtod(optarg, NULL) * 1000.0; break;
+    case 'l': config->loss_percent = strtod(optarg, NULL); break;
+    case 'R': config->reorder_percent = strtod(optarg, NULL); break;
+    case 'b': {
+      char *s = optarg;
+      config->blackout_start_s = strtoul(s, &s, 0);
+      config->blackout_duration_s = (*s == ':') ? strtoul(s + 1, NULL, 0) : 0;
+    } break;
+    case 'c': config->drift_ppm = strtol(optarg, NULL, 0); break;
+    case 'T': config->start_time_s = strtoull(optarg, NULL, 0); break;
+    case 'k': config->tick_us = strtod(optarg, NULL) * 1000.0; break;
+    case 's': config->seed = strtoull(optarg, NULL, 0); break;
+    case 'o': output_file = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n <slaves>] [-t <virtual seconds>] [-r <messages/s per slave>] [-D <delay ms>] [-j <jitter ms>]\n"
+                      "          [-l <loss %%>] [-R <reorder %%>] [-b <start s>:<duration s>] [-c <drift ppm>] [-T <start time s>]\n"
+                      "          [-k <tick ms>] [-s <seed>] [-o <result.json>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if( config->num_slaves < 1 || config->num_slaves >= APPLEMIDI_MAX_PEERS ) {
+    fprintf(stderr, "number of slaves must be 1..%d (APPLEMIDI_MAX_PEERS-1)\n", APPLEMIDI_MAX_PEERS-1);
+    return 1;
+  }
+  if( config->message_rate > 10000 ) {
+    fprintf(stderr, "message rate must be <= 10000/s per slave\n");
+    return 1;
+  }
+  if( config->tick_us == 0 ) {
+    config->tick_us = 1000;
+  }
+
+  FILE *out = stdout;
+  if( output_file != NULL ) {
+    out = fopen(output_file, "w");
+    if( out == NULL ) {
+      perror(output_file);
+      return 1;
+    }
+  }
+
+  int status = sim_run(out);
+
+  if( out != stdout ) {
+    fclose(out);
+  }
+
+  return status;
+}